@@ -9,6 +9,9 @@ expr
         | (ADD | SUB) expr  # UnaryOp
         | expr (MUL | DIV) expr  # BinaryOp
         | expr (ADD | SUB) expr  # BinaryOp
+        | expr (EQ | NE | LT | LE | GT | GE) expr  # Comparison
+        | FUNCTION '(' (expr (',' expr)*)? ')'  # Function
+        | RANGE  # Range
         | CELL  # Cell
         | NUMBER  # Literal
         ;
@@ -26,5 +29,17 @@ ADD: '+' ;
 SUB: '-' ;
 MUL: '*' ;
 DIV: '/' ;
-CELL: [A-Z]+[0-9]+ ;
+EQ: '=' ;
+NE: '<>' ;
+LT: '<' ;
+LE: '<=' ;
+GT: '>' ;
+GE: '>=' ;
+// a rectangle of cells of the same sheet (A1:B3); only allowed as a function argument
+RANGE: [A-Z]+[0-9]+ ':' [A-Z]+[0-9]+ ;
+// a cell of the same sheet (A1) or of another sheet of the workbook (Sheet2!A1)
+CELL: (SHEET_NAME '!')? [A-Z]+[0-9]+ ;
+// a function name (VLOOKUP); a name followed by digits is a cell instead
+FUNCTION: [A-Z]+ ;
+fragment SHEET_NAME: [A-Za-z_] [A-Za-z0-9_]* ;
 WS: [ \t\n\r]+ -> skip ;
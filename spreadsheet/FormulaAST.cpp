@@ -3,16 +3,24 @@
 #include "FormulaBaseListener.h"
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
+#include "formula.h"
+#include "lookup_index.h"
+#include "vector_program.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
+#include <limits>
 #include <memory>
 #include <optional>
 #include <sstream>
+#include <utility>
+#include <vector>
 
 namespace ASTImpl {
 
 enum ExprPrecedence {
+    EP_COMPARE,
     EP_ADD,
     EP_SUB,
     EP_MUL,
@@ -58,13 +66,33 @@ enum PrecedenceRule {
 //     (currently in the table we're always putting in the parentheses)
 // +(A * B) - always okay (the resulting binary op has the highest grammatic precedence)
 // +(A / B) - always okay (the resulting binary op has the highest grammatic precedence)
+// A < (B < C) - never okay (comparisons are left-associative)
+// A + (B < C), -(A < B) - never okay (a comparison has the lowest grammatic precedence)
+// F(A < B) - always okay (function arguments are separated by commas)
 constexpr PrecedenceRule PRECEDENCE_RULES[EP_END][EP_END] = {
-    /* EP_ADD */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-    /* EP_SUB */ {PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-    /* EP_MUL */ {PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-    /* EP_DIV */ {PR_BOTH, PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE},
-    /* EP_UNARY */ {PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-    /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_COMPARE */ {PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_ADD */ {PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_SUB */ {PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_MUL */ {PR_BOTH, PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_DIV */ {PR_BOTH, PR_BOTH, PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE},
+    /* EP_UNARY */ {PR_BOTH, PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+};
+
+// Maps the nodes of the cell lists of a FormulaAST to the nodes of its copy
+struct CellMapping {
+    std::vector<std::pair<const Position*, const Position*>> cells;
+    std::vector<std::pair<const SheetReference*, const SheetReference*>> external_cells;
+    std::vector<std::pair<const Range*, const Range*>> ranges;
+
+    template <typename T>
+    static const T* Find(const std::vector<std::pair<const T*, const T*>>& nodes, const T* node) {
+        auto iter = std::find_if(nodes.begin(), nodes.end(), [node](const auto& entry) {
+            return entry.first == node;
+        });
+        assert(iter != nodes.end());
+        return iter->second;
+    }
 };
 
 class Expr {
@@ -74,9 +102,44 @@ public:
     virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
     virtual double Evaluate(const SheetInterface& args) const = 0;
 
+    // Evaluates the subtree as a lookup value: a cell reference gives the value
+    // of the cell as is, so that text can be looked up
+    virtual CellInterface::Value EvaluateValue(const SheetInterface& args) const {
+        return Evaluate(args);
+    }
+
     // higher is tighter
     virtual ExprPrecedence GetPrecedence() const = 0;
 
+    // size of the subtree nodes
+    virtual size_t GetAllocatedBytes() const = 0;
+
+    // Builds an equivalent tree for evaluation: constant subtrees are folded,
+    // identity operations and chains of unary signs are removed. The original
+    // tree is kept intact for printing.
+    virtual std::unique_ptr<Expr> Optimize() const = 0;
+
+    // Appends the postfix form of the subtree to a vector program
+    virtual void Compile(VectorProgram& program) const = 0;
+
+    // Copies the subtree; cell nodes refer to the cell lists of the copy
+    virtual std::unique_ptr<Expr> Clone(const CellMapping& mapping) const = 0;
+
+    // Calls use for every reference to a cell of the same sheet in the
+    // subtree; conditional is set for references that are only read when
+    // a branch of IF, AND, OR or CHOOSE is taken
+    using CellUse = std::function<void(const Position& cell, bool conditional)>;
+    virtual void CollectCells(const CellUse& /* use */, bool /* conditional */) const {
+    }
+
+    // set only for nodes that evaluate to a constant
+    virtual std::optional<double> GetConstant() const {
+        return std::nullopt;
+    }
+    virtual std::optional<FormulaError> GetConstantError() const {
+        return std::nullopt;
+    }
+
     void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
                       bool right_child = false) const {
         auto precedence = GetPrecedence();
@@ -96,6 +159,71 @@ public:
 
 namespace {
 
+std::unique_ptr<Expr> MakeConstant(double value);
+
+// A constant subexpression that always fails, e.g. 1/0. Only appears in
+// optimized trees, so the error is raised at the same point of evaluation.
+class ErrorExpr final : public Expr {
+public:
+    explicit ErrorExpr(FormulaError error)
+        : error_(error) {
+    }
+
+    void Print(std::ostream& out) const override {
+        out << error_;
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+        Print(out);
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    size_t GetAllocatedBytes() const override {
+        return sizeof(*this);
+    }
+
+    double Evaluate(const SheetInterface& /* arg */) const override {
+        throw error_;
+    }
+
+    std::unique_ptr<Expr> Optimize() const override {
+        return std::make_unique<ErrorExpr>(error_);
+    }
+
+    std::optional<FormulaError> GetConstantError() const override {
+        return error_;
+    }
+
+    void Compile(VectorProgram& program) const override {
+        program.PushError(error_);
+    }
+
+    std::unique_ptr<Expr> Clone(const CellMapping& /* mapping */) const override {
+        return std::make_unique<ErrorExpr>(error_);
+    }
+
+private:
+    FormulaError error_;
+};
+
+// All values produced by expressions are finite: infinite results of
+// arithmetic become #DIV/0! and non-finite cell texts are not numbers.
+// That is what makes the identities below exact in IEEE arithmetic.
+bool IsPositiveZero(const std::optional<double>& value) {
+    return value && *value == 0.0 && !std::signbit(*value);
+}
+
+bool IsNegativeZero(const std::optional<double>& value) {
+    return value && *value == 0.0 && std::signbit(*value);
+}
+
+bool IsOne(const std::optional<double>& value) {
+    return value && *value == 1.0;
+}
+
 class BinaryOpExpr final : public Expr {
 public:
     enum Type : char {
@@ -143,10 +271,102 @@ public:
         }
     }
 
+    size_t GetAllocatedBytes() const override {
+        return sizeof(*this) + lhs_->GetAllocatedBytes() + rhs_->GetAllocatedBytes();
+    }
+
     double Evaluate(const SheetInterface& arg) const override {
         double lhs_value = static_cast<double>(lhs_->Evaluate(arg));
         double rhs_value = static_cast<double>(rhs_->Evaluate(arg));
+        return Apply(type_, lhs_value, rhs_value);
+    }
+
+    std::unique_ptr<Expr> Optimize() const override {
+        auto lhs = lhs_->Optimize();
+        auto rhs = rhs_->Optimize();
+        auto lhs_value = lhs->GetConstant();
+        auto rhs_value = rhs->GetConstant();
+
+        // the left operand is evaluated first, so its error wins
+        if (auto error = lhs->GetConstantError()) {
+            return std::make_unique<ErrorExpr>(*error);
+        }
+        if (lhs_value) {
+            if (auto error = rhs->GetConstantError()) {
+                return std::make_unique<ErrorExpr>(*error);
+            }
+        }
+        if (lhs_value && rhs_value) {
+            try {
+                return MakeConstant(Apply(type_, *lhs_value, *rhs_value));
+            } catch (const FormulaError& fe) {
+                return std::make_unique<ErrorExpr>(fe);
+            }
+        }
+
+        // x+0 and 0+x are not identities: -0+0 is +0
         switch (type_) {
+            case Add:
+                if (IsNegativeZero(rhs_value)) {
+                    return lhs;
+                }
+                if (IsNegativeZero(lhs_value)) {
+                    return rhs;
+                }
+                break;
+            case Subtract:
+                if (IsPositiveZero(rhs_value)) {
+                    return lhs;
+                }
+                break;
+            case Multiply:
+                if (IsOne(rhs_value)) {
+                    return lhs;
+                }
+                if (IsOne(lhs_value)) {
+                    return rhs;
+                }
+                break;
+            case Divide:
+                if (IsOne(rhs_value)) {
+                    return lhs;
+                }
+                break;
+        }
+        return std::make_unique<BinaryOpExpr>(type_, std::move(lhs), std::move(rhs));
+    }
+
+    std::unique_ptr<Expr> Clone(const CellMapping& mapping) const override {
+        return std::make_unique<BinaryOpExpr>(type_, lhs_->Clone(mapping), rhs_->Clone(mapping));
+    }
+
+    void CollectCells(const CellUse& use, bool conditional) const override {
+        lhs_->CollectCells(use, conditional);
+        rhs_->CollectCells(use, conditional);
+    }
+
+    void Compile(VectorProgram& program) const override {
+        lhs_->Compile(program);
+        rhs_->Compile(program);
+        switch (type_) {
+            case Add:
+                program.PushOperation(VectorProgram::OpCode::Add);
+                break;
+            case Subtract:
+                program.PushOperation(VectorProgram::OpCode::Subtract);
+                break;
+            case Multiply:
+                program.PushOperation(VectorProgram::OpCode::Multiply);
+                break;
+            case Divide:
+                program.PushOperation(VectorProgram::OpCode::Divide);
+                break;
+        }
+    }
+
+private:
+    static double Apply(Type type, double lhs_value, double rhs_value) {
+        switch (type) {
             case Add:
                 if(std::isinf(lhs_value + rhs_value)) {
                     throw FormulaError{FormulaError::Category::Div0};
@@ -174,7 +394,6 @@ public:
         }
     }
 
-private:
     Type type_;
     std::unique_ptr<Expr> lhs_;
     std::unique_ptr<Expr> rhs_;
@@ -208,34 +427,67 @@ public:
         return EP_UNARY;
     }
 
+    size_t GetAllocatedBytes() const override {
+        return sizeof(*this) + operand_->GetAllocatedBytes();
+    }
+
     double Evaluate(const SheetInterface& arg) const override {
         return type_ == UnaryPlus ? static_cast<double>(operand_->Evaluate(arg)) : 
             -static_cast<double>(operand_->Evaluate(arg));
     }
 
+    std::unique_ptr<Expr> Optimize() const override {
+        auto operand = operand_->Optimize();
+        if (type_ == UnaryPlus || operand->GetConstantError()) {
+            return operand;
+        }
+        if (auto value = operand->GetConstant()) {
+            return MakeConstant(-*value);
+        }
+        // the operand is already collapsed, so at most one minus remains below
+        if (auto* inner = dynamic_cast<UnaryOpExpr*>(operand.get())) {
+            assert(inner->type_ == UnaryMinus);
+            return std::move(inner->operand_);
+        }
+        return std::make_unique<UnaryOpExpr>(type_, std::move(operand));
+    }
+
+    std::unique_ptr<Expr> Clone(const CellMapping& mapping) const override {
+        return std::make_unique<UnaryOpExpr>(type_, operand_->Clone(mapping));
+    }
+
+    void CollectCells(const CellUse& use, bool conditional) const override {
+        operand_->CollectCells(use, conditional);
+    }
+
+    void Compile(VectorProgram& program) const override {
+        operand_->Compile(program);
+        if (type_ == UnaryMinus) {
+            program.PushOperation(VectorProgram::OpCode::Negate);
+        }
+    }
+
 private:
     Type type_;
     std::unique_ptr<Expr> operand_;
 };
 
-class CellExpr final : public Expr {
-private:
-    struct CellVisitor {
-        double operator() (const std::string& str) const {
-            try {
-                return str.empty() ? 0.0 : std::stod(str);
-            }
-            catch(...) {
-                throw FormulaError{FormulaError::Category::Value};
-            }
-        }
-        double operator() (double d) const {
-            return d;
-        }
-        double operator() (FormulaError& fe) const {
-            throw fe;
+struct CellVisitor {
+    double operator() (const std::string& str) const {
+        if(auto res = TextToNumber(str)) {
+            return *res;
         }
-    };
+        throw FormulaError{FormulaError::Category::Value};
+    }
+    double operator() (double d) const {
+        return d;
+    }
+    double operator() (FormulaError& fe) const {
+        throw fe;
+    }
+};
+
+class CellExpr final : public Expr {
 public:
     explicit CellExpr(const Position* cell)
         : cell_(cell) {
@@ -257,6 +509,10 @@ public:
         return EP_ATOM;
     }
 
+    size_t GetAllocatedBytes() const override {
+        return sizeof(*this);
+    }
+
     double Evaluate(const SheetInterface& arg) const override {
         auto cell_ptr = arg.GetCell(*cell_);
         auto value = cell_ptr ? arg.GetCell(*cell_)->GetValue() : CellInterface::Value{0.0};
@@ -265,10 +521,102 @@ public:
         return res;
     }
 
+    CellInterface::Value EvaluateValue(const SheetInterface& arg) const override {
+        auto cell_ptr = arg.GetCell(*cell_);
+        return cell_ptr ? cell_ptr->GetValue() : CellInterface::Value{std::string{}};
+    }
+
+    std::unique_ptr<Expr> Optimize() const override {
+        // a reference shifted off the grid, see FormulaAST::Shifted
+        if (!cell_->IsValid()) {
+            return std::make_unique<ErrorExpr>(FormulaError{FormulaError::Category::Ref});
+        }
+        return std::make_unique<CellExpr>(cell_);
+    }
+
+    void Compile(VectorProgram& program) const override {
+        program.PushInput(*cell_);
+    }
+
+    std::unique_ptr<Expr> Clone(const CellMapping& mapping) const override {
+        return std::make_unique<CellExpr>(CellMapping::Find(mapping.cells, cell_));
+    }
+
+    void CollectCells(const CellUse& use, bool conditional) const override {
+        use(*cell_, conditional);
+    }
+
 private:
     const Position* cell_;
 };
 
+// A reference to a cell of another sheet of the workbook: Sheet2!A1
+class ExternalCellExpr final : public Expr {
+public:
+    explicit ExternalCellExpr(const SheetReference* cell)
+        : cell_(cell) {
+    }
+
+    void Print(std::ostream& out) const override {
+        if (!cell_->pos.IsValid()) {
+            out << FormulaError::Category::Ref;
+        } else {
+            out << cell_->ToString();
+        }
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+        Print(out);
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    size_t GetAllocatedBytes() const override {
+        return sizeof(*this);
+    }
+
+    double Evaluate(const SheetInterface& arg) const override {
+        auto sheet = arg.FindSheet(cell_->sheet);
+        if (!sheet) {
+            throw FormulaError{FormulaError::Category::Ref};
+        }
+        auto cell_ptr = sheet->GetCell(cell_->pos);
+        auto value = cell_ptr ? cell_ptr->GetValue() : CellInterface::Value{0.0};
+        return std::visit(CellVisitor(), value);
+    }
+
+    CellInterface::Value EvaluateValue(const SheetInterface& arg) const override {
+        auto sheet = arg.FindSheet(cell_->sheet);
+        if (!sheet) {
+            return FormulaError{FormulaError::Category::Ref};
+        }
+        auto cell_ptr = sheet->GetCell(cell_->pos);
+        return cell_ptr ? cell_ptr->GetValue() : CellInterface::Value{std::string{}};
+    }
+
+    std::unique_ptr<Expr> Optimize() const override {
+        if (!cell_->pos.IsValid()) {
+            return std::make_unique<ErrorExpr>(FormulaError{FormulaError::Category::Ref});
+        }
+        return std::make_unique<ExternalCellExpr>(cell_);
+    }
+
+    std::unique_ptr<Expr> Clone(const CellMapping& mapping) const override {
+        return std::make_unique<ExternalCellExpr>(CellMapping::Find(mapping.external_cells, cell_));
+    }
+
+    void Compile(VectorProgram& program) const override {
+        // column batches read only cells of their own sheet
+        program.MarkNotBatchable();
+        program.PushConstant(0.0);
+    }
+
+private:
+    const SheetReference* cell_;
+};
+
 class NumberExpr final : public Expr {
 public:
     explicit NumberExpr(double value)
@@ -287,18 +635,671 @@ public:
         return EP_ATOM;
     }
 
+    size_t GetAllocatedBytes() const override {
+        return sizeof(*this);
+    }
+
     double Evaluate(const SheetInterface& arg) const override {
         return value_;
     }
 
+    std::unique_ptr<Expr> Optimize() const override {
+        return std::make_unique<NumberExpr>(value_);
+    }
+
+    std::optional<double> GetConstant() const override {
+        return value_;
+    }
+
+    void Compile(VectorProgram& program) const override {
+        program.PushConstant(value_);
+    }
+
+    std::unique_ptr<Expr> Clone(const CellMapping& /* mapping */) const override {
+        return std::make_unique<NumberExpr>(value_);
+    }
+
 private:
     double value_;
 };
 
+std::unique_ptr<Expr> MakeConstant(double value) {
+    return std::make_unique<NumberExpr>(value);
+}
+
+// A rectangle of cells (A1:B3). Only appears as a function argument: the
+// function reads the cells itself, so the range has no value of its own.
+class RangeExpr final : public Expr {
+public:
+    explicit RangeExpr(const Range* range)
+        : range_(range) {
+    }
+
+    void Print(std::ostream& out) const override {
+        if (!range_->IsValid()) {
+            out << FormulaError::Category::Ref;
+        } else {
+            out << range_->ToString();
+        }
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+        Print(out);
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    size_t GetAllocatedBytes() const override {
+        return sizeof(*this);
+    }
+
+    double Evaluate(const SheetInterface& /* arg */) const override {
+        throw FormulaError{FormulaError::Category::Value};
+    }
+
+    std::unique_ptr<Expr> Optimize() const override {
+        return std::make_unique<RangeExpr>(range_);
+    }
+
+    void Compile(VectorProgram& program) const override {
+        program.MarkNotBatchable();
+        program.PushConstant(0.0);
+    }
+
+    std::unique_ptr<Expr> Clone(const CellMapping& mapping) const override {
+        return std::make_unique<RangeExpr>(CellMapping::Find(mapping.ranges, range_));
+    }
+
+    // a range shifted off the grid is #REF!, see FormulaAST::Shifted
+    const Range& GetRange() const {
+        if (!range_->IsValid()) {
+            throw FormulaError{FormulaError::Category::Ref};
+        }
+        return *range_;
+    }
+
+private:
+    const Range* range_;
+};
+
+void CheckScalar(const Expr& expr) {
+    if (dynamic_cast<const RangeExpr*>(&expr)) {
+        throw ParsingError("A range can only be a function argument");
+    }
+}
+
+// VLOOKUP(value, table, column, [approximate = 1]): the value from the column
+//     of the table (counting from 1) in the first row whose first cell is the
+//     value; an approximate lookup takes the last row whose first cell is not
+//     greater than the value, the table being sorted by the first column.
+// MATCH(value, cells, [type = 1]): the number of the cell (counting from 1)
+//     in a row or a column of cells: the last one not greater than the value
+//     for type 1, equal to it for type 0 and not less than it for type -1
+//     (the cells being sorted in ascending and descending order).
+// XLOOKUP(value, cells, results, [if_not_found]): the cell of results at the
+//     position of the first cell equal to the value.
+// The value is looked up as LookupIndex::Key, so a referenced text cell is
+// looked up as text. A value that is not found gives #N/A. The sheet supplies
+// a shared index of the searched cells, otherwise they are scanned one by one.
+class LookupExpr final : public Expr {
+public:
+    enum Type {
+        VLookup,
+        Match,
+        XLookup,
+    };
+
+    LookupExpr(Type type, std::vector<std::unique_ptr<Expr>> args)
+        : type_(type)
+        , args_(std::move(args)) {
+    }
+
+    // Checks the arguments of a function call; throws ParsingError for an
+    // unknown function or wrong arguments
+    static std::unique_ptr<Expr> Make(const std::string& name, std::vector<std::unique_ptr<Expr>> args) {
+        auto iter = std::find_if(std::begin(SIGNATURES), std::end(SIGNATURES), [&name](const auto& signature) {
+            return name == signature.name;
+        });
+        if (iter == std::end(SIGNATURES)) {
+            throw ParsingError("Unknown function: " + name);
+        }
+        if (args.size() < iter->min_args || args.size() > iter->max_args) {
+            throw ParsingError("Wrong number of arguments: " + name);
+        }
+        for (size_t i = 0; i < args.size(); ++i) {
+            bool is_range = dynamic_cast<const RangeExpr*>(args[i].get()) != nullptr;
+            bool needs_range = i == 1 || (i == 2 && iter->type == XLookup);
+            if (is_range != needs_range) {
+                throw ParsingError("Wrong argument " + std::to_string(i + 1) + " of " + name);
+            }
+        }
+        return std::make_unique<LookupExpr>(iter->type, std::move(args));
+    }
+
+    void Print(std::ostream& out) const override {
+        out << '(' << SIGNATURES[type_].name;
+        for (const auto& arg : args_) {
+            out << ' ';
+            arg->Print(out);
+        }
+        out << ')';
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+        out << SIGNATURES[type_].name << '(';
+        bool first = true;
+        for (const auto& arg : args_) {
+            if (!first) {
+                out << ',';
+            }
+            first = false;
+            arg->PrintFormula(out, EP_ATOM);
+        }
+        out << ')';
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    size_t GetAllocatedBytes() const override {
+        size_t res = sizeof(*this) + args_.capacity() * sizeof(args_.front());
+        for (const auto& arg : args_) {
+            res += arg->GetAllocatedBytes();
+        }
+        return res;
+    }
+
+    double Evaluate(const SheetInterface& arg) const override {
+        auto value = args_[0]->EvaluateValue(arg);
+        if (const auto* error = std::get_if<FormulaError>(&value)) {
+            throw *error;
+        }
+        auto key = LookupIndex::Key::FromValue(value);
+        const Range& cells = GetRange(1);
+        switch (type_) {
+            case VLookup: {
+                double column = std::trunc(args_[2]->Evaluate(arg));
+                if (column < 1.0) {
+                    throw FormulaError{FormulaError::Category::Value};
+                }
+                if (column > cells.size.cols) {
+                    throw FormulaError{FormulaError::Category::Ref};
+                }
+                bool approximate = args_.size() < 4u || args_[3]->Evaluate(arg) != 0.0;
+                Range keys{cells.top_left, {cells.size.rows, 1}};
+                size_t offset = Find(arg, keys, key, approximate ? 1 : 0);
+                return ReadNumber(arg, {cells.top_left.row + static_cast<int>(offset),
+                                        cells.top_left.col + static_cast<int>(column) - 1});
+            }
+            case Match: {
+                if (cells.size.rows != 1 && cells.size.cols != 1) {
+                    throw FormulaError{FormulaError::Category::NA};
+                }
+                double match_type = args_.size() < 3u ? 1.0 : args_[2]->Evaluate(arg);
+                int order = match_type > 0.0 ? 1 : (match_type < 0.0 ? -1 : 0);
+                return static_cast<double>(Find(arg, cells, key, order) + 1u);
+            }
+            case XLookup: {
+                const Range& results = GetRange(2);
+                if ((cells.size.rows != 1 && cells.size.cols != 1) || !(cells.size == results.size)) {
+                    throw FormulaError{FormulaError::Category::Value};
+                }
+                size_t offset = 0;
+                try {
+                    offset = Find(arg, cells, key, 0);
+                } catch (const FormulaError& fe) {
+                    if (fe.GetCategory() != FormulaError::Category::NA || args_.size() < 4u) {
+                        throw;
+                    }
+                    return args_[3]->Evaluate(arg);
+                }
+                int shift = static_cast<int>(offset);
+                return ReadNumber(arg, cells.size.rows == 1
+                                           ? Position{results.top_left.row, results.top_left.col + shift}
+                                           : Position{results.top_left.row + shift, results.top_left.col});
+            }
+        }
+        // have to do this because VC++ has a buggy warning
+        assert(false);
+        return 0.0;
+    }
+
+    std::unique_ptr<Expr> Optimize() const override {
+        std::vector<std::unique_ptr<Expr>> args;
+        for (const auto& arg : args_) {
+            args.push_back(arg->Optimize());
+        }
+        return std::make_unique<LookupExpr>(type_, std::move(args));
+    }
+
+    void Compile(VectorProgram& program) const override {
+        // the result depends on a whole range, so the formula is evaluated
+        // cell by cell
+        program.MarkNotBatchable();
+        program.PushConstant(0.0);
+    }
+
+    std::unique_ptr<Expr> Clone(const CellMapping& mapping) const override {
+        std::vector<std::unique_ptr<Expr>> args;
+        for (const auto& arg : args_) {
+            args.push_back(arg->Clone(mapping));
+        }
+        return std::make_unique<LookupExpr>(type_, std::move(args));
+    }
+
+    void CollectCells(const CellUse& use, bool conditional) const override {
+        for (size_t i = 0; i < args_.size(); ++i) {
+            // if_not_found of XLOOKUP is only evaluated when nothing is found
+            args_[i]->CollectCells(use, conditional || (type_ == XLookup && i == 3u));
+        }
+    }
+
+private:
+    struct Signature {
+        const char* name;
+        Type type;
+        size_t min_args;
+        size_t max_args;
+    };
+    static constexpr Signature SIGNATURES[] = {
+        {"VLOOKUP", VLookup, 3, 4},
+        {"MATCH", Match, 2, 3},
+        {"XLOOKUP", XLookup, 3, 4},
+    };
+
+    const Range& GetRange(size_t index) const {
+        return static_cast<const RangeExpr&>(*args_[index]).GetRange();
+    }
+
+    // order: 0 - exact match, 1 - sorted in ascending order, -1 - in descending
+    static size_t Find(const SheetInterface& arg, const Range& cells, const LookupIndex::Key& key,
+                       int order) {
+        std::optional<size_t> res;
+        if (const auto* index = arg.GetLookupIndex(cells)) {
+            res = order == 0 ? index->FindExact(cells, key) : index->FindSorted(cells, key, order < 0);
+        } else {
+            std::vector<LookupIndex::Key> values;
+            for (int row = 0; row < cells.size.rows; ++row) {
+                for (int col = 0; col < cells.size.cols; ++col) {
+                    auto cell_ptr = arg.GetCell({cells.top_left.row + row, cells.top_left.col + col});
+                    values.push_back(cell_ptr ? LookupIndex::Key::FromValue(cell_ptr->GetValue())
+                                              : LookupIndex::Key{});
+                }
+            }
+            res = order == 0 ? LookupIndex::FindExact(values, key)
+                             : LookupIndex::FindSorted(values, key, order < 0);
+        }
+        if (!res) {
+            throw FormulaError{FormulaError::Category::NA};
+        }
+        return *res;
+    }
+
+    static double ReadNumber(const SheetInterface& arg, Position pos) {
+        auto cell_ptr = arg.GetCell(pos);
+        auto value = cell_ptr ? cell_ptr->GetValue() : CellInterface::Value{0.0};
+        return std::visit(CellVisitor(), value);
+    }
+
+    Type type_;
+    std::vector<std::unique_ptr<Expr>> args_;
+};
+
+// A comparison of two numbers: 1 if it holds, 0 otherwise
+class ComparisonExpr final : public Expr {
+public:
+    enum Type {
+        Equal,
+        NotEqual,
+        Less,
+        LessEqual,
+        Greater,
+        GreaterEqual,
+    };
+
+    ComparisonExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs)
+        : type_(type)
+        , lhs_(std::move(lhs))
+        , rhs_(std::move(rhs)) {
+    }
+
+    void Print(std::ostream& out) const override {
+        out << '(' << OPERATORS[type_] << ' ';
+        lhs_->Print(out);
+        out << ' ';
+        rhs_->Print(out);
+        out << ')';
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
+        lhs_->PrintFormula(out, precedence);
+        out << OPERATORS[type_];
+        rhs_->PrintFormula(out, precedence, /* right_child = */ true);
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_COMPARE;
+    }
+
+    size_t GetAllocatedBytes() const override {
+        return sizeof(*this) + lhs_->GetAllocatedBytes() + rhs_->GetAllocatedBytes();
+    }
+
+    double Evaluate(const SheetInterface& arg) const override {
+        double lhs_value = lhs_->Evaluate(arg);
+        double rhs_value = rhs_->Evaluate(arg);
+        return Apply(type_, lhs_value, rhs_value);
+    }
+
+    std::unique_ptr<Expr> Optimize() const override {
+        auto lhs = lhs_->Optimize();
+        auto rhs = rhs_->Optimize();
+        // the left operand is evaluated first, so its error wins
+        if (auto error = lhs->GetConstantError()) {
+            return std::make_unique<ErrorExpr>(*error);
+        }
+        auto lhs_value = lhs->GetConstant();
+        if (lhs_value) {
+            if (auto error = rhs->GetConstantError()) {
+                return std::make_unique<ErrorExpr>(*error);
+            }
+            if (auto rhs_value = rhs->GetConstant()) {
+                return MakeConstant(Apply(type_, *lhs_value, *rhs_value));
+            }
+        }
+        return std::make_unique<ComparisonExpr>(type_, std::move(lhs), std::move(rhs));
+    }
+
+    void Compile(VectorProgram& program) const override {
+        static constexpr VectorProgram::OpCode OPCODES[] = {
+            VectorProgram::OpCode::Equal,
+            VectorProgram::OpCode::NotEqual,
+            VectorProgram::OpCode::Less,
+            VectorProgram::OpCode::LessEqual,
+            VectorProgram::OpCode::Greater,
+            VectorProgram::OpCode::GreaterEqual,
+        };
+        lhs_->Compile(program);
+        rhs_->Compile(program);
+        program.PushOperation(OPCODES[type_]);
+    }
+
+    std::unique_ptr<Expr> Clone(const CellMapping& mapping) const override {
+        return std::make_unique<ComparisonExpr>(type_, lhs_->Clone(mapping), rhs_->Clone(mapping));
+    }
+
+    void CollectCells(const CellUse& use, bool conditional) const override {
+        lhs_->CollectCells(use, conditional);
+        rhs_->CollectCells(use, conditional);
+    }
+
+private:
+    static constexpr const char* OPERATORS[] = {"=", "<>", "<", "<=", ">", ">="};
+
+    static double Apply(Type type, double lhs_value, double rhs_value) {
+        bool res = false;
+        switch (type) {
+            case Equal:
+                res = lhs_value == rhs_value;
+                break;
+            case NotEqual:
+                res = lhs_value != rhs_value;
+                break;
+            case Less:
+                res = lhs_value < rhs_value;
+                break;
+            case LessEqual:
+                res = lhs_value <= rhs_value;
+                break;
+            case Greater:
+                res = lhs_value > rhs_value;
+                break;
+            case GreaterEqual:
+                res = lhs_value >= rhs_value;
+                break;
+        }
+        return res ? 1.0 : 0.0;
+    }
+
+    Type type_;
+    std::unique_ptr<Expr> lhs_;
+    std::unique_ptr<Expr> rhs_;
+};
+
+// IF(condition, then, [else = 0]): then if the condition is not 0, else else.
+// AND(a, ...), OR(a, ...): 1 if all (any) of the arguments are not 0, else 0.
+// CHOOSE(index, a, ...): the argument with the index (counting from 1),
+//     #VALUE! if there is none.
+// Evaluation short-circuits: only the taken branch of IF and CHOOSE is
+// evaluated, AND and OR stop at the first argument that decides the result.
+// So an error in a branch that is not taken doesn't reach the result, and
+// the cells of such a branch are not read.
+class ConditionalExpr final : public Expr {
+public:
+    enum Type {
+        If,
+        And,
+        Or,
+        Choose,
+    };
+
+    ConditionalExpr(Type type, std::vector<std::unique_ptr<Expr>> args)
+        : type_(type)
+        , args_(std::move(args)) {
+    }
+
+    // Returns nullptr and leaves args intact if name is not a conditional
+    // function; throws ParsingError for wrong arguments
+    static std::unique_ptr<Expr> Make(const std::string& name, std::vector<std::unique_ptr<Expr>>&& args) {
+        auto iter = std::find_if(std::begin(SIGNATURES), std::end(SIGNATURES), [&name](const auto& signature) {
+            return name == signature.name;
+        });
+        if (iter == std::end(SIGNATURES)) {
+            return nullptr;
+        }
+        if (args.size() < iter->min_args || args.size() > iter->max_args) {
+            throw ParsingError("Wrong number of arguments: " + name);
+        }
+        for (const auto& arg : args) {
+            CheckScalar(*arg);
+        }
+        return std::make_unique<ConditionalExpr>(iter->type, std::move(args));
+    }
+
+    void Print(std::ostream& out) const override {
+        out << '(' << SIGNATURES[type_].name;
+        for (const auto& arg : args_) {
+            out << ' ';
+            arg->Print(out);
+        }
+        out << ')';
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+        out << SIGNATURES[type_].name << '(';
+        bool first = true;
+        for (const auto& arg : args_) {
+            if (!first) {
+                out << ',';
+            }
+            first = false;
+            arg->PrintFormula(out, EP_ATOM);
+        }
+        out << ')';
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    size_t GetAllocatedBytes() const override {
+        size_t res = sizeof(*this) + args_.capacity() * sizeof(args_.front());
+        for (const auto& arg : args_) {
+            res += arg->GetAllocatedBytes();
+        }
+        return res;
+    }
+
+    double Evaluate(const SheetInterface& arg) const override {
+        switch (type_) {
+            case If:
+            case Choose: {
+                const Expr* branch = GetBranch(arg);
+                return branch ? branch->Evaluate(arg) : 0.0;
+            }
+            case And:
+                for (const auto& operand : args_) {
+                    if (operand->Evaluate(arg) == 0.0) {
+                        return 0.0;
+                    }
+                }
+                return 1.0;
+            case Or:
+                for (const auto& operand : args_) {
+                    if (operand->Evaluate(arg) != 0.0) {
+                        return 1.0;
+                    }
+                }
+                return 0.0;
+        }
+        // have to do this because VC++ has a buggy warning
+        assert(false);
+        return 0.0;
+    }
+
+    // the taken branch of IF and CHOOSE is looked up as is, as if it were
+    // written in place of the function
+    CellInterface::Value EvaluateValue(const SheetInterface& arg) const override {
+        if (type_ != If && type_ != Choose) {
+            return Evaluate(arg);
+        }
+        const Expr* branch = GetBranch(arg);
+        return branch ? branch->EvaluateValue(arg) : CellInterface::Value{0.0};
+    }
+
+    std::unique_ptr<Expr> Optimize() const override {
+        std::vector<std::unique_ptr<Expr>> args;
+        for (const auto& operand : args_) {
+            args.push_back(operand->Optimize());
+        }
+        if (auto error = args.front()->GetConstantError()) {
+            return std::make_unique<ErrorExpr>(*error);
+        }
+        auto first = args.front()->GetConstant();
+        switch (type_) {
+            case If:
+                if (first) {
+                    size_t index = *first != 0.0 ? 1u : 2u;
+                    return index < args.size() ? std::move(args[index]) : MakeConstant(0.0);
+                }
+                break;
+            case Choose:
+                if (first) {
+                    double index = std::trunc(*first);
+                    if (index < 1.0 || index >= static_cast<double>(args.size())) {
+                        return std::make_unique<ErrorExpr>(FormulaError{FormulaError::Category::Value});
+                    }
+                    return std::move(args[static_cast<size_t>(index)]);
+                }
+                break;
+            case And:
+            case Or: {
+                // leading constants either decide the result or can be dropped
+                const bool decisive = type_ == Or;
+                size_t skipped = 0;
+                for (; skipped < args.size(); ++skipped) {
+                    if (auto error = args[skipped]->GetConstantError()) {
+                        return std::make_unique<ErrorExpr>(*error);
+                    }
+                    auto value = args[skipped]->GetConstant();
+                    if (!value) {
+                        break;
+                    }
+                    if ((*value != 0.0) == decisive) {
+                        return MakeConstant(decisive ? 1.0 : 0.0);
+                    }
+                }
+                if (skipped == args.size()) {
+                    return MakeConstant(decisive ? 0.0 : 1.0);
+                }
+                args.erase(args.begin(), args.begin() + static_cast<std::ptrdiff_t>(skipped));
+                break;
+            }
+        }
+        return std::make_unique<ConditionalExpr>(type_, std::move(args));
+    }
+
+    void Compile(VectorProgram& program) const override {
+        // every lane would take its own branch, so the formula is evaluated
+        // cell by cell
+        program.MarkNotBatchable();
+        program.PushConstant(0.0);
+    }
+
+    std::unique_ptr<Expr> Clone(const CellMapping& mapping) const override {
+        std::vector<std::unique_ptr<Expr>> args;
+        for (const auto& operand : args_) {
+            args.push_back(operand->Clone(mapping));
+        }
+        return std::make_unique<ConditionalExpr>(type_, std::move(args));
+    }
+
+    void CollectCells(const CellUse& use, bool conditional) const override {
+        // the first argument is always evaluated
+        args_.front()->CollectCells(use, conditional);
+        for (size_t i = 1; i < args_.size(); ++i) {
+            args_[i]->CollectCells(use, true);
+        }
+    }
+
+private:
+    struct Signature {
+        const char* name;
+        Type type;
+        size_t min_args;
+        size_t max_args;
+    };
+    static constexpr size_t UNLIMITED = std::numeric_limits<size_t>::max();
+    static constexpr Signature SIGNATURES[] = {
+        {"IF", If, 2, 3},
+        {"AND", And, 1, UNLIMITED},
+        {"OR", Or, 1, UNLIMITED},
+        {"CHOOSE", Choose, 2, UNLIMITED},
+    };
+
+    // the taken branch of IF or CHOOSE; nullptr for a missing else of IF
+    const Expr* GetBranch(const SheetInterface& arg) const {
+        double first = args_.front()->Evaluate(arg);
+        if (type_ == If) {
+            size_t index = first != 0.0 ? 1u : 2u;
+            return index < args_.size() ? args_[index].get() : nullptr;
+        }
+        double index = std::trunc(first);
+        if (index < 1.0 || index >= static_cast<double>(args_.size())) {
+            throw FormulaError{FormulaError::Category::Value};
+        }
+        return args_[static_cast<size_t>(index)].get();
+    }
+
+    Type type_;
+    std::vector<std::unique_ptr<Expr>> args_;
+};
+
+std::unique_ptr<Expr> MakeFunction(const std::string& name, std::vector<std::unique_ptr<Expr>> args) {
+    if (auto res = ConditionalExpr::Make(name, std::move(args))) {
+        return res;
+    }
+    return LookupExpr::Make(name, std::move(args));
+}
+
 class ParseASTListener final : public FormulaBaseListener {
 public:
     std::unique_ptr<Expr> MoveRoot() {
         assert(args_.size() == 1);
+        CheckScalar(*args_.front());
         auto root = std::move(args_.front());
         args_.clear();
 
@@ -309,11 +1310,20 @@ public:
         return std::move(cells_);
     }
 
+    std::forward_list<SheetReference> MoveExternalCells() {
+        return std::move(external_cells_);
+    }
+
+    std::forward_list<Range> MoveRanges() {
+        return std::move(ranges_);
+    }
+
 public:
     void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
         assert(args_.size() >= 1);
 
         auto operand = std::move(args_.back());
+        CheckScalar(*operand);
 
         UnaryOpExpr::Type type;
         if (ctx->SUB()) {
@@ -342,11 +1352,20 @@ public:
 
     void exitCell(FormulaParser::CellContext* ctx) override {
         auto value_str = ctx->CELL()->getSymbol()->getText();
-        auto value = Position::FromString(value_str);
+        auto sheet_end = value_str.find('!');
+        auto value = Position::FromString(
+            sheet_end == std::string::npos ? value_str : value_str.substr(sheet_end + 1));
         if (!value.IsValid()) {
             throw FormulaException("Invalid position: " + value_str);
         }
 
+        if (sheet_end != std::string::npos) {
+            external_cells_.push_front({value_str.substr(0, sheet_end), value});
+            auto node = std::make_unique<ExternalCellExpr>(&external_cells_.front());
+            args_.push_back(std::move(node));
+            return;
+        }
+
         cells_.push_front(value);
         auto node = std::make_unique<CellExpr>(&cells_.front());
         args_.push_back(std::move(node));
@@ -359,6 +1378,8 @@ public:
         args_.pop_back();
 
         auto lhs = std::move(args_.back());
+        CheckScalar(*lhs);
+        CheckScalar(*rhs);
 
         BinaryOpExpr::Type type;
         if (ctx->ADD()) {
@@ -376,6 +1397,57 @@ public:
         args_.back() = std::move(node);
     }
 
+    void exitRange(FormulaParser::RangeContext* ctx) override {
+        auto value_str = ctx->RANGE()->getSymbol()->getText();
+        auto value = Range::FromString(value_str);
+        if (!value.IsValid()) {
+            throw FormulaException("Invalid range: " + value_str);
+        }
+        ranges_.push_front(value);
+        args_.push_back(std::make_unique<RangeExpr>(&ranges_.front()));
+    }
+
+    void exitFunction(FormulaParser::FunctionContext* ctx) override {
+        size_t count = ctx->expr().size();
+        assert(args_.size() >= count);
+
+        auto first = args_.end() - static_cast<std::ptrdiff_t>(count);
+        std::vector<std::unique_ptr<Expr>> args(std::make_move_iterator(first),
+                                                std::make_move_iterator(args_.end()));
+        args_.erase(first, args_.end());
+
+        args_.push_back(MakeFunction(ctx->FUNCTION()->getSymbol()->getText(), std::move(args)));
+    }
+
+    void exitComparison(FormulaParser::ComparisonContext* ctx) override {
+        assert(args_.size() >= 2);
+
+        auto rhs = std::move(args_.back());
+        args_.pop_back();
+
+        auto lhs = std::move(args_.back());
+        CheckScalar(*lhs);
+        CheckScalar(*rhs);
+
+        ComparisonExpr::Type type;
+        if (ctx->EQ()) {
+            type = ComparisonExpr::Equal;
+        } else if (ctx->NE()) {
+            type = ComparisonExpr::NotEqual;
+        } else if (ctx->LT()) {
+            type = ComparisonExpr::Less;
+        } else if (ctx->LE()) {
+            type = ComparisonExpr::LessEqual;
+        } else if (ctx->GT()) {
+            type = ComparisonExpr::Greater;
+        } else {
+            assert(ctx->GE() != nullptr);
+            type = ComparisonExpr::GreaterEqual;
+        }
+
+        args_.back() = std::make_unique<ComparisonExpr>(type, std::move(lhs), std::move(rhs));
+    }
+
     void visitErrorNode(antlr4::tree::ErrorNode* node) override {
         throw ParsingError("Error when parsing: " + node->getSymbol()->getText());
     }
@@ -383,6 +1455,8 @@ public:
 private:
     std::vector<std::unique_ptr<Expr>> args_;
     std::forward_list<Position> cells_;
+    std::forward_list<SheetReference> external_cells_;
+    std::forward_list<Range> ranges_;
 };
 
 class BailErrorListener : public antlr4::BaseErrorListener {
@@ -419,7 +1493,8 @@ FormulaAST ParseFormulaAST(std::istream& in) {
     ASTImpl::ParseASTListener listener;
     tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
 
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+    return FormulaAST(listener.MoveRoot(), listener.MoveCells(), listener.MoveExternalCells(),
+                      listener.MoveRanges());
 }
 
 FormulaAST ParseFormulaAST(const std::string& in_str) {
@@ -441,14 +1516,106 @@ void FormulaAST::PrintFormula(std::ostream& out) const {
     root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
 }
 
+void FormulaAST::PrintOptimized(std::ostream& out) const {
+    optimized_expr_->Print(out);
+}
+
 double FormulaAST::Execute(const SheetInterface& arg) const {
-    return root_expr_->Evaluate(arg);
+    return optimized_expr_->Evaluate(arg);
+}
+
+std::vector<Position> FormulaAST::GetBranchCells() const {
+    std::vector<Position> always_read;
+    optimized_expr_->CollectCells([&always_read](const Position& cell, bool conditional) {
+        if (!conditional) {
+            always_read.push_back(cell);
+        }
+    }, false);
+    std::sort(always_read.begin(), always_read.end());
+
+    // cells_ is sorted; cells dropped by the optimizer are never read at all
+    std::vector<Position> res;
+    for (const auto& cell : cells_) {
+        if (cell.IsValid() && (res.empty() || !(res.back() == cell))
+            && !std::binary_search(always_read.begin(), always_read.end(), cell)) {
+            res.push_back(cell);
+        }
+    }
+    return res;
+}
+
+size_t FormulaAST::GetNodeBytes() const {
+    return root_expr_->GetAllocatedBytes() + optimized_expr_->GetAllocatedBytes();
+}
+
+size_t FormulaAST::GetCellListBytes() const {
+    // a forward_list node holds the value and a pointer to the next node
+    size_t res = 0;
+    for ([[maybe_unused]] const auto& cell : cells_) {
+        res += sizeof(Position) + sizeof(void*);
+    }
+    for (const auto& cell : external_cells_) {
+        res += sizeof(SheetReference) + sizeof(void*);
+        if (cell.sheet.capacity() > std::string{}.capacity()) {
+            res += cell.sheet.capacity() + 1;
+        }
+    }
+    for ([[maybe_unused]] const auto& range : ranges_) {
+        res += sizeof(Range) + sizeof(void*);
+    }
+    return res;
+}
+
+FormulaAST FormulaAST::Shifted(int row_shift, int col_shift) const {
+    auto shift = [row_shift, col_shift](Position pos) {
+        Position res{pos.row + row_shift, pos.col + col_shift};
+        return pos.IsValid() && res.IsValid() ? res : Position::NONE;
+    };
+    ASTImpl::CellMapping mapping;
+    std::forward_list<Position> cells;
+    auto cells_tail = cells.before_begin();
+    for (const auto& cell : cells_) {
+        cells_tail = cells.insert_after(cells_tail, shift(cell));
+        mapping.cells.emplace_back(&cell, &*cells_tail);
+    }
+    std::forward_list<SheetReference> external_cells;
+    auto external_tail = external_cells.before_begin();
+    for (const auto& cell : external_cells_) {
+        external_tail = external_cells.insert_after(external_tail, SheetReference{cell.sheet, shift(cell.pos)});
+        mapping.external_cells.emplace_back(&cell, &*external_tail);
+    }
+    std::forward_list<Range> ranges;
+    auto ranges_tail = ranges.before_begin();
+    for (const auto& range : ranges_) {
+        Range shifted{shift(range.top_left), range.size};
+        if (!shift(range.GetBottomRight()).IsValid()) {
+            shifted.top_left = Position::NONE;
+        }
+        ranges_tail = ranges.insert_after(ranges_tail, shifted);
+        mapping.ranges.emplace_back(&range, &*ranges_tail);
+    }
+    return FormulaAST(root_expr_->Clone(mapping), std::move(cells), std::move(external_cells),
+                      std::move(ranges));
+}
+
+VectorProgram FormulaAST::Compile() const {
+    VectorProgram program;
+    optimized_expr_->Compile(program);
+    return program;
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
+FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells,
+                       std::forward_list<SheetReference> external_cells, std::forward_list<Range> ranges)
     : root_expr_(std::move(root_expr))
-    , cells_(std::move(cells)) {
+    , optimized_expr_(root_expr_->Optimize())
+    , cells_(std::move(cells))
+    , external_cells_(std::move(external_cells))
+    , ranges_(std::move(ranges)) {
     cells_.sort();  // to avoid sorting in GetReferencedCells
+    external_cells_.sort();
+    ranges_.sort();
 }
 
+FormulaAST::FormulaAST(FormulaAST&&) = default;
+FormulaAST& FormulaAST::operator=(FormulaAST&&) = default;
 FormulaAST::~FormulaAST() = default;
@@ -2,10 +2,12 @@
 
 #include "FormulaLexer.h"
 #include "common.h"
+#include "vector_program.h"
 
 #include <forward_list>
 #include <functional>
 #include <stdexcept>
+#include <vector>
 
 namespace ASTImpl {
 class Expr;
@@ -18,15 +20,30 @@ class ParsingError : public std::runtime_error {
 class FormulaAST {
 public:
     explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-                        std::forward_list<Position> cells);
-    FormulaAST(FormulaAST&&) = default;
-    FormulaAST& operator=(FormulaAST&&) = default;
+                        std::forward_list<Position> cells,
+                        std::forward_list<SheetReference> external_cells = {},
+                        std::forward_list<Range> ranges = {});
+    FormulaAST(FormulaAST&&);
+    FormulaAST& operator=(FormulaAST&&);
     ~FormulaAST();
 
     double Execute(const SheetInterface& arg) const;
+    // compiles the optimized tree for batch evaluation
+    VectorProgram Compile() const;
+    // A copy with every cell reference moved by (row_shift, col_shift), as when
+    // the formula is copied to another cell. References that leave the grid
+    // become #REF!.
+    FormulaAST Shifted(int row_shift, int col_shift) const;
     void PrintCells(std::ostream& out) const;
     void Print(std::ostream& out) const;
     void PrintFormula(std::ostream& out) const;
+    // prints the tree that Execute() actually evaluates
+    void PrintOptimized(std::ostream& out) const;
+
+    // heap memory of the printed and the optimized trees
+    size_t GetNodeBytes() const;
+    // heap memory of the cell and range reference lists
+    size_t GetCellListBytes() const;
 
     std::forward_list<Position>& GetCells() {
         return cells_;
@@ -36,13 +53,32 @@ public:
         return cells_;
     }
 
+    // references to cells of other sheets (Sheet2!A1), sorted
+    const std::forward_list<SheetReference>& GetExternalCells() const {
+        return external_cells_;
+    }
+
+    // ranges passed to functions (VLOOKUP(A1, B1:C9, 2)), sorted
+    const std::forward_list<Range>& GetRanges() const {
+        return ranges_;
+    }
+
+    // Cells of the same sheet that Execute() may skip: those referenced only
+    // in branches of IF, AND, OR and CHOOSE, or in subtrees removed by
+    // constant folding. Sorted, without duplicates.
+    std::vector<Position> GetBranchCells() const;
+
 private:
     std::unique_ptr<ASTImpl::Expr> root_expr_;
+    // root_expr_ after constant folding; root_expr_ itself is only printed
+    std::unique_ptr<ASTImpl::Expr> optimized_expr_;
 
     // physically stores cells so that they can be
     // efficiently traversed without going through
     // the whole AST
     std::forward_list<Position> cells_;
+    std::forward_list<SheetReference> external_cells_;
+    std::forward_list<Range> ranges_;
 };
 
 FormulaAST ParseFormulaAST(std::istream& in);
@@ -0,0 +1,143 @@
+#include "async_sheet.h"
+
+#include <algorithm>
+
+AsyncSheet::AsyncSheet()
+    : worker_([this] { Run(); }) {}
+
+AsyncSheet::~AsyncSheet() {
+    {
+        std::lock_guard lock(mutex_);
+        stop_ = true;
+    }
+    work_cv_.notify_one();
+    worker_.join();
+}
+
+void AsyncSheet::SetCell(Position pos, std::string text) {
+    {
+        std::lock_guard lock(mutex_);
+        sheet_.SetCell(pos, std::move(text));
+    }
+    work_cv_.notify_one();
+}
+
+void AsyncSheet::ClearCell(Position pos) {
+    {
+        std::lock_guard lock(mutex_);
+        sheet_.ClearCell(pos);
+    }
+    work_cv_.notify_one();
+}
+
+std::string AsyncSheet::GetText(Position pos) const {
+    std::lock_guard lock(mutex_);
+    auto cell = sheet_.GetCell(pos);
+    return cell ? cell->GetText() : std::string{};
+}
+
+CellInterface::Value AsyncSheet::GetLastValue(Position pos) const {
+    if(!pos.IsValid()) {
+        throw InvalidPositionException("wrong position");
+    }
+    std::lock_guard lock(mutex_);
+    auto iter = published_.find(pos);
+    return iter != published_.end() ? iter->second : CellInterface::Value{};
+}
+
+std::future<CellInterface::Value> AsyncSheet::GetFreshValue(Position pos) {
+    if(!pos.IsValid()) {
+        throw InvalidPositionException("wrong position");
+    }
+    std::lock_guard lock(mutex_);
+    std::promise<CellInterface::Value> promise;
+    auto res = promise.get_future();
+    if(computed_version_ == sheet_.GetVersion()) {
+        promise.set_value(ReadValue(pos));
+    }
+    else {
+        requests_.push_back({pos, sheet_.GetVersion(), std::move(promise)});
+    }
+    return res;
+}
+
+void AsyncSheet::WaitForRecalculation() const {
+    std::unique_lock lock(mutex_);
+    auto version = sheet_.GetVersion();
+    done_cv_.wait(lock, [this, version] {
+        return computed_version_ >= version;
+    });
+}
+
+AsyncSheet::Stats AsyncSheet::GetStats() const {
+    std::lock_guard lock(mutex_);
+    return stats_;
+}
+
+void AsyncSheet::Run() {
+    std::unique_lock lock(mutex_);
+    while(true) {
+        work_cv_.wait(lock, [this] {
+            return stop_ || computed_version_ != sheet_.GetVersion();
+        });
+        if(stop_) {
+            return;
+        }
+        auto version = sheet_.GetVersion();
+        auto changed = sheet_.GetChangedCells(computed_version_);
+        bool cancelled = false;
+        for(size_t begin = 0; begin < changed.size(); begin += CHUNK_SIZE) {
+            size_t end = std::min(changed.size(), begin + CHUNK_SIZE);
+            for(size_t i = begin; i < end; ++i) {
+                if(auto cell = sheet_.GetCell(changed[i])) {
+                    cell->GetValue();
+                    ++stats_.recalculated_cells;
+                }
+            }
+            // между порциями даём выполниться правкам
+            lock.unlock();
+            std::this_thread::yield();
+            lock.lock();
+            if(stop_) {
+                return;
+            }
+            if(sheet_.GetVersion() != version) {
+                // входы пересчёта изменились: начинаем заново с новым списком
+                cancelled = true;
+                break;
+            }
+        }
+        if(cancelled) {
+            ++stats_.cancelled_passes;
+            continue;
+        }
+        Publish(changed);
+        computed_version_ = version;
+        ++stats_.completed_passes;
+
+        auto ready = std::partition(requests_.begin(), requests_.end(), [version] (const auto& request) {
+            return request.version > version;
+        });
+        for(auto iter = ready; iter != requests_.end(); ++iter) {
+            iter->promise.set_value(ReadValue(iter->pos));
+        }
+        requests_.erase(ready, requests_.end());
+        done_cv_.notify_all();
+    }
+}
+
+void AsyncSheet::Publish(const std::vector<Position>& changed) {
+    for(const auto& pos : changed) {
+        if(auto cell = sheet_.GetCell(pos)) {
+            published_[pos] = cell->GetValue();
+        }
+        else {
+            published_.erase(pos);
+        }
+    }
+}
+
+CellInterface::Value AsyncSheet::ReadValue(Position pos) const {
+    auto cell = sheet_.GetCell(pos);
+    return cell ? cell->GetValue() : CellInterface::Value{};
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include "common.h"
+#include "position_map.h"
+#include "sheet.h"
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Таблица с фоновым пересчётом. Правки применяются и подтверждаются сразу,
+// а формулы, затронутые ими, пересчитывает отдельный поток. Читатель выбирает
+// между последним согласованным значением (результатом последнего завершённого
+// пересчёта) и ожиданием свежего значения через std::future.
+// Пересчёт идёт небольшими порциями ячеек, между которыми могут выполняться
+// правки. Если правка приходит во время пересчёта, он прерывается и
+// начинается заново с учётом новых изменений: уже вычисленные ячейки, не
+// затронутые правкой, сохраняют свои значения.
+// Все методы потокобезопасны.
+class AsyncSheet {
+public:
+    AsyncSheet();
+    ~AsyncSheet();
+
+    AsyncSheet(const AsyncSheet&) = delete;
+    AsyncSheet& operator=(const AsyncSheet&) = delete;
+
+    // Бросают те же исключения, что и методы Sheet
+    void SetCell(Position pos, std::string text);
+    void ClearCell(Position pos);
+    std::string GetText(Position pos) const;
+
+    // Значение ячейки на момент последнего завершённого пересчёта. Не ждёт
+    // пересчёта и не вычисляет формулы.
+    CellInterface::Value GetLastValue(Position pos) const;
+    // Значение ячейки после пересчёта всех сделанных к этому моменту правок
+    std::future<CellInterface::Value> GetFreshValue(Position pos);
+
+    // Ждёт, пока пересчитаются все сделанные к этому моменту правки
+    void WaitForRecalculation() const;
+
+    struct Stats {
+        size_t completed_passes = 0;
+        size_t cancelled_passes = 0;
+        size_t recalculated_cells = 0;
+    };
+    Stats GetStats() const;
+
+private:
+    // Ячеек, вычисляемых за один захват блокировки
+    static constexpr size_t CHUNK_SIZE = 64;
+
+    struct FreshValueRequest {
+        Position pos;
+        uint64_t version;
+        std::promise<CellInterface::Value> promise;
+    };
+
+    void Run();
+    void Publish(const std::vector<Position>& changed);
+    CellInterface::Value ReadValue(Position pos) const;
+
+    mutable std::mutex mutex_;
+    // будит фоновый поток при правке или остановке
+    std::condition_variable work_cv_;
+    // оповещает ожидающих о завершении пересчёта
+    mutable std::condition_variable done_cv_;
+
+    Sheet sheet_;
+    // версия листа, для которой завершён пересчёт и опубликованы значения
+    uint64_t computed_version_ = 0;
+    PositionMap<CellInterface::Value> published_;
+    std::vector<FreshValueRequest> requests_;
+    Stats stats_;
+    bool stop_ = false;
+
+    // объявлен последним, чтобы запускаться после инициализации остальных полей
+    std::thread worker_;
+};
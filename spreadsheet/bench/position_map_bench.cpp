@@ -0,0 +1,140 @@
+// Сравнение PositionMap с std::unordered_map, которым таблица пользовалась
+// раньше (хеш hash(row) ^ hash(col)), на плотном и диагональном размещении.
+// Запуск: position_map_bench [количество ячеек]
+
+#include "position_map.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+
+struct XorPositionHash {
+    size_t operator()(const Position& p) const {
+        return std::hash<int>()(p.row) ^ std::hash<int>()(p.col);
+    }
+};
+
+using LegacyMap = std::unordered_map<Position, int, XorPositionHash>;
+
+std::vector<Position> DenseLayout(int count) {
+    // блок шириной 64 столбца, как у типичной таблицы с данными
+    std::vector<Position> res;
+    res.reserve(count);
+    for(int i = 0; i < count; ++i) {
+        res.push_back({i / 64, i % 64});
+    }
+    return res;
+}
+
+std::vector<Position> DiagonalLayout(int count) {
+    // полоса вдоль главной диагонали: row ^ col принимает мало значений
+    std::vector<Position> res;
+    res.reserve(count);
+    const int band = 8;
+    for(int i = 0; res.size() < static_cast<size_t>(count); ++i) {
+        for(int d = 0; d < band && res.size() < static_cast<size_t>(count); ++d) {
+            res.push_back({i % Position::MAX_ROWS, (i + d) % Position::MAX_COLS});
+        }
+    }
+    return res;
+}
+
+template <typename F>
+double MeasureMs(F&& f) {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    auto finish = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::milli>(finish - start).count();
+}
+
+struct Result {
+    double insert_ms = 0;
+    double lookup_ms = 0;
+    double miss_ms = 0;
+    double iterate_ms = 0;
+    long long checksum = 0;
+};
+
+template <typename Map>
+Result Run(const std::vector<Position>& positions, const std::vector<Position>& lookups,
+           const std::vector<Position>& misses) {
+    Result res;
+    Map map;
+    res.insert_ms = MeasureMs([&] {
+        int i = 0;
+        for(const auto& pos : positions) {
+            map[pos] = i++;
+        }
+    });
+    res.lookup_ms = MeasureMs([&] {
+        for(const auto& pos : lookups) {
+            auto iter = map.find(pos);
+            res.checksum += iter != map.end() ? iter->second : 0;
+        }
+    });
+    res.miss_ms = MeasureMs([&] {
+        for(const auto& pos : misses) {
+            res.checksum += map.find(pos) == map.end() ? 1 : 0;
+        }
+    });
+    res.iterate_ms = MeasureMs([&] {
+        for(int rep = 0; rep < 10; ++rep) {
+            for(const auto& [pos, value] : map) {
+                res.checksum += pos.row + value;
+            }
+        }
+    });
+    return res;
+}
+
+void PrintRow(const std::string& name, const Result& res) {
+    std::cout << std::setw(24) << std::left << name << std::right << std::fixed << std::setprecision(2)
+              << std::setw(12) << res.insert_ms << std::setw(12) << res.lookup_ms
+              << std::setw(12) << res.miss_ms << std::setw(12) << res.iterate_ms << '\n';
+}
+
+void Compare(const std::string& layout_name, const std::vector<Position>& positions) {
+    std::mt19937 gen(42);
+    std::vector<Position> lookups = positions;
+    std::shuffle(lookups.begin(), lookups.end(), gen);
+    std::vector<Position> misses;
+    misses.reserve(positions.size());
+    for(const auto& pos : positions) {
+        // те же строки, но правее заполненной области
+        misses.push_back({pos.row, Position::MAX_COLS - 1 - pos.col % 64});
+    }
+
+    auto legacy = Run<LegacyMap>(positions, lookups, misses);
+    auto flat = Run<PositionMap<int>>(positions, lookups, misses);
+    if(legacy.checksum != flat.checksum) {
+        std::cerr << "checksum mismatch for " << layout_name << std::endl;
+        std::exit(1);
+    }
+
+    std::cout << layout_name << " (" << positions.size() << " cells), ms\n";
+    std::cout << std::setw(24) << std::left << "" << std::right << std::setw(12) << "insert"
+              << std::setw(12) << "lookup" << std::setw(12) << "miss" << std::setw(12) << "iterate x10"
+              << '\n';
+    PrintRow("unordered_map (xor)", legacy);
+    PrintRow("PositionMap", flat);
+    std::cout << '\n';
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    // std::unordered_map с xor-хешем на диагонали работает за квадрат, поэтому
+    // размер по умолчанию умеренный
+    int count = argc > 1 ? std::atoi(argv[1]) : 100000;
+    Compare("dense 64 columns", DenseLayout(count));
+    Compare("diagonal band", DiagonalLayout(count));
+    return 0;
+}
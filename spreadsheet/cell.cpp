@@ -1,72 +1,245 @@
 #include "cell.h"
 #include "sheet.h"
 
+#include <algorithm>
 #include <cassert>
+#include <charconv>
 #include <iostream>
 #include <string>
 #include <optional>
+#include <stdexcept>
 
 using namespace std::literals;
 
+namespace {
+// Лист, через который формула читает ячейки при вычислении: отмечает, какие
+// из ячеек её ветвей прочитаны
+class BranchReadRecorder final : public SheetInterface {
+public:
+    BranchReadRecorder(SheetInterface& sheet, std::vector<Position> branch_cells)
+        : sheet_(sheet)
+        , branch_cells_(std::move(branch_cells))
+        , read_(branch_cells_.size(), false) {}
+
+    // Ячейки ветвей, которые не были прочитаны, по возрастанию
+    std::vector<Position> GetUnread() const {
+        std::vector<Position> res;
+        for(size_t i = 0; i < branch_cells_.size(); ++i) {
+            if(!read_[i]) {
+                res.push_back(branch_cells_[i]);
+            }
+        }
+        return res;
+    }
+
+    void SetCell(Position /*pos*/, std::string /*text*/) override {
+        throw std::logic_error("formula can't change the sheet");
+    }
+
+    const CellInterface* GetCell(Position pos) const override {
+        auto iter = std::lower_bound(branch_cells_.begin(), branch_cells_.end(), pos);
+        if(iter != branch_cells_.end() && *iter == pos) {
+            read_[iter - branch_cells_.begin()] = true;
+        }
+        return std::as_const(sheet_).GetCell(pos);
+    }
+
+    CellInterface* GetCell(Position pos) override {
+        return const_cast<CellInterface*>(std::as_const(*this).GetCell(pos));
+    }
+
+    void ClearCell(Position /*pos*/) override {
+        throw std::logic_error("formula can't change the sheet");
+    }
+
+    Size GetPrintableSize() const override {
+        return sheet_.GetPrintableSize();
+    }
+
+    void PrintValues(std::ostream& output) const override {
+        sheet_.PrintValues(output);
+    }
+
+    void PrintTexts(std::ostream& output) const override {
+        sheet_.PrintTexts(output);
+    }
+
+    const SheetInterface* FindSheet(std::string_view name) const override {
+        return sheet_.FindSheet(name);
+    }
+
+    const LookupIndex* GetLookupIndex(const Range& area) const override {
+        return sheet_.GetLookupIndex(area);
+    }
+
+private:
+    SheetInterface& sheet_;
+    const std::vector<Position> branch_cells_;
+    mutable std::vector<bool> read_;
+};
+}  // namespace
+
 class Cell::Impl {
 public:
     virtual ~Impl() = default;
     
-    virtual Cell::Value GetValue(SheetInterface& sheet) const = 0;
+    virtual Cell::CachedValue GetValue(SheetInterface& sheet) const = 0;
+    // Вычисляет значение для кэша ячейки
+    virtual Cell::CachedValue Recalculate(SheetInterface& sheet) const {
+        return GetValue(sheet);
+    }
+    // Ссылка ref не была прочитана при последнем Recalculate
+    virtual bool IsSkippedReference(Position /*ref*/) const {
+        return false;
+    }
     virtual std::string GetString() const = 0;
     virtual std::vector<Position> GetReferencedCells() const {
         return {};
     }
+    virtual std::vector<SheetReference> GetExternalReferences() const {
+        return {};
+    }
+    virtual std::vector<Range> GetReferencedRanges() const {
+        return {};
+    }
+    virtual const FormulaInterface* GetFormula() const {
+        return nullptr;
+    }
+    virtual const VectorProgram* GetProgram() const {
+        return nullptr;
+    }
+    virtual size_t GetSize() const = 0;
+    // Обновляет число на месте; false, если ячейка - не число
+    virtual bool SetNumber(double /*value*/) {
+        return false;
+    }
+    virtual FormulaInterface::MemoryUsage GetFormulaMemoryUsage() const {
+        return {};
+    }
+    // Копия для ячейки, сдвинутой на (row_shift, col_shift)
+    virtual std::unique_ptr<Impl> Shifted(int row_shift, int col_shift) const = 0;
 };
 
 class Cell::EmptyImpl final : public Cell::Impl {
 public:
     EmptyImpl() = default;
     
-    Cell::Value GetValue(SheetInterface& /*sheet*/) const override {
-        return ""s;
+    Cell::CachedValue GetValue(SheetInterface& /*sheet*/) const override {
+        return ""sv;
     }
     
     std::string GetString() const override {
         return ""s;
     }
+
+    size_t GetSize() const override {
+        return sizeof(*this);
+    }
+
+    std::unique_ptr<Impl> Shifted(int /*row_shift*/, int /*col_shift*/) const override {
+        return std::make_unique<EmptyImpl>();
+    }
 };
 
 class Cell::TextImpl final : public Cell::Impl {
 public:
-    explicit TextImpl(std::string text) 
+    explicit TextImpl(StringPool::Handle text) 
         : data_(std::move(text)) {}
         
-    Cell::Value GetValue(SheetInterface& /*sheet*/) const override {
-        return data_;
+    Cell::CachedValue GetValue(SheetInterface& /*sheet*/) const override {
+        auto text = data_.View();
+        if(!text.empty() && text.front() == ESCAPE_SIGN) {
+            text.remove_prefix(1u);
+        }
+        return text;
     }
     
     std::string GetString() const override {
-        return data_;
+        return std::string{data_.View()};
+    }
+
+    // текст учитывается в пуле строк таблицы
+    size_t GetSize() const override {
+        return sizeof(*this);
+    }
+
+    std::unique_ptr<Impl> Shifted(int /*row_shift*/, int /*col_shift*/) const override {
+        return std::make_unique<TextImpl>(data_);
+    }
+private:
+    const StringPool::Handle data_;
+};
+
+class Cell::NumberImpl final : public Cell::Impl {
+public:
+    explicit NumberImpl(double value)
+        : value_(value) {}
+
+    Cell::CachedValue GetValue(SheetInterface& /*sheet*/) const override {
+        return value_;
+    }
+
+    // Кратчайшая запись, которая читается обратно в то же число: поток
+    // вывел бы только 6 значащих цифр, и 1234567.89 стало бы 1.23457e+06
+    std::string GetString() const override {
+        char buffer[32];
+        auto [end, error] = std::to_chars(buffer, buffer + sizeof(buffer), value_);
+        assert(error == std::errc{});
+        return std::string(buffer, end);
+    }
+
+    size_t GetSize() const override {
+        return sizeof(*this);
+    }
+
+    bool SetNumber(double value) override {
+        value_ = value;
+        return true;
+    }
+
+    std::unique_ptr<Impl> Shifted(int /*row_shift*/, int /*col_shift*/) const override {
+        return std::make_unique<NumberImpl>(value_);
     }
 private:
-    const std::string data_;
+    double value_;
 };
 
 class Cell::FormulaImpl final : public Cell::Impl {
 private:
     struct FormulaVisitor {
-        Cell::Value operator() (double d) {
-            return Cell::Value{d};
+        Cell::CachedValue operator() (double d) {
+            return Cell::CachedValue{d};
         }
-        Cell::Value operator() (FormulaError fe) {
-            return Cell::Value{fe};
+        Cell::CachedValue operator() (FormulaError fe) {
+            return Cell::CachedValue{fe};
         }
     };
 public:
-    explicit FormulaImpl(std::string formula) 
-        : data_(std::move(ParseFormula(std::move(formula))))
+    explicit FormulaImpl(std::shared_ptr<const FormulaInterface> formula) 
+        : data_(std::move(formula))
     {
     }
     
-    Cell::Value GetValue(SheetInterface& sheet) const override {
+    Cell::CachedValue GetValue(SheetInterface& sheet) const override {
         return std::visit(FormulaVisitor(), data_->Evaluate(sheet));
     }
+
+    // Формула с ветвями запоминает, какие ячейки ветвей она не прочитала
+    Cell::CachedValue Recalculate(SheetInterface& sheet) const override {
+        auto branch_cells = data_->GetBranchCells();
+        if(branch_cells.empty()) {
+            skipped_.reset();
+            return GetValue(sheet);
+        }
+        BranchReadRecorder recorder(sheet, std::move(branch_cells));
+        auto value = GetValue(recorder);
+        skipped_ = std::make_unique<std::vector<Position>>(recorder.GetUnread());
+        return value;
+    }
+
+    bool IsSkippedReference(Position ref) const override {
+        return skipped_ && std::binary_search(skipped_->begin(), skipped_->end(), ref);
+    }
     
     std::string GetString() const override {
         return "="s.append(data_->GetExpression());
@@ -75,23 +248,84 @@ public:
     std::vector<Position> GetReferencedCells() const override {
         return data_->GetReferencedCells();
     }
+
+    std::vector<SheetReference> GetExternalReferences() const override {
+        return data_->GetExternalReferences();
+    }
+
+    std::vector<Range> GetReferencedRanges() const override {
+        return data_->GetReferencedRanges();
+    }
+
+    const FormulaInterface* GetFormula() const override {
+        return data_.get();
+    }
+
+    const VectorProgram* GetProgram() const override {
+        return &data_->GetProgram();
+    }
+
+    size_t GetSize() const override {
+        size_t res = sizeof(*this);
+        if(skipped_) {
+            res += sizeof(*skipped_) + skipped_->capacity() * sizeof(Position);
+        }
+        return res;
+    }
+
+    FormulaInterface::MemoryUsage GetFormulaMemoryUsage() const override {
+        return data_->GetMemoryUsage();
+    }
+
+    std::unique_ptr<Impl> Shifted(int row_shift, int col_shift) const override {
+        return std::make_unique<FormulaImpl>(ShiftFormula(data_, row_shift, col_shift));
+    }
 private:
-    std::unique_ptr<FormulaInterface> data_;
+    // формула может быть общей для нескольких ячеек, см. FormulaCache, или
+    // разбираться лениво, см. Sheet::Compilation
+    std::shared_ptr<const FormulaInterface> data_;
+    // ячейки ветвей, не прочитанные при последнем вычислении; nullptr, если
+    // у формулы нет ветвей или она ещё не вычислялась
+    mutable std::unique_ptr<std::vector<Position>> skipped_;
 };
 // Реализуйте следующие методы
-Cell::Cell(Sheet& sheet) 
+Cell::Cell(Sheet& sheet, Position pos) 
     : impl_(std::make_unique<EmptyImpl>(EmptyImpl{})) 
-    , sheet_(sheet) {}
+    , sheet_(sheet)
+    , pos_(pos) {}
 
 Cell::~Cell() = default;
 
 bool Cell::IsModified() const {
-    return cache_;
+    return sheet_.GetValueCache().IsDirty(pos_);
+}
+
+bool Cell::IsUnaffectedBy(Position ref) const {
+    return impl_ && impl_->IsSkippedReference(ref) && !IsModified();
 }
 
-void Cell::SetCache(Value&& val) const {
-    cache_.val_ = std::forward<Value>(val);
-    cache_.modification_flag_ = false;
+void Cell::InvalidateCache() {
+    sheet_.GetValueCache().Invalidate(pos_);
+}
+
+struct CacheWriter {
+    ValueCache& cache;
+    Position pos;
+
+    void operator() (std::string_view /*str*/) const {
+        // текст значения всегда совпадает с текстом реализации ячейки
+        cache.SetText(pos);
+    }
+    void operator() (double d) const {
+        cache.SetNumber(pos, d);
+    }
+    void operator() (FormulaError fe) const {
+        cache.SetError(pos, fe);
+    }
+};
+
+void Cell::SetCache(const CachedValue& val) const {
+    std::visit(CacheWriter{sheet_.GetValueCache(), pos_}, val);
 }
 
 void Cell::Set(std::string text) {
@@ -100,12 +334,16 @@ void Cell::Set(std::string text) {
     }
     else if(text.front() == '=' && text.size() > 1u) {
         try {
-            impl_ = std::make_unique<FormulaImpl>(FormulaImpl{text.substr(1u)});
-            for(const auto& ref_cell : impl_->GetReferencedCells()) {
-                auto cell_ptr = sheet_.GetCell(ref_cell);
-                if(!cell_ptr) {
-                    sheet_.SetCell(ref_cell, ""s);
+            auto expression = std::string_view{text}.substr(1u);
+            if(sheet_.GetCompilation() == Sheet::Compilation::Eager) {
+                impl_ = std::make_unique<FormulaImpl>(sheet_.GetFormulaCache().Get(expression));
+            }
+            else {
+                std::shared_ptr<const FormulaInterface> formula = ParseFormulaLazily(std::string{expression});
+                if(auto* compiler = sheet_.GetFormulaCompiler()) {
+                    compiler->Enqueue(formula);
                 }
+                impl_ = std::make_unique<FormulaImpl>(std::move(formula));
             }
         }
         catch(...) {
@@ -113,19 +351,58 @@ void Cell::Set(std::string text) {
         }
     }
     else {
-        impl_ = std::make_unique<TextImpl>(TextImpl{text});
+        impl_ = std::make_unique<TextImpl>(sheet_.GetStringPool().Intern(text));
     }
-    cache_.modification_flag_ = true;
+    InvalidateCache();
+}
+
+void Cell::SetNumber(double value) {
+    if(!impl_ || !impl_->SetNumber(value)) {
+        impl_ = std::make_unique<NumberImpl>(value);
+    }
+    // значение известно сразу, вычислять его не нужно
+    sheet_.GetValueCache().SetNumber(pos_, value);
+}
+
+void Cell::SetShifted(const Cell& other, int row_shift, int col_shift) {
+    impl_ = other.impl_ ? other.impl_->Shifted(row_shift, col_shift) : nullptr;
+    InvalidateCache();
+}
+
+void Cell::MoveTo(Position pos) {
+    pos_ = pos;
+    InvalidateCache();
 }
 
 void Cell::Clear() {
     impl_.reset(nullptr);
-    cache_.modification_flag_ = true;
+    InvalidateCache();
+}
+
+Cell::CachedValue Cell::GetCachedValue() const {
+    const auto& cache = sheet_.GetValueCache();
+    if(cache.IsDirty(pos_)) {
+        if(GetFormula()) {
+            // иначе формула вычисляла бы устаревшие входы рекурсивно
+            sheet_.EvaluatePrecedents(pos_);
+        }
+        auto value = impl_ ? impl_->Recalculate(sheet_) : CachedValue{""sv};
+        SetCache(value);
+        return value;
+    }
+    auto tag = cache.GetTag(pos_);
+    if(tag == ValueCache::Tag::Number) {
+        return cache.GetNumber(pos_);
+    }
+    if(ValueCache::IsError(tag)) {
+        return ValueCache::ToError(tag);
+    }
+    return impl_ ? impl_->GetValue(sheet_) : CachedValue{""sv};
 }
 
-struct ValueVisitor {
-    Cell::Value operator() (std::string str) const {
-        return str.front() == '\'' ? str.substr(1u) : str;
+struct CachedValueVisitor {
+    Cell::Value operator() (std::string_view str) const {
+        return std::string{str};
     }
     Cell::Value operator() (double d) const {
         return d;
@@ -136,17 +413,60 @@ struct ValueVisitor {
 };
 
 Cell::Value Cell::GetValue() const {
-    const auto& dependency = GetReferencedCells();
-    if(!cache_ || std::any_of(dependency.begin(), dependency.end(), 
-        [this] (const auto& pos) {
-                                     const Cell* cell_ptr_ = reinterpret_cast<const Cell*>(sheet_.GetCell(pos));
-                                     return cell_ptr_->IsModified();
-                                 })) {
-        
-        auto value = impl_ ? std::visit(ValueVisitor(), impl_->GetValue(sheet_)) : Cell::Value{};
-        SetCache(std::move(value));
+    return std::visit(CachedValueVisitor(), GetCachedValue());
+}
+
+Cell::ValueView Cell::GetValueView() const {
+    return GetCachedValue();
+}
+
+Cell::Value Cell::Evaluate(SheetInterface& sheet) const {
+    auto value = impl_ ? impl_->GetValue(sheet) : CachedValue{""sv};
+    return std::visit(CachedValueVisitor(), value);
+}
+
+struct NumericValueVisitor {
+    FormulaInterface::Value operator() (std::string_view str) const {
+        if(auto res = TextToNumber(str)) {
+            return *res;
+        }
+        return FormulaError{FormulaError::Category::Value};
+    }
+    FormulaInterface::Value operator() (double d) const {
+        return d;
+    }
+    FormulaInterface::Value operator() (FormulaError fe) const {
+        return fe;
+    }
+};
+
+FormulaInterface::Value Cell::GetNumericValue() const {
+    return std::visit(NumericValueVisitor(), GetCachedValue());
+}
+
+void Cell::SetCachedValue(FormulaInterface::Value value) const {
+    if(std::holds_alternative<double>(value)) {
+        sheet_.GetValueCache().SetNumber(pos_, std::get<double>(value));
+    }
+    else {
+        sheet_.GetValueCache().SetError(pos_, std::get<FormulaError>(value));
     }
-    return cache_;
+}
+
+const FormulaInterface* Cell::GetFormula() const {
+    return impl_ ? impl_->GetFormula() : nullptr;
+}
+
+const VectorProgram* Cell::GetProgram() const {
+    return impl_ ? impl_->GetProgram() : nullptr;
+}
+
+size_t Cell::GetImplBytes() const {
+    return impl_ ? impl_->GetSize() : 0u;
+}
+
+FormulaInterface::MemoryUsage Cell::GetFormulaMemoryUsage() const {
+    return impl_ ? impl_->GetFormulaMemoryUsage() : FormulaInterface::MemoryUsage{};
 }
 
 std::string Cell::GetText() const {
@@ -157,13 +477,22 @@ std::string Cell::GetText() const {
 }
 
 std::vector<Position> Cell::GetReferencedCells() const {
-    return impl_->GetReferencedCells();
+    if(impl_) {
+        return impl_->GetReferencedCells();
+    }
+    return {};
 }
 
-Cell::CellCache::operator bool() const {
-    return !modification_flag_;
+std::vector<SheetReference> Cell::GetExternalReferences() const {
+    if(impl_) {
+        return impl_->GetExternalReferences();
+    }
+    return {};
 }
 
-Cell::CellCache::operator Value() const {
-    return val_;
+std::vector<Range> Cell::GetReferencedRanges() const {
+    if(impl_) {
+        return impl_->GetReferencedRanges();
+    }
+    return {};
 }
@@ -10,36 +10,76 @@ class Sheet;
 
 class Cell : public CellInterface {
 private:
-    struct CellCache {
-        Value val_;
-        bool modification_flag_ = true;
-        
-        operator bool() const;
-        operator Value() const;
-    };
-    
-    bool IsModified() const;
-    void SetCache(Value&& val) const;
+    // Текстовое значение - представление строки из пула таблицы, которой
+    // владеет impl_ ячейки
+    using CachedValue = std::variant<std::string_view, double, FormulaError>;
+
+    // Значение ячейки хранится не в ней самой, а в ValueCache листа по её позиции
+    void SetCache(const CachedValue& val) const;
+    CachedValue GetCachedValue() const;
 
 public:
-    Cell(Sheet& sheet);
+    Cell(Sheet& sheet, Position pos);
     ~Cell();
 
     void Set(std::string text);
+    // Делает ячейку числовой, см. Sheet::SetNumber
+    void SetNumber(double value);
+    // Делает ячейку копией other, перенесённой на (row_shift, col_shift):
+    // ссылки формулы сдвигаются без разбора текста, см. Sheet::CopyRange.
+    // Текст разделяет строку пула с other, поэтому обе ячейки должны
+    // принадлежать одному листу.
+    void SetShifted(const Cell& other, int row_shift, int col_shift);
+    // Переносит ячейку в позицию pos того же листа без изменения содержимого,
+    // см. Sheet::SortRange. Значение в новой позиции устаревает.
+    void MoveTo(Position pos);
     void Clear();
     
     Value GetValue() const override;
     std::string GetText() const override;
+
+    // Значение без копирования: текст - представление строки из пула листа,
+    // действительное до изменения ячейки
+    using ValueView = std::variant<std::string_view, double, FormulaError>;
+    ValueView GetValueView() const;
     
     std::vector<Position> GetReferencedCells() const override;
+    // Ссылки формулы на ячейки других листов книги
+    std::vector<SheetReference> GetExternalReferences() const;
+    // Диапазоны, по которым ищут функции формулы
+    std::vector<Range> GetReferencedRanges() const;
+
+    // Кэш значения устарел и будет пересчитан при следующем GetValue()
+    bool IsModified() const;
+    void InvalidateCache();
+    // Значение формулы актуально и при его вычислении не читалась ячейка ref
+    // из ветви условия, поэтому изменение ref его не затрагивает
+    bool IsUnaffectedBy(Position ref) const;
+
+    // Значение ячейки как операнд формулы (текст с числом - число и т.д.)
+    FormulaInterface::Value GetNumericValue() const;
+    // Записывает в кэш значение, вычисленное снаружи (пакетным вычислением)
+    void SetCachedValue(FormulaInterface::Value value) const;
+    // Вычисляет значение ячейки, читая другие ячейки из sheet, без
+    // использования и изменения кэша
+    Value Evaluate(SheetInterface& sheet) const;
+    // Формула ячейки или nullptr, если ячейка - не формула. В отличие от
+    // GetProgram, не разбирает лениво созданную формулу.
+    const FormulaInterface* GetFormula() const;
+    // Скомпилированная формула ячейки или nullptr, если ячейка - не формула
+    const VectorProgram* GetProgram() const;
+
+    // Память, которую занимают реализация ячейки и её формула
+    size_t GetImplBytes() const;
+    FormulaInterface::MemoryUsage GetFormulaMemoryUsage() const;
     
 private:
     class Impl;
     class EmptyImpl;
     class TextImpl;
+    class NumberImpl;
     class FormulaImpl;
     std::unique_ptr<Impl> impl_;
     Sheet& sheet_;
-    
-    mutable CellCache cache_;
+    Position pos_;
 };
@@ -26,6 +26,17 @@ struct Position {
     static const Position NONE;
 };
 
+// Ссылка на ячейку другого листа книги, например Sheet2!A1
+struct SheetReference {
+    std::string sheet;
+    Position pos;
+
+    bool operator==(const SheetReference& rhs) const;
+    bool operator<(const SheetReference& rhs) const;
+
+    std::string ToString() const;
+};
+
 struct Size {
     int rows = 0;
     int cols = 0;
@@ -33,6 +44,28 @@ struct Size {
     bool operator==(Size rhs) const;
 };
 
+// Прямоугольная область листа, например A1:B3. Область, сдвинутая за
+// пределы таблицы, некорректна.
+struct Range {
+    Position top_left;
+    Size size;
+
+    bool operator==(const Range& rhs) const;
+    bool operator<(const Range& rhs) const;
+
+    bool IsValid() const;
+    bool Contains(Position pos) const;
+    bool Contains(const Range& other) const;
+    Position GetBottomRight() const;
+    // Пустая строка для некорректной области
+    std::string ToString() const;
+
+    // Область между двумя углами в любом порядке, например B3:A1
+    static Range FromCorners(Position first, Position second);
+    // Разбирает запись вида A1:B3; при ошибке возвращает некорректную область
+    static Range FromString(std::string_view str);
+};
+
 // Описывает ошибки, которые могут возникнуть при вычислении формулы.
 class FormulaError {
 public:
@@ -40,6 +73,7 @@ public:
         Ref,    // ссылка на ячейку с некорректной позицией
         Value,  // ячейка не может быть трактована как число
         Div0,  // в результате вычисления возникло деление на ноль
+        NA,    // функция поиска не нашла значение
     };
 
     FormulaError(Category category);
@@ -99,6 +133,8 @@ public:
     virtual std::vector<Position> GetReferencedCells() const = 0;
 };
 
+class LookupIndex;
+
 inline constexpr char FORMULA_SIGN = '=';
 inline constexpr char ESCAPE_SIGN = '\'';
 
@@ -143,6 +179,21 @@ public:
     // соответственно. Пустая ячейка представляется пустой строкой в любом случае.
     virtual void PrintValues(std::ostream& output) const = 0;
     virtual void PrintTexts(std::ostream& output) const = 0;
+
+    // Возвращает лист той же книги с указанным именем, к которому обращаются
+    // ссылки вида Sheet2!A1. Если листа нет или таблица не входит в книгу,
+    // возвращает nullptr и такие ссылки дают ошибку #REF!.
+    virtual const SheetInterface* FindSheet(std::string_view /*name*/) const {
+        return nullptr;
+    }
+
+    // Возвращает индекс значений строки или столбца area для функций поиска
+    // (VLOOKUP, MATCH, XLOOKUP), актуальный на момент вызова. Если лист не
+    // поддерживает индексы, возвращает nullptr и функции просматривают ячейки
+    // области по одной.
+    virtual const LookupIndex* GetLookupIndex(const Range& /*area*/) const {
+        return nullptr;
+    }
 };
 
 // Создаёт готовую к работе пустую таблицу.
@@ -0,0 +1,121 @@
+#include "dependency_index.h"
+
+#include <algorithm>
+
+DependencyIndex::DependencyIndex(const std::vector<Edge>& edges) {
+    std::vector<std::pair<uint32_t, uint32_t>> forward;
+    std::vector<std::pair<uint32_t, uint32_t>> backward;
+    forward.reserve(edges.size());
+    backward.reserve(edges.size());
+    for(const auto& [from, to] : edges) {
+        uint32_t from_id = GetId(from);
+        uint32_t to_id = GetId(to);
+        forward.emplace_back(from_id, to_id);
+        backward.emplace_back(to_id, from_id);
+    }
+    dependents_ = BuildAdjacency(positions_.size(), forward);
+    precedents_ = BuildAdjacency(positions_.size(), backward);
+}
+
+uint32_t DependencyIndex::GetId(Position pos) {
+    auto [iter, inserted] = ids_.try_emplace(pos, static_cast<uint32_t>(positions_.size()));
+    if(inserted) {
+        positions_.push_back(pos);
+    }
+    return iter->second;
+}
+
+DependencyIndex::Adjacency DependencyIndex::BuildAdjacency(
+        size_t node_count, const std::vector<std::pair<uint32_t, uint32_t>>& edges) {
+    // сортировка подсчётом по исходному узлу
+    Adjacency res;
+    res.offsets.assign(node_count + 1u, 0u);
+    for(const auto& edge : edges) {
+        ++res.offsets[edge.first + 1u];
+    }
+    for(size_t i = 1; i <= node_count; ++i) {
+        res.offsets[i] += res.offsets[i - 1u];
+    }
+    res.targets.resize(edges.size());
+    std::vector<uint32_t> next(res.offsets.begin(), res.offsets.end() - 1);
+    for(const auto& [from, to] : edges) {
+        res.targets[next[from]++] = to;
+    }
+    return res;
+}
+
+std::vector<Position> DependencyIndex::Collect(const std::vector<Position>& seeds, Direction direction,
+                                               int max_depth) const {
+    const auto& adjacency = direction == Direction::Precedents ? precedents_ : dependents_;
+    std::vector<uint64_t> visited((positions_.size() + 63u) / 64u, 0u);
+    auto visit = [&visited] (uint32_t id) {
+        uint64_t bit = uint64_t{1} << (id % 64u);
+        if(visited[id / 64u] & bit) {
+            return false;
+        }
+        visited[id / 64u] |= bit;
+        return true;
+    };
+
+    std::vector<uint32_t> frontier;
+    for(const auto& seed : seeds) {
+        auto iter = ids_.find(seed);
+        if(iter != ids_.end() && visit(iter->second)) {
+            frontier.push_back(iter->second);
+        }
+    }
+    std::vector<uint32_t> reached;
+    std::vector<uint32_t> next_frontier;
+    for(int depth = 0; !frontier.empty() && depth != max_depth; ++depth) {
+        next_frontier.clear();
+        for(uint32_t id : frontier) {
+            for(uint32_t i = adjacency.offsets[id]; i < adjacency.offsets[id + 1u]; ++i) {
+                uint32_t target = adjacency.targets[i];
+                if(visit(target)) {
+                    next_frontier.push_back(target);
+                }
+            }
+        }
+        reached.insert(reached.end(), next_frontier.begin(), next_frontier.end());
+        std::swap(frontier, next_frontier);
+    }
+
+    std::vector<Position> res;
+    res.reserve(reached.size());
+    for(uint32_t id : reached) {
+        res.push_back(positions_[id]);
+    }
+    std::sort(res.begin(), res.end());
+    return res;
+}
+
+std::vector<Position> DependencyIndex::Collect(Position top_left, Size size, Direction direction,
+                                               int max_depth) const {
+    std::vector<Position> seeds;
+    auto area = static_cast<size_t>(size.rows) * static_cast<size_t>(size.cols);
+    // перебираем меньшее из двух: ячейки области или узлы графа
+    if(area <= positions_.size()) {
+        for(int row = top_left.row; row < top_left.row + size.rows; ++row) {
+            for(int col = top_left.col; col < top_left.col + size.cols; ++col) {
+                seeds.push_back({row, col});
+            }
+        }
+    }
+    else {
+        for(const auto& pos : positions_) {
+            if(top_left.row <= pos.row && pos.row < top_left.row + size.rows
+               && top_left.col <= pos.col && pos.col < top_left.col + size.cols) {
+                seeds.push_back(pos);
+            }
+        }
+    }
+    return Collect(seeds, direction, max_depth);
+}
+
+size_t DependencyIndex::GetNodeCount() const {
+    return positions_.size();
+}
+
+size_t DependencyIndex::GetEdgeCount() const {
+    return dependents_.targets.size();
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "common.h"
+#include "position_map.h"
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Снимок графа зависимостей листа в компактном виде: узлы пронумерованы
+// подряд, а рёбра в обе стороны хранятся сплошными массивами смежности
+// (соседи узла i лежат в [offsets[i], offsets[i + 1])). Обход использует
+// битовую маску посещённых узлов вместо хеш-множества.
+// Снимок строится за O(V + E) и не обновляется: после изменения графа
+// нужно построить новый.
+class DependencyIndex {
+public:
+    // Ребро (from, to): формула в to ссылается на from
+    using Edge = std::pair<Position, Position>;
+
+    enum class Direction {
+        Precedents,  // ячейки, от которых зависит формула
+        Dependents,  // формулы, которые зависят от ячейки
+    };
+
+    static constexpr int UNLIMITED_DEPTH = -1;
+
+    explicit DependencyIndex(const std::vector<Edge>& edges);
+
+    // Ячейки, достижимые из seeds не более чем за max_depth рёбер, без самих
+    // seeds, отсортированные по позиции
+    std::vector<Position> Collect(const std::vector<Position>& seeds, Direction direction,
+                                  int max_depth = UNLIMITED_DEPTH) const;
+    // То же для всех ячеек области size с левым верхним углом top_left
+    std::vector<Position> Collect(Position top_left, Size size, Direction direction,
+                                  int max_depth = UNLIMITED_DEPTH) const;
+
+    size_t GetNodeCount() const;
+    size_t GetEdgeCount() const;
+
+private:
+    struct Adjacency {
+        std::vector<uint32_t> offsets;
+        std::vector<uint32_t> targets;
+    };
+
+    uint32_t GetId(Position pos);
+    static Adjacency BuildAdjacency(size_t node_count,
+                                    const std::vector<std::pair<uint32_t, uint32_t>>& edges);
+
+    PositionMap<uint32_t> ids_;
+    std::vector<Position> positions_;
+    Adjacency precedents_;
+    Adjacency dependents_;
+};
@@ -3,8 +3,13 @@
 #include "FormulaAST.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cctype>
+#include <cmath>
+#include <iterator>
+#include <mutex>
+#include <set>
 #include <sstream>
 
 using namespace std::literals;
@@ -18,12 +23,33 @@ class Formula : public FormulaInterface {
 public:
 // Реализуйте следующие методы:
     explicit Formula(std::string expression) 
-        : ast_(ParseFormulaAST(std::move(expression)))
+        : Formula(ParseFormulaAST(std::move(expression)))
+    {
+    }
+
+    explicit Formula(FormulaAST ast)
+        : ast_(std::move(ast))
     {
         auto cells = ast_.GetCells();
         cells.unique();
         cells.sort();
+        // ссылки, сдвинутые за пределы таблицы, вычисляются в #REF!
+        cells.remove_if([](const Position& pos) {
+            return !pos.IsValid();
+        });
         cells_ = {cells.begin(), cells.end()};
+        for(const auto& cell : ast_.GetExternalCells()) {
+            if(cell.pos.IsValid() && (external_cells_.empty() || !(external_cells_.back() == cell))) {
+                external_cells_.push_back(cell);
+            }
+        }
+        for(const auto& range : ast_.GetRanges()) {
+            if(range.IsValid() && (ranges_.empty() || !(ranges_.back() == range))) {
+                ranges_.push_back(range);
+            }
+        }
+        branch_cells_ = ast_.GetBranchCells();
+        program_ = ast_.Compile();
     }
     
     Value Evaluate(const SheetInterface& arg) const override {
@@ -45,12 +71,456 @@ public:
         return cells_;
     }
 
+    std::vector<SheetReference> GetExternalReferences() const override {
+        return external_cells_;
+    }
+
+    std::vector<Range> GetReferencedRanges() const override {
+        return ranges_;
+    }
+
+    std::vector<Position> GetBranchCells() const override {
+        return branch_cells_;
+    }
+
+    const VectorProgram& GetProgram() const override {
+        return program_;
+    }
+
+    std::unique_ptr<FormulaInterface> Shifted(int row_shift, int col_shift) const override {
+        return std::make_unique<Formula>(ast_.Shifted(row_shift, col_shift));
+    }
+
+    MemoryUsage GetMemoryUsage() const override {
+        MemoryUsage res;
+        // сам объект формулы хранит корни деревьев и списки
+        res.ast = sizeof(*this) + ast_.GetNodeBytes();
+        res.references = ast_.GetCellListBytes() + cells_.capacity() * sizeof(Position)
+            + external_cells_.capacity() * sizeof(SheetReference) + ranges_.capacity() * sizeof(Range)
+            + branch_cells_.capacity() * sizeof(Position);
+        for(const auto& ref : external_cells_) {
+            if(ref.sheet.capacity() > std::string{}.capacity()) {
+                res.references += ref.sheet.capacity() + 1u;
+            }
+        }
+        res.program = program_.GetAllocatedBytes();
+        return res;
+    }
+
 private:
     FormulaAST ast_;
     std::vector<Position> cells_;
+    std::vector<SheetReference> external_cells_;
+    std::vector<Range> ranges_;
+    std::vector<Position> branch_cells_;
+    VectorProgram program_;
+};
+
+// Ссылки выражения, найденные без разбора, по правилам лексера Formula.g4
+struct ScannedReferences {
+    std::vector<Position> cells;
+    std::vector<SheetReference> external_cells;
+    std::vector<Range> ranges;
 };
+
+bool IsNameStart(char c) {
+    return std::isalpha(static_cast<unsigned char>(c)) || c == '_';
+}
+
+bool IsNameChar(char c) {
+    return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+}
+
+bool IsDigit(char c) {
+    return std::isdigit(static_cast<unsigned char>(c));
+}
+
+ScannedReferences ScanReferences(std::string_view expression) {
+    std::set<Position> cells;
+    std::set<SheetReference> external_cells;
+    std::set<Range> ranges;
+    int depth = 0;
+    size_t i = 0;
+    auto fail = [&expression] {
+        throw FormulaException{"Unable to parse: "s.append(expression)};
+    };
+    while(i < expression.size()) {
+        char c = expression[i];
+        if(c == ' ' || c == '\t' || c == '\n' || c == '\r'
+           || c == '+' || c == '-' || c == '*' || c == '/' || c == ','
+           || c == '=' || c == '<' || c == '>') {
+            ++i;
+        }
+        else if(c == '(' || c == ')') {
+            depth += c == '(' ? 1 : -1;
+            if(depth < 0) {
+                fail();
+            }
+            ++i;
+        }
+        else if(IsDigit(c) || c == '.') {
+            while(i < expression.size() && (IsDigit(expression[i]) || expression[i] == '.')) {
+                ++i;
+            }
+            // показатель степени: 1e5, 2E-3
+            if(i < expression.size() && (expression[i] == 'e' || expression[i] == 'E')) {
+                size_t exponent = i + 1u;
+                if(exponent < expression.size() && (expression[exponent] == '+' || expression[exponent] == '-')) {
+                    ++exponent;
+                }
+                if(exponent == expression.size() || !IsDigit(expression[exponent])) {
+                    fail();
+                }
+                i = exponent;
+                while(i < expression.size() && IsDigit(expression[i])) {
+                    ++i;
+                }
+            }
+        }
+        else if(IsNameStart(c)) {
+            size_t begin = i;
+            while(i < expression.size() && IsNameChar(expression[i])) {
+                ++i;
+            }
+            std::string_view sheet;
+            if(i < expression.size() && expression[i] == '!') {
+                sheet = expression.substr(begin, i - begin);
+                begin = ++i;
+                while(i < expression.size() && IsNameChar(expression[i])) {
+                    ++i;
+                }
+            }
+            auto name = expression.substr(begin, i - begin);
+            if(sheet.empty() && std::all_of(name.begin(), name.end(), [](char letter) {
+                   return letter >= 'A' && letter <= 'Z';
+               })) {
+                // имя функции; проверяется при разборе
+                continue;
+            }
+            auto pos = Position::FromString(name);
+            if(!pos.IsValid()) {
+                fail();
+            }
+            if(sheet.empty() && i < expression.size() && expression[i] == ':') {
+                begin = ++i;
+                while(i < expression.size() && IsNameChar(expression[i])) {
+                    ++i;
+                }
+                auto range = Range::FromCorners(pos, Position::FromString(expression.substr(begin, i - begin)));
+                if(!range.IsValid()) {
+                    fail();
+                }
+                ranges.insert(range);
+            }
+            else if(sheet.empty()) {
+                cells.insert(pos);
+            }
+            else {
+                external_cells.insert({std::string{sheet}, pos});
+            }
+        }
+        else {
+            fail();
+        }
+    }
+    if(depth != 0) {
+        fail();
+    }
+    return {{cells.begin(), cells.end()}, {external_cells.begin(), external_cells.end()},
+            {ranges.begin(), ranges.end()}};
+}
+
+// Формула, которая разбирается при первой необходимости. Разбор защищён
+// std::call_once, поэтому формулу можно разбирать заранее в другом потоке.
+class LazyFormula : public FormulaInterface {
+public:
+    explicit LazyFormula(std::string expression)
+        : expression_(std::move(expression))
+    {
+        auto references = ScanReferences(expression_);
+        cells_ = std::move(references.cells);
+        external_cells_ = std::move(references.external_cells);
+        ranges_ = std::move(references.ranges);
+    }
+
+    LazyFormula(std::string expression, ScannedReferences references)
+        : expression_(std::move(expression))
+        , cells_(std::move(references.cells))
+        , external_cells_(std::move(references.external_cells))
+        , ranges_(std::move(references.ranges))
+    {
+    }
+
+    Value Evaluate(const SheetInterface& arg) const override {
+        if(const auto* formula = Compile()) {
+            return formula->Evaluate(arg);
+        }
+        return FormulaError{FormulaError::Category::Value};
+    }
+
+    std::string GetExpression() const override {
+        if(const auto* formula = Compile()) {
+            return formula->GetExpression();
+        }
+        return expression_;
+    }
+
+    std::vector<Position> GetReferencedCells() const override {
+        return cells_;
+    }
+
+    std::vector<SheetReference> GetExternalReferences() const override {
+        return external_cells_;
+    }
+
+    std::vector<Range> GetReferencedRanges() const override {
+        return ranges_;
+    }
+
+    // До разбора ветви неизвестны, и все ссылки считаются безусловными. Ячейка
+    // ещё не разобранной формулы не вычислялась, поэтому это ничего не меняет.
+    std::vector<Position> GetBranchCells() const override {
+        if(compiled_.load(std::memory_order_acquire) && formula_) {
+            return formula_->GetBranchCells();
+        }
+        return {};
+    }
+
+    const VectorProgram& GetProgram() const override {
+        if(const auto* formula = Compile()) {
+            return formula->GetProgram();
+        }
+        return error_program_;
+    }
+
+    // Формула и программа ошибки пишутся при разборе, возможно, в фоновом
+    // потоке: до того, как compiled_ станет true, их читать нельзя
+    MemoryUsage GetMemoryUsage() const override {
+        MemoryUsage res;
+        if(compiled_.load(std::memory_order_acquire)) {
+            res = formula_ ? formula_->GetMemoryUsage() : MemoryUsage{};
+            res.program += error_program_.GetAllocatedBytes();
+        }
+        res.ast += sizeof(*this) + expression_.capacity();
+        res.references += cells_.capacity() * sizeof(Position)
+            + external_cells_.capacity() * sizeof(SheetReference) + ranges_.capacity() * sizeof(Range);
+        return res;
+    }
+
+    std::unique_ptr<FormulaInterface> Shifted(int row_shift, int col_shift) const override {
+        if(const auto* formula = Compile()) {
+            return formula->Shifted(row_shift, col_shift);
+        }
+        // выражение не разбирается: копия вычисляется в ту же ошибку и лишь
+        // зависит от сдвинутых ячеек
+        ScannedReferences references;
+        for(const auto& cell : cells_) {
+            Position pos{cell.row + row_shift, cell.col + col_shift};
+            if(pos.IsValid()) {
+                references.cells.push_back(pos);
+            }
+        }
+        for(const auto& cell : external_cells_) {
+            Position pos{cell.pos.row + row_shift, cell.pos.col + col_shift};
+            if(pos.IsValid()) {
+                references.external_cells.push_back({cell.sheet, pos});
+            }
+        }
+        for(const auto& range : ranges_) {
+            Position pos{range.top_left.row + row_shift, range.top_left.col + col_shift};
+            Range shifted{pos, range.size};
+            if(shifted.IsValid()) {
+                references.ranges.push_back(shifted);
+            }
+        }
+        return std::make_unique<LazyFormula>(expression_, std::move(references));
+    }
+
+    void Precompile() const override {
+        Compile();
+    }
+
+private:
+    const FormulaInterface* Compile() const {
+        std::call_once(compile_flag_, [this] {
+            try {
+                formula_ = std::make_unique<Formula>(expression_);
+            }
+            catch(...) {
+                error_program_.PushError(FormulaError{FormulaError::Category::Value});
+            }
+            compiled_.store(true, std::memory_order_release);
+        });
+        return formula_.get();
+    }
+
+    const std::string expression_;
+    std::vector<Position> cells_;
+    std::vector<SheetReference> external_cells_;
+    std::vector<Range> ranges_;
+
+    mutable std::once_flag compile_flag_;
+    // пишутся один раз внутри call_once
+    mutable std::unique_ptr<FormulaInterface> formula_;
+    mutable VectorProgram error_program_;
+    mutable std::atomic<bool> compiled_ = false;
+};
+
+
+// Копия формулы, сдвинутая на (row_shift, col_shift), см. ShiftFormula.
+// Дерево выражения копии строится под std::call_once, как разбор в
+// LazyFormula.
+class ShiftedFormula : public FormulaInterface {
+public:
+    ShiftedFormula(std::shared_ptr<const FormulaInterface> base, int row_shift, int col_shift)
+        : base_(std::move(base))
+        , row_shift_(row_shift)
+        , col_shift_(col_shift)
+        , program_(base_->GetProgram().Shifted(row_shift, col_shift))
+    {
+    }
+
+    Value Evaluate(const SheetInterface& arg) const override {
+        return Materialize().Evaluate(arg);
+    }
+
+    std::string GetExpression() const override {
+        return Materialize().GetExpression();
+    }
+
+    std::vector<Position> GetReferencedCells() const override {
+        return ShiftPositions(base_->GetReferencedCells());
+    }
+
+    std::vector<SheetReference> GetExternalReferences() const override {
+        auto res = base_->GetExternalReferences();
+        for(auto& ref : res) {
+            ref.pos = ShiftPosition(ref.pos);
+        }
+        return res;
+    }
+
+    std::vector<Range> GetReferencedRanges() const override {
+        auto res = base_->GetReferencedRanges();
+        for(auto& range : res) {
+            range.top_left = ShiftPosition(range.top_left);
+        }
+        return res;
+    }
+
+    std::vector<Position> GetBranchCells() const override {
+        return ShiftPositions(base_->GetBranchCells());
+    }
+
+    const VectorProgram& GetProgram() const override {
+        return program_;
+    }
+
+    // Исходная формула учитывается в ячейке, которой она принадлежит
+    MemoryUsage GetMemoryUsage() const override {
+        MemoryUsage res;
+        if(materialized_.load(std::memory_order_acquire)) {
+            res = formula_->GetMemoryUsage();
+        }
+        res.ast += sizeof(*this);
+        res.program += program_.GetAllocatedBytes();
+        return res;
+    }
+
+    std::unique_ptr<FormulaInterface> Shifted(int row_shift, int col_shift) const override {
+        return base_->Shifted(row_shift_ + row_shift, col_shift_ + col_shift);
+    }
+
+    void Precompile() const override {
+        Materialize();
+    }
+
+    const std::shared_ptr<const FormulaInterface>& GetBase() const {
+        return base_;
+    }
+
+    int GetRowShift() const {
+        return row_shift_;
+    }
+
+    int GetColShift() const {
+        return col_shift_;
+    }
+
+private:
+    Position ShiftPosition(Position pos) const {
+        return {pos.row + row_shift_, pos.col + col_shift_};
+    }
+
+    std::vector<Position> ShiftPositions(std::vector<Position> positions) const {
+        for(auto& pos : positions) {
+            pos = ShiftPosition(pos);
+        }
+        return positions;
+    }
+
+    const FormulaInterface& Materialize() const {
+        std::call_once(materialize_flag_, [this] {
+            formula_ = base_->Shifted(row_shift_, col_shift_);
+            materialized_.store(true, std::memory_order_release);
+        });
+        return *formula_;
+    }
+
+    const std::shared_ptr<const FormulaInterface> base_;
+    const int row_shift_;
+    const int col_shift_;
+    const VectorProgram program_;
+
+    mutable std::once_flag materialize_flag_;
+    // пишется один раз внутри call_once
+    mutable std::unique_ptr<FormulaInterface> formula_;
+    mutable std::atomic<bool> materialized_ = false;
+};
+
+// Остаются ли все ссылки формулы в пределах таблицы после сдвига
+bool StaysOnGrid(const FormulaInterface& formula, int row_shift, int col_shift) {
+    auto shifted_valid = [row_shift, col_shift] (Position pos) {
+        return Position{pos.row + row_shift, pos.col + col_shift}.IsValid();
+    };
+    const auto cells = formula.GetReferencedCells();
+    if(!std::all_of(cells.begin(), cells.end(), shifted_valid)) {
+        return false;
+    }
+    for(const auto& ref : formula.GetExternalReferences()) {
+        if(!shifted_valid(ref.pos)) {
+            return false;
+        }
+    }
+    for(const auto& range : formula.GetReferencedRanges()) {
+        if(!shifted_valid(range.top_left) || !shifted_valid(range.GetBottomRight())) {
+            return false;
+        }
+    }
+    return true;
+}
 }  // namespace
 
+std::optional<double> TextToNumber(std::string_view text) {
+    if(text.empty()) {
+        return 0.0;
+    }
+    std::string str{text};
+    size_t parsed = 0;
+    double res = 0.0;
+    try {
+        res = std::stod(str, &parsed);
+    }
+    catch(...) {
+        return std::nullopt;
+    }
+    // текст вида "3D" или "inf" числом не считается
+    if(parsed != str.size() || !std::isfinite(res)) {
+        return std::nullopt;
+    }
+    return res;
+}
+
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
     try {
         return std::make_unique<Formula>(std::move(expression));
@@ -59,3 +529,23 @@ std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
         throw FormulaException{"Unable to parse: "s.append(expression)};
     }
 }
+
+std::unique_ptr<FormulaInterface> ParseFormulaLazily(std::string expression) {
+    return std::make_unique<LazyFormula>(std::move(expression));
+}
+
+std::shared_ptr<const FormulaInterface> ShiftFormula(std::shared_ptr<const FormulaInterface> formula,
+                                                     int row_shift, int col_shift) {
+    if(const auto* shifted = dynamic_cast<const ShiftedFormula*>(formula.get())) {
+        row_shift += shifted->GetRowShift();
+        col_shift += shifted->GetColShift();
+        formula = shifted->GetBase();
+    }
+    if(row_shift == 0 && col_shift == 0) {
+        return formula;
+    }
+    if(!StaysOnGrid(*formula, row_shift, col_shift)) {
+        return formula->Shifted(row_shift, col_shift);
+    }
+    return std::make_shared<ShiftedFormula>(std::move(formula), row_shift, col_shift);
+}
@@ -1,15 +1,23 @@
 #pragma once
 
 #include "common.h"
+#include "vector_program.h"
 
 #include <limits>
 #include <memory>
+#include <optional>
+#include <string_view>
 #include <vector>
 
 // Формула, позволяющая вычислять и обновлять арифметическое выражение.
 // Поддерживаемые возможности:
 // * Простые бинарные операции и числа, скобки: 1+2*3, 2.5*(2+3.5/7)
 // * Значения ячеек в качестве переменных: A1+B2*C3
+// * Функции поиска по диапазонам ячеек: VLOOKUP(A1,B1:C9,2), MATCH(A1,B1:B9,0),
+//   XLOOKUP(A1,B1:B9,C1:C9,-1)
+// * Сравнения, дающие 1 или 0: A1<=B1, A1<>0
+// * Условия IF(A1>0,B1,C1), AND(A1,B1), OR(A1,B1), CHOOSE(A1,B1,C1), которые
+//   вычисляют только выбранную ветвь
 // Ячейки, указанные в формуле, могут быть как формулами, так и текстом. Если это
 // текст, но он представляет число, тогда его нужно трактовать как число. Пустая
 // ячейка или ячейка с пустым текстом трактуется как число ноль.
@@ -33,10 +41,70 @@ public:
 
         // Возвращает список ячеек, которые непосредственно задействованы в вычислении
         // формулы. Список отсортирован по возрастанию и не содержит повторяющихся
-        // ячеек.
+        // ячеек. Ссылки на другие листы в него не входят.
         virtual std::vector<Position> GetReferencedCells() const = 0;
+
+        // Возвращает отсортированный список ссылок на ячейки других листов книги
+        // без повторов.
+        virtual std::vector<SheetReference> GetExternalReferences() const = 0;
+
+        // Возвращает отсортированный список диапазонов, по которым ищут функции
+        // формулы, без повторов. Ячейки диапазонов в GetReferencedCells() не
+        // входят.
+        virtual std::vector<Range> GetReferencedRanges() const = 0;
+
+        // Возвращает ячейки из GetReferencedCells(), которые читаются не при
+        // каждом вычислении: только в ветвях IF, AND, OR и CHOOSE. Список
+        // отсортирован и не содержит повторов. От того, какие из них прочитаны
+        // при последнем вычислении, зависит, нужно ли пересчитывать формулу
+        // при их изменении.
+        virtual std::vector<Position> GetBranchCells() const = 0;
+
+        // Возвращает формулу, скомпилированную для пакетного вычисления.
+        // Входы программы - абсолютные позиции ячеек.
+        virtual const VectorProgram& GetProgram() const = 0;
+
+        // Память, занимаемая формулой вне самого объекта, по составляющим
+        struct MemoryUsage {
+            size_t ast = 0;         // узлы дерева выражения
+            size_t references = 0;  // списки ячеек, на которые ссылается формула
+            size_t program = 0;     // скомпилированная программа
+        };
+        virtual MemoryUsage GetMemoryUsage() const = 0;
+
+        // Возвращает копию формулы, все ссылки которой сдвинуты на (row_shift,
+        // col_shift), как при копировании формулы в другую ячейку. Выражение
+        // не разбирается заново. Ссылки, вышедшие за пределы таблицы,
+        // превращаются в ошибку #REF! и в списки ссылок не входят.
+        virtual std::unique_ptr<FormulaInterface> Shifted(int row_shift, int col_shift) const = 0;
+
+        // Разбирает формулу заранее, если она разбирается лениво. Может
+        // вызываться из другого потока одновременно с остальными методами.
+        virtual void Precompile() const {}
 };
 
+// Возвращает число, записанное в тексте ячейки, если текст целиком является
+// записью конечного числа. Пустой текст трактуется как ноль.
+std::optional<double> TextToNumber(std::string_view text);
+
 // Парсит переданное выражение и возвращает объект формулы.
 // Бросает FormulaException в случае, если формула синтаксически некорректна.
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+
+// Возвращает формулу, которая разбирается только при первом вычислении или
+// обращении к выражению либо программе. Ссылки на ячейки находятся сразу
+// быстрым просмотром текста без парсера. Бросает FormulaException, если в
+// выражении есть недопустимые символы, неверные позиции или непарные скобки;
+// остальные синтаксические ошибки обнаруживаются при разборе, после чего
+// формула вычисляется в ошибку #VALUE!.
+std::unique_ptr<FormulaInterface> ParseFormulaLazily(std::string expression);
+
+// Возвращает копию формулы, сдвинутую на (row_shift, col_shift), как
+// FormulaInterface::Shifted, но без копирования дерева выражения: копия
+// разделяет его с formula и хранит только сдвинутую программу, а списки
+// ссылок сдвигает при запросе. Собственное дерево строится при первом
+// вычислении формулы или обращении к её тексту; программа копии вычисляется
+// и без него. Копия копии ссылается на исходную формулу. Если ссылки выходят за
+// пределы таблицы, копия строится сразу через Shifted.
+std::shared_ptr<const FormulaInterface> ShiftFormula(std::shared_ptr<const FormulaInterface> formula,
+                                                     int row_shift, int col_shift);
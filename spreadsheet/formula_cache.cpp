@@ -0,0 +1,51 @@
+#include "formula_cache.h"
+
+FormulaCache::FormulaCache(size_t capacity)
+    : capacity_(capacity) {}
+
+std::shared_ptr<const FormulaInterface> FormulaCache::Get(std::string_view expression) {
+    auto iter = index_.find(expression);
+    if(iter != index_.end()) {
+        ++stats_.hits;
+        entries_.splice(entries_.begin(), entries_, iter->second);
+        return iter->second->second;
+    }
+    ++stats_.misses;
+    std::shared_ptr<const FormulaInterface> formula = ParseFormula(std::string{expression});
+    if(capacity_ == 0u) {
+        return formula;
+    }
+    entries_.emplace_front(std::string{expression}, formula);
+    index_.emplace(entries_.front().first, entries_.begin());
+    EvictExcess();
+    return formula;
+}
+
+FormulaCache::Stats FormulaCache::GetStats() const {
+    auto res = stats_;
+    res.size = entries_.size();
+    return res;
+}
+
+void FormulaCache::SetCapacity(size_t capacity) {
+    capacity_ = capacity;
+    EvictExcess();
+}
+
+size_t FormulaCache::GetCapacity() const {
+    return capacity_;
+}
+
+void FormulaCache::Clear() {
+    index_.clear();
+    entries_.clear();
+}
+
+void FormulaCache::EvictExcess() {
+    while(entries_.size() > capacity_) {
+        // ячейки, использующие формулу, продолжают владеть ею
+        index_.erase(entries_.back().first);
+        entries_.pop_back();
+        ++stats_.evictions;
+    }
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "formula.h"
+
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+
+// Кэш разобранных формул с вытеснением давно не использованных (LRU).
+// Формула после разбора не изменяется, поэтому ячейки с одинаковым текстом
+// формулы разделяют один её экземпляр, а повторная установка того же текста
+// не запускает разбор заново.
+class FormulaCache {
+public:
+    static constexpr size_t DEFAULT_CAPACITY = 1024;
+
+    explicit FormulaCache(size_t capacity = DEFAULT_CAPACITY);
+
+    // Возвращает формулу для выражения без знака "=", разбирая его при промахе.
+    // Бросает FormulaException, если выражение некорректно; такие выражения
+    // не кэшируются.
+    std::shared_ptr<const FormulaInterface> Get(std::string_view expression);
+
+    struct Stats {
+        size_t hits = 0;
+        size_t misses = 0;
+        size_t evictions = 0;
+        size_t size = 0;
+    };
+    Stats GetStats() const;
+
+    // Нулевая ёмкость отключает кэш
+    void SetCapacity(size_t capacity);
+    size_t GetCapacity() const;
+    void Clear();
+
+private:
+    using Entry = std::pair<std::string, std::shared_ptr<const FormulaInterface>>;
+
+    void EvictExcess();
+
+    size_t capacity_;
+    // от недавно использованных к давно не использованным
+    std::list<Entry> entries_;
+    // ключ ссылается на строку внутри элемента списка
+    std::unordered_map<std::string_view, std::list<Entry>::iterator> index_;
+    Stats stats_;
+};
@@ -0,0 +1,60 @@
+#include "formula_compiler.h"
+
+FormulaCompiler::FormulaCompiler()
+    : worker_([this] { Run(); }) {}
+
+FormulaCompiler::~FormulaCompiler() {
+    {
+        std::lock_guard lock(mutex_);
+        stop_ = true;
+    }
+    work_cv_.notify_one();
+    worker_.join();
+}
+
+void FormulaCompiler::Enqueue(std::weak_ptr<const FormulaInterface> formula) {
+    {
+        std::lock_guard lock(mutex_);
+        queue_.push_back(std::move(formula));
+    }
+    work_cv_.notify_one();
+}
+
+void FormulaCompiler::Wait() const {
+    std::unique_lock lock(mutex_);
+    idle_cv_.wait(lock, [this] {
+        return queue_.empty() && !busy_;
+    });
+}
+
+size_t FormulaCompiler::GetCompiledCount() const {
+    std::lock_guard lock(mutex_);
+    return compiled_;
+}
+
+void FormulaCompiler::Run() {
+    std::unique_lock lock(mutex_);
+    while(true) {
+        work_cv_.wait(lock, [this] {
+            return stop_ || !queue_.empty();
+        });
+        if(stop_) {
+            return;
+        }
+        auto formula = queue_.front().lock();
+        queue_.pop_front();
+        if(formula) {
+            busy_ = true;
+            lock.unlock();
+            // формула удерживается на время разбора, даже если её ячейку удалят
+            formula->Precompile();
+            formula.reset();
+            lock.lock();
+            busy_ = false;
+            ++compiled_;
+        }
+        if(queue_.empty()) {
+            idle_cv_.notify_all();
+        }
+    }
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "formula.h"
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+// Фоновый поток, который заранее разбирает лениво созданные формулы (см.
+// ParseFormulaLazily) в порядке их поступления. Очередь хранит слабые ссылки:
+// формулы удалённых к тому времени ячеек пропускаются. Формула, которую
+// читают раньше, чем до неё дошла очередь, разбирается читающим потоком.
+class FormulaCompiler {
+public:
+    FormulaCompiler();
+    // Останавливает поток, не дожидаясь разбора оставшихся формул
+    ~FormulaCompiler();
+
+    FormulaCompiler(const FormulaCompiler&) = delete;
+    FormulaCompiler& operator=(const FormulaCompiler&) = delete;
+
+    void Enqueue(std::weak_ptr<const FormulaInterface> formula);
+    // Ждёт, пока очередь опустеет
+    void Wait() const;
+    size_t GetCompiledCount() const;
+
+private:
+    void Run();
+
+    mutable std::mutex mutex_;
+    std::condition_variable work_cv_;
+    mutable std::condition_variable idle_cv_;
+    std::deque<std::weak_ptr<const FormulaInterface>> queue_;
+    size_t compiled_ = 0;
+    bool busy_ = false;
+    bool stop_ = false;
+
+    // объявлен последним, чтобы запускаться после инициализации остальных полей
+    std::thread worker_;
+};
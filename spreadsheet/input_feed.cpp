@@ -0,0 +1,63 @@
+#include "input_feed.h"
+
+#include "position_map.h"
+#include "sheet.h"
+
+#include <algorithm>
+
+InputFeed::InputFeed(size_t capacity) {
+    size_t size = 1u;
+    while(size < capacity) {
+        size *= 2u;
+    }
+    buffer_.resize(size);
+    mask_ = size - 1u;
+}
+
+bool InputFeed::Push(Position pos, double value) {
+    // некорректная позиция отвергается сразу, а не ломает пачку читателя
+    if(!pos.IsValid()) {
+        throw InvalidPositionException("wrong position");
+    }
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if(tail - head_.load(std::memory_order_acquire) == buffer_.size()) {
+        return false;
+    }
+    buffer_[tail & mask_] = {pos, value};
+    tail_.store(tail + 1u, std::memory_order_release);
+    return true;
+}
+
+std::vector<std::pair<Position, double>> InputFeed::PopCoalesced(size_t max_updates) {
+    size_t head = head_.load(std::memory_order_relaxed);
+    size_t tail = tail_.load(std::memory_order_acquire);
+    size_t count = std::min(tail - head, max_updates);
+
+    std::vector<std::pair<Position, double>> res;
+    PositionMap<size_t> index;
+    for(size_t i = head; i < head + count; ++i) {
+        const auto& update = buffer_[i & mask_];
+        auto [iter, inserted] = index.try_emplace(update.pos, res.size());
+        if(inserted) {
+            res.emplace_back(update.pos, update.value);
+        }
+        else {
+            res[iter->second].second = update.value;
+        }
+    }
+    head_.store(head + count, std::memory_order_release);
+    return res;
+}
+
+size_t InputFeed::Drain(Sheet& sheet, size_t max_updates) {
+    size_t before = head_.load(std::memory_order_relaxed);
+    auto updates = PopCoalesced(max_updates);
+    if(!updates.empty()) {
+        sheet.SetNumbers(updates);
+    }
+    return head_.load(std::memory_order_relaxed) - before;
+}
+
+size_t InputFeed::GetCapacity() const {
+    return buffer_.size();
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "common.h"
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+class Sheet;
+
+// Очередь числовых обновлений входных ячеек от потока-источника (например,
+// котировок) к потоку, владеющему таблицей. Кольцевой буфер без блокировок
+// рассчитан на одного писателя и одного читателя.
+// Читатель забирает накопившиеся обновления пачкой: повторные обновления
+// одной ячейки схлопываются до последнего, пачка записывается через
+// Sheet::SetNumbers с одним проходом сброса зависимых формул. Поэтому
+// значения формул отстают от источника не более чем на одну пачку.
+class InputFeed {
+public:
+    struct Update {
+        Position pos;
+        double value = 0.0;
+    };
+
+    // Ёмкость округляется вверх до степени двойки
+    explicit InputFeed(size_t capacity = 1u << 16u);
+
+    InputFeed(const InputFeed&) = delete;
+    InputFeed& operator=(const InputFeed&) = delete;
+
+    // Вызывается только потоком-писателем. Возвращает false, если буфер
+    // заполнен; обновление при этом не добавляется. Для некорректной позиции
+    // бросает InvalidPositionException.
+    bool Push(Position pos, double value);
+
+    // Вызываются только потоком-читателем.
+    // Забирает до max_updates обновлений, схлопывает их и записывает в таблицу.
+    // Возвращает число забранных обновлений.
+    size_t Drain(Sheet& sheet, size_t max_updates = static_cast<size_t>(-1));
+    // Забирает обновления без записи: позиции в порядке первого появления,
+    // у каждой последнее значение
+    std::vector<std::pair<Position, double>> PopCoalesced(size_t max_updates = static_cast<size_t>(-1));
+
+    size_t GetCapacity() const;
+
+private:
+    std::vector<Update> buffer_;
+    size_t mask_;
+    // индексы растут неограниченно, позиция в буфере - индекс & mask_;
+    // разнесены по разным строкам кэша, чтобы писатель и читатель не мешали
+    // друг другу
+    alignas(64) std::atomic<size_t> head_{0};  // следующая запись читателя
+    alignas(64) std::atomic<size_t> tail_{0};  // следующая запись писателя
+};
@@ -0,0 +1,332 @@
+#include "lookup_index.h"
+
+#include "formula.h"
+
+#include <algorithm>
+#include <cassert>
+
+namespace {
+LookupIndex::Key FromText(std::string_view text) {
+    LookupIndex::Key res;
+    if(text.empty()) {
+        return res;
+    }
+    if(auto number = TextToNumber(text)) {
+        res.kind = LookupIndex::Key::Kind::Number;
+        res.number = *number;
+        return res;
+    }
+    res.kind = LookupIndex::Key::Kind::Text;
+    res.text.reserve(text.size());
+    for(char c : text) {
+        res.text.push_back(c >= 'A' && c <= 'Z' ? static_cast<char>(c - 'A' + 'a') : c);
+    }
+    return res;
+}
+
+struct KeyBuilder {
+    LookupIndex::Key operator() (std::string_view text) const {
+        return FromText(text);
+    }
+    LookupIndex::Key operator() (double number) const {
+        LookupIndex::Key res;
+        res.kind = LookupIndex::Key::Kind::Number;
+        res.number = number;
+        return res;
+    }
+    LookupIndex::Key operator() (FormulaError /*error*/) const {
+        LookupIndex::Key res;
+        res.kind = LookupIndex::Key::Kind::Error;
+        return res;
+    }
+};
+
+bool IsComparable(const LookupIndex::Key& key) {
+    return key.kind == LookupIndex::Key::Kind::Number || key.kind == LookupIndex::Key::Kind::Text;
+}
+
+// Порядок упорядоченной области: числа по возрастанию, затем текст
+int Compare(const LookupIndex::Key& lhs, const LookupIndex::Key& rhs) {
+    if(lhs.kind != rhs.kind) {
+        return lhs.kind == LookupIndex::Key::Kind::Number ? -1 : 1;
+    }
+    if(lhs.kind == LookupIndex::Key::Kind::Number) {
+        return lhs.number < rhs.number ? -1 : (rhs.number < lhs.number ? 1 : 0);
+    }
+    return lhs.text.compare(rhs.text);
+}
+}  // namespace
+
+LookupIndex::Key LookupIndex::Key::FromValue(const CellInterface::Value& value) {
+    return std::visit(KeyBuilder(), value);
+}
+
+LookupIndex::Key LookupIndex::Key::FromValue(const std::variant<std::string_view, double, FormulaError>& value) {
+    return std::visit(KeyBuilder(), value);
+}
+
+bool LookupIndex::Key::operator==(const Key& rhs) const {
+    if(kind != rhs.kind) {
+        return false;
+    }
+    if(kind == Kind::Number) {
+        return number == rhs.number;
+    }
+    return kind != Kind::Text || text == rhs.text;
+}
+
+size_t LookupIndex::KeyHasher::operator()(const Key& key) const {
+    if(key.kind == Key::Kind::Text) {
+        return std::hash<std::string>{}(key.text);
+    }
+    // -0 и 0 равны и должны попасть в одну корзину
+    return std::hash<double>{}(key.number + 0.0);
+}
+
+LookupIndex::LookupIndex(Range area)
+    : area_(area)
+    , values_(static_cast<size_t>(area.size.cols == 1 ? area.size.rows : area.size.cols))
+    , is_stale_(values_.size(), true) {
+    assert(area.size.rows == 1 || area.size.cols == 1);
+    stale_.reserve(values_.size());
+    for(size_t i = 0; i < values_.size(); ++i) {
+        stale_.push_back(static_cast<uint32_t>(i));
+    }
+}
+
+const Range& LookupIndex::GetArea() const {
+    return area_;
+}
+
+size_t LookupIndex::GetSize() const {
+    return values_.size();
+}
+
+void LookupIndex::Extend(const Range& area) {
+    if(area_.Contains(area)) {
+        return;
+    }
+    bool vertical = IsVertical();
+    assert(vertical ? area.size.cols == 1 && area.top_left.col == area_.top_left.col
+                    : area.size.rows == 1 && area.top_left.row == area_.top_left.row);
+    int first = vertical ? area_.top_left.row : area_.top_left.col;
+    int end = first + static_cast<int>(values_.size());
+    int limit = vertical ? Position::MAX_ROWS : Position::MAX_COLS;
+    int area_first = vertical ? area.top_left.row : area.top_left.col;
+    int area_end = area_first + (vertical ? area.size.rows : area.size.cols);
+    int grow = static_cast<int>(values_.size());
+    int new_first = first;
+    int new_end = end;
+    if(area_first < first) {
+        new_first = std::min(area_first, std::max(0, first - grow));
+    }
+    if(area_end > end) {
+        new_end = std::max(area_end, std::min(limit, end + grow));
+    }
+
+    // номера прежних позиций сдвигаются на число новых позиций в начале
+    auto shift = static_cast<uint32_t>(first - new_first);
+    if(shift > 0u) {
+        values_.insert(values_.begin(), shift, Key{});
+        is_stale_.insert(is_stale_.begin(), shift, true);
+        for(auto& offset : stale_) {
+            offset += shift;
+        }
+        for(auto& [_, offsets] : positions_) {
+            for(auto& offset : offsets) {
+                offset += shift;
+            }
+        }
+        for(uint32_t offset = 0; offset < shift; ++offset) {
+            stale_.push_back(offset);
+        }
+    }
+    auto old_size = static_cast<uint32_t>(values_.size());
+    values_.resize(static_cast<size_t>(new_end - new_first));
+    is_stale_.resize(values_.size(), true);
+    for(uint32_t offset = old_size; offset < values_.size(); ++offset) {
+        stale_.push_back(offset);
+    }
+    if(vertical) {
+        area_.top_left.row = new_first;
+        area_.size.rows = new_end - new_first;
+    }
+    else {
+        area_.top_left.col = new_first;
+        area_.size.cols = new_end - new_first;
+    }
+}
+
+bool LookupIndex::IsVertical() const {
+    return area_.size.cols == 1;
+}
+
+std::pair<size_t, size_t> LookupIndex::GetWindow(const Range& area) const {
+    assert(area_.Contains(area));
+    if(IsVertical()) {
+        return {static_cast<size_t>(area.top_left.row - area_.top_left.row), static_cast<size_t>(area.size.rows)};
+    }
+    return {static_cast<size_t>(area.top_left.col - area_.top_left.col), static_cast<size_t>(area.size.cols)};
+}
+
+Position LookupIndex::GetPosition(size_t offset) const {
+    int shift = static_cast<int>(offset);
+    if(IsVertical()) {
+        return {area_.top_left.row + shift, area_.top_left.col};
+    }
+    return {area_.top_left.row, area_.top_left.col + shift};
+}
+
+void LookupIndex::Invalidate(Position pos) {
+    if(!area_.Contains(pos)) {
+        return;
+    }
+    size_t offset = static_cast<size_t>(IsVertical() ? pos.row - area_.top_left.row
+                                                     : pos.col - area_.top_left.col);
+    if(!is_stale_[offset]) {
+        is_stale_[offset] = true;
+        stale_.push_back(static_cast<uint32_t>(offset));
+    }
+}
+
+bool LookupIndex::IsStale() const {
+    return !stale_.empty();
+}
+
+void LookupIndex::Update(const std::function<Key(Position)>& read) {
+    if(stale_.empty()) {
+        return;
+    }
+    if(stale_.size() * 2u > values_.size()) {
+        // перечитать всё дешевле, чем править таблицу по одной позиции
+        positions_.clear();
+        for(size_t i = 0; i < values_.size(); ++i) {
+            values_[i] = read(GetPosition(i));
+            AddPosition(i);
+        }
+    }
+    else {
+        for(uint32_t offset : stale_) {
+            RemovePosition(offset);
+            values_[offset] = read(GetPosition(offset));
+            AddPosition(offset);
+        }
+    }
+    for(uint32_t offset : stale_) {
+        is_stale_[offset] = false;
+    }
+    stale_.clear();
+}
+
+void LookupIndex::AddPosition(size_t offset) {
+    if(!IsComparable(values_[offset])) {
+        return;
+    }
+    auto& offsets = positions_[values_[offset]];
+    auto iter = std::lower_bound(offsets.begin(), offsets.end(), offset);
+    offsets.insert(iter, static_cast<uint32_t>(offset));
+}
+
+void LookupIndex::RemovePosition(size_t offset) {
+    if(!IsComparable(values_[offset])) {
+        return;
+    }
+    auto iter = positions_.find(values_[offset]);
+    if(iter == positions_.end()) {
+        return;
+    }
+    auto& offsets = iter->second;
+    auto pos = std::lower_bound(offsets.begin(), offsets.end(), offset);
+    if(pos != offsets.end() && *pos == offset) {
+        offsets.erase(pos);
+    }
+    if(offsets.empty()) {
+        positions_.erase(iter);
+    }
+}
+
+std::optional<size_t> LookupIndex::FindExact(const Range& area, const Key& key) const {
+    assert(stale_.empty());
+    if(!IsComparable(key)) {
+        return std::nullopt;
+    }
+    auto iter = positions_.find(key);
+    if(iter == positions_.end()) {
+        return std::nullopt;
+    }
+    auto [first, count] = GetWindow(area);
+    const auto& offsets = iter->second;
+    auto offset = std::lower_bound(offsets.begin(), offsets.end(), first);
+    if(offset == offsets.end() || *offset >= first + count) {
+        return std::nullopt;
+    }
+    return *offset - first;
+}
+
+std::optional<size_t> LookupIndex::FindSorted(const Range& area, const Key& key, bool descending) const {
+    assert(stale_.empty());
+    auto [first, count] = GetWindow(area);
+    return FindSorted(values_.data() + first, count, key, descending);
+}
+
+std::optional<size_t> LookupIndex::FindExact(const std::vector<Key>& values, const Key& key) {
+    if(!IsComparable(key)) {
+        return std::nullopt;
+    }
+    auto iter = std::find(values.begin(), values.end(), key);
+    if(iter == values.end()) {
+        return std::nullopt;
+    }
+    return static_cast<size_t>(iter - values.begin());
+}
+
+std::optional<size_t> LookupIndex::FindSorted(const std::vector<Key>& values, const Key& key,
+                                              bool descending) {
+    return FindSorted(values.data(), values.size(), key, descending);
+}
+
+std::optional<size_t> LookupIndex::FindSorted(const Key* values, size_t count, const Key& key,
+                                              bool descending) {
+    if(!IsComparable(key)) {
+        return std::nullopt;
+    }
+    // пустые значения и ошибки стоят в конце области при любом порядке
+    auto before_or_equal = [&key, descending] (const Key& value) {
+        if(!IsComparable(value)) {
+            return false;
+        }
+        int res = Compare(value, key);
+        return descending ? res >= 0 : res <= 0;
+    };
+    size_t low = 0;
+    size_t high = count;
+    while(low < high) {
+        size_t middle = low + (high - low) / 2u;
+        if(before_or_equal(values[middle])) {
+            low = middle + 1u;
+        }
+        else {
+            high = middle;
+        }
+    }
+    if(low == 0u || values[low - 1u].kind != key.kind) {
+        return std::nullopt;
+    }
+    return low - 1u;
+}
+
+size_t LookupIndex::GetAllocatedBytes() const {
+    size_t res = values_.capacity() * sizeof(Key) + stale_.capacity() * sizeof(uint32_t)
+        + is_stale_.capacity() / 8u;
+    for(const auto& value : values_) {
+        if(value.text.capacity() > std::string{}.capacity()) {
+            res += value.text.capacity() + 1u;
+        }
+    }
+    res += positions_.bucket_count() * sizeof(void*);
+    for(const auto& [_, offsets] : positions_) {
+        // узел хеш-таблицы: ключ, вектор и указатель на следующий узел
+        res += sizeof(Key) + sizeof(offsets) + sizeof(void*) + offsets.capacity() * sizeof(uint32_t);
+    }
+    return res;
+}
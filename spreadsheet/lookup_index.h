@@ -0,0 +1,105 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <variant>
+#include <vector>
+
+// Индекс значений строки или столбца листа для функций поиска (VLOOKUP,
+// MATCH, XLOOKUP). Значения области лежат в плотном массиве, по которому идёт
+// двоичный поиск в упорядоченной области, а хеш-таблица значение -> номера
+// позиций находит точное совпадение за O(1). Индекс заполняется при первом
+// обновлении, а после изменения ячеек перечитывает только позиции, отмеченные
+// устаревшими. Поиск идёт по любой части области индекса, поэтому один индекс
+// служит всем формулам, которые ищут в отрезках одного столбца (строки), в
+// том числе сдвинутым копиям одной формулы.
+class LookupIndex {
+public:
+    // Искомое или хранимое значение. Текст, который является записью числа,
+    // считается числом, как и в арифметике формул; прочий текст сравнивается
+    // без учёта регистра латинских букв. Пустые значения и ошибки ни с чем не
+    // совпадают.
+    struct Key {
+        enum class Kind : uint8_t {
+            Blank,
+            Number,
+            Text,
+            Error,
+        };
+        Kind kind = Kind::Blank;
+        double number = 0.0;
+        // текст в нижнем регистре
+        std::string text;
+
+        static Key FromValue(const CellInterface::Value& value);
+        static Key FromValue(const std::variant<std::string_view, double, FormulaError>& value);
+
+        bool operator==(const Key& rhs) const;
+    };
+
+    // area - отрезок одного столбца или, если в нём больше одного столбца,
+    // одной строки
+    explicit LookupIndex(Range area);
+
+    const Range& GetArea() const;
+    size_t GetSize() const;
+
+    // Расширяет область так, чтобы она содержала area - отрезок того же
+    // столбца (строки). Область растёт не меньше чем вдвое, поэтому копии
+    // формулы, сдвинутые вдоль столбца, расширяют индекс O(log n) раз. Новые
+    // позиции устаревшие.
+    void Extend(const Range& area);
+
+    // Отмечает устаревшей позицию pos, если она входит в область
+    void Invalidate(Position pos);
+    bool IsStale() const;
+    // Перечитывает устаревшие позиции: read возвращает значение позиции
+    // области. Если устарела большая часть области, индекс строится заново.
+    void Update(const std::function<Key(Position)>& read);
+
+    // Номер (с нуля) первой позиции части area области индекса со значением key
+    std::optional<size_t> FindExact(const Range& area, const Key& key) const;
+    // Поиск в части area, упорядоченной по возрастанию (по убыванию при
+    // descending): номер последней позиции, значение которой не больше (не
+    // меньше) key и того же вида, что key. Как и в настольных таблицах,
+    // результат для неупорядоченной области не определён.
+    std::optional<size_t> FindSorted(const Range& area, const Key& key, bool descending) const;
+
+    // Те же поиски по значениям values без индекса, за линейное и
+    // логарифмическое время
+    static std::optional<size_t> FindExact(const std::vector<Key>& values, const Key& key);
+    static std::optional<size_t> FindSorted(const std::vector<Key>& values, const Key& key,
+                                            bool descending);
+
+    size_t GetAllocatedBytes() const;
+
+private:
+    struct KeyHasher {
+        size_t operator()(const Key& key) const;
+    };
+
+    static std::optional<size_t> FindSorted(const Key* values, size_t count, const Key& key,
+                                            bool descending);
+
+    bool IsVertical() const;
+    // Номер первой позиции area в области индекса и число позиций area
+    std::pair<size_t, size_t> GetWindow(const Range& area) const;
+    Position GetPosition(size_t offset) const;
+    void AddPosition(size_t offset);
+    void RemovePosition(size_t offset);
+
+    Range area_;
+    std::vector<Key> values_;
+    // номера позиций с одинаковым значением по возрастанию
+    std::unordered_map<Key, std::vector<uint32_t>, KeyHasher> positions_;
+    std::vector<uint32_t> stale_;
+    std::vector<bool> is_stale_;
+};
@@ -1,6 +1,26 @@
+#include "FormulaAST.h"
+#include "async_sheet.h"
 #include "common.h"
 #include "formula.h"
+#include "input_feed.h"
+#include "range_index.h"
+#include "sheet.h"
+#ifndef _WIN32
+#include "sheet_client.h"
+#include "sheet_server.h"
+#endif
 #include "test_runner_p.h"
+#include "trace.h"
+#include "workbook.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <system_error>
+#include <thread>
 
 inline std::ostream& operator<<(std::ostream& output, Position pos) {
     return output << "(" << pos.row << ", " << pos.col << ")";
@@ -14,6 +34,10 @@ inline std::ostream& operator<<(std::ostream& output, Size size) {
     return output << "(" << size.rows << ", " << size.cols << ")";
 }
 
+inline std::ostream& operator<<(std::ostream& output, const Range& range) {
+    return output << range.top_left << ":" << range.size;
+}
+
 inline std::ostream& operator<<(std::ostream& output, const CellInterface::Value& value) {
     std::visit(
         [&](const auto& x) {
@@ -23,6 +47,15 @@ inline std::ostream& operator<<(std::ostream& output, const CellInterface::Value
     return output;
 }
 
+inline std::ostream& operator<<(std::ostream& output, const FormulaInterface::Value& value) {
+    std::visit(
+        [&](const auto& x) {
+            output << x;
+        },
+        value);
+    return output;
+}
+
 namespace {
 /*
 std::string ToString(FormulaError::Category category) {
@@ -350,7 +383,7 @@ void TestCellReferences() {
 
     // Ссылка на пустую ячейку
     sheet->SetCell("B2"_pos, "=B1");
-    ASSERT(sheet->GetCell("B1"_pos)->GetReferencedCells().empty());
+    ASSERT(sheet->GetCell("B1"_pos) == nullptr);
     ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetReferencedCells(), std::vector{"B1"_pos});
 
     sheet->SetCell("A2"_pos, "");
@@ -446,6 +479,1597 @@ void Test_01() {
     size = sheet->GetPrintableSize();
 }
 
+void TestTextInterning() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "label");
+    sheet.SetCell("B1"_pos, "label");
+    sheet.SetCell("C1"_pos, "'label");
+    sheet.SetCell("D1"_pos, "=1+2");
+    ASSERT_EQUAL(sheet.GetStringPool().Size(), 2u);
+
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value("label"));
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value("label"));
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "'label");
+
+    sheet.ClearCell("A1"_pos);
+    ASSERT_EQUAL(sheet.GetStringPool().Size(), 2u);
+    sheet.SetCell("B1"_pos, "other");
+    ASSERT_EQUAL(sheet.GetStringPool().Size(), 2u);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value("other"));
+    sheet.ClearCell("C1"_pos);
+    ASSERT_EQUAL(sheet.GetStringPool().Size(), 1u);
+}
+
+void TestReferenceToEmptyCell() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "=XFD16384+1");
+    ASSERT(sheet.GetCell("XFD16384"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1, 1}));
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(1.0));
+
+    sheet.SetCell("XFD16384"_pos, "2");
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(3.0));
+
+    sheet.ClearCell("XFD16384"_pos);
+    ASSERT(sheet.GetCell("XFD16384"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1, 1}));
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(1.0));
+}
+
+void TestCacheInvalidation() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "1");
+    sheet->SetCell("B1"_pos, "=A1*2");
+    sheet->SetCell("C1"_pos, "=B1+A1");
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(3.0));
+
+    sheet->SetCell("A1"_pos, "5");
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(10.0));
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(15.0));
+
+    sheet->SetCell("B1"_pos, "7");
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(12.0));
+
+    sheet->ClearCell("A1"_pos);
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(7.0));
+}
+
+void TestPositionMap() {
+    PositionMap<int> map;
+    std::map<Position, int> expected;
+    for(int i = 0; i < 200; ++i) {
+        for(int j = 0; j < 200; j += 7) {
+            Position pos{i * 37 % 16384, (i + j) % 16384};
+            map[pos] = i + j;
+            expected[pos] = i + j;
+        }
+    }
+    int n = 0;
+    for(const auto& [pos, value] : expected) {
+        if(n++ % 3 == 0) {
+            ASSERT_EQUAL(map.erase(pos), 1u);
+        }
+    }
+    n = 0;
+    for(auto iter = expected.begin(); iter != expected.end(); ) {
+        iter = n++ % 3 == 0 ? expected.erase(iter) : std::next(iter);
+    }
+
+    ASSERT_EQUAL(map.size(), expected.size());
+    for(const auto& [pos, value] : expected) {
+        auto iter = map.find(pos);
+        ASSERT(iter != map.end());
+        ASSERT_EQUAL(iter->second, value);
+    }
+    std::map<Position, int> iterated;
+    for(const auto& [pos, value] : map) {
+        iterated[pos] = value;
+    }
+    ASSERT(iterated == expected);
+    ASSERT(map.find({16383, 16383}) == map.end());
+    ASSERT_EQUAL(UnpackPosition(PackPosition({16383, 5})), (Position{16383, 5}));
+
+    map.clear();
+    map.shrink_to_fit();
+    ASSERT(map.empty());
+    ASSERT_EQUAL(map.bucket_count(), 0u);
+}
+
+void TestRangeIndex() {
+    RangeIndex index;
+    std::vector<Range> ranges;
+    for(int i = 0; i < 300; ++i) {
+        Range range{{i * 53 % 16000, i * 31 % 16300}, {1 + i * 7 % 300, 1 + i % 40}};
+        ranges.push_back(range);
+        index.Insert(range);
+    }
+    // одинаковая область хранится дважды
+    index.Insert(ranges[5]);
+    ranges.push_back(ranges[5]);
+    for(size_t i = 0; i < ranges.size(); i += 3) {
+        index.Erase(ranges[i]);
+    }
+    for(size_t i = 0; i < ranges.size(); i += 3) {
+        ranges[i] = Range{};
+    }
+    ranges.erase(std::remove(ranges.begin(), ranges.end(), Range{}), ranges.end());
+    ASSERT_EQUAL(index.size(), ranges.size());
+
+    auto check = [&] (Position pos) {
+        std::vector<Range> found;
+        index.ForEachContaining(pos, [&found] (const Range& range) {
+            found.push_back(range);
+        });
+        std::vector<Range> expected;
+        std::copy_if(ranges.begin(), ranges.end(), std::back_inserter(expected), [pos] (const Range& range) {
+            return range.Contains(pos);
+        });
+        std::sort(found.begin(), found.end());
+        std::sort(expected.begin(), expected.end());
+        ASSERT(found == expected);
+        bool in_row = std::any_of(ranges.begin(), ranges.end(), [pos] (const Range& range) {
+            return range.top_left.row <= pos.row && pos.row <= range.GetBottomRight().row;
+        });
+        bool in_col = std::any_of(ranges.begin(), ranges.end(), [pos] (const Range& range) {
+            return range.top_left.col <= pos.col && pos.col <= range.GetBottomRight().col;
+        });
+        ASSERT_EQUAL(index.IntersectsRow(pos.row), in_row);
+        ASSERT_EQUAL(index.IntersectsColumn(pos.col), in_col);
+    };
+    for(int i = 0; i < 2000; ++i) {
+        check({i * 97 % 16384, i * 89 % 16384});
+    }
+    check({0, 0});
+    check({16383, 16383});
+
+    for(const auto& range : ranges) {
+        index.Erase(range);
+    }
+    ASSERT(index.empty());
+    ASSERT(!index.IntersectsRow(0));
+    ASSERT_EQUAL(index.GetAllocatedBytes(), 0u);
+}
+
+void TestConstantFolding() {
+    auto optimized = [](std::string expr) {
+        std::ostringstream oss;
+        ParseFormulaAST(expr).PrintOptimized(oss);
+        return oss.str();
+    };
+
+    ASSERT_EQUAL(optimized("A1*1+0+2*3"), "(+ (+ A1 0) 6)");
+    ASSERT_EQUAL(optimized("1*A1/1-0"), "A1");
+    ASSERT_EQUAL(optimized("--A1"), "A1");
+    ASSERT_EQUAL(optimized("+-+-+-A1"), "(- A1)");
+    ASSERT_EQUAL(optimized("-(-(-2))"), "-2");
+    ASSERT_EQUAL(optimized("A1+(-0)"), "A1");
+    ASSERT_EQUAL(optimized("A1-(-0)"), "(- A1 -0)");
+    ASSERT_EQUAL(optimized("A1+1/0"), "(+ A1 #DIV/0!)");
+    ASSERT_EQUAL(optimized("1/0+A1"), "#DIV/0!");
+
+    ASSERT_EQUAL(ParseFormula("A1*1+0+2*3")->GetExpression(), "A1*1+0+2*3");
+    ASSERT_EQUAL(ParseFormula("--A1")->GetExpression(), "--A1");
+
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "2");
+    sheet->SetCell("B1"_pos, "=A1*1+0+2*3");
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(8.0));
+    sheet->SetCell("B2"_pos, "=A1+(1-1)/0");
+    ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError::Category::Div0));
+    sheet->SetCell("A2"_pos, "-0");
+    sheet->SetCell("B3"_pos, "=A2+0");
+    ASSERT(!std::signbit(std::get<double>(sheet->GetCell("B3"_pos)->GetValue())));
+    sheet->SetCell("A3"_pos, "inf");
+    sheet->SetCell("B4"_pos, "=A3*1");
+    ASSERT_EQUAL(sheet->GetCell("B4"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError::Category::Value));
+}
+
+void TestColumnBatchEvaluation() {
+    Sheet sheet;
+    const int rows = 1000;
+    auto expected = [](int r) -> CellInterface::Value {
+        if(r % 97 == 0) {
+            return FormulaError::Category::Value;  // текст в A
+        }
+        if(r % 7 == 0) {
+            return FormulaError::Category::Div0;  // ноль в B
+        }
+        double a = r % 13 == 0 ? 0.0 : r;  // пустая ячейка в A
+        return a / (r % 7) + 1;
+    };
+    for(int r = 0; r < rows; ++r) {
+        if(r % 97 == 0) {
+            sheet.SetCell({r, 0}, "text");
+        }
+        else if(r % 13 != 0) {
+            sheet.SetCell({r, 0}, std::to_string(r));
+        }
+        sheet.SetCell({r, 1}, std::to_string(r % 7));
+        std::string row = std::to_string(r + 1);
+        sheet.SetCell({r, 2}, "=A" + row + "/B" + row + "+1");
+    }
+    // накопительная сумма зависит от собственного столбца
+    sheet.SetCell({0, 3}, "=B1");
+    for(int r = 1; r < rows; ++r) {
+        sheet.SetCell({r, 3}, "=D" + std::to_string(r) + "+B" + std::to_string(r + 1));
+    }
+
+    auto stats = sheet.Recalculate();
+    ASSERT_EQUAL(stats.batched_cells, static_cast<size_t>(rows));
+    ASSERT_EQUAL(stats.scalar_cells, static_cast<size_t>(rows));
+    double sum = 0;
+    for(int r = 0; r < rows; ++r) {
+        ASSERT_EQUAL(sheet.GetCell({r, 2})->GetValue(), expected(r));
+        sum += r % 7;
+        ASSERT_EQUAL(sheet.GetCell({r, 3})->GetValue(), CellInterface::Value(sum));
+    }
+
+    sheet.SetCell({4, 0}, "100");
+    stats = sheet.Recalculate();
+    ASSERT_EQUAL(stats.batched_cells, 0u);
+    ASSERT_EQUAL(stats.scalar_cells, 1u);
+    ASSERT_EQUAL(sheet.GetCell({4, 2})->GetValue(), CellInterface::Value(100.0 / 4 + 1));
+
+    sheet.SetCell({0, 1}, "2");
+    stats = sheet.Recalculate();
+    ASSERT_EQUAL(stats.batched_cells, 0u);
+    ASSERT_EQUAL(stats.scalar_cells, static_cast<size_t>(rows) + 1u);
+    ASSERT_EQUAL(sheet.GetCell({rows - 1, 3})->GetValue(), CellInterface::Value(sum + 2));
+}
+
+void TestWorkbook() {
+    auto book = CreateWorkbook();
+    int loads = 0;
+    book->AddSheet("Prices", [&loads](SheetInterface& sheet) {
+        ++loads;
+        sheet.SetCell("A1"_pos, "10");
+        sheet.SetCell("A2"_pos, "=A1*2");
+    });
+    ASSERT(book->HasSheet("Prices"));
+    ASSERT(!book->IsLoaded("Prices"));
+
+    auto& main = book->CreateSheet("Main");
+    ASSERT_EQUAL(book->GetLoadedSheetCount(), 1u);
+    main.SetCell("A1"_pos, "=Prices!A2+1");
+    ASSERT_EQUAL(main.GetCell("A1"_pos)->GetText(), "=Prices!A2+1");
+    ASSERT_EQUAL(main.GetCell("A1"_pos)->GetValue(), CellInterface::Value(21.0));
+    ASSERT_EQUAL(loads, 1);
+    ASSERT(book->IsLoaded("Prices"));
+    // ссылка на другой лист не создаёт ячеек на текущем
+    ASSERT(main.GetCell("A2"_pos) == nullptr);
+
+    auto* prices = book->GetSheet("Prices");
+    prices->SetCell("A1"_pos, "5");
+    ASSERT_EQUAL(main.GetCell("A1"_pos)->GetValue(), CellInterface::Value(11.0));
+    ASSERT_EQUAL(loads, 1);
+
+    try {
+        prices->SetCell("B1"_pos, "=Main!A1");
+        prices->SetCell("A1"_pos, "=B1");
+        ASSERT(false);
+    } catch(const CircularDependencyException&) {
+    }
+    ASSERT_EQUAL(prices->GetCell("A1"_pos)->GetText(), "5");
+
+    main.SetCell("B1"_pos, "=Nope!A1");
+    ASSERT_EQUAL(main.GetCell("B1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref));
+    book->CreateSheet("Nope").SetCell("A1"_pos, "7");
+    ASSERT_EQUAL(main.GetCell("B1"_pos)->GetValue(), CellInterface::Value(7.0));
+
+    ASSERT(book->GetSheet("Unknown") == nullptr);
+    try {
+        book->CreateSheet("Main");
+        ASSERT(false);
+    } catch(const std::invalid_argument&) {
+    }
+    ASSERT_EQUAL(book->GetSheetNames(), (std::vector<std::string>{"Main", "Nope", "Prices"}));
+}
+
+void TestChangeTracking() {
+    Sheet sheet;
+    auto v0 = sheet.GetVersion();
+    ASSERT(sheet.GetChangedCells(v0).empty());
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1+1");
+    sheet.SetCell("C1"_pos, "=B1*2");
+    sheet.SetCell("A5"_pos, "text");
+    ASSERT_EQUAL(sheet.GetChangedCells(v0).size(), 4u);
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(4.0));
+
+    auto v1 = sheet.GetVersion();
+    ASSERT(v1 > v0);
+    ASSERT(sheet.GetChangedCells(v1).empty());
+    sheet.SetCell("A1"_pos, "2");
+    ASSERT_EQUAL(sheet.GetChangedCells(v1), (std::vector<Position>{"A1"_pos, "B1"_pos, "C1"_pos}));
+
+    auto patch = sheet.GetPatch(v1);
+    ASSERT_EQUAL(patch.size(), 3u);
+    ASSERT_EQUAL(patch[2].text, "=B1*2");
+    ASSERT_EQUAL(patch[2].value, CellInterface::Value(6.0));
+
+    auto v2 = sheet.GetVersion();
+    sheet.ClearCell("A5"_pos);
+    sheet.SetCell("A1"_pos, "3");
+    sheet.SetCell("A1"_pos, "4");
+    std::ostringstream out;
+    sheet.PrintChangedValues(out, v2);
+    ASSERT_EQUAL(out.str(), "A1\t4\nB1\t5\nC1\t10\nA5\t\n");
+
+    // журнал не растёт неограниченно от правок одной ячейки
+    for(int i = 0; i < 1000; ++i) {
+        sheet.SetCell("A1"_pos, std::to_string(i));
+    }
+    ASSERT_EQUAL(sheet.GetChangedCells(v2).size(), 4u);
+}
+
+void TestSubscriptions() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1*10");
+    sheet.SetCell("B2"_pos, "=B1+1");
+
+    std::vector<std::vector<Sheet::CellPatch>> batches;
+    auto id = sheet.Subscribe("B1"_pos, Size{2, 1}, [&batches](const auto& changes) {
+        batches.push_back(changes);
+    });
+    int single_calls = 0;
+    sheet.Subscribe("A1"_pos, [&single_calls](const auto& changes) {
+        ASSERT_EQUAL(changes.size(), 1u);
+        ++single_calls;
+    });
+
+    sheet.SetCell("A1"_pos, "2");
+    ASSERT_EQUAL(batches.size(), 1u);
+    ASSERT_EQUAL(batches[0].size(), 2u);
+    ASSERT_EQUAL(batches[0][0].pos, "B1"_pos);
+    ASSERT_EQUAL(batches[0][0].value, CellInterface::Value(20.0));
+    ASSERT_EQUAL(batches[0][1].value, CellInterface::Value(21.0));
+    ASSERT_EQUAL(single_calls, 1);
+
+    // изменение вне областей подписок не оповещает
+    sheet.SetCell("Z9"_pos, "x");
+    ASSERT_EQUAL(batches.size(), 1u);
+    ASSERT_EQUAL(single_calls, 1);
+
+    sheet.ClearCell("B2"_pos);
+    ASSERT_EQUAL(batches.size(), 2u);
+    ASSERT(batches[1][0].removed);
+
+    sheet.Unsubscribe(id);
+    sheet.SetCell("A1"_pos, "3");
+    ASSERT_EQUAL(batches.size(), 2u);
+    ASSERT_EQUAL(single_calls, 2);
+
+    auto book = CreateWorkbook();
+    auto& first = book->CreateSheet("First");
+    auto& second = dynamic_cast<Sheet&>(book->CreateSheet("Second"));
+    second.SetCell("A1"_pos, "=First!A1+1");
+    std::vector<Sheet::CellPatch> received;
+    second.Subscribe("A1"_pos, [&received](const auto& changes) {
+        received = changes;
+    });
+    first.SetCell("A1"_pos, "41");
+    ASSERT_EQUAL(received.size(), 1u);
+    ASSERT_EQUAL(received[0].value, CellInterface::Value(42.0));
+}
+
+void TestMemoryUsage() {
+    Sheet sheet;
+    auto empty = sheet.GetMemoryUsage();
+    ASSERT_EQUAL(empty.cells, 0u);
+    ASSERT_EQUAL(empty.formula_ast, 0u);
+
+    const int rows = 2000;
+    for(int r = 0; r < rows; ++r) {
+        sheet.SetCell({r, 0}, "text number " + std::to_string(r));
+        sheet.SetCell({r, 1}, "=A" + std::to_string(r + 1) + "+1");
+        sheet.SetCell({r, 2}, "");
+    }
+    auto full = sheet.GetMemoryUsage();
+    ASSERT_EQUAL(full.cells, 3u * rows * sizeof(Cell));
+    // по странице на каждые 256 строк каждого из трёх столбцов
+    ASSERT(full.cached_values >= 3u * (rows / ValueCache::PAGE_ROWS) * ValueCache::PAGE_ROWS * 9u);
+    ASSERT(full.cached_values < 3u * rows * 12u);
+    ASSERT(full.impls > 0u);
+    ASSERT(full.text_payloads >= static_cast<size_t>(rows) * 13u);
+    ASSERT(full.formula_ast > 0u);
+    ASSERT(full.formula_references >= rows * sizeof(Position));
+    ASSERT(full.formula_programs > 0u);
+    ASSERT(full.dependency_graph > 0u);
+    ASSERT(full.storage >= 3u * rows * sizeof(void*));
+    ASSERT(full.Total() > empty.Total());
+
+    // ячейки, их текст и значения остаются прежними
+    auto version = sheet.GetVersion();
+    auto released = sheet.Compact();
+    ASSERT(released > 0u);
+    ASSERT(sheet.GetCell({5, 2}) != nullptr);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{rows, 3}));
+    ASSERT_EQUAL(sheet.GetVersion(), version);
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetText(), "=A2+1");
+
+    for(int r = 1; r < rows; ++r) {
+        sheet.ClearCell({r, 0});
+        sheet.ClearCell({r, 1});
+    }
+    auto cleared = sheet.GetMemoryUsage();
+    ASSERT(cleared.formula_ast < full.formula_ast);
+    ASSERT(sheet.Compact() > 0u);
+    auto compacted = sheet.GetMemoryUsage();
+    ASSERT(compacted.storage < cleared.storage);
+    ASSERT(compacted.change_tracking < cleared.change_tracking);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Value));
+}
+
+void TestFormulaCache() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "2");
+    for(int r = 1; r <= 100; ++r) {
+        sheet.SetCell({r, 0}, "=A1*10");
+    }
+    auto stats = sheet.GetFormulaCache().GetStats();
+    ASSERT_EQUAL(stats.misses, 1u);
+    ASSERT_EQUAL(stats.hits, 99u);
+    ASSERT_EQUAL(stats.size, 1u);
+    ASSERT_EQUAL(sheet.GetCell("A50"_pos)->GetValue(), CellInterface::Value(20.0));
+    ASSERT_EQUAL(sheet.GetCell("A50"_pos)->GetText(), "=A1*10");
+    // общая формула учитывается в памяти один раз
+    auto shared = sheet.GetMemoryUsage();
+    sheet.SetCell("B1"_pos, "=A1*11");
+    ASSERT_EQUAL(sheet.GetMemoryUsage().formula_ast, 2u * shared.formula_ast);
+
+    try {
+        sheet.SetCell("C1"_pos, "=A1+");
+        ASSERT(false);
+    } catch(const FormulaException&) {
+    }
+    ASSERT_EQUAL(sheet.GetFormulaCache().GetStats().size, 2u);
+
+    FormulaCache cache(2);
+    auto first = cache.Get("A1+1");
+    cache.Get("A2+1");
+    ASSERT_EQUAL(cache.Get("A1+1"), first);
+    cache.Get("A3+1");  // вытесняет A2+1
+    ASSERT_EQUAL(cache.Get("A1+1"), first);
+    cache.Get("A2+1");
+    stats = cache.GetStats();
+    ASSERT_EQUAL(stats.hits, 2u);
+    ASSERT_EQUAL(stats.misses, 4u);
+    ASSERT_EQUAL(stats.evictions, 2u);
+    ASSERT_EQUAL(stats.size, 2u);
+
+    cache.SetCapacity(0);
+    ASSERT_EQUAL(cache.GetStats().size, 0u);
+    ASSERT(cache.Get("A1+1") != first);
+    ASSERT_EQUAL(cache.GetStats().size, 0u);
+}
+
+void TestAsyncRecalculation() {
+    AsyncSheet sheet;
+    ASSERT_EQUAL(sheet.GetLastValue("A1"_pos), CellInterface::Value(""));
+    const int rows = 5000;
+    sheet.SetCell("A1"_pos, "1");
+    for(int r = 1; r < rows; ++r) {
+        sheet.SetCell({r, 0}, "=A" + std::to_string(r) + "+1");
+    }
+    auto last = sheet.GetFreshValue({rows - 1, 0});
+    ASSERT_EQUAL(last.get(), CellInterface::Value(static_cast<double>(rows)));
+    ASSERT_EQUAL(sheet.GetLastValue({rows - 1, 0}), CellInterface::Value(static_cast<double>(rows)));
+
+    // каждая правка прерывает пересчёт, начатый для предыдущей
+    for(int i = 2; i <= 20; ++i) {
+        sheet.SetCell("A1"_pos, std::to_string(i));
+    }
+    ASSERT_EQUAL(sheet.GetFreshValue({rows - 1, 0}).get(), CellInterface::Value(rows + 19.0));
+    sheet.WaitForRecalculation();
+    ASSERT_EQUAL(sheet.GetLastValue({rows / 2, 0}), CellInterface::Value(rows / 2 + 20.0));
+
+    sheet.ClearCell({rows - 1, 0});
+    sheet.WaitForRecalculation();
+    ASSERT_EQUAL(sheet.GetLastValue({rows - 1, 0}), CellInterface::Value(""));
+    ASSERT_EQUAL(sheet.GetText("A2"_pos), "=A1+1");
+
+    auto stats = sheet.GetStats();
+    ASSERT(stats.completed_passes >= 3u);
+    ASSERT(stats.recalculated_cells >= static_cast<size_t>(rows));
+    try {
+        sheet.SetCell("A1"_pos, "=A3");
+        ASSERT(false);
+    } catch(const CircularDependencyException&) {
+    }
+}
+
+void TestDependencyQueries() {
+    Sheet sheet;
+    // A1 <- B1 <- C1 <- D1, A2 <- C1, E1 ни с чем не связана
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1+1");
+    sheet.SetCell("C1"_pos, "=B1+A2");
+    sheet.SetCell("D1"_pos, "=C1*2");
+    sheet.SetCell("E1"_pos, "=5");
+
+    using Positions = std::vector<Position>;
+    ASSERT_EQUAL(sheet.GetPrecedents("D1"_pos), (Positions{"A1"_pos, "B1"_pos, "C1"_pos, "A2"_pos}));
+    ASSERT_EQUAL(sheet.GetPrecedents("D1"_pos, 1), (Positions{"C1"_pos}));
+    ASSERT_EQUAL(sheet.GetPrecedents("D1"_pos, 2), (Positions{"B1"_pos, "C1"_pos, "A2"_pos}));
+    ASSERT_EQUAL(sheet.GetDependents("A1"_pos), (Positions{"B1"_pos, "C1"_pos, "D1"_pos}));
+    ASSERT_EQUAL(sheet.GetDependents("A2"_pos), (Positions{"C1"_pos, "D1"_pos}));
+    ASSERT(sheet.GetDependents("E1"_pos).empty());
+    ASSERT(sheet.GetPrecedents("Z100"_pos).empty());
+    ASSERT_EQUAL(sheet.GetDependents("A1"_pos, Size{2, 1}, 1), (Positions{"B1"_pos, "C1"_pos}));
+
+    // снимок графа обновляется после правки
+    sheet.SetCell("D1"_pos, "=A2");
+    ASSERT_EQUAL(sheet.GetDependents("A1"_pos), (Positions{"B1"_pos, "C1"_pos}));
+
+    // число в новой ячейке диапазона тоже обновляет снимок
+    Sheet lookup;
+    lookup.SetCell("A1"_pos, "1");
+    lookup.SetCell("B1"_pos, "=MATCH(2,A1:A3,0)");
+    ASSERT(lookup.GetDependents("A2"_pos).empty());
+    lookup.SetNumber("A2"_pos, 2.0);
+    ASSERT_EQUAL(lookup.GetDependents("A2"_pos), (Positions{"B1"_pos}));
+    ASSERT_EQUAL(lookup.GetPrecedents("B1"_pos), (Positions{"A1"_pos, "A2"_pos}));
+
+    Sheet chain;
+    const int rows = 15000;
+    chain.SetCell("A1"_pos, "1");
+    for(int r = 1; r < rows; ++r) {
+        chain.SetCell({r, 0}, "=A" + std::to_string(r) + "+1");
+    }
+    ASSERT_EQUAL(chain.GetDependents("A1"_pos).size(), static_cast<size_t>(rows - 1));
+    ASSERT_EQUAL(chain.GetPrecedents({rows - 1, 0}).size(), static_cast<size_t>(rows - 1));
+    ASSERT_EQUAL(chain.GetDependents("A1"_pos, 10).back(), (Position{10, 0}));
+    ASSERT_EQUAL(chain.GetDependents({0, 0}, Size{1, Position::MAX_COLS}).size(),
+                 static_cast<size_t>(rows - 1));
+}
+
+void TestTraceRecording() {
+    std::stringstream trace;
+    Sheet sheet;
+    {
+        TraceWriter writer(trace);
+        RecordingSheet recorder(sheet, writer);
+        recorder.SetCell("A1"_pos, "2");
+        recorder.SetCell("B1"_pos, "=A1*A1");
+        ASSERT_EQUAL(recorder.GetCell("B1"_pos)->GetValue(), CellInterface::Value(4.0));
+        ASSERT(recorder.GetCell("C1"_pos) == nullptr);
+        try {
+            recorder.SetCell("A1"_pos, "=B1");
+            ASSERT(false);
+        } catch(const CircularDependencyException&) {
+        }
+        recorder.ClearCell("A1"_pos);
+        ASSERT_EQUAL(recorder.GetCell("B1"_pos)->GetText(), "=A1*A1");
+        std::ostringstream out;
+        recorder.PrintValues(out);
+        ASSERT_EQUAL(out.str(), "\t0\n");
+        ASSERT_EQUAL(writer.GetRecordCount(), 7u);
+    }
+
+    auto records = TraceReader(trace).ReadAll();
+    ASSERT_EQUAL(records.size(), 7u);
+    ASSERT(records[1].op == TraceOp::SetCell);
+    ASSERT_EQUAL(records[1].pos, "B1"_pos);
+    ASSERT_EQUAL(records[1].text, "=A1*A1");
+    ASSERT(records[2].op == TraceOp::GetValue);
+    ASSERT(records[4].op == TraceOp::ClearCell);
+    ASSERT(records[6].op == TraceOp::PrintValues);
+    ASSERT(std::is_sorted(records.begin(), records.end(), [](const auto& lhs, const auto& rhs) {
+        return lhs.time < rhs.time;
+    }));
+
+    Sheet replayed;
+    auto result = ReplayTrace(records, replayed);
+    ASSERT_EQUAL(result.operations, 7u);
+    ASSERT_EQUAL(result.errors, 1u);
+    ASSERT_EQUAL(result.latencies[static_cast<size_t>(TraceOp::SetCell)].size(), 3u);
+    ASSERT(replayed.GetCell("A1"_pos) == nullptr);
+    ASSERT_EQUAL(replayed.GetCell("B1"_pos)->GetValue(), CellInterface::Value(0.0));
+
+    std::istringstream garbage("not a trace");
+    try {
+        TraceReader reader(garbage);
+        ASSERT(false);
+    } catch(const std::runtime_error&) {
+    }
+}
+
+void TestValueCache() {
+    ValueCache cache;
+    ASSERT(cache.IsDirty("A1"_pos));
+    cache.Occupy("A1"_pos);
+    cache.Occupy("A3"_pos);
+    ASSERT_EQUAL(cache.GetPageCount(), 1u);
+    ASSERT(cache.IsDirty("A1"_pos));
+    cache.SetNumber("A1"_pos, 1.5);
+    cache.SetError("A3"_pos, FormulaError::Category::Div0);
+    ASSERT(!cache.IsDirty("A1"_pos));
+    ASSERT(cache.GetTag("A1"_pos) == ValueCache::Tag::Number);
+    ASSERT_EQUAL(cache.GetNumber("A1"_pos), 1.5);
+    ASSERT_EQUAL(ValueCache::ToError(cache.GetTag("A3"_pos)), FormulaError(FormulaError::Category::Div0));
+
+    auto span = cache.GetSpan("A1"_pos);
+    // окно страницы - от первой до последней занятой строки
+    ASSERT_EQUAL(span.count, 3u);
+    ASSERT(!span.IsDirty(0) && span.IsDirty(1) && !span.IsDirty(2));
+    ASSERT_EQUAL(span.values[0], 1.5);
+
+    cache.Invalidate("A1"_pos);
+    ASSERT(cache.IsDirty("A1"_pos));
+    cache.Release("A1"_pos);
+    cache.Release("A3"_pos);
+    ASSERT_EQUAL(cache.GetPageCount(), 0u);
+    ASSERT_EQUAL(cache.GetSpan("A1"_pos).count, 0u);
+
+    // разреженные ячейки не занимают целых страниц и столбцов
+    ValueCache sparse;
+    sparse.Occupy("XFD16384"_pos);
+    ASSERT(sparse.GetAllocatedBytes() < 512u);
+    sparse.Occupy({300, 0});
+    auto gap = sparse.GetSpan({256, 0});
+    ASSERT_EQUAL(gap.count, 0u);
+    ASSERT_EQUAL(gap.empty, 44u);
+    ASSERT_EQUAL(sparse.GetSpan({300, 0}).count, 1u);
+    ASSERT_EQUAL(sparse.GetSpan({301, 0}).empty, 211u);
+    for(int i = 0; i < 1000; ++i) {
+        sparse.Occupy({i * 16, i * 16});
+    }
+    ASSERT(sparse.GetAllocatedBytes() < 1002u * 200u);
+    Sheet diagonal;
+    diagonal.SetNumber("XFD16384"_pos, 1.0);
+    ASSERT(diagonal.GetMemoryUsage().cached_values < 512u);
+    for(int i = 0; i < 1000; ++i) {
+        diagonal.SetNumber({i * 16, i * 16}, i);
+    }
+    ASSERT(diagonal.GetMemoryUsage().cached_values < 1001u * 200u);
+    ASSERT_EQUAL(diagonal.GetCell({320, 320})->GetValue(), CellInterface::Value(20.0));
+
+    // значение ячейки хранится в кэше листа, а не в объекте ячейки
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "2");
+    sheet.SetCell("A2"_pos, "=A1/0");
+    sheet.SetCell("A3"_pos, "'text");
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Div0));
+    ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value("text"));
+    ASSERT(sheet.GetValueCache().GetTag("A3"_pos) == ValueCache::Tag::Text);
+    sheet.SetCell("A2"_pos, "=A1*4");
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(8.0));
+    ASSERT_EQUAL(sheet.GetValueCache().GetNumber("A2"_pos), 8.0);
+    sheet.ClearCell("A1"_pos);
+    ASSERT(sheet.GetValueCache().IsDirty("A2"_pos));
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(0.0));
+}
+
+void TestNumericInput() {
+    Sheet sheet;
+    sheet.SetCell("B1"_pos, "=A1*2");
+    sheet.SetCell("C1"_pos, "=A1+A2");
+    sheet.SetNumber("A1"_pos, 1.5);
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(1.5));
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "1.5");
+    // формула из текста числа вычисляется в то же число
+    for(double number : {1234567.89, 0.1, -2.5e-300, 1e21, 1.0 / 3.0}) {
+        sheet.SetNumber("D1"_pos, number);
+        auto text = sheet.GetCell("D1"_pos)->GetText();
+        sheet.SetCell("D2"_pos, "=" + text);
+        ASSERT_EQUAL(sheet.GetCell("D2"_pos)->GetValue(), CellInterface::Value(number));
+    }
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetText(), "0.3333333333333333");
+    sheet.SetNumber("D1"_pos, 1234567.89);
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetText(), "1234567.89");
+    sheet.ClearCell("D1"_pos);
+    sheet.ClearCell("D2"_pos);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(3.0));
+
+    auto version = sheet.GetVersion();
+    sheet.SetNumbers({{"A1"_pos, 2.0}, {"A2"_pos, 10.0}, {"A1"_pos, 4.0}});
+    ASSERT_EQUAL(sheet.GetVersion(), version + 1u);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(8.0));
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(14.0));
+    ASSERT_EQUAL(sheet.GetChangedCells(version).size(), 4u);
+
+    // число заменяет формулу вместе с её зависимостями
+    sheet.SetNumber("C1"_pos, 0.0);
+    ASSERT(sheet.GetDependents("A2"_pos).empty());
+    sheet.SetCell("A2"_pos, "=C1");
+
+    try {
+        sheet.SetNumbers({{"A1"_pos, 1.0}, {Position{-1, 0}, 1.0}});
+        ASSERT(false);
+    } catch(const InvalidPositionException&) {
+    }
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(4.0));
+
+    InputFeed feed(4);
+    ASSERT_EQUAL(feed.GetCapacity(), 4u);
+    ASSERT(feed.Push("A1"_pos, 1.0));
+    ASSERT(feed.Push("A1"_pos, 2.0));
+    ASSERT(feed.Push("A2"_pos, 3.0));
+    ASSERT(feed.Push("A1"_pos, 5.0));
+    ASSERT(!feed.Push("A3"_pos, 0.0));
+    ASSERT_EQUAL(feed.Drain(sheet), 4u);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(10.0));
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(3.0));
+
+    InputFeed ticks(1024);
+    const int count = 100000;
+    std::thread producer([&ticks] {
+        for(int i = 1; i <= count; ++i) {
+            while(!ticks.Push({i % 8, 0}, i)) {
+                std::this_thread::yield();
+            }
+        }
+    });
+    size_t drained = 0;
+    while(drained < static_cast<size_t>(count)) {
+        drained += ticks.Drain(sheet);
+    }
+    producer.join();
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(static_cast<double>(count - count % 8)));
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(2.0 * (count - count % 8)));
+}
+
+void TestWhatIfEvaluation() {
+    Sheet sheet;
+    sheet.SetNumber("A1"_pos, 1.0);
+    sheet.SetNumber("A2"_pos, 2.0);
+    sheet.SetCell("B1"_pos, "=A1+A2");
+    sheet.SetCell("B2"_pos, "=B1*10");
+    sheet.SetCell("C1"_pos, "=A2*3");
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(30.0));
+    auto version = sheet.GetVersion();
+
+    auto values = sheet.Evaluate({{"A1"_pos, 5.0}}, {"B2"_pos, "C1"_pos, "A1"_pos});
+    ASSERT_EQUAL(values.size(), 3u);
+    ASSERT_EQUAL(values[0], CellInterface::Value(70.0));
+    ASSERT_EQUAL(values[1], CellInterface::Value(6.0));
+    ASSERT_EQUAL(values[2], CellInterface::Value(5.0));
+
+    // переопределение формулы отрезает её от входов; текст читается как число
+    values = sheet.Evaluate({{"B1"_pos, std::string{"4"}}, {"D1"_pos, 1.0}}, {"B2"_pos});
+    ASSERT_EQUAL(values[0], CellInterface::Value(40.0));
+    values = sheet.Evaluate({{"A2"_pos, std::string{"x"}}}, {"B2"_pos, "D5"_pos});
+    ASSERT_EQUAL(values[0], CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+    ASSERT_EQUAL(values[1], CellInterface::Value());
+
+    // лист не изменился
+    ASSERT_EQUAL(sheet.GetVersion(), version);
+    ASSERT(!sheet.GetValueCache().IsDirty("B2"_pos));
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(30.0));
+    ASSERT(sheet.GetCell("D1"_pos) == nullptr);
+
+    // невычисленные формулы вычисляются в наложении и остаются в листе грязными
+    sheet.SetNumber("A2"_pos, 0.0);
+    values = sheet.Evaluate({}, {"B2"_pos});
+    ASSERT_EQUAL(values[0], CellInterface::Value(10.0));
+    ASSERT(sheet.GetValueCache().IsDirty("B2"_pos));
+    sheet.Recalculate();
+
+    std::vector<std::thread> threads;
+    std::vector<double> results(8);
+    for(size_t i = 0; i < results.size(); ++i) {
+        threads.emplace_back([&sheet, &results, i] {
+            for(int n = 0; n < 1000; ++n) {
+                auto value = sheet.Evaluate({{"A1"_pos, static_cast<double>(i)}}, {"B2"_pos});
+                results[i] = std::get<double>(value[0]);
+            }
+        });
+    }
+    for(auto& thread : threads) {
+        thread.join();
+    }
+    for(size_t i = 0; i < results.size(); ++i) {
+        ASSERT_EQUAL(results[i], 10.0 * i);
+    }
+
+    try {
+        sheet.Evaluate({{Position{-1, 0}, 1.0}}, {"B2"_pos});
+        ASSERT(false);
+    } catch(const InvalidPositionException&) {
+    }
+}
+
+void TestParameterSweep() {
+    Sheet sheet;
+    sheet.SetNumber("A1"_pos, 1.0);
+    sheet.SetNumber("A2"_pos, 2.0);
+    sheet.SetCell("A3"_pos, "10");
+    sheet.SetCell("B1"_pos, "=A1*A3");
+    sheet.SetCell("B2"_pos, "=B1/A2");
+    sheet.SetCell("B3"_pos, "=A3+1");
+    sheet.SetCell("C1"_pos, "=B2+B3-A1");
+    auto version = sheet.GetVersion();
+
+    std::vector<std::vector<double>> scenarios;
+    for(int i = 0; i < 1000; ++i) {
+        scenarios.push_back({static_cast<double>(i), static_cast<double>(i % 5)});
+    }
+    auto res = sheet.Sweep({"A1"_pos, "A2"_pos}, scenarios, {"C1"_pos, "A2"_pos, "B3"_pos}, 4);
+    ASSERT_EQUAL(res.scenario_count, 1000u);
+    ASSERT_EQUAL(res.target_count, 3u);
+    // B3 от входов не зависит
+    ASSERT_EQUAL(res.cone_size, 3u);
+    for(size_t s = 0; s < scenarios.size(); ++s) {
+        auto expected = sheet.Evaluate({{"A1"_pos, scenarios[s][0]}, {"A2"_pos, scenarios[s][1]}}, {"C1"_pos});
+        if(std::holds_alternative<double>(expected[0])) {
+            ASSERT_EQUAL(res.Get(s, 0), FormulaInterface::Value(std::get<double>(expected[0])));
+        }
+        else {
+            ASSERT_EQUAL(res.Get(s, 0), FormulaInterface::Value(std::get<FormulaError>(expected[0])));
+        }
+        ASSERT_EQUAL(res.Get(s, 1), FormulaInterface::Value(scenarios[s][1]));
+        ASSERT_EQUAL(res.Get(s, 2), FormulaInterface::Value(11.0));
+    }
+    ASSERT_EQUAL(res.Get(5, 0), FormulaInterface::Value(FormulaError(FormulaError::Category::Div0)));
+    ASSERT_EQUAL(res.values[1000 + 7], 2.0);
+
+    ASSERT_EQUAL(sheet.GetVersion(), version);
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(15.0));
+
+    ASSERT(sheet.Sweep({"A1"_pos}, {}, {"C1"_pos}).values.empty());
+    try {
+        sheet.Sweep({"A1"_pos}, {{1.0, 2.0}}, {"C1"_pos});
+        ASSERT(false);
+    } catch(const std::invalid_argument&) {
+    }
+}
+
+void TestEvaluationSchedule() {
+    Sheet sheet;
+    sheet.SetNumber("A1"_pos, 1.0);
+    sheet.SetCell("B1"_pos, "=A1+1");
+    for(int row = 1; row < 100; ++row) {
+        sheet.SetCell({row, 1}, "=B" + std::to_string(row) + "+1");
+    }
+    sheet.SetCell("C1"_pos, "=A2*2");
+
+    auto stats = sheet.Refresh("B100"_pos);
+    ASSERT(stats.rebuilt);
+    ASSERT_EQUAL(stats.schedule_steps, 100u);
+    ASSERT_EQUAL(stats.evaluated_cells, 100u);
+    ASSERT_EQUAL(sheet.GetCell("B100"_pos)->GetValue(), CellInterface::Value(101.0));
+
+    // изменение значений не перестраивает расписание
+    sheet.SetNumber("A1"_pos, 10.0);
+    stats = sheet.Refresh("B100"_pos);
+    ASSERT(!stats.rebuilt);
+    ASSERT_EQUAL(stats.evaluated_cells, 100u);
+    ASSERT_EQUAL(sheet.GetCell("B100"_pos)->GetValue(), CellInterface::Value(110.0));
+    ASSERT_EQUAL(sheet.Refresh("B100"_pos).evaluated_cells, 0u);
+
+    // правки вне конуса расписания его не затрагивают
+    sheet.SetCell("C1"_pos, "=A2*3");
+    sheet.SetNumber("A2"_pos, 1.0);
+    ASSERT(!sheet.Refresh("B100"_pos).rebuilt);
+
+    sheet.SetCell("B50"_pos, "=A1*2");
+    stats = sheet.Refresh("B100"_pos);
+    ASSERT(stats.rebuilt);
+    ASSERT_EQUAL(stats.schedule_steps, 51u);
+    ASSERT_EQUAL(sheet.GetCell("B100"_pos)->GetValue(), CellInterface::Value(70.0));
+
+    sheet.SetCell("A1"_pos, "x");
+    ASSERT(sheet.Refresh("B100"_pos).rebuilt);
+    ASSERT_EQUAL(sheet.GetCell("B100"_pos)->GetValue(), CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+    sheet.ClearCell("A1"_pos);
+    sheet.SetCell("D1"_pos, "=1/A1");
+    sheet.Refresh("A1"_pos, Size{1, 4});
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(FormulaError(FormulaError::Category::Div0)));
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(3.0));
+    ASSERT_EQUAL(sheet.GetCell("B100"_pos)->GetValue(), CellInterface::Value(50.0));
+}
+
+void TestBulkValues() {
+    Sheet sheet;
+    for(int row = 0; row < 600; ++row) {
+        sheet.SetNumber({row, 0}, row);
+        sheet.SetCell({row, 1}, "=A" + std::to_string(row + 1) + "*2");
+    }
+    sheet.SetCell("C1"_pos, "'=text");
+    sheet.SetCell("C2"_pos, "12");
+    sheet.SetCell("C3"_pos, "=1/0");
+
+    const Size size{600, 4};
+    std::vector<double> numbers(600 * 4);
+    std::vector<ValueCache::Tag> tags(600 * 4);
+    std::vector<std::string_view> texts(600 * 4);
+    sheet.GetValues("A1"_pos, size, numbers.data(), tags.data(), texts.data());
+    for(int row = 0; row < 600; ++row) {
+        ASSERT(tags[row * 4] == ValueCache::Tag::Number);
+        ASSERT_EQUAL(numbers[row * 4], row);
+        ASSERT_EQUAL(numbers[row * 4 + 1], 2.0 * row);
+        ASSERT(tags[row * 4 + 3] == ValueCache::Tag::Text);
+        ASSERT(texts[row * 4 + 3].empty());
+    }
+    ASSERT(tags[2] == ValueCache::Tag::Text);
+    ASSERT_EQUAL(texts[2], "=text");
+    ASSERT(tags[4 + 2] == ValueCache::Tag::Text);
+    ASSERT_EQUAL(texts[4 + 2], "12");
+    ASSERT(tags[8 + 2] == ValueCache::Tag::Div0Error);
+    ASSERT(!sheet.GetValueCache().IsDirty("B600"_pos));
+
+    sheet.SetNumber("A10"_pos, 0.5);
+    sheet.GetNumericValues("A1"_pos, size, numbers.data(), tags.data());
+    ASSERT_EQUAL(numbers[9 * 4 + 1], 1.0);
+    ASSERT(tags[2] == ValueCache::Tag::ValueError);
+    ASSERT(tags[4 + 2] == ValueCache::Tag::Number);
+    ASSERT_EQUAL(numbers[4 + 2], 12.0);
+    ASSERT(tags[8 + 2] == ValueCache::Tag::Div0Error);
+    ASSERT(tags[599 * 4 + 3] == ValueCache::Tag::Number);
+    ASSERT_EQUAL(numbers[599 * 4 + 3], 0.0);
+
+    // разовые чтения разных областей не оставляют расписаний
+    for(int row = 0; row < 100; ++row) {
+        sheet.GetValues({row, 0}, Size{500, 2}, numbers.data(), tags.data());
+    }
+    ASSERT_EQUAL(sheet.GetMemoryUsage().schedules, 0u);
+    sheet.Refresh("A1"_pos, Size{600, 2});
+    ASSERT(sheet.GetMemoryUsage().schedules > 0u);
+    sheet.Compact();
+    ASSERT_EQUAL(sheet.GetMemoryUsage().schedules, 0u);
+    ASSERT(sheet.Refresh("A1"_pos, Size{600, 2}).rebuilt);
+
+    try {
+        sheet.GetValues({-1, 0}, size, numbers.data(), tags.data());
+        ASSERT(false);
+    } catch(const InvalidPositionException&) {
+    }
+}
+
+void TestLazyCompilation() {
+    Sheet sheet;
+    sheet.SetCompilation(Sheet::Compilation::Lazy);
+    ASSERT(sheet.GetFormulaCompiler() == nullptr);
+    sheet.SetCell("B1"_pos, "=A1 * 2 + (A1 + C3)");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetReferencedCells(), (std::vector{"A1"_pos, "C3"_pos}));
+    ASSERT_EQUAL(sheet.GetDependents("A1"_pos), std::vector{"B1"_pos});
+    try {
+        sheet.SetCell("C3"_pos, "=B1 + 1");
+        ASSERT(false);
+    } catch(const CircularDependencyException&) {
+    }
+    auto unparsed = sheet.GetMemoryUsage().formula_programs;
+    sheet.SetNumber("A1"_pos, 3.0);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(9.0));
+    ASSERT(sheet.GetMemoryUsage().formula_programs > unparsed);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=A1*2+A1+C3");
+
+    for(const auto& text : {"=1 $ 2", "=ZZZZZ1", "=(1+2", "=1+2)", "=1e"}) {
+        try {
+            sheet.SetCell("D1"_pos, text);
+            ASSERT(false);
+        } catch(const FormulaException&) {
+        }
+    }
+    // остальные ошибки обнаруживаются при разборе
+    sheet.SetCell("D1"_pos, "=1*/A1");
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetText(), "=1*/A1");
+
+    sheet.SetCompilation(Sheet::Compilation::Background);
+    auto* compiler = sheet.GetFormulaCompiler();
+    ASSERT(compiler != nullptr);
+    for(int row = 0; row < 200; ++row) {
+        sheet.SetCell({row, 5}, "=A1+" + std::to_string(row) + "e0");
+    }
+    // учёт памяти во время фонового разбора читает только разобранные формулы
+    for(int row = 0; row < 50; ++row) {
+        sheet.SetCell({row, 6}, "=1*/A" + std::to_string(row + 1));
+        ASSERT(sheet.GetMemoryUsage().formula_ast > 0u);
+    }
+    compiler->Wait();
+    ASSERT_EQUAL(compiler->GetCompiledCount(), 250u);
+    ASSERT(sheet.GetMemoryUsage().formula_programs > 0u);
+    sheet.Recalculate();
+    ASSERT_EQUAL(sheet.GetCell("F200"_pos)->GetValue(), CellInterface::Value(202.0));
+
+    sheet.SetCompilation(Sheet::Compilation::Eager);
+    ASSERT(sheet.GetFormulaCompiler() == nullptr);
+    try {
+        sheet.SetCell("D1"_pos, "=1*/A1");
+        ASSERT(false);
+    } catch(const FormulaException&) {
+    }
+}
+
+void TestCopyAndFill() {
+    Sheet sheet;
+    for(int row = 0; row < 3; ++row) {
+        sheet.SetNumber({row, 0}, row + 1.0);
+    }
+    sheet.SetCell("B1"_pos, "=A1*2");
+    sheet.FillDown("B1"_pos, Size{3, 1});
+    ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetText(), "=A3*2");
+    ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetValue(), CellInterface::Value(6.0));
+    ASSERT_EQUAL(sheet.GetDependents("A2"_pos), std::vector{"B2"_pos});
+
+    sheet.CopyRange("A1"_pos, Size{3, 2}, "C5"_pos);
+    ASSERT_EQUAL(sheet.GetCell("D7"_pos)->GetText(), "=C7*2");
+    ASSERT_EQUAL(sheet.GetCell("D7"_pos)->GetValue(), CellInterface::Value(6.0));
+    sheet.SetNumber("C7"_pos, 10.0);
+    ASSERT_EQUAL(sheet.GetCell("D7"_pos)->GetValue(), CellInterface::Value(20.0));
+
+    // ссылки за пределами таблицы
+    sheet.SetCell("E1"_pos, "=A1+B1");
+    sheet.FillRight("D1"_pos, Size{1, 1});
+    sheet.CopyRange("E1"_pos, Size{1, 1}, "D1"_pos);
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetText(), "=#REF!+A1");
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetReferencedCells(), std::vector{"A1"_pos});
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(FormulaError(FormulaError::Category::Ref)));
+
+    // пересекающиеся области и очистка пустыми позициями
+    sheet.CopyRange("A1"_pos, Size{4, 1}, "A2"_pos);
+    ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetValue(), CellInterface::Value(3.0));
+    ASSERT(sheet.GetCell("B4"_pos) == nullptr);
+    ASSERT(sheet.GetCell("A5"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetValue(), CellInterface::Value(4.0));
+
+    // цикл через существующую формулу: лист не меняется
+    sheet.SetCell("G1"_pos, "=F1+1");
+    sheet.SetCell("F10"_pos, "=G10");
+    auto version = sheet.GetVersion();
+    try {
+        sheet.CopyRange("F10"_pos, Size{1, 1}, "F1"_pos);
+        ASSERT(false);
+    } catch(const CircularDependencyException&) {
+    }
+    ASSERT_EQUAL(sheet.GetVersion(), version);
+    ASSERT(sheet.GetCell("F1"_pos) == nullptr);
+
+    try {
+        sheet.FillDown({16383, 0}, Size{2, 1});
+        ASSERT(false);
+    } catch(const InvalidPositionException&) {
+    }
+
+    Sheet big;
+    big.SetCompilation(Sheet::Compilation::Lazy);
+    big.SetNumber("A1"_pos, 1.0);
+    big.SetCell("A2"_pos, "=A1+1");
+    big.SetCell("B1"_pos, "=A1*2");
+    big.FillDown("A2"_pos, Size{10000, 1});
+    big.FillDown("B1"_pos, Size{10001, 1});
+    ASSERT_EQUAL(big.GetCell("B10001"_pos)->GetValue(), CellInterface::Value(20002.0));
+}
+
+// Заполнение миллиона ячеек цепочками формул во всю высоту листа: каждая
+// ячейка ссылается на ячейку над ней.
+void TestLargeFill() {
+    const int cols = 64;
+    Sheet sheet;
+    for(int col = 0; col < cols; ++col) {
+        sheet.SetNumber({0, col}, col);
+    }
+    sheet.SetCell("A2"_pos, "=A1+1");
+    sheet.FillRight("A2"_pos, Size{1, cols});
+
+    auto start = std::chrono::steady_clock::now();
+    sheet.FillDown("A2"_pos, Size{Position::MAX_ROWS - 1, cols});
+    // вычисление нижней ячейки проходит всю цепочку в 16383 формулы
+    auto value = sheet.GetCell({Position::MAX_ROWS - 1, cols - 1})->GetValue();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    ASSERT_EQUAL(value, CellInterface::Value(cols - 1.0 + Position::MAX_ROWS - 1));
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{Position::MAX_ROWS, cols}));
+#ifdef NDEBUG
+    // без оптимизаций время не показательно
+    ASSERT(elapsed.count() < 3.0);
+#else
+    (void)elapsed;
+#endif
+}
+
+void TestSortRange() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "pear");
+    sheet.SetNumber("B1"_pos, 3.0);
+    sheet.SetCell("A2"_pos, "Apple");
+    sheet.SetNumber("B2"_pos, 1.0);
+    sheet.SetCell("A3"_pos, "banana");
+    sheet.SetCell("B3"_pos, "x");
+    sheet.SetCell("A4"_pos, "kiwi");
+    sheet.SetCell("A5"_pos, "plum");
+    sheet.SetCell("B5"_pos, "=1/0");
+    for(int row = 0; row < 5; ++row) {
+        sheet.SetCell({row, 2}, "=" + Position{row, 1}.ToString() + "*2");
+    }
+    sheet.SetCell("E1"_pos, "=B1");
+    ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), CellInterface::Value(3.0));
+    const Cell* banana = static_cast<const Cell*>(sheet.GetCell("A3"_pos));
+    const Cell* apple = static_cast<const Cell*>(sheet.GetCell("A2"_pos));
+
+    // числа, текст, ошибки, пустые значения
+    auto version = sheet.GetVersion();
+    sheet.SortRange("A1"_pos, Size{5, 3}, {{1}});
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "Apple");
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetText(), "pear");
+    ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetText(), "banana");
+    ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetText(), "plum");
+    ASSERT_EQUAL(sheet.GetCell("A5"_pos)->GetText(), "kiwi");
+    ASSERT(sheet.GetCell("B5"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=B1*2");
+    ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetValue(), CellInterface::Value(6.0));
+    ASSERT_EQUAL(sheet.GetCell("C4"_pos)->GetValue(), CellInterface::Value(FormulaError(FormulaError::Category::Div0)));
+    ASSERT_EQUAL(sheet.GetCell("C5"_pos)->GetValue(), CellInterface::Value(0.0));
+    // ячейки переносятся, а не копируются; ссылки извне области не меняются
+    ASSERT(sheet.GetCell("A1"_pos) == apple);
+    ASSERT(sheet.GetCell("A3"_pos) == banana);
+    ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetText(), "=B1");
+    ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), CellInterface::Value(1.0));
+    ASSERT_EQUAL(sheet.GetDependents("B2"_pos), std::vector{"C2"_pos});
+    auto changed = sheet.GetChangedCells(version);
+    ASSERT(std::find(changed.begin(), changed.end(), "A3"_pos) == changed.end());
+    ASSERT(std::find(changed.begin(), changed.end(), "A4"_pos) != changed.end());
+
+    // порядок уже правильный: лист не меняется
+    version = sheet.GetVersion();
+    sheet.SortRange("A1"_pos, Size{5, 3}, {{1}});
+    ASSERT_EQUAL(sheet.GetVersion(), version);
+
+    // несколько ключей, регистр не учитывается, равные строки не меняются местами
+    Sheet keys;
+    const std::vector<std::string> names{"b", "A", "a", "B"};
+    for(int row = 0; row < 4; ++row) {
+        keys.SetCell({row, 0}, names[row]);
+        keys.SetNumber({row, 1}, row + 1.0);
+    }
+    auto column_b = [&keys] {
+        std::vector<double> res(4);
+        std::vector<ValueCache::Tag> tags(4);
+        keys.GetValues("B1"_pos, Size{4, 1}, res.data(), tags.data());
+        return res;
+    };
+    keys.SortRange("A1"_pos, Size{4, 2}, {{0}});
+    ASSERT_EQUAL(column_b(), (std::vector{2.0, 3.0, 1.0, 4.0}));
+    keys.SortRange("A1"_pos, Size{4, 2}, {{0, Sheet::SortOrder::Descending}, {1, Sheet::SortOrder::Descending}});
+    ASSERT_EQUAL(column_b(), (std::vector{4.0, 1.0, 3.0, 2.0}));
+
+    try {
+        keys.SortRange("A1"_pos, Size{4, 2}, {{2}});
+        ASSERT(false);
+    } catch(const InvalidPositionException&) {
+    }
+
+    // сдвинутые формулы ссылаются друг на друга: лист не меняется
+    Sheet cycle;
+    cycle.SetNumber("A1"_pos, 1.0);
+    cycle.SetNumber("A2"_pos, 3.0);
+    cycle.SetNumber("A3"_pos, 4.0);
+    cycle.SetNumber("A4"_pos, 2.0);
+    cycle.SetCell("B1"_pos, "=B2");
+    cycle.SetNumber("B2"_pos, 10.0);
+    cycle.SetNumber("B3"_pos, 20.0);
+    cycle.SetCell("B4"_pos, "=B3");
+    version = cycle.GetVersion();
+    try {
+        cycle.SortRange("A1"_pos, Size{4, 2}, {{0}});
+        ASSERT(false);
+    } catch(const CircularDependencyException&) {
+    }
+    ASSERT_EQUAL(cycle.GetVersion(), version);
+    ASSERT_EQUAL(cycle.GetCell("B4"_pos)->GetText(), "=B3");
+    ASSERT_EQUAL(cycle.GetCell("B4"_pos)->GetValue(), CellInterface::Value(20.0));
+}
+
+
+void TestLookupFunctions() {
+    Sheet sheet;
+    const std::vector<std::string> names{"pear", "Apple", "kiwi", "plum"};
+    for(int row = 0; row < 4; ++row) {
+        sheet.SetNumber({row, 0}, (row + 1) * 10.0);
+        sheet.SetCell({row, 1}, names[row]);
+        sheet.SetNumber({row, 2}, row + 1.0);
+    }
+    auto value = [&sheet] (std::string_view pos) {
+        return sheet.GetCell(Position::FromString(pos))->GetValue();
+    };
+    const CellInterface::Value not_found = FormulaError(FormulaError::Category::NA);
+
+    // точный и приблизительный поиск в первом столбце таблицы
+    sheet.SetCell("E1"_pos, "=VLOOKUP(30,A1:C4,2,0)");
+    sheet.SetCell("E2"_pos, "=VLOOKUP(25,A1:C4,3)");
+    sheet.SetCell("E3"_pos, "=VLOOKUP(25,A1:C4,3,0)");
+    sheet.SetCell("E4"_pos, "=VLOOKUP(5,A1:C4,3)");
+    sheet.SetCell("E5"_pos, "=VLOOKUP(10,A1:C4,4)");
+    ASSERT_EQUAL(value("E1"), CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+    ASSERT_EQUAL(value("E2"), CellInterface::Value(2.0));
+    ASSERT_EQUAL(value("E3"), not_found);
+    ASSERT_EQUAL(value("E4"), not_found);
+    ASSERT_EQUAL(value("E5"), CellInterface::Value(FormulaError(FormulaError::Category::Ref)));
+    ASSERT_EQUAL(sheet.GetCell("E2"_pos)->GetText(), "=VLOOKUP(25,A1:C4,3)");
+    ASSERT_EQUAL(static_cast<const Cell*>(sheet.GetCell("E2"_pos))->GetReferencedRanges(),
+                 std::vector{Range::FromString("A1:C4")});
+    std::ostringstream values;
+    values << std::get<FormulaError>(value("E3"));
+    ASSERT_EQUAL(values.str(), "#N/A");
+
+    // текст ищется без учёта регистра, искомое значение может быть ссылкой
+    sheet.SetCell("F1"_pos, "APPLE");
+    sheet.SetCell("E6"_pos, "=MATCH(F1,B1:B4,0)");
+    sheet.SetCell("E7"_pos, "=XLOOKUP(F1,B1:B4,A1:A4)");
+    sheet.SetCell("E8"_pos, "=XLOOKUP(F2,B1:B4,A1:A4,-1)");
+    sheet.SetCell("E9"_pos, "=MATCH(35,A1:A4)");
+    sheet.SetCell("E10"_pos, "=MATCH(35,A1:B2)");
+    sheet.SetCell("E11"_pos, "=XLOOKUP(1,C1:C4,A1:A3)");
+    ASSERT_EQUAL(value("E6"), CellInterface::Value(2.0));
+    ASSERT_EQUAL(value("E7"), CellInterface::Value(20.0));
+    ASSERT_EQUAL(value("E8"), CellInterface::Value(-1.0));
+    ASSERT_EQUAL(value("E9"), CellInterface::Value(3.0));
+    ASSERT_EQUAL(value("E10"), not_found);
+    ASSERT_EQUAL(value("E11"), CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+
+    // правка ячейки диапазона пересчитывает зависящие от него формулы
+    sheet.SetCell("F2"_pos, "kiwi");
+    ASSERT_EQUAL(value("E8"), CellInterface::Value(30.0));
+    sheet.SetCell("B3"_pos, "fig");
+    ASSERT_EQUAL(value("E8"), CellInterface::Value(-1.0));
+    sheet.SetNumber("F2"_pos, 40.0);
+    sheet.SetCell("B4"_pos, "=C2*20");
+    ASSERT_EQUAL(value("E8"), CellInterface::Value(40.0));
+    sheet.ClearCell("B4"_pos);
+    ASSERT_EQUAL(value("E8"), CellInterface::Value(-1.0));
+    sheet.SetNumbers({{"A2"_pos, 15.0}, {"A3"_pos, 36.0}});
+    ASSERT_EQUAL(value("E9"), CellInterface::Value(2.0));
+    ASSERT_EQUAL(value("E7"), CellInterface::Value(15.0));
+    auto dependents = sheet.GetDependents("A3"_pos, 1);
+    ASSERT(std::find(dependents.begin(), dependents.end(), "E9"_pos) != dependents.end());
+
+    // цикл через диапазон
+    try {
+        sheet.SetCell("B2"_pos, "=MATCH(1,C1:E4,0)");
+        ASSERT(false);
+    } catch(const CircularDependencyException&) {
+    }
+    try {
+        sheet.SetCell("A5"_pos, "=VLOOKUP(1,A1:A9,1)");
+        ASSERT(false);
+    } catch(const CircularDependencyException&) {
+    }
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetText(), "Apple");
+
+    // диапазон вне функции и неизвестная функция
+    try_formula(&sheet, "=A1:B2");
+    try_formula(&sheet, "=A1:B2+1");
+    try_formula(&sheet, "=SUM(A1:B2)");
+    try_formula(&sheet, "=MATCH(1)");
+    try_formula(&sheet, "=MATCH(A1:A2,B1:B2)");
+
+    // ленивая формула находит диапазоны без разбора
+    Sheet lazy;
+    lazy.SetCompilation(Sheet::Compilation::Lazy);
+    lazy.SetCell("A1"_pos, "=MATCH(C1, B1:B3, 0)");
+    const Cell* match = static_cast<const Cell*>(lazy.GetCell("A1"_pos));
+    ASSERT_EQUAL(match->GetReferencedCells(), std::vector{"C1"_pos});
+    ASSERT_EQUAL(match->GetReferencedRanges(), std::vector{Range::FromString("B1:B3")});
+    lazy.SetCell("B2"_pos, "x");
+    lazy.SetCell("C1"_pos, "X");
+    ASSERT_EQUAL(match->GetValue(), CellInterface::Value(2.0));
+
+    // копия формулы сдвигает диапазон
+    Sheet table;
+    for(int row = 0; row < 1000; ++row) {
+        table.SetNumber({row, 0}, row * 2.0);
+        table.SetNumber({row, 1}, row * 4.0);
+    }
+    table.SetCell("C1"_pos, "=VLOOKUP(A1,A1:B1000,2,0)");
+    table.FillDown("C1"_pos, Size{500, 1});
+    ASSERT_EQUAL(table.GetCell("C500"_pos)->GetText(), "=VLOOKUP(A500,A500:B1499,2,0)");
+    ASSERT_EQUAL(table.GetCell("C500"_pos)->GetValue(), CellInterface::Value(1996.0));
+    // сдвинутые копии ищут по одному индексу столбца A, каждая в своей части
+    size_t one_index = table.GetMemoryUsage().lookup_indexes;
+    ASSERT(one_index > 0u);
+    for(int row = 0; row < 500; ++row) {
+        ASSERT_EQUAL(table.GetCell({row, 2})->GetValue(), CellInterface::Value(row * 4.0));
+    }
+    ASSERT(table.GetMemoryUsage().lookup_indexes < 3u * one_index);
+    table.SetCell("E1"_pos, "=MATCH(0,A2:A1000,0)");
+    ASSERT_EQUAL(table.GetCell("E1"_pos)->GetValue(), not_found);
+    table.SetCell("E2"_pos, "=MATCH(1998,A2:A1000,0)");
+    ASSERT_EQUAL(table.GetCell("E2"_pos)->GetValue(), CellInterface::Value(999.0));
+    table.ClearCell("E1"_pos);
+    table.ClearCell("E2"_pos);
+    table.SetCell("D1"_pos, "=MATCH(1998,A1:A1000,0)");
+    table.SetCell("D2"_pos, "=MATCH(1000,A1:A1000)");
+    ASSERT_EQUAL(table.GetCell("D1"_pos)->GetValue(), CellInterface::Value(1000.0));
+    ASSERT_EQUAL(table.GetCell("D2"_pos)->GetValue(), CellInterface::Value(501.0));
+    ASSERT(table.GetMemoryUsage().lookup_indexes > 0u);
+    table.SetNumber("A1000"_pos, 5.0);
+    ASSERT_EQUAL(table.GetCell("D1"_pos)->GetValue(), not_found);
+    table.ClearCell("D1"_pos);
+    table.ClearCell("D2"_pos);
+    table.Compact();
+    ASSERT_EQUAL(table.GetMemoryUsage().lookup_indexes, 0u);
+}
+
+void TestConditionalFunctions() {
+    Sheet sheet;
+    auto value = [&sheet] (std::string_view pos) {
+        return sheet.GetCell(Position::FromString(pos))->GetValue();
+    };
+    auto text = [&sheet] (std::string_view pos) {
+        return sheet.GetCell(Position::FromString(pos))->GetText();
+    };
+    const CellInterface::Value div0 = FormulaError(FormulaError::Category::Div0);
+    sheet.SetNumber("A1"_pos, 1.0);
+    sheet.SetNumber("B1"_pos, 2.0);
+    sheet.SetNumber("C1"_pos, 3.0);
+
+    // сравнения дают 1 или 0 и связывают слабее арифметики
+    sheet.SetCell("D1"_pos, "=A1<B1");
+    sheet.SetCell("D2"_pos, "=(A1<B1)+1");
+    sheet.SetCell("D3"_pos, "=A1<(B1<C1)");
+    sheet.SetCell("D4"_pos, "=((A1<B1))<C1");
+    sheet.SetCell("D5"_pos, "=A1+1<>B1*1");
+    sheet.SetCell("D6"_pos, "=C1>=B1+1");
+    sheet.SetCell("D7"_pos, "=1/0=A1");
+    ASSERT_EQUAL(value("D1"), CellInterface::Value(1.0));
+    ASSERT_EQUAL(value("D2"), CellInterface::Value(2.0));
+    ASSERT_EQUAL(value("D3"), CellInterface::Value(0.0));
+    ASSERT_EQUAL(value("D4"), CellInterface::Value(1.0));
+    ASSERT_EQUAL(value("D5"), CellInterface::Value(0.0));
+    ASSERT_EQUAL(value("D6"), CellInterface::Value(1.0));
+    ASSERT_EQUAL(value("D7"), div0);
+    ASSERT_EQUAL(text("D2"), "=(A1<B1)+1");
+    ASSERT_EQUAL(text("D3"), "=A1<(B1<C1)");
+    ASSERT_EQUAL(text("D4"), "=A1<B1<C1");
+    ASSERT_EQUAL(text("D5"), "=A1+1<>B1*1");
+
+    // невыбранные ветви не вычисляются
+    sheet.SetCell("E1"_pos, "=IF(A1>B1,10,20)");
+    sheet.SetCell("E2"_pos, "=IF(A1,2,1/0)");
+    sheet.SetCell("E3"_pos, "=IF(A1-1,2)");
+    sheet.SetCell("E4"_pos, "=AND(A1,B1>C1,1/0)");
+    sheet.SetCell("E5"_pos, "=OR(A1-1,C1)");
+    sheet.SetCell("E6"_pos, "=CHOOSE(B1,1/0,C1*2,A1)");
+    sheet.SetCell("E7"_pos, "=CHOOSE(C1+1,1,2,3)");
+    sheet.SetCell("E8"_pos, "=IF(1/0,1,2)");
+    sheet.SetCell("E9"_pos, "=OR(0,0)+AND(1)");
+    ASSERT_EQUAL(value("E1"), CellInterface::Value(20.0));
+    ASSERT_EQUAL(value("E2"), CellInterface::Value(2.0));
+    ASSERT_EQUAL(value("E3"), CellInterface::Value(0.0));
+    ASSERT_EQUAL(value("E4"), CellInterface::Value(0.0));
+    ASSERT_EQUAL(value("E5"), CellInterface::Value(1.0));
+    ASSERT_EQUAL(value("E6"), CellInterface::Value(6.0));
+    ASSERT_EQUAL(value("E7"), CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+    ASSERT_EQUAL(value("E8"), div0);
+    ASSERT_EQUAL(value("E9"), CellInterface::Value(1.0));
+    ASSERT_EQUAL(text("E6"), "=CHOOSE(B1,1/0,C1*2,A1)");
+    try_formula(&sheet, "=IF(1)");
+    try_formula(&sheet, "=IF(1,2,3,4)");
+    try_formula(&sheet, "=AND()");
+    try_formula(&sheet, "=CHOOSE(1)");
+    try_formula(&sheet, "=IF(A1:A2,1)");
+    try_formula(&sheet, "=NOT(1)");
+
+    // ячейки, которые читаются только в ветвях
+    sheet.SetCell("F1"_pos, "=IF(A1>5,G1+G2,G3)+G2");
+    const Cell* branchy = static_cast<const Cell*>(sheet.GetCell("F1"_pos));
+    ASSERT_EQUAL(branchy->GetFormula()->GetBranchCells(), (std::vector{"G1"_pos, "G3"_pos}));
+    sheet.SetNumber("G2"_pos, 1.0);
+    sheet.SetNumber("G3"_pos, 2.0);
+    ASSERT_EQUAL(value("F1"), CellInterface::Value(3.0));
+
+    // правка ячейки невыбранной ветви не сбрасывает значение формулы
+    auto version = sheet.GetVersion();
+    sheet.SetNumber("G1"_pos, 100.0);
+    ASSERT(!branchy->IsModified());
+    ASSERT_EQUAL(sheet.GetChangedCells(version), std::vector{"G1"_pos});
+    ASSERT_EQUAL(value("F1"), CellInterface::Value(3.0));
+    sheet.SetNumber("G3"_pos, 4.0);
+    ASSERT(branchy->IsModified());
+    ASSERT_EQUAL(value("F1"), CellInterface::Value(5.0));
+
+    // после смены условия ветвь становится выбранной
+    sheet.SetNumber("A1"_pos, 10.0);
+    ASSERT_EQUAL(value("F1"), CellInterface::Value(102.0));
+    sheet.SetNumber("G1"_pos, 200.0);
+    ASSERT_EQUAL(value("F1"), CellInterface::Value(202.0));
+    version = sheet.GetVersion();
+    sheet.SetNumber("G3"_pos, 8.0);
+    ASSERT(!branchy->IsModified());
+    ASSERT_EQUAL(sheet.GetChangedCells(version), std::vector{"G3"_pos});
+
+    // формула за невыбранной ветвью тоже не пересчитывается
+    sheet.SetCell("H1"_pos, "=F1*2");
+    ASSERT_EQUAL(value("H1"), CellInterface::Value(404.0));
+    sheet.SetNumber("G3"_pos, 9.0);
+    ASSERT(!static_cast<const Cell*>(sheet.GetCell("H1"_pos))->IsModified());
+    sheet.SetNumber("G2"_pos, 2.0);
+    ASSERT_EQUAL(value("H1"), CellInterface::Value(408.0));
+
+    // сравнения вычисляются пакетом
+    Sheet table;
+    for(int row = 0; row < 1000; ++row) {
+        table.SetNumber({row, 0}, row % 7);
+        table.SetNumber({row, 1}, 3.0);
+        table.SetCell({row, 2}, "=A" + std::to_string(row + 1) + ">=B" + std::to_string(row + 1));
+    }
+    auto stats = table.Recalculate();
+    ASSERT_EQUAL(stats.batched_cells, 1000u);
+    ASSERT_EQUAL(table.GetCell("C3"_pos)->GetValue(), CellInterface::Value(0.0));
+    ASSERT_EQUAL(table.GetCell("C4"_pos)->GetValue(), CellInterface::Value(1.0));
+    ASSERT_EQUAL(table.GetCell("C8"_pos)->GetValue(), CellInterface::Value(0.0));
+
+    // ленивая формула: ветви известны после разбора
+    Sheet lazy;
+    lazy.SetCompilation(Sheet::Compilation::Lazy);
+    lazy.SetCell("A1"_pos, "=IF(B1<>0,C1/B1,D1)");
+    const Cell* lazy_if = static_cast<const Cell*>(lazy.GetCell("A1"_pos));
+    ASSERT_EQUAL(lazy_if->GetReferencedCells(), (std::vector{"B1"_pos, "C1"_pos, "D1"_pos}));
+    ASSERT_EQUAL(lazy_if->GetValue(), CellInterface::Value(0.0));
+    ASSERT_EQUAL(lazy_if->GetFormula()->GetBranchCells(), (std::vector{"C1"_pos, "D1"_pos}));
+    lazy.SetNumber("B1"_pos, 4.0);
+    lazy.SetNumber("C1"_pos, 2.0);
+    ASSERT_EQUAL(lazy_if->GetValue(), CellInterface::Value(0.5));
+    lazy.SetNumber("D1"_pos, 7.0);
+    ASSERT(!lazy_if->IsModified());
+}
+
+// сервер и клиент используют сокеты POSIX и в сборку под Windows не входят
+#ifndef _WIN32
+void TestSheetServer() {
+    using sheet_protocol::Status;
+    // кодирование команд и разбор повреждённых данных
+    std::string data;
+    sheet_protocol::Encoder encoder(data);
+    sheet_protocol::Command command;
+    command.op = sheet_protocol::Op::SetNumber;
+    command.sheet = 300;
+    command.pos = "XFD16384"_pos;
+    command.number = -0.125;
+    encoder.PutCommand(command);
+    sheet_protocol::Decoder decoder(data);
+    auto decoded = decoder.GetCommand();
+    ASSERT(decoder.AtEnd());
+    ASSERT(decoded.op == command.op);
+    ASSERT_EQUAL(decoded.sheet, 300u);
+    ASSERT_EQUAL(decoded.pos, "XFD16384"_pos);
+    ASSERT_EQUAL(decoded.number, -0.125);
+    for(std::string_view bad : {std::string_view(data).substr(0, data.size() - 1), std::string_view("\x20")}) {
+        try {
+            sheet_protocol::Decoder(bad).GetCommand();
+            ASSERT(false);
+        } catch(const sheet_protocol::ProtocolError&) {
+        }
+    }
+
+    const std::string path = "/tmp/spreadsheet_test_"
+        + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()) + ".sock";
+    // обычный файл по пути сокета сервер не удаляет
+    std::ofstream(path) << "data";
+    try {
+        SheetServer taken(SheetServer::Options{path});
+        ASSERT(false);
+    } catch(const std::system_error& e) {
+        ASSERT_EQUAL(e.code().value(), EADDRINUSE);
+    }
+    std::string content;
+    std::ifstream(path) >> content;
+    ASSERT_EQUAL(content, "data");
+    std::remove(path.c_str());
+
+    auto server = std::make_unique<SheetServer>(SheetServer::Options{path});
+    ASSERT_EQUAL(server->GetPort(), 0u);
+    auto client = SheetClient::ConnectUnix(path);
+    auto prices = client.OpenSheet("Prices");
+    ASSERT_EQUAL(client.OpenSheet("Prices"), prices);
+
+    // пакет выполняется по порядку, ошибка команды не прерывает его
+    SheetClient::Batch batch;
+    batch.SetCell(prices, "A1"_pos, "=B1*2")
+        .SetNumber(prices, "B1"_pos, 21.0)
+        .GetValue(prices, "A1"_pos)
+        .GetText(prices, "A1"_pos)
+        .SetCell(prices, "B1"_pos, "=A1")
+        .SetCell(prices, "C1"_pos, "=1+")
+        .GetValue(7, "A1"_pos)
+        .SetCell(prices, "A2"_pos, "text")
+        .GetRange(prices, "A1"_pos, {2, 3})
+        .PrintTexts(prices);
+    auto results = client.Execute(batch);
+    ASSERT_EQUAL(results.size(), 10u);
+    ASSERT_EQUAL(results[2].values, std::vector<CellInterface::Value>{42.0});
+    ASSERT_EQUAL(results[3].text, "=B1*2");
+    ASSERT(results[4].status == Status::CircularDependency);
+    ASSERT(results[5].status == Status::InvalidFormula);
+    ASSERT(results[6].status == Status::UnknownSheet);
+    ASSERT_EQUAL(results[8].values, (std::vector<CellInterface::Value>{42.0, 21.0, "", "text", "", ""}));
+    Sheet local;
+    local.SetCell("A1"_pos, "=B1*2");
+    local.SetNumber("B1"_pos, 21.0);
+    local.SetCell("A2"_pos, "text");
+    std::ostringstream texts;
+    local.PrintTexts(texts);
+    ASSERT_EQUAL(results[9].text, texts.str());
+
+    // методы для одной команды бросают исключения таблицы
+    try {
+        client.SetCell(prices, "B1"_pos, "=A1");
+        ASSERT(false);
+    } catch(const CircularDependencyException&) {
+    }
+    try {
+        client.GetRange(prices, "A1"_pos, {16385, 1});
+        ASSERT(false);
+    } catch(const InvalidPositionException&) {
+    }
+    try {
+        client.OpenSheet("1st");
+        ASSERT(false);
+    } catch(const std::runtime_error&) {
+    }
+    ASSERT_EQUAL(client.GetValue(prices, "A3"_pos), CellInterface::Value(""));
+
+    // конвейер: ответы приходят в порядке отправки
+    for(int i = 1; i <= 3; ++i) {
+        SheetClient::Batch step;
+        step.SetNumber(prices, "B1"_pos, i).GetValue(prices, "A1"_pos);
+        client.Send(step);
+    }
+    ASSERT_EQUAL(client.GetPendingCount(), 3u);
+    for(int i = 1; i <= 3; ++i) {
+        ASSERT_EQUAL(client.Receive()[1].values[0], CellInterface::Value(i * 2.0));
+    }
+
+    // клиенты разных потоков работают с одной книгой, подряд идущие числа
+    // записываются вместе
+    constexpr int WRITERS = 4;
+    constexpr int ROWS = 200;
+    std::vector<std::thread> writers;
+    for(int col = 0; col < WRITERS; ++col) {
+        writers.emplace_back([&path, col] {
+            auto writer = SheetClient::ConnectUnix(path);
+            auto sheet = writer.OpenSheet("Quotes");
+            SheetClient::Batch batch;
+            for(int row = 0; row < ROWS; ++row) {
+                batch.SetNumber(sheet, {row, col}, row * 10.0 + col);
+                if(batch.GetSize() == 50u) {
+                    writer.Send(batch);
+                    batch.Clear();
+                }
+            }
+            while(writer.GetPendingCount() > 0u) {
+                writer.Receive();
+            }
+        });
+    }
+    for(auto& writer : writers) {
+        writer.join();
+    }
+    auto quotes = client.OpenSheet("Quotes");
+    client.SetCell(prices, "D1"_pos, "=Quotes!D200-Quotes!A1");
+    ASSERT_EQUAL(client.GetValue(prices, "D1"_pos), CellInterface::Value(1993.0));
+    auto values = client.GetRange(quotes, "A1"_pos, {ROWS, WRITERS});
+    ASSERT_EQUAL(values.size(), static_cast<size_t>(ROWS * WRITERS));
+    ASSERT_EQUAL(values[5 * WRITERS + 2], CellInterface::Value(52.0));
+    auto stats = server->GetStats();
+    ASSERT_EQUAL(stats.accepted_connections, 1u + WRITERS);
+    ASSERT(stats.groups <= stats.frames);
+    ASSERT(stats.coalesced_numbers >= static_cast<size_t>(WRITERS * (ROWS - ROWS / 50)));
+    ASSERT_EQUAL(stats.protocol_errors, 0u);
+
+    // TCP на 127.0.0.1
+    SheetServer tcp_server({"", 0});
+    ASSERT(tcp_server.GetPort() != 0u);
+    auto tcp_client = SheetClient::ConnectTcp(tcp_server.GetPort());
+    auto sheet = tcp_client.OpenSheet("Sheet1");
+    tcp_client.SetCell(sheet, "A1"_pos, "=IF(B1,1/B1,0)");
+    tcp_client.SetNumber(sheet, "B1"_pos, 4.0);
+    ASSERT_EQUAL(tcp_client.GetValue(sheet, "A1"_pos), CellInterface::Value(0.25));
+    ASSERT_EQUAL(tcp_client.PrintValues(sheet), "0.25\t4\n");
+
+    // остановка сервера закрывает соединения
+    server.reset();
+    try {
+        client.GetValue(prices, "A1"_pos);
+        ASSERT(false);
+    } catch(const std::runtime_error&) {
+    }
+}
+#endif
 }  // namespace
 
 int main() {
@@ -472,5 +2096,35 @@ int main() {
     RUN_TEST(tr, TestDiv0);
     RUN_TEST(tr, TestPrint_02);
     RUN_TEST(tr, Test_01);
+    RUN_TEST(tr, TestTextInterning);
+    RUN_TEST(tr, TestReferenceToEmptyCell);
+    RUN_TEST(tr, TestCacheInvalidation);
+    RUN_TEST(tr, TestPositionMap);
+    RUN_TEST(tr, TestRangeIndex);
+    RUN_TEST(tr, TestConstantFolding);
+    RUN_TEST(tr, TestColumnBatchEvaluation);
+    RUN_TEST(tr, TestWorkbook);
+    RUN_TEST(tr, TestChangeTracking);
+    RUN_TEST(tr, TestSubscriptions);
+    RUN_TEST(tr, TestMemoryUsage);
+    RUN_TEST(tr, TestFormulaCache);
+    RUN_TEST(tr, TestAsyncRecalculation);
+    RUN_TEST(tr, TestDependencyQueries);
+    RUN_TEST(tr, TestTraceRecording);
+    RUN_TEST(tr, TestValueCache);
+    RUN_TEST(tr, TestNumericInput);
+    RUN_TEST(tr, TestWhatIfEvaluation);
+    RUN_TEST(tr, TestParameterSweep);
+    RUN_TEST(tr, TestEvaluationSchedule);
+    RUN_TEST(tr, TestBulkValues);
+    RUN_TEST(tr, TestLazyCompilation);
+    RUN_TEST(tr, TestCopyAndFill);
+    RUN_TEST(tr, TestLargeFill);
+    RUN_TEST(tr, TestSortRange);
+    RUN_TEST(tr, TestLookupFunctions);
+    RUN_TEST(tr, TestConditionalFunctions);
+#ifndef _WIN32
+    RUN_TEST(tr, TestSheetServer);
+#endif
     return 0;
 }
@@ -0,0 +1,452 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+// Упаковывает корректную позицию в 32-битный ключ: row << 14 | col.
+// Оба индекса меньше 16384 = 2^14, поэтому ключ занимает 28 бит.
+inline uint32_t PackPosition(Position pos) {
+    return static_cast<uint32_t>(pos.row) << 14u | static_cast<uint32_t>(pos.col);
+}
+
+inline Position UnpackPosition(uint32_t key) {
+    return {static_cast<int>(key >> 14u), static_cast<int>(key & 0x3FFFu)};
+}
+
+// Перемешивание ключа (финализатор splitmix64): соседние строки, столбцы и
+// симметричные пары позиций попадают в разные корзины.
+inline size_t MixPositionKey(uint32_t key) {
+    uint64_t x = key;
+    x ^= x >> 30u;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27u;
+    x *= 0x94d049bb133111ebull;
+    x ^= x >> 31u;
+    return static_cast<size_t>(x);
+}
+
+struct PositionHasher {
+    size_t operator()(Position pos) const {
+        return MixPositionKey(PackPosition(pos));
+    }
+};
+
+// Хеш-таблица с открытой адресацией и линейным пробированием, ключом которой
+// служит упакованная позиция. Элементы лежат в одном непрерывном массиве, без
+// отдельного узла на каждую запись; удаление сдвигает следующие элементы
+// цепочки назад, поэтому "надгробий" не остаётся.
+// Вставка (при перестройке таблицы) и удаление (сдвигом следующих элементов
+// назад, см. MoveSlot) перемещают элементы: после любой из них ссылки и
+// итераторы недействительны.
+template <typename T>
+class PositionMap {
+public:
+    using value_type = std::pair<const Position, T>;
+
+private:
+    static constexpr uint32_t EMPTY_KEY = ~uint32_t{0};
+    static constexpr size_t MIN_CAPACITY = 16u;
+    static constexpr uint32_t GROUP_SIZE = 8u;
+
+    struct Slot {
+        alignas(value_type) unsigned char storage[sizeof(value_type)];
+
+        value_type& Value() {
+            return *std::launder(reinterpret_cast<value_type*>(storage));
+        }
+        const value_type& Value() const {
+            return *std::launder(reinterpret_cast<const value_type*>(storage));
+        }
+    };
+
+    template <typename Map, typename Ref>
+    class Iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = PositionMap::value_type;
+        using difference_type = std::ptrdiff_t;
+        using reference = Ref&;
+        using pointer = Ref*;
+
+        Iterator() = default;
+        Iterator(Map* map, size_t index)
+            : map_(map)
+            , index_(index) {
+            SkipEmpty();
+        }
+        // iterator -> const_iterator
+        template <typename OtherMap, typename OtherRef>
+        Iterator(const Iterator<OtherMap, OtherRef>& other)
+            : map_(other.map_)
+            , index_(other.index_) {}
+
+        reference operator*() const {
+            return map_->slots_[index_].Value();
+        }
+        pointer operator->() const {
+            return &map_->slots_[index_].Value();
+        }
+        Iterator& operator++() {
+            ++index_;
+            SkipEmpty();
+            return *this;
+        }
+        Iterator operator++(int) {
+            auto copy = *this;
+            ++*this;
+            return copy;
+        }
+        bool operator==(const Iterator& rhs) const {
+            return index_ == rhs.index_;
+        }
+        bool operator!=(const Iterator& rhs) const {
+            return index_ != rhs.index_;
+        }
+
+    private:
+        template <typename, typename>
+        friend class Iterator;
+        friend class PositionMap;
+
+        void SkipEmpty() {
+            while(index_ < map_->capacity_ && map_->keys_[index_] == EMPTY_KEY) {
+                ++index_;
+            }
+        }
+
+        Map* map_ = nullptr;
+        size_t index_ = 0;
+    };
+
+public:
+    using iterator = Iterator<PositionMap, value_type>;
+    using const_iterator = Iterator<const PositionMap, const value_type>;
+
+    PositionMap() = default;
+
+    PositionMap(PositionMap&& other) noexcept
+        : keys_(std::move(other.keys_))
+        , slots_(std::move(other.slots_))
+        , capacity_(std::exchange(other.capacity_, 0u))
+        , size_(std::exchange(other.size_, 0u)) {}
+
+    PositionMap& operator=(PositionMap&& other) noexcept {
+        if(this != &other) {
+            clear();
+            keys_ = std::move(other.keys_);
+            slots_ = std::move(other.slots_);
+            capacity_ = std::exchange(other.capacity_, 0u);
+            size_ = std::exchange(other.size_, 0u);
+        }
+        return *this;
+    }
+
+    PositionMap(const PositionMap&) = delete;
+    PositionMap& operator=(const PositionMap&) = delete;
+
+    ~PositionMap() {
+        clear();
+    }
+
+    iterator begin() {
+        return {this, 0u};
+    }
+    iterator end() {
+        return {this, capacity_};
+    }
+    const_iterator begin() const {
+        return {this, 0u};
+    }
+    const_iterator end() const {
+        return {this, capacity_};
+    }
+
+    size_t size() const {
+        return size_;
+    }
+    bool empty() const {
+        return size_ == 0u;
+    }
+    size_t bucket_count() const {
+        return capacity_;
+    }
+
+    iterator find(Position pos) {
+        return {this, FindIndex(pos)};
+    }
+    const_iterator find(Position pos) const {
+        return {this, FindIndex(pos)};
+    }
+    size_t count(Position pos) const {
+        return FindIndex(pos) != capacity_ ? 1u : 0u;
+    }
+
+    T& operator[](Position pos) {
+        return try_emplace(pos).first->second;
+    }
+
+    template <typename... Args>
+    std::pair<iterator, bool> try_emplace(Position pos, Args&&... args) {
+        auto index = FindIndex(pos);
+        if(index != capacity_) {
+            return {iterator{this, index}, false};
+        }
+        if((size_ + 1u) * 4u > capacity_ * 3u) {
+            Rehash(capacity_ ? capacity_ * 2u : MIN_CAPACITY);
+        }
+        uint32_t key = PackPosition(pos);
+        index = HomeIndex(key);
+        while(keys_[index] != EMPTY_KEY) {
+            index = (index + 1u) & (capacity_ - 1u);
+        }
+        new (slots_[index].storage) value_type(std::piecewise_construct,
+                                               std::forward_as_tuple(pos),
+                                               std::forward_as_tuple(std::forward<Args>(args)...));
+        keys_[index] = key;
+        ++size_;
+        return {iterator{this, index}, true};
+    }
+
+    size_t erase(Position pos) {
+        auto index = FindIndex(pos);
+        if(index == capacity_) {
+            return 0u;
+        }
+        EraseIndex(index);
+        return 1u;
+    }
+
+    void erase(const_iterator iter) {
+        EraseIndex(iter.index_);
+    }
+
+    void clear() {
+        for(size_t i = 0; i < capacity_; ++i) {
+            if(keys_[i] != EMPTY_KEY) {
+                slots_[i].Value().~value_type();
+                keys_[i] = EMPTY_KEY;
+            }
+        }
+        size_ = 0u;
+    }
+
+    void reserve(size_t count) {
+        size_t capacity = MIN_CAPACITY;
+        while(count * 4u > capacity * 3u) {
+            capacity *= 2u;
+        }
+        if(capacity > capacity_) {
+            Rehash(capacity);
+        }
+    }
+
+    // Уменьшает таблицу до минимального размера, достаточного для текущих элементов
+    void shrink_to_fit() {
+        size_t capacity = MIN_CAPACITY;
+        while(size_ * 4u > capacity * 3u) {
+            capacity *= 2u;
+        }
+        if(size_ == 0u) {
+            keys_.reset();
+            slots_.reset();
+            capacity_ = 0u;
+        }
+        else if(capacity < capacity_) {
+            Rehash(capacity);
+        }
+    }
+
+    // Объём памяти, занимаемый массивами таблицы
+    size_t allocated_bytes() const {
+        return capacity_ * (sizeof(uint32_t) + sizeof(Slot));
+    }
+
+private:
+    // Соседние столбцы одной строки группами по GROUP_SIZE попадают в
+    // соседние корзины: построчный обход листа читает ключи подряд, а не
+    // промахивается мимо кэша на каждой ячейке. Группы по-прежнему
+    // перемешиваются между собой.
+    size_t HomeIndex(uint32_t key) const {
+        size_t group = MixPositionKey(key / GROUP_SIZE) * GROUP_SIZE;
+        return (group | key % GROUP_SIZE) & (capacity_ - 1u);
+    }
+
+    size_t FindIndex(Position pos) const {
+        if(size_ == 0u) {
+            return capacity_;
+        }
+        uint32_t key = PackPosition(pos);
+        size_t index = HomeIndex(key);
+        while(keys_[index] != EMPTY_KEY) {
+            if(keys_[index] == key) {
+                return index;
+            }
+            index = (index + 1u) & (capacity_ - 1u);
+        }
+        return capacity_;
+    }
+
+    void EraseIndex(size_t index) {
+        slots_[index].Value().~value_type();
+        keys_[index] = EMPTY_KEY;
+        --size_;
+        // сдвигаем назад элементы, которые иначе стали бы недостижимы
+        size_t mask = capacity_ - 1u;
+        size_t hole = index;
+        size_t next = (index + 1u) & mask;
+        while(keys_[next] != EMPTY_KEY) {
+            size_t home = HomeIndex(keys_[next]);
+            if(((next - home) & mask) >= ((next - hole) & mask)) {
+                MoveSlot(next, hole);
+                hole = next;
+            }
+            next = (next + 1u) & mask;
+        }
+    }
+
+    void MoveSlot(size_t from, size_t to) {
+        new (slots_[to].storage) value_type(std::move(slots_[from].Value()));
+        slots_[from].Value().~value_type();
+        keys_[to] = keys_[from];
+        keys_[from] = EMPTY_KEY;
+    }
+
+    void Rehash(size_t new_capacity) {
+        auto old_keys = std::move(keys_);
+        auto old_slots = std::move(slots_);
+        size_t old_capacity = capacity_;
+
+        keys_ = std::make_unique<uint32_t[]>(new_capacity);
+        // элементы конструируются по месту, обнулять массив незачем
+        slots_.reset(new Slot[new_capacity]);
+        capacity_ = new_capacity;
+        for(size_t i = 0; i < capacity_; ++i) {
+            keys_[i] = EMPTY_KEY;
+        }
+
+        for(size_t i = 0; i < old_capacity; ++i) {
+            if(old_keys[i] == EMPTY_KEY) {
+                continue;
+            }
+            size_t index = HomeIndex(old_keys[i]);
+            while(keys_[index] != EMPTY_KEY) {
+                index = (index + 1u) & (capacity_ - 1u);
+            }
+            new (slots_[index].storage) value_type(std::move(old_slots[i].Value()));
+            old_slots[i].Value().~value_type();
+            keys_[index] = old_keys[i];
+        }
+    }
+
+    std::unique_ptr<uint32_t[]> keys_;
+    std::unique_ptr<Slot[]> slots_;
+    size_t capacity_ = 0u;
+    size_t size_ = 0u;
+};
+
+// Множество позиций для рёбер графа зависимостей. У большинства позиций одна-две
+// зависимые формулы, поэтому элементы лежат подряд в векторе, без узлов и
+// корзин. Когда элементов становится больше SMALL_SIZE, строится индекс
+// позиция -> номер в векторе, и вставка и удаление остаются O(1). Удаление
+// переносит на место удалённого последний элемент, поэтому порядок обхода
+// не сохраняется.
+class SmallPositionSet {
+public:
+    using const_iterator = std::vector<Position>::const_iterator;
+
+    bool insert(Position pos) {
+        if(Find(pos) != items_.size()) {
+            return false;
+        }
+        if(index_) {
+            (*index_)[pos] = static_cast<uint32_t>(items_.size());
+        }
+        items_.push_back(pos);
+        if(!index_ && items_.size() > SMALL_SIZE) {
+            index_ = std::make_unique<PositionMap<uint32_t>>();
+            index_->reserve(items_.size());
+            for(size_t i = 0; i < items_.size(); ++i) {
+                (*index_)[items_[i]] = static_cast<uint32_t>(i);
+            }
+        }
+        return true;
+    }
+
+    size_t erase(Position pos) {
+        size_t index = Find(pos);
+        if(index == items_.size()) {
+            return 0u;
+        }
+        if(index + 1u != items_.size()) {
+            items_[index] = items_.back();
+            if(index_) {
+                (*index_)[items_[index]] = static_cast<uint32_t>(index);
+            }
+        }
+        items_.pop_back();
+        if(index_) {
+            index_->erase(pos);
+        }
+        return 1u;
+    }
+
+    size_t count(Position pos) const {
+        return Find(pos) != items_.size() ? 1u : 0u;
+    }
+
+    size_t size() const {
+        return items_.size();
+    }
+    bool empty() const {
+        return items_.empty();
+    }
+
+    const_iterator begin() const {
+        return items_.begin();
+    }
+    const_iterator end() const {
+        return items_.end();
+    }
+
+    void shrink_to_fit() {
+        items_.shrink_to_fit();
+        if(index_) {
+            index_->shrink_to_fit();
+        }
+    }
+
+    // Объём памяти вне самого объекта
+    size_t allocated_bytes() const {
+        size_t res = items_.capacity() * sizeof(Position);
+        if(index_) {
+            res += sizeof(*index_) + index_->allocated_bytes();
+        }
+        return res;
+    }
+
+private:
+    static constexpr size_t SMALL_SIZE = 16u;
+
+    size_t Find(Position pos) const {
+        if(index_) {
+            auto iter = index_->find(pos);
+            return iter != index_->end() ? iter->second : items_.size();
+        }
+        for(size_t i = 0; i < items_.size(); ++i) {
+            if(items_[i] == pos) {
+                return i;
+            }
+        }
+        return items_.size();
+    }
+
+    std::vector<Position> items_;
+    std::unique_ptr<PositionMap<uint32_t>> index_;
+};
@@ -0,0 +1,103 @@
+#include "range_index.h"
+
+#include <algorithm>
+#include <cassert>
+
+void RangeIndex::Insert(const Range& range) {
+    Position bottom_right = range.GetBottomRight();
+    rows_.Insert(range.top_left.row, bottom_right.row + 1, range);
+    cols_.Insert(range.top_left.col, bottom_right.col + 1, range);
+    ++size_;
+}
+
+void RangeIndex::Erase(const Range& range) {
+    Position bottom_right = range.GetBottomRight();
+    rows_.Erase(range.top_left.row, bottom_right.row + 1, range);
+    cols_.Erase(range.top_left.col, bottom_right.col + 1, range);
+    --size_;
+}
+
+bool RangeIndex::IntersectsRow(int row) const {
+    return rows_.AnyOnPath(row);
+}
+
+bool RangeIndex::IntersectsColumn(int col) const {
+    return cols_.AnyOnPath(col);
+}
+
+size_t RangeIndex::size() const {
+    return size_;
+}
+
+bool RangeIndex::empty() const {
+    return size_ == 0u;
+}
+
+void RangeIndex::clear() {
+    rows_.clear();
+    cols_.clear();
+    size_ = 0u;
+}
+
+size_t RangeIndex::GetAllocatedBytes() const {
+    return rows_.GetAllocatedBytes() + cols_.GetAllocatedBytes();
+}
+
+void RangeIndex::Tree::Insert(int first, int end, const Range& range) {
+    if(used_.empty()) {
+        used_.assign(2u * LEAVES / 64u, 0u);
+    }
+    ForEachCanonical(first, end, [this, &range] (uint32_t node) {
+        nodes_[node].push_back(range);
+        used_[node / 64u] |= uint64_t{1} << (node % 64u);
+    });
+}
+
+void RangeIndex::Tree::Erase(int first, int end, const Range& range) {
+    ForEachCanonical(first, end, [this, &range] (uint32_t node) {
+        auto iter = nodes_.find(node);
+        assert(iter != nodes_.end());
+        auto& ranges = iter->second;
+        auto found = std::find(ranges.begin(), ranges.end(), range);
+        assert(found != ranges.end());
+        *found = ranges.back();
+        ranges.pop_back();
+        if(ranges.empty()) {
+            nodes_.erase(iter);
+            used_[node / 64u] &= ~(uint64_t{1} << (node % 64u));
+        }
+    });
+    // пустое дерево не держит битовую маску
+    if(nodes_.empty()) {
+        clear();
+    }
+}
+
+bool RangeIndex::Tree::AnyOnPath(int point) const {
+    if(nodes_.empty()) {
+        return false;
+    }
+    for(uint32_t node = static_cast<uint32_t>(point) + LEAVES; node > 0u; node /= 2u) {
+        if(IsUsed(node)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void RangeIndex::Tree::clear() {
+    nodes_ = std::unordered_map<uint32_t, std::vector<Range>>();
+    used_ = std::vector<uint64_t>();
+}
+
+size_t RangeIndex::Tree::GetAllocatedBytes() const {
+    if(used_.empty()) {
+        return 0u;
+    }
+    // узел хеш-таблицы: ключ, вектор и указатель на следующий узел
+    size_t res = used_.capacity() * sizeof(uint64_t) + nodes_.bucket_count() * sizeof(void*);
+    for(const auto& [_, ranges] : nodes_) {
+        res += sizeof(uint32_t) + sizeof(ranges) + sizeof(void*) + ranges.capacity() * sizeof(Range);
+    }
+    return res;
+}
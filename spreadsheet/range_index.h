@@ -0,0 +1,103 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// Множество областей листа с поиском областей, содержащих позицию. Отрезок
+// строк области делится на O(log n) канонических отрезков дерева отрезков, и
+// область хранится в узле каждого из них; так же отдельно по столбцам. Узлы
+// на пути от листа строки к корню содержат ровно те области, чьи строки
+// покрывают эту строку, поэтому поиск просматривает O(log n) узлов и только
+// области, пересекающие строку позиции, а не все области листа. Узлы
+// заводятся по мере надобности.
+class RangeIndex {
+public:
+    // Каждая добавленная область хранится столько раз, сколько добавлена
+    void Insert(const Range& range);
+    // Удаляет одно вхождение области. Время пропорционально числу областей в
+    // узлах её канонических отрезков.
+    void Erase(const Range& range);
+
+    // Вызывает f(range) для каждой области, содержащей pos
+    template <typename F>
+    void ForEachContaining(Position pos, F f) const {
+        rows_.ForEachOnPath(pos.row, [pos, &f] (const Range& range) {
+            if(range.Contains(pos)) {
+                f(range);
+            }
+        });
+    }
+
+    // Пересекает ли строку row (столбец col) хотя бы одна область
+    bool IntersectsRow(int row) const;
+    bool IntersectsColumn(int col) const;
+
+    size_t size() const;
+    bool empty() const;
+    void clear();
+
+    size_t GetAllocatedBytes() const;
+
+private:
+    // Дерево отрезков над [0, LEAVES): узел i покрывает отрезки узлов 2i и
+    // 2i + 1, листья - узлы LEAVES + k
+    class Tree {
+    public:
+        void Insert(int first, int end, const Range& range);
+        void Erase(int first, int end, const Range& range);
+
+        template <typename F>
+        void ForEachOnPath(int point, F f) const {
+            if(nodes_.empty()) {
+                return;
+            }
+            for(uint32_t node = static_cast<uint32_t>(point) + LEAVES; node > 0u; node /= 2u) {
+                if(!IsUsed(node)) {
+                    continue;
+                }
+                for(const auto& range : nodes_.at(node)) {
+                    f(range);
+                }
+            }
+        }
+
+        bool AnyOnPath(int point) const;
+        void clear();
+        size_t GetAllocatedBytes() const;
+
+    private:
+        template <typename F>
+        static void ForEachCanonical(int first, int end, F f) {
+            uint32_t left = static_cast<uint32_t>(first) + LEAVES;
+            uint32_t right = static_cast<uint32_t>(end) + LEAVES;
+            for(; left < right; left /= 2u, right /= 2u) {
+                if(left & 1u) {
+                    f(left++);
+                }
+                if(right & 1u) {
+                    f(--right);
+                }
+            }
+        }
+
+        bool IsUsed(uint32_t node) const {
+            return used_[node / 64u] >> (node % 64u) & 1u;
+        }
+
+        static constexpr uint32_t LEAVES = 16384u;
+        static_assert(LEAVES >= static_cast<uint32_t>(Position::MAX_ROWS)
+                      && LEAVES >= static_cast<uint32_t>(Position::MAX_COLS));
+
+        std::unordered_map<uint32_t, std::vector<Range>> nodes_;
+        // непустые узлы: проверка бита дешевле поиска в таблице
+        std::vector<uint64_t> used_;
+    };
+
+    Tree rows_;
+    Tree cols_;
+    size_t size_ = 0;
+};
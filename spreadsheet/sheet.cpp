@@ -1,56 +1,136 @@
 #include "sheet.h"
 
 #include "common.h"
+#include "workbook.h"
 
 #include <algorithm>
 #include <functional>
 #include <iostream>
+#include <set>
 #include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
 
 using namespace std::literals;
 
+Sheet::Sheet(Workbook& workbook, std::string name)
+    : workbook_(&workbook)
+    , name_(std::move(name)) {}
+
 Sheet::~Sheet() = default;
 
 void Sheet::SetCell(Position pos, std::string text) {
     if(!pos.IsValid()) {
         throw InvalidPositionException("wrong position"s);
     }
-    auto temp_cell = std::move(std::make_unique<Cell>(*this));
-    temp_cell->Set(text);
-    if(CheckForCircularDependencies(temp_cell.get(), pos)) {
+    auto temp_cell = std::make_unique<Cell>(*this, pos);
+    temp_cell->Set(std::move(text));
+    if(CheckForCircularDependencies(*temp_cell, pos)) {
         throw CircularDependencyException("Circular dependency"s);
     }
-    data_[pos] = std::move(temp_cell);
+    auto& cell = data_[pos];
+    if(cell) {
+        RemoveDependencies(pos, *cell);
+    }
+    else {
+        value_cache_.Occupy(pos);
+    }
+    DropSchedules(pos);
+    cell = std::move(temp_cell);
+    cell->InvalidateCache();
+    AddDependencies(pos, *cell);
+    ++version_;
+    MarkChanged(pos);
+    InvalidateDependents(pos);
+    NotifySubscribers();
+}
+
+void Sheet::SetNumber(Position pos, double value) {
+    SetNumbers({{pos, value}});
+}
+
+void Sheet::SetNumbers(const std::vector<std::pair<Position, double>>& updates) {
+    for(const auto& [pos, _] : updates) {
+        if(!pos.IsValid()) {
+            throw InvalidPositionException("wrong position"s);
+        }
+    }
+    if(updates.empty()) {
+        return;
+    }
+    ++version_;
+    std::vector<Position> positions;
+    positions.reserve(updates.size());
+    for(const auto& [pos, value] : updates) {
+        auto& cell = data_[pos];
+        if(!cell) {
+            value_cache_.Occupy(pos);
+            cell = std::make_unique<Cell>(*this, pos);
+            DropSchedules(pos);
+            // рёбра диапазонов в индексе строятся только до существующих ячеек
+            dependency_index_.reset();
+        }
+        else if(cell->GetFormula()) {
+            // число ни на что не ссылается: рёбра прежней формулы удаляются,
+            // а проверка циклов не нужна
+            RemoveDependencies(pos, *cell);
+            DropSchedules(pos);
+        }
+        cell->SetNumber(value);
+        if(MarkChanged(pos)) {
+            positions.push_back(pos);
+        }
+    }
+    InvalidateDependents(positions);
+    NotifySubscribers();
 }
 
 const CellInterface* Sheet::GetCell(Position pos) const {
     if(!pos.IsValid()) {
         throw InvalidPositionException("wrong position"s);
     }
-    auto iter = data_.find(pos);
-    if(iter != data_.end()) {
-        return data_.at(pos).get();
-    }
-    return nullptr;
+    return GetConcreteCell(pos);
 }
 CellInterface* Sheet::GetCell(Position pos) {
     if(!pos.IsValid()) {
         throw InvalidPositionException("wrong position"s);
     }
+    return GetConcreteCell(pos);
+}
+
+const Cell* Sheet::GetConcreteCell(Position pos) const {
     auto iter = data_.find(pos);
     if(iter != data_.end()) {
-        return data_.at(pos).get();
+        return iter->second.get();
     }
     return nullptr;
 }
 
-void Sheet::ClearCell(Position pos) {
-    if(pos.IsValid()) {
-       data_.erase(pos);
+Cell* Sheet::GetConcreteCell(Position pos) {
+    auto iter = data_.find(pos);
+    if(iter != data_.end()) {
+        return iter->second.get();
     }
-    else {
+    return nullptr;
+}
+
+void Sheet::ClearCell(Position pos) {
+    if(!pos.IsValid()) {
         throw InvalidPositionException("wrong position"s);
     }
+    auto iter = data_.find(pos);
+    if(iter == data_.end()) {
+        return;
+    }
+    RemoveDependencies(pos, *iter->second);
+    DropSchedules(pos);
+    data_.erase(iter);
+    value_cache_.Release(pos);
+    ++version_;
+    MarkChanged(pos);
+    InvalidateDependents(pos);
+    NotifySubscribers();
 }
 
 Size Sheet::GetPrintableSize() const {
@@ -82,6 +162,7 @@ void Sheet::PrintValues(std::ostream& output) const {
     if(data_.empty()) {
         return;
     }
+    Recalculate();
     Position left_corner{};
     Position right_corner{};
     std::tie(left_corner, right_corner) = GetLeftRightCorners();
@@ -120,8 +201,66 @@ void Sheet::PrintTexts(std::ostream& output) const {
     }
 }
 
-size_t Sheet::position_hash::operator() (const Position& p) const {
-    return std::hash<int>()(p.row) ^ std::hash<int>()(p.col);
+const SheetInterface* Sheet::FindSheet(std::string_view name) const {
+    return ResolveSheet(name);
+}
+
+Sheet* Sheet::ResolveSheet(std::string_view name) const {
+    return workbook_ ? workbook_->GetConcreteSheet(name) : nullptr;
+}
+
+const LookupIndex* Sheet::GetLookupIndex(const Range& area) const {
+    if(area.size.rows != 1 && area.size.cols != 1) {
+        return nullptr;
+    }
+    bool vertical = area.size.cols == 1;
+    auto& indexes = vertical ? column_indexes_ : row_indexes_;
+    int line = vertical ? area.top_left.col : area.top_left.row;
+    auto iter = indexes.find(line);
+    if(iter == indexes.end()) {
+        // индекс без охватывающего диапазона некому удалить
+        bool covered = false;
+        range_index_.ForEachContaining(area.top_left, [&covered, &area] (const Range& range) {
+            covered = covered || range.Contains(area);
+        });
+        if(!covered) {
+            return nullptr;
+        }
+        iter = indexes.emplace(line, std::make_unique<LookupIndex>(area)).first;
+    }
+    auto& index = *iter->second;
+    index.Extend(area);
+    if(index.IsStale()) {
+        index.Update([this] (Position pos) {
+            const Cell* cell = GetConcreteCell(pos);
+            return cell ? LookupIndex::Key::FromValue(cell->GetValueView()) : LookupIndex::Key{};
+        });
+    }
+    return &index;
+}
+
+StringPool& Sheet::GetStringPool() {
+    return string_pool_;
+}
+
+const StringPool& Sheet::GetStringPool() const {
+    return string_pool_;
+}
+
+ValueCache& Sheet::GetValueCache() {
+    return value_cache_;
+}
+
+const ValueCache& Sheet::GetValueCache() const {
+    return value_cache_;
+}
+
+FormulaCache& Sheet::GetFormulaCache() {
+    return formula_cache_;
+}
+
+const FormulaCache& Sheet::GetFormulaCache() const {
+    return formula_cache_;
 }
 
 std::pair<Position, Position> Sheet::GetLeftRightCorners() const {
@@ -144,18 +283,1735 @@ std::pair<Position, Position> Sheet::GetLeftRightCorners() const {
     return {{0,0}, right};
 }
 
-bool Sheet::CheckForCircularDependencies(const CellInterface* cell, Position head) const {
-    if(!cell) {
-        return false;
+bool Sheet::CheckForCircularDependencies(const Cell& cell, Position head) const {
+    // Цикл возникает, если одна из ячеек, на которые ссылается новая формула,
+    // уже зависит от head. Обход идёт от head по обратным рёбрам, в том числе
+    // через другие листы книги: при заполнении таблицы сверху вниз у новой
+    // ячейки обычно нет зависимых, и проверка не обходит всю цепочку влияющих.
+    std::unordered_map<const Sheet*, PositionSet> targets;
+    for(const auto& pos : cell.GetReferencedCells()) {
+        targets[this].insert(pos);
+    }
+    for(const auto& ref : cell.GetExternalReferences()) {
+        // ссылки на ещё не созданный лист цикла образовать не могут
+        if(const Sheet* ref_sheet = ResolveSheet(ref.sheet)) {
+            targets[ref_sheet].insert(ref.pos);
+        }
     }
-    bool res = false;
-    for(const auto& next_cell_pos : cell->GetReferencedCells()) {
-        if(next_cell_pos == head) {
+    // диапазоны могут быть большими, поэтому их ячейки не перечисляются
+    const auto ranges = cell.GetReferencedRanges();
+    auto is_target = [this, &targets, &ranges] (const Sheet* sheet, Position pos) {
+        auto iter = targets.find(sheet);
+        if(iter != targets.end() && iter->second.count(pos) > 0u) {
             return true;
         }
-        res = res || CheckForCircularDependencies(GetCell(next_cell_pos), head);
+        return sheet == this && std::any_of(ranges.begin(), ranges.end(), [pos] (const Range& range) {
+            return range.Contains(pos);
+        });
+    };
+    if(targets.empty() && ranges.empty()) {
+        return false;
+    }
+    if(is_target(this, head)) {
+        return true;
+    }
+
+    std::unordered_map<const Sheet*, PositionSet> visited;
+    std::vector<std::pair<const Sheet*, Position>> to_visit{{this, head}};
+    while(!to_visit.empty()) {
+        auto [sheet, current] = to_visit.back();
+        to_visit.pop_back();
+        std::vector<std::pair<const Sheet*, Position>> next;
+        auto iter = sheet->dependents_.find(current);
+        if(iter != sheet->dependents_.end()) {
+            for(const auto& dependent : iter->second) {
+                next.emplace_back(sheet, dependent);
+            }
+        }
+        std::vector<Position> range_dependents;
+        sheet->AppendRangeDependents(current, range_dependents);
+        for(const auto& dependent : range_dependents) {
+            next.emplace_back(sheet, dependent);
+        }
+        if(workbook_ && workbook_->HasExternalDependencies()) {
+            for(const auto& dependent : workbook_->GetExternalDependents(sheet->name_, current)) {
+                next.emplace_back(dependent.sheet, dependent.pos);
+            }
+        }
+        for(const auto& [next_sheet, pos] : next) {
+            if(is_target(next_sheet, pos)) {
+                return true;
+            }
+            if(visited[next_sheet].insert(pos).second) {
+                to_visit.emplace_back(next_sheet, pos);
+            }
+        }
+    }
+    return false;
+}
+
+bool Sheet::CheckForCircularDependencies(const CellUpdates& updates) const {
+    // Цикл в графе после вставки обязательно проходит через новое ребро,
+    // то есть через одну из новых формул. Поиск в глубину от них идёт по рёбрам
+    // графа после вставки: прежние рёбра заменяемых ячеек пропускаются, новые
+    // добавляются; возврат в вершину, обход которой не закончен, - цикл.
+    enum class State : uint8_t { NotVisited, InProgress, Done };
+    constexpr uint32_t NO_NEW_EDGES = ~uint32_t{0};
+    // Всё, что обход узнаёт о позиции этого листа, лежит в одной записи:
+    // на большой вставке каждая лишняя таблица - лишний промах кэша на вершину.
+    struct OwnNode {
+        uint32_t new_edges_begin = NO_NEW_EDGES;  // начало её рёбер в new_edges
+        bool replaced = false;                    // ячейка заменяется вставкой
+        State state = State::NotVisited;
+    };
+    PositionMap<OwnNode> own_nodes;
+    own_nodes.reserve(updates.size());
+    // новые рёбра листа по возрастанию: упакованные ссылка и формула
+    std::vector<uint64_t> new_edges;
+    std::unordered_map<const Sheet*, PositionMap<std::vector<Position>>> new_external_dependents;
+    std::map<Range, std::vector<Position>> new_range_dependents;
+    RangeIndex new_ranges;
+    std::vector<Position> roots;
+    for(const auto& [pos, cell] : updates) {
+        own_nodes[pos].replaced = true;
+        if(!cell) {
+            continue;
+        }
+        auto refs = cell->GetReferencedCells();
+        for(const auto& ref : refs) {
+            new_edges.push_back(uint64_t{PackPosition(ref)} << 32u | PackPosition(pos));
+        }
+        for(const auto& ref : cell->GetExternalReferences()) {
+            if(const Sheet* ref_sheet = ResolveSheet(ref.sheet)) {
+                new_external_dependents[ref_sheet][ref.pos].push_back(pos);
+                refs.push_back(ref.pos);
+            }
+        }
+        auto ranges = cell->GetReferencedRanges();
+        for(const auto& range : ranges) {
+            auto [iter, inserted] = new_range_dependents.try_emplace(range);
+            if(inserted) {
+                new_ranges.Insert(range);
+            }
+            iter->second.push_back(pos);
+        }
+        if(!refs.empty() || !ranges.empty()) {
+            roots.push_back(pos);
+        }
+    }
+    std::sort(new_edges.begin(), new_edges.end());
+    for(size_t i = 0; i < new_edges.size(); ++i) {
+        if(i == 0u || (new_edges[i] >> 32u) != (new_edges[i - 1u] >> 32u)) {
+            own_nodes[UnpackPosition(static_cast<uint32_t>(new_edges[i] >> 32u))].new_edges_begin = static_cast<uint32_t>(i);
+        }
+    }
+
+    using Node = std::pair<const Sheet*, Position>;
+    std::vector<Position> range_dependents;
+    auto for_each_dependent = [&] (const Node& node, auto visit) {
+        auto [sheet, pos] = node;
+        auto is_replaced = [&] (const Sheet* dependent_sheet, Position dependent) {
+            if(dependent_sheet != this) {
+                return false;
+            }
+            auto iter = own_nodes.find(dependent);
+            return iter != own_nodes.end() && iter->second.replaced;
+        };
+        auto iter = sheet->dependents_.find(pos);
+        if(iter != sheet->dependents_.end()) {
+            for(const auto& dependent : iter->second) {
+                if(!is_replaced(sheet, dependent)) {
+                    visit(Node{sheet, dependent});
+                }
+            }
+        }
+        range_dependents.clear();
+        sheet->AppendRangeDependents(pos, range_dependents);
+        for(const auto& dependent : range_dependents) {
+            if(!is_replaced(sheet, dependent)) {
+                visit(Node{sheet, dependent});
+            }
+        }
+        if(workbook_ && workbook_->HasExternalDependencies()) {
+            for(const auto& dependent : workbook_->GetExternalDependents(sheet->name_, pos)) {
+                if(!is_replaced(dependent.sheet, dependent.pos)) {
+                    visit(Node{dependent.sheet, dependent.pos});
+                }
+            }
+        }
+        if(sheet == this) {
+            new_ranges.ForEachContaining(pos, [&] (const Range& range) {
+                for(const auto& dependent : new_range_dependents.find(range)->second) {
+                    visit(Node{this, dependent});
+                }
+            });
+            auto own = own_nodes.find(pos);
+            if(own != own_nodes.end() && own->second.new_edges_begin != NO_NEW_EDGES) {
+                uint32_t key = PackPosition(pos);
+                for(size_t i = own->second.new_edges_begin; i < new_edges.size() && (new_edges[i] >> 32u) == key; ++i) {
+                    visit(Node{this, UnpackPosition(static_cast<uint32_t>(new_edges[i]))});
+                }
+            }
+        }
+        if(auto sheet_iter = new_external_dependents.find(sheet); sheet_iter != new_external_dependents.end()) {
+            if(auto new_iter = sheet_iter->second.find(pos); new_iter != sheet_iter->second.end()) {
+                for(const auto& dependent : new_iter->second) {
+                    visit(Node{this, dependent});
+                }
+            }
+        }
+    };
+
+    std::unordered_map<const Sheet*, PositionMap<State>> other_states;
+    auto state_of = [&] (const Node& node) -> State& {
+        return node.first == this ? own_nodes[node.second].state : other_states[node.first][node.second];
+    };
+    // Вершина кладётся в стек дважды: для входа и, под своими зависимыми, для
+    // выхода. Незаконченные вершины образуют путь от корня до текущей, поэтому
+    // ребро в незаконченную вершину замыкает цикл.
+    std::vector<std::pair<Node, bool>> stack;
+    for(const auto& root : roots) {
+        if(own_nodes[root].state != State::NotVisited) {
+            continue;
+        }
+        stack.push_back({{this, root}, false});
+        while(!stack.empty()) {
+            auto [node, leaving] = stack.back();
+            stack.pop_back();
+            State& state = state_of(node);
+            if(leaving) {
+                state = State::Done;
+                continue;
+            }
+            if(state == State::InProgress) {
+                return true;
+            }
+            if(state == State::Done) {
+                continue;
+            }
+            state = State::InProgress;
+            stack.push_back({node, true});
+            for_each_dependent(node, [&stack] (const Node& next) {
+                stack.push_back({next, false});
+            });
+        }
+    }
+    return false;
+}
+
+void Sheet::CopyRange(Position src_top_left, Size size, Position dst_top_left) {
+    PasteCells(src_top_left, size, dst_top_left, size);
+}
+
+void Sheet::FillDown(Position top_left, Size size) {
+    PasteCells(top_left, Size{1, size.cols}, Position{top_left.row + 1, top_left.col},
+               Size{size.rows - 1, size.cols});
+}
+
+void Sheet::FillRight(Position top_left, Size size) {
+    PasteCells(top_left, Size{size.rows, 1}, Position{top_left.row, top_left.col + 1},
+               Size{size.rows, size.cols - 1});
+}
+
+namespace {
+// Значение ключа сортировки. Ранг задаёт порядок видов значений.
+struct SortValue {
+    enum Rank : uint8_t {
+        Number,
+        Text,
+        Error,
+        Blank,
+    };
+    Rank rank = Blank;
+    double number = 0.0;
+    std::string_view text;
+};
+
+char FoldCase(char c) {
+    return c >= 'A' && c <= 'Z' ? static_cast<char>(c - 'A' + 'a') : c;
+}
+
+int CompareText(std::string_view lhs, std::string_view rhs) {
+    size_t n = std::min(lhs.size(), rhs.size());
+    for(size_t i = 0; i < n; ++i) {
+        char l = FoldCase(lhs[i]);
+        char r = FoldCase(rhs[i]);
+        if(l != r) {
+            return static_cast<unsigned char>(l) < static_cast<unsigned char>(r) ? -1 : 1;
+        }
+    }
+    return lhs.size() == rhs.size() ? 0 : (lhs.size() < rhs.size() ? -1 : 1);
+}
+
+// -1, 0 или 1; пустые значения идут последними при любом порядке
+int CompareSortValues(const SortValue& lhs, const SortValue& rhs, Sheet::SortOrder order) {
+    if(lhs.rank == SortValue::Blank || rhs.rank == SortValue::Blank) {
+        return static_cast<int>(lhs.rank == SortValue::Blank) - static_cast<int>(rhs.rank == SortValue::Blank);
+    }
+    int res = 0;
+    if(lhs.rank != rhs.rank) {
+        res = lhs.rank < rhs.rank ? -1 : 1;
+    }
+    else if(lhs.rank == SortValue::Number) {
+        res = lhs.number < rhs.number ? -1 : (rhs.number < lhs.number ? 1 : 0);
+    }
+    else if(lhs.rank == SortValue::Text) {
+        res = CompareText(lhs.text, rhs.text);
+    }
+    return order == Sheet::SortOrder::Descending ? -res : res;
+}
+}  // namespace
+
+void Sheet::SortRange(Position top_left, Size size, const std::vector<SortKey>& keys) {
+    Position bottom_right{top_left.row + size.rows - 1, top_left.col + size.cols - 1};
+    if(!top_left.IsValid() || !bottom_right.IsValid() || size.rows <= 0 || size.cols <= 0) {
+        throw InvalidPositionException("wrong position"s);
+    }
+    for(const auto& key : keys) {
+        if(key.col < top_left.col || key.col > bottom_right.col) {
+            throw InvalidPositionException("wrong position"s);
+        }
+    }
+    if(keys.empty() || size.rows == 1) {
+        return;
+    }
+
+    // Значения ключей одной строки лежат подряд, поэтому сравнение строк
+    // читает память последовательно и не обращается к ячейкам
+    const size_t rows = static_cast<size_t>(size.rows);
+    const size_t key_count = keys.size();
+    std::vector<SortValue> values(rows * key_count);
+    {
+        std::vector<double> numbers(rows);
+        std::vector<ValueCache::Tag> tags(rows);
+        std::vector<std::string_view> texts(rows);
+        for(size_t k = 0; k < key_count; ++k) {
+            GetValues({top_left.row, keys[k].col}, Size{size.rows, 1}, numbers.data(), tags.data(), texts.data());
+            for(size_t row = 0; row < rows; ++row) {
+                auto& value = values[row * key_count + k];
+                if(tags[row] == ValueCache::Tag::Number) {
+                    value.rank = SortValue::Number;
+                    value.number = numbers[row];
+                }
+                else if(tags[row] == ValueCache::Tag::Text) {
+                    value.rank = texts[row].empty() ? SortValue::Blank : SortValue::Text;
+                    value.text = texts[row];
+                }
+                else {
+                    value.rank = SortValue::Error;
+                }
+            }
+        }
+    }
+    std::vector<int> order(rows);
+    for(size_t row = 0; row < rows; ++row) {
+        order[row] = static_cast<int>(row);
+    }
+    std::stable_sort(order.begin(), order.end(), [&] (int lhs, int rhs) {
+        const SortValue* lhs_values = &values[lhs * key_count];
+        const SortValue* rhs_values = &values[rhs * key_count];
+        for(size_t k = 0; k < key_count; ++k) {
+            if(int res = CompareSortValues(lhs_values[k], rhs_values[k], keys[k].order)) {
+                return res < 0;
+            }
+        }
+        return false;
+    });
+
+    // Переставленные строки области: новое место и прежнее. Их прежние места
+    // совпадают с новыми, поэтому прочие строки не затрагиваются.
+    std::vector<std::pair<int, int>> moved;
+    std::vector<int> moved_index(rows, -1);
+    for(size_t row = 0; row < rows; ++row) {
+        if(order[row] != static_cast<int>(row)) {
+            moved_index[row] = static_cast<int>(moved.size());
+            moved.emplace_back(static_cast<int>(row), order[row]);
+        }
+    }
+    if(moved.empty()) {
+        return;
+    }
+
+    // Формулы со ссылками получают сдвинутые копии; остальные ячейки рёбер
+    // графа не имеют и переносятся как есть
+    const size_t cols = static_cast<size_t>(size.cols);
+    CellUpdates updates;
+    updates.reserve(moved.size() * cols);
+    for(const auto& [row, src_row] : moved) {
+        for(size_t col = 0; col < cols; ++col) {
+            Position dst{top_left.row + row, top_left.col + static_cast<int>(col)};
+            Position src{top_left.row + src_row, dst.col};
+            std::unique_ptr<Cell> cell;
+            const Cell* source = GetConcreteCell(src);
+            if(source && (!source->GetReferencedCells().empty() || !source->GetExternalReferences().empty()
+                          || !source->GetReferencedRanges().empty())) {
+                cell = std::make_unique<Cell>(*this, dst);
+                cell->SetShifted(*source, row - src_row, 0);
+            }
+            updates.emplace_back(dst, std::move(cell));
+        }
+    }
+    if(CheckForCircularDependencies(updates)) {
+        throw CircularDependencyException("Circular dependency"s);
+    }
+
+    ++version_;
+    std::vector<std::unique_ptr<Cell>> taken(moved.size() * cols);
+    std::vector<bool> occupied(moved.size() * cols);
+    for(size_t i = 0; i < moved.size(); ++i) {
+        for(size_t col = 0; col < cols; ++col) {
+            Position pos{top_left.row + moved[i].first, top_left.col + static_cast<int>(col)};
+            DropSchedules(pos);
+            auto iter = data_.find(pos);
+            if(iter == data_.end()) {
+                continue;
+            }
+            RemoveDependencies(pos, *iter->second);
+            taken[i * cols + col] = std::move(iter->second);
+            occupied[i * cols + col] = true;
+            data_.erase(iter);
+        }
+    }
+    std::vector<Position> changed;
+    for(size_t i = 0; i < moved.size(); ++i) {
+        size_t src_index = static_cast<size_t>(moved_index[moved[i].second]);
+        for(size_t col = 0; col < cols; ++col) {
+            auto& [pos, update] = updates[i * cols + col];
+            auto& source = taken[src_index * cols + col];
+            bool was_occupied = occupied[i * cols + col];
+            if(!update && !source) {
+                if(!was_occupied) {
+                    continue;
+                }
+                value_cache_.Release(pos);
+            }
+            else {
+                if(!was_occupied) {
+                    value_cache_.Occupy(pos);
+                }
+                std::unique_ptr<Cell> cell;
+                if(update) {
+                    cell = std::move(update);
+                    cell->InvalidateCache();
+                }
+                else {
+                    cell = std::move(source);
+                    cell->MoveTo(pos);
+                }
+                AddDependencies(pos, *cell);
+                data_[pos] = std::move(cell);
+            }
+            if(MarkChanged(pos)) {
+                changed.push_back(pos);
+            }
+        }
+    }
+    InvalidateDependents(changed);
+    NotifySubscribers();
+}
+
+void Sheet::PasteCells(Position src_top_left, Size src_size, Position dst_top_left, Size dst_size) {
+    auto check_area = [] (Position top_left, Size size) {
+        Position bottom_right{top_left.row + size.rows - 1, top_left.col + size.cols - 1};
+        if(!top_left.IsValid() || !bottom_right.IsValid() || size.rows < 0 || size.cols < 0) {
+            throw InvalidPositionException("wrong position"s);
+        }
+    };
+    // заполнение области из одной строки или столбца ничего не делает
+    if(dst_size.rows == 0 || dst_size.cols == 0) {
+        return;
+    }
+    check_area(src_top_left, src_size);
+    check_area(dst_top_left, dst_size);
+
+    // новые ячейки строятся до изменения листа: области могут пересекаться
+    CellUpdates updates;
+    updates.reserve(static_cast<size_t>(dst_size.rows) * dst_size.cols);
+    for(int row = 0; row < dst_size.rows; ++row) {
+        for(int col = 0; col < dst_size.cols; ++col) {
+            Position src{src_top_left.row + row % src_size.rows, src_top_left.col + col % src_size.cols};
+            Position dst{dst_top_left.row + row, dst_top_left.col + col};
+            std::unique_ptr<Cell> cell;
+            if(const Cell* source = GetConcreteCell(src)) {
+                cell = std::make_unique<Cell>(*this, dst);
+                cell->SetShifted(*source, dst.row - src.row, dst.col - src.col);
+            }
+            updates.emplace_back(dst, std::move(cell));
+        }
+    }
+    if(CheckForCircularDependencies(updates)) {
+        throw CircularDependencyException("Circular dependency"s);
+    }
+
+    ++version_;
+    // каждая вставленная ячейка попадает в обе таблицы: большая вставка не
+    // должна перестраивать их по нескольку раз
+    data_.reserve(data_.size() + updates.size());
+    last_change_.reserve(last_change_.size() + updates.size());
+    std::vector<Position> changed;
+    for(auto& [pos, cell] : updates) {
+        auto iter = data_.find(pos);
+        bool exists = iter != data_.end();
+        if(exists) {
+            RemoveDependencies(pos, *iter->second);
+        }
+        if(!cell) {
+            if(!exists) {
+                continue;
+            }
+            data_.erase(iter);
+            value_cache_.Release(pos);
+        }
+        else {
+            if(!exists) {
+                value_cache_.Occupy(pos);
+            }
+            auto& slot = data_[pos];
+            slot = std::move(cell);
+            slot->InvalidateCache();
+            AddDependencies(pos, *slot);
+        }
+        DropSchedules(pos);
+        if(MarkChanged(pos)) {
+            changed.push_back(pos);
+        }
+    }
+    InvalidateDependents(changed);
+    NotifySubscribers();
+}
+
+void Sheet::AddDependencies(Position pos, const Cell& cell) {
+    dependency_index_.reset();
+    for(const auto& ref_cell : cell.GetReferencedCells()) {
+        dependents_[ref_cell].insert(pos);
+    }
+    for(const auto& range : cell.GetReferencedRanges()) {
+        auto [iter, inserted] = range_dependents_.try_emplace(range);
+        if(inserted) {
+            range_index_.Insert(range);
+        }
+        iter->second.insert(pos);
+    }
+    if(workbook_) {
+        for(const auto& ref : cell.GetExternalReferences()) {
+            workbook_->AddExternalDependency(ref, this, pos);
+        }
+    }
+}
+
+void Sheet::RemoveDependencies(Position pos, const Cell& cell) {
+    dependency_index_.reset();
+    for(const auto& ref_cell : cell.GetReferencedCells()) {
+        auto iter = dependents_.find(ref_cell);
+        if(iter == dependents_.end()) {
+            continue;
+        }
+        iter->second.erase(pos);
+        if(iter->second.empty()) {
+            dependents_.erase(iter);
+        }
+    }
+    for(const auto& range : cell.GetReferencedRanges()) {
+        auto iter = range_dependents_.find(range);
+        if(iter == range_dependents_.end()) {
+            continue;
+        }
+        iter->second.erase(pos);
+        if(!iter->second.empty()) {
+            continue;
+        }
+        range_dependents_.erase(iter);
+        range_index_.Erase(range);
+        DropUncoveredLookupIndexes(range);
+    }
+    if(workbook_) {
+        for(const auto& ref : cell.GetExternalReferences()) {
+            workbook_->RemoveExternalDependency(ref, this, pos);
+        }
+    }
+}
+
+void Sheet::SetCompilation(Compilation mode) {
+    compilation_ = mode;
+    if(mode != Compilation::Background) {
+        formula_compiler_.reset();
+    }
+    else if(!formula_compiler_) {
+        formula_compiler_ = std::make_unique<FormulaCompiler>();
+    }
+}
+
+Sheet::Compilation Sheet::GetCompilation() const {
+    return compilation_;
+}
+
+FormulaCompiler* Sheet::GetFormulaCompiler() const {
+    return formula_compiler_.get();
+}
+
+void Sheet::InvalidateCell(Position pos) {
+    ++version_;
+    if(auto cell = GetConcreteCell(pos)) {
+        cell->InvalidateCache();
+        MarkChanged(pos);
+    }
+    InvalidateDependents(pos);
+    NotifySubscribers();
+}
+
+void Sheet::InvalidateDependents(Position pos) {
+    InvalidateDependents(std::vector<Position>{pos});
+}
+
+void Sheet::AppendRangeDependents(Position pos, std::vector<Position>& out) const {
+    range_index_.ForEachContaining(pos, [this, &out] (const Range& range) {
+        const auto& dependents = range_dependents_.find(range)->second;
+        out.insert(out.end(), dependents.begin(), dependents.end());
+    });
+}
+
+void Sheet::InvalidateLookupIndexes(Position pos) {
+    if(auto iter = column_indexes_.find(pos.col); iter != column_indexes_.end()) {
+        iter->second->Invalidate(pos);
+    }
+    if(auto iter = row_indexes_.find(pos.row); iter != row_indexes_.end()) {
+        iter->second->Invalidate(pos);
+    }
+}
+
+void Sheet::DropUncoveredLookupIndexes(const Range& range) {
+    Position bottom_right = range.GetBottomRight();
+    auto drop = [] (auto& indexes, int first, int last, auto is_covered) {
+        for(auto iter = indexes.lower_bound(first); iter != indexes.end() && iter->first <= last; ) {
+            iter = is_covered(iter->first) ? std::next(iter) : indexes.erase(iter);
+        }
+    };
+    drop(column_indexes_, range.top_left.col, bottom_right.col, [this] (int col) {
+        return range_index_.IntersectsColumn(col);
+    });
+    drop(row_indexes_, range.top_left.row, bottom_right.row, [this] (int row) {
+        return range_index_.IntersectsRow(row);
+    });
+}
+
+void Sheet::InvalidateDependents(const std::vector<Position>& positions) {
+    std::vector<std::pair<Sheet*, Position>> to_visit;
+    to_visit.reserve(positions.size());
+    for(const auto& pos : positions) {
+        to_visit.emplace_back(this, pos);
+    }
+    // другие листы получают новую версию один раз за всё распространение
+    std::unordered_set<Sheet*> versioned{this};
+    // source - ячейка того же листа, которую читает dependent, или
+    // Position::NONE для диапазонов и ссылок с других листов
+    auto visit = [&to_visit, &versioned] (Sheet* sheet, Position dependent, Position source) {
+        auto cell = sheet->GetConcreteCell(dependent);
+        if(!cell) {
+            return;
+        }
+        // формула не читала source, потому что он в невыбранной ветви
+        // условия: её значение остаётся прежним
+        if(source.IsValid() && cell->IsUnaffectedBy(source)) {
+            return;
+        }
+        if(versioned.insert(sheet).second) {
+            ++sheet->version_;
+        }
+        // Ещё не вычисленная ячейка тоже получает новую версию: журнал
+        // изменений должен содержать все затронутые правкой ячейки. Обход
+        // останавливается на ячейках, уже отмеченных в этой правке.
+        if(sheet->MarkChanged(dependent)) {
+            cell->InvalidateCache();
+            to_visit.emplace_back(sheet, dependent);
+        }
+    };
+    std::vector<Position> range_dependents;
+    while(!to_visit.empty()) {
+        auto [sheet, current] = to_visit.back();
+        to_visit.pop_back();
+        auto iter = sheet->dependents_.find(current);
+        if(iter != sheet->dependents_.end()) {
+            for(const auto& dependent : iter->second) {
+                visit(sheet, dependent, current);
+            }
+        }
+        sheet->InvalidateLookupIndexes(current);
+        range_dependents.clear();
+        sheet->AppendRangeDependents(current, range_dependents);
+        for(const auto& dependent : range_dependents) {
+            visit(sheet, dependent, Position::NONE);
+        }
+        if(workbook_ && workbook_->HasExternalDependencies()) {
+            for(const auto& dependent : workbook_->GetExternalDependents(sheet->name_, current)) {
+                visit(dependent.sheet, dependent.pos, Position::NONE);
+            }
+        }
+    }
+    // подписчиков этого листа оповестит вызывающий метод после завершения правки
+    for(auto* sheet : versioned) {
+        if(sheet != this) {
+            sheet->NotifySubscribers();
+        }
+    }
+}
+
+// Лист-наложение для Evaluate: ячейки с переопределёнными значениями и
+// зависящие от них формулы вычисляются здесь, остальные читаются из листа
+class Sheet::Overlay : public SheetInterface {
+public:
+    Overlay(const Sheet& base, const Overrides& overrides)
+        : base_(base) {
+        std::vector<Position> to_visit;
+        for(const auto& [pos, value] : overrides) {
+            values_[pos] = value;
+            to_visit.push_back(pos);
+        }
+        // формулы, зависящие от переопределённых ячеек, обходятся по обратным
+        // рёбрам без изменения листа
+        std::vector<Position> dependents;
+        while(!to_visit.empty()) {
+            auto current = to_visit.back();
+            to_visit.pop_back();
+            dependents.clear();
+            auto iter = base_.dependents_.find(current);
+            if(iter != base_.dependents_.end()) {
+                dependents.assign(iter->second.begin(), iter->second.end());
+            }
+            base_.AppendRangeDependents(current, dependents);
+            for(const auto& dependent : dependents) {
+                if(affected_.insert(dependent).second) {
+                    to_visit.push_back(dependent);
+                }
+            }
+        }
+    }
+
+    // Зависит ли формула в позиции pos от переопределённых ячеек
+    bool IsAffected(Position pos) const {
+        return affected_.count(pos) > 0u;
+    }
+
+    CellInterface::Value GetValue(Position pos) {
+        auto iter = values_.find(pos);
+        if(iter != values_.end()) {
+            return iter->second;
+        }
+        const Cell* cell = base_.GetConcreteCell(pos);
+        if(!cell) {
+            return CellInterface::Value{};
+        }
+        if(!affected_.count(pos) && !cell->IsModified()) {
+            return cell->GetValue();
+        }
+        auto value = cell->Evaluate(*this);
+        values_[pos] = value;
+        return value;
+    }
+
+    void SetCell(Position /*pos*/, std::string /*text*/) override {
+        throw std::logic_error("overlay is read-only");
+    }
+
+    const CellInterface* GetCell(Position pos) const override {
+        if(!pos.IsValid()) {
+            throw InvalidPositionException("wrong position"s);
+        }
+        if(!base_.GetConcreteCell(pos) && !values_.count(pos)) {
+            return nullptr;
+        }
+        auto& cell = cells_[pos];
+        if(!cell) {
+            cell = std::make_unique<OverlayCell>(const_cast<Overlay&>(*this), pos);
+        }
+        return cell.get();
+    }
+
+    CellInterface* GetCell(Position pos) override {
+        return const_cast<CellInterface*>(std::as_const(*this).GetCell(pos));
+    }
+
+    void ClearCell(Position /*pos*/) override {
+        throw std::logic_error("overlay is read-only");
+    }
+
+    Size GetPrintableSize() const override {
+        return base_.GetPrintableSize();
+    }
+
+    void PrintValues(std::ostream& /*output*/) const override {
+        throw std::logic_error("overlay can't be printed");
+    }
+
+    void PrintTexts(std::ostream& /*output*/) const override {
+        throw std::logic_error("overlay can't be printed");
+    }
+
+    const SheetInterface* FindSheet(std::string_view name) const override {
+        return base_.FindSheet(name);
+    }
+
+private:
+    // Ячейка, значение которой читается через наложение
+    class OverlayCell : public CellInterface {
+    public:
+        OverlayCell(Overlay& overlay, Position pos)
+            : overlay_(overlay)
+            , pos_(pos) {}
+
+        void Set(std::string /*text*/) override {
+            throw std::logic_error("overlay is read-only");
+        }
+
+        Value GetValue() const override {
+            return overlay_.GetValue(pos_);
+        }
+
+        std::string GetText() const override {
+            auto cell = overlay_.base_.GetConcreteCell(pos_);
+            return cell ? cell->GetText() : std::string{};
+        }
+
+        std::vector<Position> GetReferencedCells() const override {
+            auto cell = overlay_.base_.GetConcreteCell(pos_);
+            return cell ? cell->GetReferencedCells() : std::vector<Position>{};
+        }
+
+    private:
+        Overlay& overlay_;
+        Position pos_;
+    };
+
+    const Sheet& base_;
+    // переопределённые и уже вычисленные в наложении значения
+    PositionMap<CellInterface::Value> values_;
+    PositionSet affected_;
+    mutable PositionMap<std::unique_ptr<OverlayCell>> cells_;
+};
+
+std::vector<CellInterface::Value> Sheet::Evaluate(const Overrides& overrides,
+                                                  const std::vector<Position>& targets) const {
+    for(const auto& [pos, _] : overrides) {
+        if(!pos.IsValid()) {
+            throw InvalidPositionException("wrong position"s);
+        }
+    }
+    Overlay overlay(*this, overrides);
+    std::vector<CellInterface::Value> res;
+    res.reserve(targets.size());
+    for(const auto& pos : targets) {
+        if(!pos.IsValid()) {
+            throw InvalidPositionException("wrong position"s);
+        }
+        res.push_back(overlay.GetValue(pos));
+    }
+    return res;
+}
+
+namespace {
+// Значение ячейки как операнд формулы, см. Cell::GetNumericValue
+FormulaInterface::Value ToNumericValue(const CellInterface::Value& value) {
+    if(const auto* text = std::get_if<std::string>(&value)) {
+        if(auto number = TextToNumber(*text)) {
+            return *number;
+        }
+        return FormulaError{FormulaError::Category::Value};
+    }
+    if(const auto* number = std::get_if<double>(&value)) {
+        return *number;
+    }
+    return std::get<FormulaError>(value);
+}
+
+// Значения одной ячейки во всех сценариях. errors пуст, если ошибок нет.
+struct SweepLane {
+    std::vector<double> values;
+    std::vector<VectorProgram::ErrorCode> errors;
+
+    SweepLane(size_t count, FormulaInterface::Value value)
+        : values(count, 0.0) {
+        if(std::holds_alternative<double>(value)) {
+            std::fill(values.begin(), values.end(), std::get<double>(value));
+        }
+        else {
+            errors.assign(count, VectorProgram::ToErrorCode(std::get<FormulaError>(value).GetCategory()));
+        }
+    }
+
+    VectorProgram::InputLanes GetInput(size_t offset) const {
+        return {values.data() + offset, errors.empty() ? nullptr : errors.data() + offset};
+    }
+};
+}  // namespace
+
+FormulaInterface::Value Sheet::SweepResult::Get(size_t scenario, size_t target) const {
+    size_t index = target * scenario_count + scenario;
+    if(errors[index] != VectorProgram::NO_ERROR) {
+        return VectorProgram::FromErrorCode(errors[index]);
+    }
+    return values[index];
+}
+
+Sheet::SweepResult Sheet::Sweep(const std::vector<Position>& inputs,
+                                const std::vector<std::vector<double>>& scenarios,
+                                const std::vector<Position>& targets,
+                                size_t thread_count) const {
+    for(const auto& positions : {&inputs, &targets}) {
+        for(const auto& pos : *positions) {
+            if(!pos.IsValid()) {
+                throw InvalidPositionException("wrong position"s);
+            }
+        }
+    }
+    for(const auto& scenario : scenarios) {
+        if(scenario.size() != inputs.size()) {
+            throw std::invalid_argument("Scenario size doesn't match the number of inputs"s);
+        }
+    }
+    const size_t count = scenarios.size();
+
+    // значения входов в наложении не используются: по нему выбираются
+    // зависящие от входов формулы и читаются значения остальных ячеек
+    Overrides overrides;
+    for(const auto& pos : inputs) {
+        overrides.emplace_back(pos, 0.0);
+    }
+    Overlay cone(*this, overrides);
+
+    std::vector<SweepLane> lanes;
+    PositionMap<size_t> lane_index;
+    for(size_t i = 0; i < inputs.size(); ++i) {
+        auto [iter, inserted] = lane_index.try_emplace(inputs[i], lanes.size());
+        if(inserted) {
+            lanes.emplace_back(count, 0.0);
+        }
+        // повторный вход переопределяет предыдущий
+        auto& values = lanes[iter->second].values;
+        for(size_t s = 0; s < count; ++s) {
+            values[s] = scenarios[s][i];
+        }
+    }
+    auto get_lane = [&] (Position pos) {
+        auto [iter, inserted] = lane_index.try_emplace(pos, lanes.size());
+        if(inserted) {
+            lanes.emplace_back(count, ToNumericValue(cone.GetValue(pos)));
+        }
+        return iter->second;
+    };
+
+    // зависящие от входов формулы, нужные для targets, в порядке вычисления
+    std::vector<Position> order;
+    PositionSet visited;
+    std::vector<std::pair<Position, bool>> stack;
+    for(auto iter = targets.rbegin(); iter != targets.rend(); ++iter) {
+        stack.emplace_back(*iter, false);
+    }
+    while(!stack.empty()) {
+        auto [pos, expanded] = stack.back();
+        stack.pop_back();
+        if(expanded) {
+            order.push_back(pos);
+            continue;
+        }
+        if(lane_index.count(pos) || !cone.IsAffected(pos) || !visited.insert(pos).second) {
+            continue;
+        }
+        stack.emplace_back(pos, true);
+        for(const auto& ref : GetConcreteCell(pos)->GetReferencedCells()) {
+            stack.emplace_back(ref, false);
+        }
+    }
+
+    struct Step {
+        Position pos;
+        const VectorProgram* program;
+        size_t output;
+        std::vector<size_t> inputs;
+    };
+    std::vector<Step> steps;
+    for(const auto& pos : order) {
+        const auto* program = GetConcreteCell(pos)->GetProgram();
+        Step step{pos, program && program->IsBatchable() ? program : nullptr, 0u, {}};
+        if(step.program) {
+            for(const auto& input : program->GetInputs()) {
+                step.inputs.push_back(get_lane(input));
+            }
+        }
+        step.output = get_lane(pos);
+        lanes[step.output].errors.assign(count, VectorProgram::NO_ERROR);
+        steps.push_back(std::move(step));
+    }
+
+    auto evaluate = [&] (size_t begin, size_t end) {
+        std::vector<VectorProgram::InputLanes> input_lanes;
+        for(const auto& step : steps) {
+            auto& output = lanes[step.output];
+            if(step.program) {
+                input_lanes.clear();
+                for(size_t index : step.inputs) {
+                    input_lanes.push_back(lanes[index].GetInput(begin));
+                }
+                step.program->Run(input_lanes, end - begin,
+                                  output.values.data() + begin, output.errors.data() + begin);
+                continue;
+            }
+            // формула читает другие листы: сценарии вычисляются по одному
+            for(size_t s = begin; s < end; ++s) {
+                Overrides scenario;
+                for(size_t i = 0; i < inputs.size(); ++i) {
+                    scenario.emplace_back(inputs[i], scenarios[s][i]);
+                }
+                auto value = ToNumericValue(Overlay(*this, scenario).GetValue(step.pos));
+                if(std::holds_alternative<double>(value)) {
+                    output.values[s] = std::get<double>(value);
+                }
+                else {
+                    output.errors[s] = VectorProgram::ToErrorCode(std::get<FormulaError>(value).GetCategory());
+                }
+            }
+        }
+    };
+
+    // каждый поток получает целое число блоков программы
+    const size_t blocks = (count + VectorProgram::BLOCK_SIZE - 1u) / VectorProgram::BLOCK_SIZE;
+    if(thread_count == 0u) {
+        thread_count = std::max(1u, std::thread::hardware_concurrency());
+    }
+    thread_count = std::max<size_t>(std::min(thread_count, blocks), 1u);
+    const size_t chunk = (blocks + thread_count - 1u) / thread_count * VectorProgram::BLOCK_SIZE;
+    std::vector<std::thread> workers;
+    for(size_t begin = chunk; begin < count; begin += chunk) {
+        workers.emplace_back(evaluate, begin, std::min(count, begin + chunk));
+    }
+    evaluate(0u, std::min(count, chunk));
+    for(auto& worker : workers) {
+        worker.join();
+    }
+
+    SweepResult res;
+    res.scenario_count = count;
+    res.target_count = targets.size();
+    res.cone_size = steps.size();
+    res.values.reserve(count * targets.size());
+    res.errors.reserve(count * targets.size());
+    for(const auto& pos : targets) {
+        const auto& lane = lanes[get_lane(pos)];
+        res.values.insert(res.values.end(), lane.values.begin(), lane.values.end());
+        if(lane.errors.empty()) {
+            res.errors.insert(res.errors.end(), count, VectorProgram::NO_ERROR);
+        }
+        else {
+            res.errors.insert(res.errors.end(), lane.errors.begin(), lane.errors.end());
+        }
+    }
+    return res;
+}
+
+void Sheet::EvaluatePrecedents(Position pos) const {
+    auto schedule = BuildSchedule({pos}, true);
+    // формула pos стоит в расписании последней и вычисляется вызывающим
+    if(!schedule.steps.empty() && schedule.steps.back().cell == GetConcreteCell(pos)) {
+        schedule.steps.pop_back();
+    }
+    RunSchedule(schedule);
+}
+
+Sheet::RefreshStats Sheet::Refresh(Position pos) const {
+    return Refresh(pos, Size{1, 1});
+}
+
+Sheet::RefreshStats Sheet::Refresh(Position top_left, Size size) const {
+    Position bottom_right{top_left.row + size.rows - 1, top_left.col + size.cols - 1};
+    if(!top_left.IsValid() || !bottom_right.IsValid() || size.rows <= 0 || size.cols <= 0) {
+        throw InvalidPositionException("wrong position"s);
+    }
+    RefreshStats stats;
+    auto key = std::make_tuple(top_left.row, top_left.col, size.rows, size.cols);
+    auto iter = schedules_.find(key);
+    if(iter == schedules_.end()) {
+        std::vector<Position> targets;
+        targets.reserve(static_cast<size_t>(size.rows) * size.cols);
+        for(int row = top_left.row; row < top_left.row + size.rows; ++row) {
+            for(int col = top_left.col; col < top_left.col + size.cols; ++col) {
+                targets.push_back(Position{row, col});
+            }
+        }
+        iter = schedules_.emplace(key, BuildSchedule(targets, false)).first;
+        stats.rebuilt = true;
+    }
+    const auto& schedule = iter->second;
+    stats.schedule_steps = schedule.steps.size();
+    stats.evaluated_cells = RunSchedule(schedule);
+    return stats;
+}
+
+size_t Sheet::RunSchedule(const Schedule& schedule) const {
+    size_t evaluated = 0;
+    std::vector<double> values;
+    std::vector<VectorProgram::ErrorCode> errors;
+    std::vector<double> stack;
+    for(const auto& step : schedule.steps) {
+        if(!step.cell->IsModified()) {
+            continue;
+        }
+        ++evaluated;
+        if(!step.program) {
+            step.cell->GetValue();
+            continue;
+        }
+        // все формулы-входы стоят в расписании раньше и уже вычислены
+        values.assign(step.inputs.size(), 0.0);
+        errors.assign(step.inputs.size(), VectorProgram::NO_ERROR);
+        for(size_t i = 0; i < step.inputs.size(); ++i) {
+            if(!step.inputs[i]) {
+                continue;
+            }
+            auto value = step.inputs[i]->GetNumericValue();
+            if(std::holds_alternative<double>(value)) {
+                values[i] = std::get<double>(value);
+            }
+            else {
+                errors[i] = VectorProgram::ToErrorCode(std::get<FormulaError>(value).GetCategory());
+            }
+        }
+        VectorProgram::ErrorCode error = VectorProgram::NO_ERROR;
+        double res = step.program->RunScalar(values.data(), errors.data(), stack, error);
+        if(error == VectorProgram::NO_ERROR) {
+            step.cell->SetCachedValue(res);
+        }
+        else {
+            step.cell->SetCachedValue(VectorProgram::FromErrorCode(error));
+        }
+    }
+    return evaluated;
+}
+
+void Sheet::GetValues(Position top_left, Size size, double* numbers, ValueCache::Tag* tags,
+                      std::string_view* texts) const {
+    ReadValues(top_left, size, numbers, tags, texts, false);
+}
+
+void Sheet::GetNumericValues(Position top_left, Size size, double* numbers, ValueCache::Tag* tags) const {
+    ReadValues(top_left, size, numbers, tags, nullptr, true);
+}
+
+void Sheet::ReadValues(Position top_left, Size size, double* numbers, ValueCache::Tag* tags,
+                       std::string_view* texts, bool as_numbers) const {
+    Position bottom_right{top_left.row + size.rows - 1, top_left.col + size.cols - 1};
+    if(!top_left.IsValid() || !bottom_right.IsValid() || size.rows <= 0 || size.cols <= 0) {
+        throw InvalidPositionException("wrong position"s);
+    }
+    // Устаревшие формулы области вычисляются по расписанию, которое не
+    // кэшируется: разовое чтение произвольной области не должно оставлять
+    // после себя расписание размером с эту область
+    std::vector<Position> dirty_formulas;
+    for(int col = 0; col < size.cols; ++col) {
+        for(int row = 0; row < size.rows; ) {
+            Position pos{top_left.row + row, top_left.col + col};
+            auto span = value_cache_.GetSpan(pos);
+            if(span.count == 0u) {
+                row += static_cast<int>(std::min(static_cast<size_t>(size.rows - row), span.empty));
+                continue;
+            }
+            size_t n = std::min(static_cast<size_t>(size.rows - row), span.count);
+            for(size_t j = 0; j < n; ++j) {
+                if(!span.IsDirty(j)) {
+                    continue;
+                }
+                Position dirty{pos.row + static_cast<int>(j), pos.col};
+                const Cell* cell = GetConcreteCell(dirty);
+                if(cell && cell->GetFormula()) {
+                    dirty_formulas.push_back(dirty);
+                }
+            }
+            row += static_cast<int>(n);
+        }
+    }
+    if(!dirty_formulas.empty()) {
+        RunSchedule(BuildSchedule(dirty_formulas, true));
+    }
+
+    auto write_text = [&] (size_t index, std::string_view text) {
+        numbers[index] = 0.0;
+        if(!as_numbers) {
+            tags[index] = ValueCache::Tag::Text;
+            if(texts) {
+                texts[index] = text;
+            }
+        }
+        else if(auto number = TextToNumber(text)) {
+            numbers[index] = *number;
+            tags[index] = ValueCache::Tag::Number;
+        }
+        else {
+            tags[index] = ValueCache::ToTag(FormulaError{FormulaError::Category::Value});
+        }
+    };
+
+    const size_t cols = static_cast<size_t>(size.cols);
+    for(int col = 0; col < size.cols; ++col) {
+        for(int row = 0; row < size.rows; ) {
+            Position pos{top_left.row + row, top_left.col + col};
+            auto span = value_cache_.GetSpan(pos);
+            if(span.count == 0u) {
+                // в этих строках нет ни одной ячейки
+                size_t n = std::min(static_cast<size_t>(size.rows - row), span.empty);
+                for(size_t j = 0; j < n; ++j) {
+                    write_text((row + j) * cols + col, {});
+                }
+                row += static_cast<int>(n);
+                continue;
+            }
+            size_t n = std::min(static_cast<size_t>(size.rows - row), span.count);
+            for(size_t j = 0; j < n; ++j) {
+                size_t index = (row + j) * cols + col;
+                auto tag = span.tags[j];
+                if(!span.IsDirty(j) && tag != ValueCache::Tag::Text) {
+                    numbers[index] = tag == ValueCache::Tag::Number ? span.values[j] : 0.0;
+                    tags[index] = tag;
+                    continue;
+                }
+                // текст, пустая позиция или ещё не прочитанное значение
+                const Cell* cell = GetConcreteCell({pos.row + static_cast<int>(j), pos.col});
+                if(!cell) {
+                    write_text(index, {});
+                    continue;
+                }
+                auto value = cell->GetValueView();
+                if(const auto* text = std::get_if<std::string_view>(&value)) {
+                    write_text(index, *text);
+                }
+                else if(const auto* number = std::get_if<double>(&value)) {
+                    numbers[index] = *number;
+                    tags[index] = ValueCache::Tag::Number;
+                }
+                else {
+                    numbers[index] = 0.0;
+                    tags[index] = ValueCache::ToTag(std::get<FormulaError>(value));
+                }
+            }
+            row += static_cast<int>(n);
+        }
+    }
+}
+
+namespace {
+// Вызывает visit для каждой позиции диапазона, в которой есть ячейка
+template <typename Cells, typename Visit>
+void ForEachOccupied(const Cells& cells, const Range& range, Visit visit) {
+    for(int row = range.top_left.row; row < range.top_left.row + range.size.rows; ++row) {
+        for(int col = range.top_left.col; col < range.top_left.col + range.size.cols; ++col) {
+            if(cells.find(Position{row, col}) != cells.end()) {
+                visit(Position{row, col});
+            }
+        }
+    }
+}
+}  // namespace
+
+Sheet::Schedule Sheet::BuildSchedule(const std::vector<Position>& targets, bool dirty_only) const {
+    Schedule schedule;
+    PositionSet visited;
+    std::set<Range> expanded_ranges;
+    std::vector<std::pair<Position, bool>> stack;
+    for(auto iter = targets.rbegin(); iter != targets.rend(); ++iter) {
+        stack.emplace_back(*iter, false);
+    }
+    // обход в глубину: формула попадает в расписание после всех своих входов
+    while(!stack.empty()) {
+        auto [pos, expanded] = stack.back();
+        stack.pop_back();
+        const Cell* cell = GetConcreteCell(pos);
+        if(expanded) {
+            Schedule::Step step;
+            step.cell = cell;
+            const auto* program = cell->GetProgram();
+            if(program->IsBatchable()) {
+                step.program = program;
+                for(const auto& input : program->GetInputs()) {
+                    step.inputs.push_back(GetConcreteCell(input));
+                }
+            }
+            schedule.steps.push_back(std::move(step));
+            continue;
+        }
+        if(!visited.insert(pos).second) {
+            continue;
+        }
+        schedule.cone.push_back(pos);
+        if(!cell || !cell->GetFormula()) {
+            continue;
+        }
+        // актуальная формула не требует вычисления ни её, ни её входов
+        if(dirty_only && !cell->IsModified()) {
+            continue;
+        }
+        stack.emplace_back(pos, true);
+        for(const auto& ref : cell->GetReferencedCells()) {
+            stack.emplace_back(ref, false);
+        }
+        // из диапазона в расписание попадают только занятые позиции: пустые
+        // на значение функции поиска не влияют, пока в них не запишут ячейку
+        for(const auto& range : cell->GetReferencedRanges()) {
+            if(!expanded_ranges.insert(range).second) {
+                continue;
+            }
+            ForEachOccupied(data_, range, [&stack] (Position ref) {
+                stack.emplace_back(ref, false);
+            });
+        }
+    }
+    std::sort(schedule.cone.begin(), schedule.cone.end());
+    return schedule;
+}
+
+void Sheet::DropSchedules(Position pos) {
+    for(auto iter = schedules_.begin(); iter != schedules_.end(); ) {
+        const auto& cone = iter->second.cone;
+        if(std::binary_search(cone.begin(), cone.end(), pos)) {
+            iter = schedules_.erase(iter);
+        }
+        else {
+            ++iter;
+        }
+    }
+}
+
+std::vector<Position> Sheet::GetPrecedents(Position pos, int max_depth) const {
+    return GetPrecedents(pos, Size{1, 1}, max_depth);
+}
+
+std::vector<Position> Sheet::GetPrecedents(Position top_left, Size size, int max_depth) const {
+    return CollectRelated(top_left, size, DependencyIndex::Direction::Precedents, max_depth);
+}
+
+std::vector<Position> Sheet::GetDependents(Position pos, int max_depth) const {
+    return GetDependents(pos, Size{1, 1}, max_depth);
+}
+
+std::vector<Position> Sheet::GetDependents(Position top_left, Size size, int max_depth) const {
+    return CollectRelated(top_left, size, DependencyIndex::Direction::Dependents, max_depth);
+}
+
+std::vector<Position> Sheet::CollectRelated(Position top_left, Size size,
+                                            DependencyIndex::Direction direction, int max_depth) const {
+    Position bottom_right{top_left.row + size.rows - 1, top_left.col + size.cols - 1};
+    if(!top_left.IsValid() || !bottom_right.IsValid() || size.rows <= 0 || size.cols <= 0) {
+        throw InvalidPositionException("wrong position"s);
+    }
+    return GetDependencyIndex().Collect(top_left, size, direction, max_depth);
+}
+
+const DependencyIndex& Sheet::GetDependencyIndex() const {
+    if(!dependency_index_) {
+        std::vector<DependencyIndex::Edge> edges;
+        for(const auto& [pos, dependents] : dependents_) {
+            for(const auto& dependent : dependents) {
+                edges.emplace_back(pos, dependent);
+            }
+        }
+        // диапазон связывает с формулой каждую свою занятую ячейку
+        for(const auto& [range, dependents] : range_dependents_) {
+            ForEachOccupied(data_, range, [&] (Position pos) {
+                for(const auto& dependent : dependents) {
+                    edges.emplace_back(pos, dependent);
+                }
+            });
+        }
+        dependency_index_ = std::make_unique<DependencyIndex>(edges);
+    }
+    return *dependency_index_;
+}
+
+bool Sheet::MarkChanged(Position pos) {
+    auto& last = last_change_[pos];
+    if(last == version_) {
+        return false;
+    }
+    last = version_;
+    change_log_.emplace_back(version_, pos);
+    if(change_log_.size() > 2u * last_change_.size() + 64u) {
+        DropStaleChanges();
+    }
+    return true;
+}
+
+void Sheet::DropStaleChanges() {
+    auto stale = std::remove_if(change_log_.begin(), change_log_.end(), [this] (const auto& entry) {
+        return last_change_.find(entry.second)->second != entry.first;
+    });
+    change_log_.erase(stale, change_log_.end());
+}
+
+uint64_t Sheet::GetVersion() const {
+    return version_;
+}
+
+std::vector<Position> Sheet::GetChangedCells(uint64_t since) const {
+    auto first = std::upper_bound(change_log_.begin(), change_log_.end(), since,
+        [] (uint64_t version, const auto& entry) {
+            return version < entry.first;
+        });
+    std::vector<Position> res;
+    for(auto iter = first; iter != change_log_.end(); ++iter) {
+        // более поздняя запись той же позиции ещё встретится дальше
+        if(last_change_.find(iter->second)->second == iter->first) {
+            res.push_back(iter->second);
+        }
+    }
+    std::sort(res.begin(), res.end());
+    return res;
+}
+
+Sheet::CellPatch Sheet::MakePatch(Position pos) const {
+    CellPatch patch;
+    patch.pos = pos;
+    if(auto cell = GetConcreteCell(pos)) {
+        patch.text = cell->GetText();
+        patch.value = cell->GetValue();
+    }
+    else {
+        patch.removed = true;
+    }
+    return patch;
+}
+
+std::vector<Sheet::CellPatch> Sheet::GetPatch(uint64_t since) const {
+    std::vector<CellPatch> res;
+    for(const auto& pos : GetChangedCells(since)) {
+        res.push_back(MakePatch(pos));
+    }
+    return res;
+}
+
+void Sheet::PrintChangedValues(std::ostream& output, uint64_t since) const {
+    for(const auto& patch : GetPatch(since)) {
+        output << patch.pos.ToString() << '\t';
+        if(!patch.removed) {
+            output << std::visit(ValueToStringVisitor(), patch.value);
+        }
+        output << '\n';
+    }
+}
+
+namespace {
+// Оценка памяти std::unordered_set: массив корзин и узлы с указателем на
+// следующий узел, значением и сохранённым хешем
+template <typename Set>
+size_t HashSetBytes(const Set& set) {
+    constexpr size_t node_bytes = sizeof(void*) + sizeof(typename Set::value_type) + sizeof(size_t);
+    return set.bucket_count() * sizeof(void*) + set.size() * node_bytes;
+}
+}  // namespace
+
+size_t Sheet::MemoryUsage::Total() const {
+    return cells + impls + cached_values + text_payloads + formula_ast + formula_references
+        + formula_programs + dependency_graph + lookup_indexes + schedules + change_tracking + storage;
+}
+
+Sheet::MemoryUsage Sheet::GetMemoryUsage() const {
+    MemoryUsage res;
+    std::unordered_set<const FormulaInterface*> formulas;
+    for(const auto& [_, cell] : data_) {
+        res.cells += sizeof(Cell);
+        res.impls += cell->GetImplBytes();
+        if(!formulas.insert(cell->GetFormula()).second) {
+            continue;
+        }
+        auto formula = cell->GetFormulaMemoryUsage();
+        res.formula_ast += formula.ast;
+        res.formula_references += formula.references;
+        res.formula_programs += formula.program;
+    }
+    res.cached_values = value_cache_.GetAllocatedBytes();
+    res.text_payloads = string_pool_.PayloadBytes();
+    res.dependency_graph = dependents_.allocated_bytes();
+    for(const auto& [_, dependents] : dependents_) {
+        res.dependency_graph += dependents.allocated_bytes();
+    }
+    // узел std::map: три указателя, цвет и значение
+    constexpr size_t map_node_bytes = 4u * sizeof(void*);
+    for(const auto& [_, dependents] : range_dependents_) {
+        res.dependency_graph += map_node_bytes + sizeof(Range) + HashSetBytes(dependents);
+    }
+    res.dependency_graph += range_index_.GetAllocatedBytes();
+    for(const auto* indexes : {&column_indexes_, &row_indexes_}) {
+        for(const auto& [_, index] : *indexes) {
+            res.lookup_indexes += map_node_bytes + sizeof(int) + sizeof(LookupIndex) + index->GetAllocatedBytes();
+        }
+    }
+    for(const auto& [_, schedule] : schedules_) {
+        res.schedules += map_node_bytes + sizeof(std::tuple<int, int, int, int>) + sizeof(Schedule)
+            + schedule.steps.capacity() * sizeof(Schedule::Step)
+            + schedule.cone.capacity() * sizeof(Position);
+        for(const auto& step : schedule.steps) {
+            res.schedules += step.inputs.capacity() * sizeof(const Cell*);
+        }
+    }
+    res.change_tracking = last_change_.allocated_bytes()
+        + change_log_.capacity() * sizeof(change_log_.front())
+        + subscriptions_.capacity() * sizeof(Subscription);
+    res.storage = data_.allocated_bytes() + string_pool_.OverheadBytes();
+    return res;
+}
+
+size_t Sheet::Compact() {
+    size_t before = GetMemoryUsage().Total();
+    // содержимое листа не меняется: только таблицы уменьшаются под число
+    // элементов
+    data_.shrink_to_fit();
+
+    for(auto& [_, dependents] : dependents_) {
+        dependents.shrink_to_fit();
+    }
+    dependents_.shrink_to_fit();
+    // индексы поиска строятся заново при следующем поиске
+    column_indexes_.clear();
+    row_indexes_.clear();
+    // как и расписания Refresh
+    schedules_.clear();
+
+    DropStaleChanges();
+    change_log_.shrink_to_fit();
+    last_change_.shrink_to_fit();
+    subscriptions_.shrink_to_fit();
+
+    string_pool_.Compact();
+    size_t after = GetMemoryUsage().Total();
+    return before > after ? before - after : 0u;
+}
+
+bool Sheet::Subscription::Contains(Position pos) const {
+    return top_left.row <= pos.row && pos.row <= bottom_right.row
+        && top_left.col <= pos.col && pos.col <= bottom_right.col;
+}
+
+Sheet::SubscriptionId Sheet::Subscribe(Position top_left, Size size, ChangeCallback callback) {
+    Position bottom_right{top_left.row + size.rows - 1, top_left.col + size.cols - 1};
+    if(!top_left.IsValid() || !bottom_right.IsValid() || size.rows <= 0 || size.cols <= 0) {
+        throw InvalidPositionException("wrong subscription area"s);
+    }
+    if(subscriptions_.empty()) {
+        notified_version_ = version_;
+    }
+    subscriptions_.push_back({next_subscription_id_, top_left, bottom_right, std::move(callback)});
+    return next_subscription_id_++;
+}
+
+Sheet::SubscriptionId Sheet::Subscribe(Position pos, ChangeCallback callback) {
+    return Subscribe(pos, Size{1, 1}, std::move(callback));
+}
+
+void Sheet::Unsubscribe(SubscriptionId id) {
+    auto iter = std::find_if(subscriptions_.begin(), subscriptions_.end(), [id] (const auto& subscription) {
+        return subscription.id == id;
+    });
+    if(iter != subscriptions_.end()) {
+        subscriptions_.erase(iter);
+    }
+}
+
+void Sheet::NotifySubscribers() {
+    if(subscriptions_.empty() || notified_version_ == version_) {
+        return;
+    }
+    auto since = std::exchange(notified_version_, version_);
+    // значения вычисляются только для ячеек, на которые кто-то подписан
+    std::vector<CellPatch> patch;
+    for(const auto& pos : GetChangedCells(since)) {
+        bool subscribed = std::any_of(subscriptions_.begin(), subscriptions_.end(),
+            [pos] (const auto& subscription) {
+                return subscription.Contains(pos);
+            });
+        if(subscribed) {
+            patch.push_back(MakePatch(pos));
+        }
+    }
+    std::vector<std::pair<ChangeCallback, std::vector<CellPatch>>> batches;
+    for(const auto& subscription : subscriptions_) {
+        std::vector<CellPatch> changes;
+        for(const auto& change : patch) {
+            if(subscription.Contains(change.pos)) {
+                changes.push_back(change);
+            }
+        }
+        if(!changes.empty()) {
+            batches.emplace_back(subscription.callback, std::move(changes));
+        }
+    }
+    // обработчик может изменить лист или список подписок
+    for(const auto& [callback, changes] : batches) {
+        callback(changes);
+    }
+}
+
+Sheet::RecalculationStats Sheet::Recalculate() const {
+    RecalculationStats stats;
+    std::vector<const Cell*> scalar_cells;
+    auto runs = FindFormulaRuns(scalar_cells);
+
+    // Пакет, читающий результаты другого пакета, вычисляется после него.
+    // Порядок влияет только на скорость: непосчитанный вход всё равно будет
+    // вычислен по одной ячейке при чтении.
+    std::vector<std::vector<size_t>> inputs_of(runs.size());
+    for(size_t i = 0; i < runs.size(); ++i) {
+        for(const auto& input : runs[i].program->GetInputs()) {
+            for(size_t j = 0; j < runs.size(); ++j) {
+                if(i != j && runs[j].top.col == input.col
+                   && runs[j].top.row < input.row + runs[i].rows
+                   && input.row < runs[j].top.row + runs[j].rows) {
+                    inputs_of[i].push_back(j);
+                }
+            }
+        }
+    }
+    std::vector<char> visited(runs.size(), 0);
+    std::vector<size_t> order;
+    order.reserve(runs.size());
+    for(size_t root = 0; root < runs.size(); ++root) {
+        std::vector<std::pair<size_t, size_t>> stack;
+        if(!visited[root]) {
+            visited[root] = 1;
+            stack.push_back({root, 0u});
+        }
+        while(!stack.empty()) {
+            auto& [run, next] = stack.back();
+            if(next < inputs_of[run].size()) {
+                auto input_run = inputs_of[run][next++];
+                if(!visited[input_run]) {
+                    visited[input_run] = 1;
+                    stack.push_back({input_run, 0u});
+                }
+                continue;
+            }
+            order.push_back(run);
+            stack.pop_back();
+        }
+    }
+
+    for(auto index : order) {
+        EvaluateFormulaRun(runs[index]);
+        stats.batched_cells += runs[index].rows;
+    }
+    for(const auto* cell : scalar_cells) {
+        if(cell->IsModified()) {
+            cell->GetValue();
+            ++stats.scalar_cells;
+        }
+    }
+    return stats;
+}
+
+std::vector<Sheet::FormulaRun> Sheet::FindFormulaRuns(std::vector<const Cell*>& scalar_cells) const {
+    std::vector<std::pair<Position, const Cell*>> dirty;
+    for(const auto& [pos, cell] : data_) {
+        const auto* program = cell->GetProgram();
+        if(cell->IsModified() && program && program->IsBatchable()) {
+            dirty.emplace_back(pos, cell.get());
+        }
+    }
+    std::sort(dirty.begin(), dirty.end(), [] (const auto& lhs, const auto& rhs) {
+        return std::tie(lhs.first.col, lhs.first.row) < std::tie(rhs.first.col, rhs.first.row);
+    });
+
+    std::vector<FormulaRun> runs;
+    for(size_t begin = 0; begin < dirty.size(); ) {
+        auto [top, top_cell] = dirty[begin];
+        const auto* program = top_cell->GetProgram();
+        size_t end = begin + 1u;
+        while(end < dirty.size()) {
+            int shift = static_cast<int>(end - begin);
+            const auto& [pos, cell] = dirty[end];
+            if(pos.col != top.col || pos.row != top.row + shift
+               || !program->IsShiftOf(*cell->GetProgram(), shift, 0)) {
+                break;
+            }
+            ++end;
+        }
+
+        FormulaRun run{top, static_cast<int>(end - begin), program};
+        // формулы, читающие собственный столбец в пределах пакета (накопительные
+        // суммы и т.п.), зависят друг от друга и считаются по одной
+        bool self_dependent = std::any_of(program->GetInputs().begin(), program->GetInputs().end(),
+            [&run] (Position input) {
+                return input.col == run.top.col && input.row < run.top.row + run.rows
+                    && run.top.row < input.row + run.rows;
+            });
+        if(run.rows >= MIN_BATCH_ROWS && !self_dependent && !program->GetInputs().empty()) {
+            runs.push_back(run);
+        }
+        else {
+            for(size_t i = begin; i < end; ++i) {
+                scalar_cells.push_back(dirty[i].second);
+            }
+        }
+        begin = end;
+    }
+    return runs;
+}
+
+void Sheet::EvaluateFormulaRun(const FormulaRun& run) const {
+    const auto& inputs = run.program->GetInputs();
+    const size_t rows = static_cast<size_t>(run.rows);
+
+    std::vector<double> input_values(inputs.size() * rows, 0.0);
+    std::vector<VectorProgram::ErrorCode> input_errors(inputs.size() * rows, VectorProgram::NO_ERROR);
+    std::vector<VectorProgram::InputLanes> lanes(inputs.size());
+    for(size_t i = 0; i < inputs.size(); ++i) {
+        double* values = input_values.data() + i * rows;
+        VectorProgram::ErrorCode* errors = input_errors.data() + i * rows;
+        bool has_errors = false;
+        // числа и ошибки читаются прямо из столбцов кэша значений; устаревшие
+        // значения и текст вычисляются и преобразуются через ячейку
+        for(size_t k = 0; k < rows; ) {
+            Position pos{inputs[i].row + static_cast<int>(k), inputs[i].col};
+            auto span = value_cache_.GetSpan(pos);
+            if(span.count == 0u) {
+                // в этих строках нет ни одной ячейки: все значения нулевые
+                k += std::min(rows - k, span.empty);
+                continue;
+            }
+            size_t n = std::min(rows - k, span.count);
+            for(size_t j = 0; j < n; ++j, ++k) {
+                auto tag = span.tags[j];
+                if(!span.IsDirty(j) && tag == ValueCache::Tag::Number) {
+                    values[k] = span.values[j];
+                    continue;
+                }
+                if(!span.IsDirty(j) && ValueCache::IsError(tag)) {
+                    errors[k] = VectorProgram::ToErrorCode(ValueCache::ToError(tag).GetCategory());
+                    has_errors = true;
+                    continue;
+                }
+                const Cell* cell = GetConcreteCell({pos.row + static_cast<int>(j), pos.col});
+                if(!cell) {
+                    continue;
+                }
+                auto value = cell->GetNumericValue();
+                if(std::holds_alternative<double>(value)) {
+                    values[k] = std::get<double>(value);
+                }
+                else {
+                    errors[k] = VectorProgram::ToErrorCode(std::get<FormulaError>(value).GetCategory());
+                    has_errors = true;
+                }
+            }
+        }
+        lanes[i] = {values, has_errors ? errors : nullptr};
+    }
+
+    std::vector<double> values(rows);
+    std::vector<VectorProgram::ErrorCode> errors(rows);
+    run.program->Run(lanes, rows, values.data(), errors.data());
+
+    for(size_t k = 0; k < rows; ++k) {
+        Position pos{run.top.row + static_cast<int>(k), run.top.col};
+        if(errors[k] != VectorProgram::NO_ERROR) {
+            value_cache_.SetError(pos, VectorProgram::FromErrorCode(errors[k]));
+        }
+        else {
+            value_cache_.SetNumber(pos, values[k]);
+        }
     }
-    return res;
 }
 
 std::unique_ptr<SheetInterface> CreateSheet() {
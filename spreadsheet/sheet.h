@@ -2,20 +2,80 @@
 
 #include "cell.h"
 #include "common.h"
+#include "dependency_index.h"
+#include "formula_cache.h"
+#include "formula_compiler.h"
+#include "lookup_index.h"
+#include "position_map.h"
+#include "range_index.h"
+#include "string_pool.h"
+#include "value_cache.h"
+#include "vector_program.h"
 
 #include <functional>
-#include <unordered_map>
+#include <map>
+#include <string>
+#include <tuple>
 #include <unordered_set>
 
+class Workbook;
+
 class Sheet : public SheetInterface {
 public:
+    Sheet() = default;
+    // Лист книги workbook: формулы листа могут ссылаться на другие её листы
+    Sheet(Workbook& workbook, std::string name);
     ~Sheet();
 
     void SetCell(Position pos, std::string text) override;
 
+    // Записывает в ячейку число без разбора текста. Значение ячейки - число,
+    // текст - его запись, как при выводе значений. Повторная запись числа в
+    // ту же ячейку обновляет его на месте.
+    void SetNumber(Position pos, double value);
+    // Записывает пачку чисел и сбрасывает зависимые формулы одним проходом.
+    // Если позиция встречается несколько раз, остаётся последнее значение.
+    // Бросает InvalidPositionException до каких-либо изменений.
+    void SetNumbers(const std::vector<std::pair<Position, double>>& updates);
+
     const CellInterface* GetCell(Position pos) const override;
     CellInterface* GetCell(Position pos) override;
 
+    // Копирует ячейки области size с левым верхним углом src_top_left в такую
+    // же область с углом dst_top_left, как вставка в настольных таблицах:
+    // ссылки формул сдвигаются на смещение прямо в разобранных формулах, без
+    // разбора текста, а ссылки, вышедшие за пределы таблицы, дают #REF!.
+    // Пустые позиции источника очищают назначение; области могут
+    // пересекаться. Все новые формулы проверяются на циклы одним обходом; при
+    // цикле бросается CircularDependencyException и лист не меняется.
+    void CopyRange(Position src_top_left, Size size, Position dst_top_left);
+    // Заполняют область копиями её верхней строки (FillDown) или левого
+    // столбца (FillRight) по тем же правилам
+    void FillDown(Position top_left, Size size);
+    void FillRight(Position top_left, Size size);
+
+    enum class SortOrder {
+        Ascending,
+        Descending,
+    };
+    struct SortKey {
+        // столбец листа внутри сортируемой области
+        int col = 0;
+        SortOrder order = SortOrder::Ascending;
+    };
+    // Сортирует строки области size с левым верхним углом top_left по
+    // значениям ключевых столбцов: при равенстве первого ключа сравнивается
+    // второй и т.д., равные строки сохраняют взаимный порядок. Как в
+    // настольных таблицах, числа идут раньше текста, текст (регистр латинских
+    // букв не учитывается) раньше ошибок, а пустые значения всегда в конце.
+    // Ячейки переставленных строк переносятся в хранилище без копирования;
+    // ссылки их формул сдвигаются на смещение строки, как в CopyRange, а
+    // ссылки остальных формул на ячейки области не меняются. Строки, оставшиеся
+    // на месте, не затрагиваются. Бросает InvalidPositionException, если ключ
+    // вне области, и CircularDependencyException, если сдвинутые формулы
+    // образуют цикл; в обоих случаях лист не меняется.
+    void SortRange(Position top_left, Size size, const std::vector<SortKey>& keys);
+
     void ClearCell(Position pos) override;
 
     Size GetPrintableSize() const override;
@@ -23,15 +83,332 @@ public:
     void PrintValues(std::ostream& output) const override;
     void PrintTexts(std::ostream& output) const override;
 
+    const SheetInterface* FindSheet(std::string_view name) const override;
+    // Индексы создаются при первом поиске в области и живут, пока на
+    // охватывающий их диапазон ссылается хотя бы одна формула; правки ячеек
+    // отмечают устаревшими только их позиции.
+    const LookupIndex* GetLookupIndex(const Range& area) const override;
+
+    StringPool& GetStringPool();
+    const StringPool& GetStringPool() const;
+
+    // Вычисляет устаревшие формулы, от которых зависит формула в позиции pos,
+    // в порядке зависимостей, как Refresh, но без сохранения расписания.
+    // После этого формула вычисляется без рекурсии по цепочке ссылок, сколь
+    // бы длинной та ни была.
+    void EvaluatePrecedents(Position pos) const;
+
+    // Вычисленные значения ячеек листа
+    ValueCache& GetValueCache();
+    const ValueCache& GetValueCache() const;
+
+    // Кэш разобранных формул листа: ячейки с одинаковым текстом формулы
+    // разделяют её разобранное представление
+    FormulaCache& GetFormulaCache();
+    const FormulaCache& GetFormulaCache() const;
+
+    // Когда разбираются формулы, записанные в ячейки листа
+    enum class Compilation {
+        // при записи в ячейку; некорректная формула сразу даёт FormulaException
+        Eager,
+        // при первом вычислении, см. ParseFormulaLazily; ячейка хранит текст
+        // формулы и её ссылки, поэтому проверка циклов и зависимости работают
+        // как обычно
+        Lazy,
+        // как Lazy, но фоновый поток разбирает формулы заранее, в порядке записи
+        Background,
+    };
+    // Режим действует на формулы, записанные после его установки
+    void SetCompilation(Compilation mode);
+    Compilation GetCompilation() const;
+    // Фоновый разборщик формул в режиме Background, иначе nullptr
+    FormulaCompiler* GetFormulaCompiler() const;
+
+    // Сбрасывает кэш ячейки и всех зависящих от неё формул, в том числе на
+    // других листах книги
+    void InvalidateCell(Position pos);
+
+    struct RecalculationStats {
+        size_t batched_cells = 0;
+        size_t scalar_cells = 0;
+    };
+    // Вычисляет все формулы с устаревшим значением. Подряд идущие в столбце
+    // копии одной относительной формулы (=A1*B1, =A2*B2, ...) вычисляются одним
+    // пакетом: входы читаются в непрерывные массивы, формула выполняется
+    // векторной программой сразу для всех строк.
+    RecalculationStats Recalculate() const;
+
+    // Приводит в актуальное состояние значения области по кэшированному
+    // расписанию: формулам области и всех влияющих на неё ячеек в порядке
+    // вычисления, с уже найденными ячейками-входами. Повторный вызов проходит
+    // расписание и вычисляет только устаревшие формулы, без поиска ячеек по
+    // позициям. Изменение чисел (SetNumber, SetNumbers) расписание не
+    // затрагивает; оно строится заново, только если изменилась структура одной
+    // из его ячеек: SetCell, ClearCell или замена числом формулы. Расписание
+    // хранится до такого изменения или до Compact, поэтому Refresh нужен для
+    // областей, которые читаются многократно.
+    struct RefreshStats {
+        size_t schedule_steps = 0;
+        size_t evaluated_cells = 0;
+        bool rebuilt = false;
+    };
+    RefreshStats Refresh(Position top_left, Size size) const;
+    RefreshStats Refresh(Position pos) const;
+
+    // Читает значения области size с левым верхним углом top_left в плотные
+    // буферы вызывающего по строкам: значение (row, col) области попадает в
+    // элемент row * size.cols + col. tags получает вид значения, numbers -
+    // число (0 для текста и ошибок), texts - текст, который остаётся
+    // действительным до изменения ячейки; texts может быть nullptr. Пустая
+    // позиция читается как пустой текст. Устаревшие формулы области сначала
+    // вычисляются по расписанию, как в Refresh, после чего числа и ошибки
+    // копируются прямо из столбцов кэша значений. В отличие от Refresh,
+    // расписание строится только для устаревших формул и не сохраняется.
+    void GetValues(Position top_left, Size size, double* numbers, ValueCache::Tag* tags,
+                   std::string_view* texts = nullptr) const;
+    // То же для значений как операндов формулы: текст с числом - число, пустая
+    // позиция - 0, прочий текст - ошибка #VALUE!. tags получает Number или
+    // тег ошибки.
+    void GetNumericValues(Position top_left, Size size, double* numbers, ValueCache::Tag* tags) const;
+
+    // Транзитивные влияющие ячейки (на которые прямо или косвенно ссылается
+    // формула) и зависимые формулы ячейки или области, без неё самой, в порядке
+    // строк и столбцов. max_depth ограничивает длину цепочки ссылок: 1 -
+    // только непосредственные. Учитываются ссылки в пределах листа.
+    // Запросы выполняются по компактному снимку графа, который строится при
+    // первом запросе после изменения зависимостей.
+    std::vector<Position> GetPrecedents(Position pos,
+                                        int max_depth = DependencyIndex::UNLIMITED_DEPTH) const;
+    std::vector<Position> GetPrecedents(Position top_left, Size size,
+                                        int max_depth = DependencyIndex::UNLIMITED_DEPTH) const;
+    std::vector<Position> GetDependents(Position pos,
+                                        int max_depth = DependencyIndex::UNLIMITED_DEPTH) const;
+    std::vector<Position> GetDependents(Position top_left, Size size,
+                                        int max_depth = DependencyIndex::UNLIMITED_DEPTH) const;
+
+    // Вычисляет значения ячеек targets так, как если бы ячейки overrides имели
+    // указанные значения, не изменяя ни содержимого, ни кэша листа.
+    // Заново вычисляются только формулы, зависящие от overrides (и ещё не
+    // вычисленные), которые нужны для targets; остальные значения берутся из
+    // кэша листа. Ссылки на другие листы книги читают их обычные значения.
+    // Несколько вызовов Evaluate могут выполняться одновременно из разных
+    // потоков, но не одновременно с изменением листа или чтением значений,
+    // которые ещё не вычислены.
+    using Overrides = std::vector<std::pair<Position, CellInterface::Value>>;
+    std::vector<CellInterface::Value> Evaluate(const Overrides& overrides,
+                                               const std::vector<Position>& targets) const;
+
+    // Результат Sweep: значения целевых ячеек во всех сценариях. Значения
+    // одной ячейки лежат подряд: values[target * scenario_count + scenario].
+    struct SweepResult {
+        size_t scenario_count = 0;
+        size_t target_count = 0;
+        std::vector<double> values;
+        std::vector<VectorProgram::ErrorCode> errors;
+        // число формул, вычисленных для каждого сценария
+        size_t cone_size = 0;
+
+        FormulaInterface::Value Get(size_t scenario, size_t target) const;
+    };
+    // Вычисляет targets сразу для многих сценариев: scenarios[s][i] - значение
+    // ячейки inputs[i] в сценарии s. Формулы, которые зависят от входов и нужны
+    // для targets, выбираются один раз; каждая из них выполняется векторной
+    // программой сразу для всех сценариев, а сценарии делятся между
+    // thread_count потоками (0 - по числу ядер). Как и Evaluate, лист не
+    // изменяется. Бросает std::invalid_argument, если размер сценария не
+    // совпадает с числом входов.
+    SweepResult Sweep(const std::vector<Position>& inputs,
+                      const std::vector<std::vector<double>>& scenarios,
+                      const std::vector<Position>& targets,
+                      size_t thread_count = 0) const;
+
+    // Номер последнего изменения листа. Растёт при каждом SetCell/ClearCell,
+    // а также когда меняется ячейка другого листа, от которой зависят формулы
+    // этого листа.
+    uint64_t GetVersion() const;
+
+    // Ячейка, текст или значение которой могли измениться. У удалённой ячейки
+    // removed == true, а текст и значение пустые.
+    struct CellPatch {
+        Position pos;
+        bool removed = false;
+        std::string text;
+        CellInterface::Value value;
+    };
+    // Позиции ячеек, изменившихся после версии since, в порядке строк и
+    // столбцов. Время работы пропорционально числу изменений после since, а не
+    // размеру листа.
+    std::vector<Position> GetChangedCells(uint64_t since) const;
+    std::vector<CellPatch> GetPatch(uint64_t since) const;
+    // Выводит изменения после версии since построчно: позиция, знак табуляции и
+    // значение ячейки. Удалённая ячейка выводится с пустым значением.
+    void PrintChangedValues(std::ostream& output, uint64_t since) const;
+
+    // Память, занимаемая листом, по составляющим, в байтах. Формулы, общие
+    // для нескольких ячеек, учитываются один раз.
+    struct MemoryUsage {
+        size_t cells = 0;               // объекты Cell
+        size_t impls = 0;               // реализации ячеек (текст, формула)
+        size_t cached_values = 0;       // столбцы вычисленных значений
+        size_t text_payloads = 0;       // тексты в пуле строк
+        size_t formula_ast = 0;         // узлы деревьев формул
+        size_t formula_references = 0;  // списки ячеек, на которые ссылаются формулы
+        size_t formula_programs = 0;    // скомпилированные формулы
+        size_t dependency_graph = 0;    // обратные рёбра графа зависимостей
+        size_t lookup_indexes = 0;      // индексы функций поиска
+        size_t schedules = 0;           // расписания Refresh
+        size_t change_tracking = 0;     // журнал изменений и подписки
+        size_t storage = 0;             // таблица ячеек и служебные структуры пула
+
+        size_t Total() const;
+    };
+    MemoryUsage GetMemoryUsage() const;
+
+    // Освобождает неиспользуемую память: уменьшает таблицы после массового
+    // удаления ячеек, удаляет устаревшие записи журнала изменений, индексы
+    // поиска и расписания Refresh, которые построятся заново при следующем
+    // обращении. Содержимое
+    // листа, его версия и журнал изменений для читателя не меняются.
+    // Возвращает число освобождённых байт.
+    size_t Compact();
+
+    // Подписка на изменения значений ячеек области size с левым верхним углом
+    // top_left. После каждой правки подписчик получает одним вызовом все
+    // изменившиеся ячейки своей области, включая пересчитанные формулы. Пока
+    // подписок нет, правки листа не выполняют для них никакой работы.
+    using ChangeCallback = std::function<void(const std::vector<CellPatch>& changes)>;
+    using SubscriptionId = size_t;
+    SubscriptionId Subscribe(Position top_left, Size size, ChangeCallback callback);
+    SubscriptionId Subscribe(Position pos, ChangeCallback callback);
+    void Unsubscribe(SubscriptionId id);
+
 private:
+    using PositionSet = std::unordered_set<Position, PositionHasher>;
+
+    const Cell* GetConcreteCell(Position pos) const;
+    Cell* GetConcreteCell(Position pos);
+
     std::pair<Position, Position> GetLeftRightCorners() const;
     
-    bool CheckForCircularDependencies(const CellInterface* cell, Position head) const;
+    Sheet* ResolveSheet(std::string_view name) const;
+
+    bool CheckForCircularDependencies(const Cell& cell, Position head) const;
+    // Новые ячейки для позиций листа; nullptr - позиция очищается
+    using CellUpdates = std::vector<std::pair<Position, std::unique_ptr<Cell>>>;
+    bool CheckForCircularDependencies(const CellUpdates& updates) const;
+    // Заполняет область dst_size с углом dst_top_left копиями области
+    // src_size с углом src_top_left, повторяя её по строкам и столбцам
+    void PasteCells(Position src_top_left, Size src_size, Position dst_top_left, Size dst_size);
+
+    void AddDependencies(Position pos, const Cell& cell);
+    void RemoveDependencies(Position pos, const Cell& cell);
+    void InvalidateDependents(Position pos);
+    void InvalidateDependents(const std::vector<Position>& positions);
+    // Добавляет в out формулы, которые ищут по диапазонам, содержащим pos
+    void AppendRangeDependents(Position pos, std::vector<Position>& out) const;
+    // Отмечает позицию pos устаревшей в индексах поиска
+    void InvalidateLookupIndexes(Position pos);
+    // Удаляет индексы строк и столбцов области range, которые больше не
+    // пересекает ни один диапазон
+    void DropUncoveredLookupIndexes(const Range& range);
+
+    class Overlay;
+
+    const DependencyIndex& GetDependencyIndex() const;
+    std::vector<Position> CollectRelated(Position top_left, Size size, DependencyIndex::Direction direction,
+                                         int max_depth) const;
+
+    // Расписание вычисления области для Refresh
+    struct Schedule {
+        struct Step {
+            const Cell* cell = nullptr;
+            // nullptr, если формулу можно вычислить только через ячейку
+            const VectorProgram* program = nullptr;
+            // ячейки входов программы; nullptr - пустая позиция
+            std::vector<const Cell*> inputs;
+        };
+        std::vector<Step> steps;
+        // позиции, от содержимого которых зависит расписание, по возрастанию
+        std::vector<Position> cone;
+    };
+    // Расписание для формул targets и всех влияющих на них ячеек. Если
+    // dirty_only, актуальные формулы не раскрываются и в расписание не попадают.
+    Schedule BuildSchedule(const std::vector<Position>& targets, bool dirty_only) const;
+    // Вычисляет устаревшие формулы расписания; возвращает их число
+    size_t RunSchedule(const Schedule& schedule) const;
+    void ReadValues(Position top_left, Size size, double* numbers, ValueCache::Tag* tags,
+                    std::string_view* texts, bool as_numbers) const;
+    // Удаляет расписания, которые ссылаются на ячейку в позиции pos
+    void DropSchedules(Position pos);
+
+    // Отмечает изменение позиции в текущей версии. Возвращает false, если
+    // позиция в ней уже отмечена.
+    bool MarkChanged(Position pos);
+    void DropStaleChanges();
+    CellPatch MakePatch(Position pos) const;
+    void NotifySubscribers();
+
+    // Столбец из rows подряд идущих формул, совпадающих с точностью до сдвига
+    struct FormulaRun {
+        Position top;
+        int rows = 0;
+        const VectorProgram* program = nullptr;
+    };
+    static constexpr int MIN_BATCH_ROWS = 4;
+
+    std::vector<FormulaRun> FindFormulaRuns(std::vector<const Cell*>& scalar_cells) const;
+    void EvaluateFormulaRun(const FormulaRun& run) const;
     
 private:
-    struct position_hash { 
-        size_t operator()(const Position& p) const;
+    // пул объявлен раньше ячеек, чтобы пережить их при разрушении таблицы
+    StringPool string_pool_;
+    FormulaCache formula_cache_;
+    // значения вычисляются лениво, в том числе при чтении константного листа
+    mutable ValueCache value_cache_;
+    PositionMap<std::unique_ptr<Cell>> data_;
+    // Обратные рёбра графа зависимостей: позиция -> ячейки, чьи формулы на неё
+    // ссылаются. Узлом графа может быть и пустая позиция без объекта Cell,
+    // поэтому ссылки на пустые ячейки не занимают места в data_ и не влияют
+    // на область печати.
+    PositionMap<SmallPositionSet> dependents_;
+    // Рёбра от диапазонов функций поиска: диапазон -> ячейки, чьи формулы по
+    // нему ищут. Ячейки диапазона в dependents_ не добавляются.
+    std::map<Range, PositionSet> range_dependents_;
+    // диапазоны range_dependents_ по строкам и столбцам
+    RangeIndex range_index_;
+    // Индексы поиска по номеру столбца и строки. Индекс одного столбца служит
+    // всем диапазонам в нём, в том числе сдвинутым копиям одного диапазона, и
+    // живёт, пока столбец пересекает хотя бы один диапазон range_dependents_.
+    mutable std::map<int, std::unique_ptr<LookupIndex>> column_indexes_;
+    mutable std::map<int, std::unique_ptr<LookupIndex>> row_indexes_;
+    // снимок графа для запросов зависимостей; сбрасывается при изменении рёбер
+    mutable std::unique_ptr<DependencyIndex> dependency_index_;
+    // расписания Refresh по области: строка, столбец, число строк и столбцов
+    mutable std::map<std::tuple<int, int, int, int>, Schedule> schedules_;
+    Compilation compilation_ = Compilation::Eager;
+    std::unique_ptr<FormulaCompiler> formula_compiler_;
+    // Книга, которой принадлежит лист, или nullptr для отдельного листа.
+    // Рёбра графа между листами хранит книга.
+    Workbook* workbook_ = nullptr;
+    std::string name_;
+
+    uint64_t version_ = 0;
+    // Журнал изменений в порядке версий и последняя версия каждой позиции.
+    // Запись журнала действительна, только если она последняя для своей
+    // позиции; устаревшие записи удаляются, когда их становится слишком много.
+    std::vector<std::pair<uint64_t, Position>> change_log_;
+    PositionMap<uint64_t> last_change_;
+
+    struct Subscription {
+        SubscriptionId id;
+        Position top_left;
+        Position bottom_right;
+        ChangeCallback callback;
+
+        bool Contains(Position pos) const;
     };
-    
-    std::unordered_map<Position, std::unique_ptr<CellInterface>, position_hash> data_;
+    std::vector<Subscription> subscriptions_;
+    SubscriptionId next_subscription_id_ = 0;
+    // Версия, об изменениях до которой подписчики уже оповещены
+    uint64_t notified_version_ = 0;
 };
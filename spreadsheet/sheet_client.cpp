@@ -0,0 +1,340 @@
+#include "sheet_client.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <optional>
+#include <stdexcept>
+#include <system_error>
+#include <utility>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace std::literals;
+using sheet_protocol::Command;
+using sheet_protocol::Op;
+using sheet_protocol::ProtocolError;
+using sheet_protocol::Result;
+using sheet_protocol::Status;
+
+namespace {
+#ifdef MSG_NOSIGNAL
+constexpr int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+constexpr int SEND_FLAGS = 0;
+#endif
+
+constexpr size_t READ_CHUNK_SIZE = 64u << 10u;
+
+[[noreturn]] void ThrowSystemError(const char* what) {
+    throw std::system_error(errno, std::generic_category(), what);
+}
+
+// Позиции передаются беззнаковыми, поэтому проверяются до отправки
+void CheckPosition(Position pos) {
+    if(!pos.IsValid()) {
+        throw InvalidPositionException("wrong position"s);
+    }
+}
+
+Command MakeCommand(Op op, uint32_t sheet, Position pos = {}, Size size = {}) {
+    Command res;
+    res.op = op;
+    res.sheet = sheet;
+    res.pos = pos;
+    res.size = size;
+    return res;
+}
+
+int Connect(int domain, const sockaddr* address, socklen_t length) {
+    int fd = socket(domain, SOCK_STREAM, 0);
+    if(fd < 0) {
+        ThrowSystemError("socket");
+    }
+    while(connect(fd, address, length) < 0) {
+        if(errno != EINTR) {
+            int error = errno;
+            close(fd);
+            throw std::system_error(error, std::generic_category(), "connect");
+        }
+    }
+#ifdef SO_NOSIGPIPE
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+    return fd;
+}
+}  // namespace
+
+SheetClient::Batch& SheetClient::Batch::Open(std::string name) {
+    Command command;
+    command.op = Op::Open;
+    command.text = std::move(name);
+    return Add(std::move(command));
+}
+
+SheetClient::Batch& SheetClient::Batch::SetCell(uint32_t sheet, Position pos, std::string text) {
+    CheckPosition(pos);
+    auto command = MakeCommand(Op::SetCell, sheet, pos);
+    command.text = std::move(text);
+    return Add(std::move(command));
+}
+
+SheetClient::Batch& SheetClient::Batch::SetNumber(uint32_t sheet, Position pos, double value) {
+    CheckPosition(pos);
+    auto command = MakeCommand(Op::SetNumber, sheet, pos);
+    command.number = value;
+    return Add(std::move(command));
+}
+
+SheetClient::Batch& SheetClient::Batch::ClearCell(uint32_t sheet, Position pos) {
+    CheckPosition(pos);
+    return Add(MakeCommand(Op::ClearCell, sheet, pos));
+}
+
+SheetClient::Batch& SheetClient::Batch::GetValue(uint32_t sheet, Position pos) {
+    CheckPosition(pos);
+    return Add(MakeCommand(Op::GetValue, sheet, pos));
+}
+
+SheetClient::Batch& SheetClient::Batch::GetText(uint32_t sheet, Position pos) {
+    CheckPosition(pos);
+    return Add(MakeCommand(Op::GetText, sheet, pos));
+}
+
+SheetClient::Batch& SheetClient::Batch::GetRange(uint32_t sheet, Position top_left, Size size) {
+    CheckPosition(top_left);
+    if(size.rows < 0 || size.cols < 0) {
+        throw InvalidPositionException("wrong position"s);
+    }
+    return Add(MakeCommand(Op::GetRange, sheet, top_left, size));
+}
+
+SheetClient::Batch& SheetClient::Batch::PrintValues(uint32_t sheet) {
+    return Add(MakeCommand(Op::PrintValues, sheet));
+}
+
+SheetClient::Batch& SheetClient::Batch::PrintTexts(uint32_t sheet) {
+    return Add(MakeCommand(Op::PrintTexts, sheet));
+}
+
+size_t SheetClient::Batch::GetSize() const {
+    return commands_.size();
+}
+
+void SheetClient::Batch::Clear() {
+    commands_.clear();
+}
+
+SheetClient::Batch& SheetClient::Batch::Add(Command command) {
+    commands_.push_back(std::move(command));
+    return *this;
+}
+
+SheetClient SheetClient::ConnectUnix(const std::string& path) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if(path.size() >= sizeof(address.sun_path)) {
+        throw std::system_error(ENAMETOOLONG, std::generic_category(), "socket path");
+    }
+    std::memcpy(address.sun_path, path.data(), path.size());
+    return SheetClient(Connect(AF_UNIX, reinterpret_cast<const sockaddr*>(&address), sizeof(address)));
+}
+
+SheetClient SheetClient::ConnectTcp(uint16_t port) {
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    int fd = Connect(AF_INET, reinterpret_cast<const sockaddr*>(&address), sizeof(address));
+    // пакет уходит одной записью, задерживать её незачем
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    return SheetClient(fd);
+}
+
+SheetClient::SheetClient(int fd)
+    : fd_(fd) {}
+
+SheetClient::SheetClient(SheetClient&& other) noexcept
+    : fd_(std::exchange(other.fd_, -1))
+    , pending_(std::move(other.pending_))
+    , input_(std::move(other.input_))
+    , output_(std::move(other.output_)) {}
+
+SheetClient& SheetClient::operator=(SheetClient&& other) noexcept {
+    if(this != &other) {
+        if(fd_ >= 0) {
+            close(fd_);
+        }
+        fd_ = std::exchange(other.fd_, -1);
+        pending_ = std::move(other.pending_);
+        input_ = std::move(other.input_);
+        output_ = std::move(other.output_);
+    }
+    return *this;
+}
+
+SheetClient::~SheetClient() {
+    if(fd_ >= 0) {
+        close(fd_);
+    }
+}
+
+void SheetClient::Send(const Batch& batch) {
+    output_.clear();
+    sheet_protocol::Encoder encoder(output_);
+    encoder.BeginFrame();
+    for(const auto& command : batch.commands_) {
+        encoder.PutCommand(command);
+    }
+    encoder.EndFrame();
+    if(output_.size() - sheet_protocol::FRAME_HEADER_SIZE > sheet_protocol::MAX_FRAME_SIZE) {
+        throw std::length_error("batch is too large"s);
+    }
+
+    size_t offset = 0;
+    while(offset < output_.size()) {
+        auto sent = send(fd_, output_.data() + offset, output_.size() - offset, SEND_FLAGS);
+        if(sent < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            ThrowSystemError("send");
+        }
+        offset += static_cast<size_t>(sent);
+    }
+
+    std::vector<Command> expected;
+    expected.reserve(batch.commands_.size());
+    for(const auto& command : batch.commands_) {
+        expected.push_back(MakeCommand(command.op, 0, {}, command.size));
+    }
+    pending_.push_back(std::move(expected));
+}
+
+std::vector<Result> SheetClient::Receive() {
+    if(pending_.empty()) {
+        throw std::logic_error("no batch is waiting for a response"s);
+    }
+    std::optional<size_t> size;
+    while(!(size = sheet_protocol::PeekFrameSize(input_))
+          || input_.size() - sheet_protocol::FRAME_HEADER_SIZE < *size) {
+        auto old_size = input_.size();
+        input_.resize(old_size + READ_CHUNK_SIZE);
+        auto received = recv(fd_, input_.data() + old_size, READ_CHUNK_SIZE, 0);
+        input_.resize(old_size + std::max<ssize_t>(received, 0));
+        if(received == 0) {
+            throw ProtocolError("Connection closed by server"s);
+        }
+        if(received < 0 && errno != EINTR) {
+            ThrowSystemError("recv");
+        }
+    }
+
+    sheet_protocol::Decoder decoder(std::string_view(input_).substr(sheet_protocol::FRAME_HEADER_SIZE, *size));
+    std::vector<Result> res;
+    res.reserve(pending_.front().size());
+    for(const auto& command : pending_.front()) {
+        res.push_back(decoder.GetResult(command));
+    }
+    if(!decoder.AtEnd()) {
+        throw ProtocolError("Unexpected data in response"s);
+    }
+    input_.erase(0, sheet_protocol::FRAME_HEADER_SIZE + *size);
+    pending_.pop_front();
+    return res;
+}
+
+std::vector<Result> SheetClient::Execute(const Batch& batch) {
+    Send(batch);
+    return Receive();
+}
+
+size_t SheetClient::GetPendingCount() const {
+    return pending_.size();
+}
+
+uint32_t SheetClient::OpenSheet(std::string name) {
+    Command command;
+    command.op = Op::Open;
+    command.text = std::move(name);
+    return ExecuteOne(std::move(command)).sheet;
+}
+
+void SheetClient::SetCell(uint32_t sheet, Position pos, std::string text) {
+    CheckPosition(pos);
+    auto command = MakeCommand(Op::SetCell, sheet, pos);
+    command.text = std::move(text);
+    ExecuteOne(std::move(command));
+}
+
+void SheetClient::SetNumber(uint32_t sheet, Position pos, double value) {
+    CheckPosition(pos);
+    auto command = MakeCommand(Op::SetNumber, sheet, pos);
+    command.number = value;
+    ExecuteOne(std::move(command));
+}
+
+void SheetClient::ClearCell(uint32_t sheet, Position pos) {
+    CheckPosition(pos);
+    ExecuteOne(MakeCommand(Op::ClearCell, sheet, pos));
+}
+
+CellInterface::Value SheetClient::GetValue(uint32_t sheet, Position pos) {
+    CheckPosition(pos);
+    return std::move(ExecuteOne(MakeCommand(Op::GetValue, sheet, pos)).values.at(0));
+}
+
+std::string SheetClient::GetText(uint32_t sheet, Position pos) {
+    CheckPosition(pos);
+    return ExecuteOne(MakeCommand(Op::GetText, sheet, pos)).text;
+}
+
+std::vector<CellInterface::Value> SheetClient::GetRange(uint32_t sheet, Position top_left, Size size) {
+    Batch batch;
+    batch.GetRange(sheet, top_left, size);
+    return ExecuteOne(std::move(batch.commands_.front())).values;
+}
+
+std::string SheetClient::PrintValues(uint32_t sheet) {
+    return ExecuteOne(MakeCommand(Op::PrintValues, sheet)).text;
+}
+
+std::string SheetClient::PrintTexts(uint32_t sheet) {
+    return ExecuteOne(MakeCommand(Op::PrintTexts, sheet)).text;
+}
+
+void SheetClient::ThrowIfFailed(const Result& result) {
+    switch(result.status) {
+        case Status::Ok:
+            return;
+        case Status::InvalidPosition:
+            throw InvalidPositionException(result.text);
+        case Status::InvalidFormula:
+            throw FormulaException(result.text);
+        case Status::CircularDependency:
+            throw CircularDependencyException(result.text);
+        case Status::UnknownSheet:
+            throw std::out_of_range(result.text);
+        case Status::Failed:
+            break;
+    }
+    throw std::runtime_error(result.text);
+}
+
+Result SheetClient::ExecuteOne(Command command) {
+    if(!pending_.empty()) {
+        throw std::logic_error("responses to sent batches must be received first"s);
+    }
+    Batch batch;
+    batch.Add(std::move(command));
+    auto results = Execute(batch);
+    ThrowIfFailed(results.front());
+    return std::move(results.front());
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include "sheet_protocol.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+
+// Клиент сервера таблиц (SheetServer).
+//
+// Команды накапливаются в пакете (Batch) и уходят на сервер одним кадром.
+// Send не ждёт ответа, поэтому в пути может быть несколько пакетов сразу
+// (конвейер); Receive забирает ответы в порядке отправки. Клиент, который
+// отправляет пакеты, не забирая ответов, в конце концов блокируется в Send,
+// пока не прочитает ответы на отправленные.
+//
+// Методы для одной команды отправляют пакет из неё и ждут ответа. Они
+// требуют, чтобы в пути не было других пакетов, и бросают те же исключения,
+// что и методы Sheet.
+//
+// Ошибки сокета бросаются как std::system_error, разрыв соединения и
+// повреждённый ответ - как sheet_protocol::ProtocolError. Объект не
+// потокобезопасен: каждому потоку нужен свой клиент.
+class SheetClient {
+public:
+    class Batch {
+    public:
+        Batch& Open(std::string name);
+        Batch& SetCell(uint32_t sheet, Position pos, std::string text);
+        Batch& SetNumber(uint32_t sheet, Position pos, double value);
+        Batch& ClearCell(uint32_t sheet, Position pos);
+        Batch& GetValue(uint32_t sheet, Position pos);
+        Batch& GetText(uint32_t sheet, Position pos);
+        Batch& GetRange(uint32_t sheet, Position top_left, Size size);
+        Batch& PrintValues(uint32_t sheet);
+        Batch& PrintTexts(uint32_t sheet);
+
+        size_t GetSize() const;
+        void Clear();
+
+    private:
+        friend class SheetClient;
+
+        Batch& Add(sheet_protocol::Command command);
+
+        std::vector<sheet_protocol::Command> commands_;
+    };
+
+    static SheetClient ConnectUnix(const std::string& path);
+    // Подключается к серверу на 127.0.0.1
+    static SheetClient ConnectTcp(uint16_t port);
+
+    SheetClient(SheetClient&& other) noexcept;
+    SheetClient& operator=(SheetClient&& other) noexcept;
+    ~SheetClient();
+
+    void Send(const Batch& batch);
+    // Ждёт ответа на самый ранний из отправленных пакетов: результаты его
+    // команд в порядке добавления
+    std::vector<sheet_protocol::Result> Receive();
+    std::vector<sheet_protocol::Result> Execute(const Batch& batch);
+    // Пакеты, ответы на которые ещё не получены
+    size_t GetPendingCount() const;
+
+    uint32_t OpenSheet(std::string name);
+    void SetCell(uint32_t sheet, Position pos, std::string text);
+    void SetNumber(uint32_t sheet, Position pos, double value);
+    void ClearCell(uint32_t sheet, Position pos);
+    CellInterface::Value GetValue(uint32_t sheet, Position pos);
+    std::string GetText(uint32_t sheet, Position pos);
+    // Значения области по строкам
+    std::vector<CellInterface::Value> GetRange(uint32_t sheet, Position top_left, Size size);
+    std::string PrintValues(uint32_t sheet);
+    std::string PrintTexts(uint32_t sheet);
+
+    // Бросает исключение, которое бросил бы метод таблицы с такой ошибкой
+    static void ThrowIfFailed(const sheet_protocol::Result& result);
+
+private:
+    explicit SheetClient(int fd);
+
+    sheet_protocol::Result ExecuteOne(sheet_protocol::Command command);
+
+    int fd_ = -1;
+    // команды отправленных пакетов без ответа, без аргументов, не нужных для
+    // разбора ответа
+    std::deque<std::vector<sheet_protocol::Command>> pending_;
+    std::string input_;
+    std::string output_;
+};
@@ -0,0 +1,299 @@
+#include "sheet_protocol.h"
+
+#include <cstring>
+#include <limits>
+#include <variant>
+
+using namespace std::literals;
+
+namespace sheet_protocol {
+
+namespace {
+bool HasPosition(Op op) {
+    return op == Op::SetCell || op == Op::SetNumber || op == Op::ClearCell
+        || op == Op::GetValue || op == Op::GetText || op == Op::GetRange;
+}
+}  // namespace
+
+Encoder::Encoder(std::string& output)
+    : output_(output) {}
+
+void Encoder::PutByte(uint8_t value) {
+    output_.push_back(static_cast<char>(value));
+}
+
+void Encoder::PutVarint(uint64_t value) {
+    while(value >= 0x80u) {
+        PutByte(static_cast<uint8_t>((value & 0x7Fu) | 0x80u));
+        value >>= 7u;
+    }
+    PutByte(static_cast<uint8_t>(value));
+}
+
+void Encoder::PutDouble(double value) {
+    uint64_t bits = 0;
+    std::memcpy(&bits, &value, sizeof(bits));
+    for(int i = 0; i < 8; ++i) {
+        PutByte(static_cast<uint8_t>(bits >> (8 * i)));
+    }
+}
+
+void Encoder::PutString(std::string_view value) {
+    PutVarint(value.size());
+    output_.append(value);
+}
+
+void Encoder::PutValue(const CellInterface::Value& value) {
+    if(const auto* text = std::get_if<std::string>(&value)) {
+        PutByte(static_cast<uint8_t>(ValueKind::Text));
+        PutString(*text);
+    }
+    else if(const auto* number = std::get_if<double>(&value)) {
+        PutByte(static_cast<uint8_t>(ValueKind::Number));
+        PutDouble(*number);
+    }
+    else {
+        PutByte(static_cast<uint8_t>(ValueKind::Error));
+        PutByte(static_cast<uint8_t>(std::get<FormulaError>(value).GetCategory()));
+    }
+}
+
+void Encoder::PutCommand(const Command& command) {
+    PutByte(static_cast<uint8_t>(command.op));
+    if(command.op == Op::Open) {
+        PutString(command.text);
+        return;
+    }
+    PutVarint(command.sheet);
+    if(HasPosition(command.op)) {
+        PutVarint(static_cast<uint64_t>(command.pos.row));
+        PutVarint(static_cast<uint64_t>(command.pos.col));
+    }
+    switch(command.op) {
+        case Op::SetCell:
+            PutString(command.text);
+            break;
+        case Op::SetNumber:
+            PutDouble(command.number);
+            break;
+        case Op::GetRange:
+            PutVarint(static_cast<uint64_t>(command.size.rows));
+            PutVarint(static_cast<uint64_t>(command.size.cols));
+            break;
+        default:
+            break;
+    }
+}
+
+void Encoder::PutResult(Op op, const Result& result) {
+    PutByte(static_cast<uint8_t>(result.status));
+    if(result.status != Status::Ok) {
+        PutString(result.text);
+        return;
+    }
+    switch(op) {
+        case Op::Open:
+            PutVarint(result.sheet);
+            break;
+        case Op::GetValue:
+            PutValue(result.values.at(0));
+            break;
+        case Op::GetRange:
+            // размер области клиенту известен из команды
+            for(const auto& value : result.values) {
+                PutValue(value);
+            }
+            break;
+        case Op::GetText:
+        case Op::PrintValues:
+        case Op::PrintTexts:
+            PutString(result.text);
+            break;
+        default:
+            break;
+    }
+}
+
+void Encoder::BeginFrame() {
+    frame_start_ = output_.size();
+    output_.append(FRAME_HEADER_SIZE, '\0');
+}
+
+void Encoder::EndFrame() {
+    auto size = static_cast<uint32_t>(output_.size() - frame_start_ - FRAME_HEADER_SIZE);
+    for(size_t i = 0; i < FRAME_HEADER_SIZE; ++i) {
+        output_[frame_start_ + i] = static_cast<char>(size >> (8 * i));
+    }
+}
+
+Decoder::Decoder(std::string_view input)
+    : input_(input) {}
+
+bool Decoder::AtEnd() const {
+    return input_.empty();
+}
+
+uint8_t Decoder::GetByte() {
+    if(input_.empty()) {
+        throw ProtocolError("Truncated message"s);
+    }
+    auto res = static_cast<uint8_t>(input_.front());
+    input_.remove_prefix(1);
+    return res;
+}
+
+uint64_t Decoder::GetVarint() {
+    uint64_t res = 0;
+    for(unsigned shift = 0; shift < 64u; shift += 7u) {
+        auto byte = GetByte();
+        res |= static_cast<uint64_t>(byte & 0x7Fu) << shift;
+        if(!(byte & 0x80u)) {
+            return res;
+        }
+    }
+    throw ProtocolError("Malformed varint"s);
+}
+
+double Decoder::GetDouble() {
+    uint64_t bits = 0;
+    for(int i = 0; i < 8; ++i) {
+        bits |= static_cast<uint64_t>(GetByte()) << (8 * i);
+    }
+    double res = 0.0;
+    std::memcpy(&res, &bits, sizeof(res));
+    return res;
+}
+
+std::string_view Decoder::GetString() {
+    auto size = GetVarint();
+    if(size > input_.size()) {
+        throw ProtocolError("Truncated message"s);
+    }
+    auto res = input_.substr(0, size);
+    input_.remove_prefix(size);
+    return res;
+}
+
+CellInterface::Value Decoder::GetValue() {
+    auto kind = GetByte();
+    switch(static_cast<ValueKind>(kind)) {
+        case ValueKind::Text:
+            return std::string(GetString());
+        case ValueKind::Number:
+            return GetDouble();
+        case ValueKind::Error: {
+            auto category = GetByte();
+            if(category > static_cast<uint8_t>(FormulaError::Category::NA)) {
+                throw ProtocolError("Unknown formula error"s);
+            }
+            return FormulaError(static_cast<FormulaError::Category>(category));
+        }
+    }
+    throw ProtocolError("Unknown value kind"s);
+}
+
+Command Decoder::GetCommand() {
+    auto op = GetByte();
+    if(op > static_cast<uint8_t>(Op::PrintTexts)) {
+        throw ProtocolError("Unknown operation"s);
+    }
+    Command res;
+    res.op = static_cast<Op>(op);
+    if(res.op == Op::Open) {
+        res.text = GetString();
+        return res;
+    }
+    res.sheet = GetSheet();
+    if(HasPosition(res.op)) {
+        res.pos.row = GetIndex();
+        res.pos.col = GetIndex();
+    }
+    switch(res.op) {
+        case Op::SetCell:
+            res.text = GetString();
+            break;
+        case Op::SetNumber:
+            res.number = GetDouble();
+            break;
+        case Op::GetRange:
+            res.size.rows = GetIndex();
+            res.size.cols = GetIndex();
+            break;
+        default:
+            break;
+    }
+    return res;
+}
+
+Result Decoder::GetResult(const Command& command) {
+    auto status = GetByte();
+    if(status > static_cast<uint8_t>(Status::Failed)) {
+        throw ProtocolError("Unknown status"s);
+    }
+    Result res;
+    res.status = static_cast<Status>(status);
+    if(res.status != Status::Ok) {
+        res.text = GetString();
+        return res;
+    }
+    switch(command.op) {
+        case Op::Open:
+            res.sheet = GetSheet();
+            break;
+        case Op::GetValue:
+            res.values.push_back(GetValue());
+            break;
+        case Op::GetRange: {
+            auto count = static_cast<size_t>(command.size.rows) * static_cast<size_t>(command.size.cols);
+            // каждое значение занимает хотя бы два байта
+            if(count > input_.size() / 2u) {
+                throw ProtocolError("Truncated message"s);
+            }
+            res.values.reserve(count);
+            for(size_t i = 0; i < count; ++i) {
+                res.values.push_back(GetValue());
+            }
+            break;
+        }
+        case Op::GetText:
+        case Op::PrintValues:
+        case Op::PrintTexts:
+            res.text = GetString();
+            break;
+        default:
+            break;
+    }
+    return res;
+}
+
+int Decoder::GetIndex() {
+    auto value = GetVarint();
+    if(value > static_cast<uint64_t>(std::numeric_limits<int>::max())) {
+        throw ProtocolError("Index out of range"s);
+    }
+    return static_cast<int>(value);
+}
+
+uint32_t Decoder::GetSheet() {
+    auto value = GetVarint();
+    if(value > std::numeric_limits<uint32_t>::max()) {
+        throw ProtocolError("Sheet number out of range"s);
+    }
+    return static_cast<uint32_t>(value);
+}
+
+std::optional<size_t> PeekFrameSize(std::string_view data) {
+    if(data.size() < FRAME_HEADER_SIZE) {
+        return std::nullopt;
+    }
+    size_t size = 0;
+    for(size_t i = 0; i < FRAME_HEADER_SIZE; ++i) {
+        size |= static_cast<size_t>(static_cast<uint8_t>(data[i])) << (8 * i);
+    }
+    if(size > MAX_FRAME_SIZE) {
+        throw ProtocolError("Frame too large"s);
+    }
+    return size;
+}
+
+}  // namespace sheet_protocol
@@ -0,0 +1,157 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Двоичный протокол сервера таблиц (см. SheetServer).
+//
+// Клиент и сервер обмениваются кадрами: длина тела (4 байта, младшие вперёд)
+// и тело. Тело запроса - одна или несколько команд подряд, тело ответа -
+// результаты этих команд в том же порядке. Клиент может отправлять следующие
+// кадры, не дожидаясь ответов на предыдущие: сервер отвечает на кадры одного
+// соединения в порядке их получения.
+//
+// Целые числа записываются как varint (как в трассе, см. trace.h), числа
+// double - 8 байт младшими вперёд, строки - длиной и байтами.
+//
+// Команда - байт операции и её аргументы; лист задаётся номером, который
+// возвращает Open:
+//   Open         имя листа                    -> номер листа
+//   SetCell      лист, строка, столбец, текст
+//   SetNumber    лист, строка, столбец, число
+//   ClearCell    лист, строка, столбец
+//   GetValue     лист, строка, столбец          -> значение
+//   GetText      лист, строка, столбец          -> текст
+//   GetRange     лист, строка, столбец, строк, столбцов -> значения по строкам
+//   PrintValues  лист                         -> текст
+//   PrintTexts   лист                         -> текст
+// Результат - байт Status, затем для Ok - данные операции, иначе - сообщение
+// об ошибке. Значение - байт вида (ValueKind), затем текст, число или байт
+// категории ошибки формулы.
+namespace sheet_protocol {
+
+enum class Op : uint8_t {
+    Open,
+    SetCell,
+    SetNumber,
+    ClearCell,
+    GetValue,
+    GetText,
+    GetRange,
+    PrintValues,
+    PrintTexts,
+};
+
+// Исключения методов таблицы передаются клиенту кодом
+enum class Status : uint8_t {
+    Ok,
+    InvalidPosition,
+    InvalidFormula,
+    CircularDependency,
+    UnknownSheet,
+    Failed,
+};
+
+enum class ValueKind : uint8_t {
+    Text,
+    Number,
+    Error,
+};
+
+// Размер заголовка кадра
+constexpr size_t FRAME_HEADER_SIZE = 4;
+// Кадр большего размера считается ошибкой протокола
+constexpr size_t MAX_FRAME_SIZE = 64u << 20u;
+// Ячеек, которые можно запросить одной командой GetRange
+constexpr size_t MAX_RANGE_CELLS = 1u << 20u;
+
+// Повреждённые или неполные данные
+class ProtocolError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+struct Command {
+    Op op = Op::GetValue;
+    uint32_t sheet = 0;
+    Position pos;
+    // для GetRange
+    Size size;
+    // имя листа для Open, текст для SetCell
+    std::string text;
+    // для SetNumber
+    double number = 0.0;
+};
+
+struct Result {
+    Status status = Status::Ok;
+    // номер листа для Open
+    uint32_t sheet = 0;
+    // текст для GetText и Print*, сообщение об ошибке
+    std::string text;
+    // значение для GetValue, значения области для GetRange
+    std::vector<CellInterface::Value> values;
+};
+
+// Дописывает в конец буфера данные в формате протокола
+class Encoder {
+public:
+    explicit Encoder(std::string& output);
+
+    void PutByte(uint8_t value);
+    void PutVarint(uint64_t value);
+    void PutDouble(double value);
+    void PutString(std::string_view value);
+    void PutValue(const CellInterface::Value& value);
+
+    void PutCommand(const Command& command);
+    // Данные результата зависят от операции команды
+    void PutResult(Op op, const Result& result);
+
+    // Начинает кадр: записывает заголовок, длина в котором заполняется
+    // EndFrame по тому, что записано между ними
+    void BeginFrame();
+    void EndFrame();
+
+private:
+    std::string& output_;
+    size_t frame_start_ = 0;
+};
+
+// Читает данные в формате протокола. При нехватке или повреждении данных
+// бросает ProtocolError.
+class Decoder {
+public:
+    explicit Decoder(std::string_view input);
+
+    bool AtEnd() const;
+
+    uint8_t GetByte();
+    uint64_t GetVarint();
+    double GetDouble();
+    std::string_view GetString();
+    CellInterface::Value GetValue();
+
+    Command GetCommand();
+    // Данные результата зависят от команды, на которую он получен
+    Result GetResult(const Command& command);
+
+private:
+    int GetIndex();
+    uint32_t GetSheet();
+
+    std::string_view input_;
+};
+
+// Длина тела кадра, если его заголовок уже в data. Бросает ProtocolError для
+// кадра длиннее MAX_FRAME_SIZE.
+std::optional<size_t> PeekFrameSize(std::string_view data);
+
+}  // namespace sheet_protocol
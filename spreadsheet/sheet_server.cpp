@@ -0,0 +1,475 @@
+#include "sheet_server.h"
+
+#include "sheet.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <system_error>
+#include <utility>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace std::literals;
+using sheet_protocol::Command;
+using sheet_protocol::Op;
+using sheet_protocol::Result;
+using sheet_protocol::Status;
+
+namespace {
+#ifdef MSG_NOSIGNAL
+// запись в закрытое клиентом соединение не должна завершать процесс по SIGPIPE
+constexpr int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+constexpr int SEND_FLAGS = 0;
+#endif
+
+constexpr size_t READ_CHUNK_SIZE = 64u << 10u;
+
+class UnknownSheetError : public std::out_of_range {
+public:
+    using std::out_of_range::out_of_range;
+};
+
+[[noreturn]] void ThrowSystemError(const char* what) {
+    throw std::system_error(errno, std::generic_category(), what);
+}
+
+void CloseDescriptor(int& fd) {
+    if(fd >= 0) {
+        close(fd);
+        fd = -1;
+    }
+}
+
+void SetNonBlocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if(flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        ThrowSystemError("fcntl");
+    }
+#ifdef SO_NOSIGPIPE
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+}
+
+int ListenUnix(const std::string& path) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if(path.size() >= sizeof(address.sun_path)) {
+        throw std::system_error(ENAMETOOLONG, std::generic_category(), "socket path");
+    }
+    std::memcpy(address.sun_path, path.data(), path.size());
+    // Файл сокета остаётся после прежнего сервера и удаляется. Любой другой
+    // файл по этому пути - чужой: сервер его не трогает.
+    struct stat status{};
+    if(lstat(path.c_str(), &status) == 0) {
+        if(!S_ISSOCK(status.st_mode)) {
+            throw std::system_error(EADDRINUSE, std::generic_category(), "bind " + path);
+        }
+        unlink(path.c_str());
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0) {
+        ThrowSystemError("socket");
+    }
+    if(bind(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) < 0
+       || listen(fd, SOMAXCONN) < 0) {
+        int error = errno;
+        close(fd);
+        throw std::system_error(error, std::generic_category(), "bind " + path);
+    }
+    return fd;
+}
+
+int ListenTcp(uint16_t port, uint16_t& bound_port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd < 0) {
+        ThrowSystemError("socket");
+    }
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    socklen_t length = sizeof(address);
+    if(bind(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) < 0
+       || listen(fd, SOMAXCONN) < 0
+       || getsockname(fd, reinterpret_cast<sockaddr*>(&address), &length) < 0) {
+        int error = errno;
+        close(fd);
+        throw std::system_error(error, std::generic_category(), "bind 127.0.0.1:" + std::to_string(port));
+    }
+    bound_port = ntohs(address.sin_port);
+    return fd;
+}
+
+// Значения области в порядке строк
+void ReadRange(const Sheet& sheet, Position top_left, Size size, std::vector<CellInterface::Value>& values) {
+    if(size.rows <= 0 || size.cols <= 0) {
+        throw InvalidPositionException("wrong position"s);
+    }
+    auto count = static_cast<size_t>(size.rows) * static_cast<size_t>(size.cols);
+    if(count > sheet_protocol::MAX_RANGE_CELLS) {
+        throw std::length_error("range is too large"s);
+    }
+    std::vector<double> numbers(count);
+    std::vector<ValueCache::Tag> tags(count);
+    std::vector<std::string_view> texts(count);
+    sheet.GetValues(top_left, size, numbers.data(), tags.data(), texts.data());
+    values.reserve(count);
+    for(size_t i = 0; i < count; ++i) {
+        if(tags[i] == ValueCache::Tag::Number) {
+            values.emplace_back(numbers[i]);
+        }
+        else if(tags[i] == ValueCache::Tag::Text) {
+            values.emplace_back(std::string(texts[i]));
+        }
+        else {
+            values.emplace_back(ValueCache::ToError(tags[i]));
+        }
+    }
+}
+}  // namespace
+
+SheetServer::SheetServer(Options options)
+    : unix_path_(std::move(options.unix_path)) {
+    try {
+        if(pipe(wake_fds_) < 0) {
+            ThrowSystemError("pipe");
+        }
+        SetNonBlocking(wake_fds_[0]);
+        listen_fd_ = unix_path_.empty() ? ListenTcp(options.tcp_port, port_) : ListenUnix(unix_path_);
+        SetNonBlocking(listen_fd_);
+    }
+    catch(...) {
+        CloseDescriptor(listen_fd_);
+        CloseDescriptor(wake_fds_[0]);
+        CloseDescriptor(wake_fds_[1]);
+        throw;
+    }
+    reactor_ = std::thread([this] { Run(); });
+}
+
+SheetServer::~SheetServer() {
+    stop_ = true;
+    char byte = 0;
+    // пишущий конец блокирующий, а реактор читает всё из канала
+    while(write(wake_fds_[1], &byte, 1) < 0 && errno == EINTR) {
+    }
+    reactor_.join();
+    for(auto& connection : connections_) {
+        CloseDescriptor(connection->fd);
+    }
+    CloseDescriptor(listen_fd_);
+    CloseDescriptor(wake_fds_[0]);
+    CloseDescriptor(wake_fds_[1]);
+    if(!unix_path_.empty()) {
+        unlink(unix_path_.c_str());
+    }
+}
+
+uint16_t SheetServer::GetPort() const {
+    return port_;
+}
+
+SheetServer::Stats SheetServer::GetStats() const {
+    std::lock_guard lock(stats_mutex_);
+    return stats_;
+}
+
+void SheetServer::Run() {
+    std::vector<pollfd> fds;
+    while(!stop_) {
+        fds.clear();
+        fds.push_back({wake_fds_[0], POLLIN, 0});
+        fds.push_back({listen_fd_, POLLIN, 0});
+        for(const auto& connection : connections_) {
+            short events = 0;
+            // клиент, который не забирает ответы, перестаёт читаться
+            if(!connection->eof && connection->output.size() - connection->output_offset < MAX_PENDING_OUTPUT) {
+                events |= POLLIN;
+            }
+            if(connection->output_offset < connection->output.size()) {
+                events |= POLLOUT;
+            }
+            fds.push_back({connection->fd, events, 0});
+        }
+        if(poll(fds.data(), fds.size(), -1) < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if(fds[0].revents) {
+            char buffer[64];
+            while(read(wake_fds_[0], buffer, sizeof(buffer)) > 0) {
+            }
+        }
+        for(size_t i = 0; i < connections_.size(); ++i) {
+            if(fds[i + 2].revents & (POLLIN | POLLHUP | POLLERR)) {
+                Read(*connections_[i]);
+            }
+        }
+        // новые соединения добавляются в конец, после тех, что есть в fds
+        if(fds[1].revents & POLLIN) {
+            Accept();
+        }
+        ExecuteGroup();
+        for(auto& connection : connections_) {
+            if(!connection->broken && connection->output_offset < connection->output.size()) {
+                Write(*connection);
+            }
+        }
+        connections_.erase(std::remove_if(connections_.begin(), connections_.end(), [] (auto& connection) {
+            bool done = connection->broken
+                || (connection->eof && connection->output_offset == connection->output.size());
+            if(done) {
+                CloseDescriptor(connection->fd);
+            }
+            return done;
+        }), connections_.end());
+    }
+}
+
+void SheetServer::Accept() {
+    while(true) {
+        int fd = accept(listen_fd_, nullptr, nullptr);
+        if(fd < 0) {
+            // EAGAIN - очередь пуста; прочие ошибки относятся к одному
+            // соединению и не останавливают сервер
+            return;
+        }
+        try {
+            SetNonBlocking(fd);
+        }
+        catch(const std::system_error&) {
+            close(fd);
+            continue;
+        }
+        if(unix_path_.empty()) {
+            // ответ группы уходит одной записью, задерживать её незачем
+            int on = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        }
+        auto connection = std::make_unique<Connection>();
+        connection->fd = fd;
+        connections_.push_back(std::move(connection));
+        ++round_stats_.accepted_connections;
+    }
+}
+
+void SheetServer::Read(Connection& connection) {
+    size_t total = 0;
+    while(total < MAX_READ_PER_ROUND) {
+        auto size = connection.input.size();
+        connection.input.resize(size + READ_CHUNK_SIZE);
+        auto received = recv(connection.fd, connection.input.data() + size, READ_CHUNK_SIZE, 0);
+        connection.input.resize(size + std::max<ssize_t>(received, 0));
+        if(received > 0) {
+            total += static_cast<size_t>(received);
+            continue;
+        }
+        if(received == 0) {
+            // клиент закончил передачу; ответы на полученные кадры ещё
+            // отправляются
+            connection.eof = true;
+        }
+        else if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            connection.broken = true;
+        }
+        return;
+    }
+}
+
+void SheetServer::Write(Connection& connection) {
+    while(connection.output_offset < connection.output.size()) {
+        auto sent = send(connection.fd, connection.output.data() + connection.output_offset,
+                         connection.output.size() - connection.output_offset, SEND_FLAGS);
+        if(sent < 0) {
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                connection.broken = true;
+            }
+            break;
+        }
+        connection.output_offset += static_cast<size_t>(sent);
+    }
+    if(connection.output_offset == connection.output.size()) {
+        connection.output.clear();
+        connection.output_offset = 0;
+    }
+    else if(connection.output_offset > connection.output.size() / 2u) {
+        connection.output.erase(0, connection.output_offset);
+        connection.output_offset = 0;
+    }
+}
+
+void SheetServer::ExecuteGroup() {
+    std::vector<Command> commands;
+    for(auto& connection : connections_) {
+        if(connection->broken) {
+            continue;
+        }
+        std::string_view input = connection->input;
+        size_t offset = 0;
+        try {
+            while(auto size = sheet_protocol::PeekFrameSize(input.substr(offset))) {
+                if(input.size() - offset - sheet_protocol::FRAME_HEADER_SIZE < *size) {
+                    break;
+                }
+                // кадр разбирается целиком до выполнения первой команды
+                sheet_protocol::Decoder decoder(input.substr(offset + sheet_protocol::FRAME_HEADER_SIZE, *size));
+                commands.clear();
+                while(!decoder.AtEnd()) {
+                    commands.push_back(decoder.GetCommand());
+                }
+                offset += sheet_protocol::FRAME_HEADER_SIZE + *size;
+
+                sheet_protocol::Encoder encoder(connection->output);
+                encoder.BeginFrame();
+                for(const auto& command : commands) {
+                    Result result;
+                    Execute(command, result);
+                    encoder.PutResult(command.op, result);
+                }
+                encoder.EndFrame();
+                ++round_stats_.frames;
+                round_stats_.commands += commands.size();
+            }
+        }
+        catch(const sheet_protocol::ProtocolError&) {
+            connection->broken = true;
+            ++round_stats_.protocol_errors;
+        }
+        connection->input.erase(0, offset);
+    }
+    // ответы уходят клиентам только после записи всей группы
+    FlushNumbers();
+
+    if(round_stats_.frames > 0) {
+        ++round_stats_.groups;
+    }
+    std::lock_guard lock(stats_mutex_);
+    stats_.accepted_connections += round_stats_.accepted_connections;
+    stats_.frames += round_stats_.frames;
+    stats_.commands += round_stats_.commands;
+    stats_.groups += round_stats_.groups;
+    stats_.coalesced_numbers += round_stats_.coalesced_numbers;
+    stats_.protocol_errors += round_stats_.protocol_errors;
+    round_stats_ = {};
+}
+
+void SheetServer::Execute(const Command& command, Result& result) {
+    try {
+        // остальные команды должны видеть все предыдущие записи
+        if(command.op != Op::SetNumber) {
+            FlushNumbers();
+        }
+        switch(command.op) {
+            case Op::Open:
+                result.sheet = OpenSheet(command.text);
+                break;
+            case Op::SetCell:
+                GetSheet(command.sheet).SetCell(command.pos, command.text);
+                break;
+            case Op::SetNumber: {
+                auto& sheet = GetSheet(command.sheet);
+                if(!command.pos.IsValid()) {
+                    throw InvalidPositionException("wrong position"s);
+                }
+                if(&sheet != pending_sheet_) {
+                    FlushNumbers();
+                    pending_sheet_ = &sheet;
+                }
+                else if(!pending_numbers_.empty()) {
+                    ++round_stats_.coalesced_numbers;
+                }
+                pending_numbers_.emplace_back(command.pos, command.number);
+                break;
+            }
+            case Op::ClearCell:
+                GetSheet(command.sheet).ClearCell(command.pos);
+                break;
+            case Op::GetValue: {
+                auto cell = std::as_const(GetSheet(command.sheet)).GetCell(command.pos);
+                result.values.push_back(cell ? cell->GetValue() : CellInterface::Value{});
+                break;
+            }
+            case Op::GetText: {
+                auto cell = std::as_const(GetSheet(command.sheet)).GetCell(command.pos);
+                result.text = cell ? cell->GetText() : std::string{};
+                break;
+            }
+            case Op::GetRange:
+                ReadRange(GetSheet(command.sheet), command.pos, command.size, result.values);
+                break;
+            case Op::PrintValues:
+            case Op::PrintTexts: {
+                std::ostringstream output;
+                const auto& sheet = GetSheet(command.sheet);
+                if(command.op == Op::PrintValues) {
+                    sheet.PrintValues(output);
+                }
+                else {
+                    sheet.PrintTexts(output);
+                }
+                result.text = output.str();
+                break;
+            }
+        }
+    }
+    catch(const InvalidPositionException& e) {
+        result = {Status::InvalidPosition, 0, e.what(), {}};
+    }
+    catch(const FormulaException& e) {
+        result = {Status::InvalidFormula, 0, e.what(), {}};
+    }
+    catch(const CircularDependencyException& e) {
+        result = {Status::CircularDependency, 0, e.what(), {}};
+    }
+    catch(const UnknownSheetError& e) {
+        result = {Status::UnknownSheet, 0, e.what(), {}};
+    }
+    catch(const std::exception& e) {
+        result = {Status::Failed, 0, e.what(), {}};
+    }
+}
+
+void SheetServer::FlushNumbers() {
+    if(!pending_numbers_.empty()) {
+        pending_sheet_->SetNumbers(pending_numbers_);
+        pending_numbers_.clear();
+    }
+    pending_sheet_ = nullptr;
+}
+
+uint32_t SheetServer::OpenSheet(const std::string& name) {
+    auto iter = sheet_indexes_.find(name);
+    if(iter != sheet_indexes_.end()) {
+        return iter->second;
+    }
+    // листы книги создаёт только сервер, и все они - Sheet
+    auto& sheet = static_cast<Sheet&>(workbook_.CreateSheet(name));
+    auto index = static_cast<uint32_t>(sheets_.size());
+    sheets_.push_back(&sheet);
+    sheet_indexes_.emplace(name, index);
+    return index;
+}
+
+Sheet& SheetServer::GetSheet(uint32_t index) {
+    if(index >= sheets_.size()) {
+        throw UnknownSheetError("unknown sheet "s + std::to_string(index));
+    }
+    return *sheets_[index];
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include "sheet_protocol.h"
+#include "workbook.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+class Sheet;
+
+// Сервер, который держит книгу в памяти и открывает её листы процессам той же
+// машины через сокет Unix или TCP на 127.0.0.1. Клиенты общаются с ним по
+// двоичному протоколу sheet_protocol.h, например через SheetClient.
+//
+// Все соединения обслуживает один поток-реактор: он ждёт готовности сокетов
+// (poll), читает пришедшие кадры и выполняет их группой. Книга не
+// потокобезопасна, поэтому ею владеет только реактор, а параллельность
+// клиентов достигается конвейером кадров. В группу попадают все кадры, полные
+// на момент пробуждения реактора, от всех соединений. Идущие подряд SetNumber
+// в группе записываются одним Sheet::SetNumbers, с одним проходом сброса
+// зависимых формул, а ответы соединению отправляются одной записью после
+// выполнения всей группы.
+//
+// Кадр с повреждёнными данными закрывает соединение; ни одна его команда не
+// выполняется. Исключение метода таблицы становится кодом ошибки в результате
+// команды, и выполнение кадра продолжается.
+class SheetServer {
+public:
+    struct Options {
+        // Путь сокета Unix. Если пуст, сервер слушает TCP на 127.0.0.1.
+        std::string unix_path;
+        // Порт TCP; 0 - любой свободный, см. GetPort()
+        uint16_t tcp_port = 0;
+    };
+
+    // Открывает сокет и запускает реактор. Ошибки сокетов бросаются как
+    // std::system_error. Сокет, оставшийся по пути unix_path, заменяется;
+    // другой файл по этому пути не трогается, и конструктор бросает
+    // std::system_error с кодом EADDRINUSE.
+    explicit SheetServer(Options options);
+    // Останавливает реактор и закрывает соединения
+    ~SheetServer();
+
+    SheetServer(const SheetServer&) = delete;
+    SheetServer& operator=(const SheetServer&) = delete;
+
+    // Порт, на котором слушает сервер TCP, или 0 для сокета Unix
+    uint16_t GetPort() const;
+
+    struct Stats {
+        size_t accepted_connections = 0;
+        size_t frames = 0;
+        size_t commands = 0;
+        // группы кадров, выполненные за одно пробуждение реактора
+        size_t groups = 0;
+        // SetNumber, записанные вместе с предыдущими одним SetNumbers
+        size_t coalesced_numbers = 0;
+        size_t protocol_errors = 0;
+    };
+    Stats GetStats() const;
+
+private:
+    // Объём неотправленных ответов, после которого соединение перестаёт
+    // читаться, пока клиент их не заберёт
+    static constexpr size_t MAX_PENDING_OUTPUT = 64u << 20u;
+    // Байтов, читаемых из одного соединения за пробуждение, чтобы одно
+    // соединение не задерживало остальные
+    static constexpr size_t MAX_READ_PER_ROUND = 1u << 20u;
+
+    struct Connection {
+        int fd = -1;
+        std::string input;
+        std::string output;
+        // уже отправленная часть output
+        size_t output_offset = 0;
+        // клиент закрыл передачу: соединение закрывается после отправки ответов
+        bool eof = false;
+        // ошибка сокета или протокола: соединение закрывается сразу
+        bool broken = false;
+    };
+
+    void Run();
+    void Accept();
+    void Read(Connection& connection);
+    void Write(Connection& connection);
+    void ExecuteGroup();
+    void Execute(const sheet_protocol::Command& command, sheet_protocol::Result& result);
+    // Записывает накопленные SetNumber
+    void FlushNumbers();
+    // Номер листа name; создаёт лист, если его нет
+    uint32_t OpenSheet(const std::string& name);
+    Sheet& GetSheet(uint32_t index);
+
+    Workbook workbook_;
+    // листы в порядке открытия: номер листа в протоколе - индекс
+    std::vector<Sheet*> sheets_;
+    std::unordered_map<std::string, uint32_t> sheet_indexes_;
+
+    // накопленные SetNumber группы и лист, к которому они относятся
+    std::vector<std::pair<Position, double>> pending_numbers_;
+    Sheet* pending_sheet_ = nullptr;
+
+    std::string unix_path_;
+    uint16_t port_ = 0;
+    int listen_fd_ = -1;
+    // пишущий конец будит реактор при остановке
+    int wake_fds_[2] = {-1, -1};
+    std::vector<std::unique_ptr<Connection>> connections_;
+
+    mutable std::mutex stats_mutex_;
+    Stats stats_;
+    // статистика текущего пробуждения, переносится в stats_ в его конце
+    Stats round_stats_;
+    std::atomic<bool> stop_{false};
+
+    // объявлен последним, чтобы запускаться после инициализации остальных полей
+    std::thread reactor_;
+};
@@ -0,0 +1,72 @@
+#include "string_pool.h"
+
+#include <utility>
+
+StringPool::Handle::Handle(Entry* entry)
+    : entry_(entry) {
+    if(entry_) {
+        ++entry_->refs;
+    }
+}
+
+StringPool::Handle::Handle(const Handle& other)
+    : Handle(other.entry_) {}
+
+StringPool::Handle::Handle(Handle&& other) noexcept
+    : entry_(std::exchange(other.entry_, nullptr)) {}
+
+StringPool::Handle& StringPool::Handle::operator=(Handle other) noexcept {
+    std::swap(entry_, other.entry_);
+    return *this;
+}
+
+StringPool::Handle::~Handle() {
+    if(entry_ && --entry_->refs == 0u) {
+        entry_->pool->Release(entry_);
+    }
+}
+
+std::string_view StringPool::Handle::View() const {
+    return entry_ ? std::string_view{entry_->text} : std::string_view{};
+}
+
+bool StringPool::Handle::Empty() const {
+    return !entry_ || entry_->text.empty();
+}
+
+StringPool::Handle StringPool::Intern(std::string_view text) {
+    auto iter = entries_.find(text);
+    if(iter == entries_.end()) {
+        auto entry = std::make_unique<Entry>(Entry{std::string{text}, 0u, this});
+        // ключ ссылается на строку внутри узла, адрес которой не меняется
+        std::string_view key = entry->text;
+        payload_bytes_ += entry->text.capacity();
+        iter = entries_.emplace(key, std::move(entry)).first;
+    }
+    return Handle{iter->second.get()};
+}
+
+size_t StringPool::Size() const {
+    return entries_.size();
+}
+
+size_t StringPool::PayloadBytes() const {
+    return payload_bytes_;
+}
+
+size_t StringPool::OverheadBytes() const {
+    // узел хеш-таблицы: указатель на следующий узел, ключ, значение и хеш
+    constexpr size_t node_bytes = sizeof(void*) + sizeof(std::string_view)
+        + sizeof(std::unique_ptr<Entry>) + sizeof(size_t);
+    return entries_.bucket_count() * sizeof(void*) + entries_.size() * (node_bytes + sizeof(Entry));
+}
+
+void StringPool::Compact() {
+    entries_.rehash(0u);
+}
+
+void StringPool::Release(Entry* entry) {
+    payload_bytes_ -= entry->text.capacity();
+    auto iter = entries_.find(std::string_view{entry->text});
+    entries_.erase(iter);
+}
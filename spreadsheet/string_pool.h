@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// Пул интернированных строк таблицы. Одинаковые тексты хранятся в единственном
+// экземпляре, ячейки держат на них лишь дескриптор (Handle) размером в указатель.
+// Строка удаляется из пула, когда исчезает последний ссылающийся на неё дескриптор.
+class StringPool {
+private:
+    struct Entry {
+        std::string text;
+        size_t refs = 0;
+        StringPool* pool = nullptr;
+    };
+
+public:
+    class Handle {
+    public:
+        Handle() = default;
+        Handle(const Handle& other);
+        Handle(Handle&& other) noexcept;
+        Handle& operator=(Handle other) noexcept;
+        ~Handle();
+
+        std::string_view View() const;
+        bool Empty() const;
+
+    private:
+        friend class StringPool;
+        explicit Handle(Entry* entry);
+
+        Entry* entry_ = nullptr;
+    };
+
+    StringPool() = default;
+    StringPool(const StringPool&) = delete;
+    StringPool& operator=(const StringPool&) = delete;
+
+    Handle Intern(std::string_view text);
+
+    // Количество различных строк в пуле и суммарный объём их содержимого
+    size_t Size() const;
+    size_t PayloadBytes() const;
+    // Память служебных структур пула: таблицы и записей без текста строк
+    size_t OverheadBytes() const;
+
+    // Уменьшает таблицу пула после удаления большого числа строк
+    void Compact();
+
+private:
+    void Release(Entry* entry);
+
+    std::unordered_map<std::string_view, std::unique_ptr<Entry>> entries_;
+    size_t payload_bytes_ = 0;
+};
@@ -97,11 +97,80 @@ std::string_view FormulaError::ToString() const {
         case FormulaError::Category::Div0: {
             return "#DIV/0!"sv;
         }
+        case FormulaError::Category::NA: {
+            return "#N/A"sv;
+        }
         default:
             throw std::runtime_error{"Wrong FE type"s};
     }
 }
 
+bool SheetReference::operator==(const SheetReference& rhs) const {
+    return sheet == rhs.sheet && pos == rhs.pos;
+}
+
+bool SheetReference::operator<(const SheetReference& rhs) const {
+    return std::tie(sheet, pos) < std::tie(rhs.sheet, rhs.pos);
+}
+
+std::string SheetReference::ToString() const {
+    if (!pos.IsValid()) {
+        return "";
+    }
+    return sheet + '!' + pos.ToString();
+}
+
 bool Size::operator==(Size rhs) const {
     return cols == rhs.cols && rows == rhs.rows;
 }
+
+bool Range::operator==(const Range& rhs) const {
+    return top_left == rhs.top_left && size == rhs.size;
+}
+
+bool Range::operator<(const Range& rhs) const {
+    return std::tie(top_left, size.rows, size.cols) < std::tie(rhs.top_left, rhs.size.rows, rhs.size.cols);
+}
+
+bool Range::IsValid() const {
+    return top_left.IsValid() && size.rows > 0 && size.cols > 0 && GetBottomRight().IsValid();
+}
+
+bool Range::Contains(Position pos) const {
+    return top_left.row <= pos.row && pos.row < top_left.row + size.rows
+        && top_left.col <= pos.col && pos.col < top_left.col + size.cols;
+}
+
+bool Range::Contains(const Range& other) const {
+    return Contains(other.top_left) && Contains(other.GetBottomRight());
+}
+
+Position Range::GetBottomRight() const {
+    return {top_left.row + size.rows - 1, top_left.col + size.cols - 1};
+}
+
+std::string Range::ToString() const {
+    if (!IsValid()) {
+        return "";
+    }
+    return top_left.ToString() + ':' + GetBottomRight().ToString();
+}
+
+Range Range::FromCorners(Position first, Position second) {
+    Position top_left{std::min(first.row, second.row), std::min(first.col, second.col)};
+    Position bottom_right{std::max(first.row, second.row), std::max(first.col, second.col)};
+    return {top_left, {bottom_right.row - top_left.row + 1, bottom_right.col - top_left.col + 1}};
+}
+
+Range Range::FromString(std::string_view str) {
+    auto colon = str.find(':');
+    if (colon == std::string_view::npos) {
+        return {Position::NONE, {}};
+    }
+    auto first = Position::FromString(str.substr(0, colon));
+    auto second = Position::FromString(str.substr(colon + 1));
+    if (!first.IsValid() || !second.IsValid()) {
+        return {Position::NONE, {}};
+    }
+    return FromCorners(first, second);
+}
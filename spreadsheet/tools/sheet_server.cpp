@@ -0,0 +1,78 @@
+// Сервер таблиц: держит книгу в памяти и открывает её клиентам той же машины.
+// Запуск: sheet_server (--unix <путь> | --port N)
+//   --unix <путь>  слушать сокет Unix
+//   --port N       слушать TCP на 127.0.0.1; 0 - любой свободный порт
+// Работает до SIGINT или SIGTERM и выводит статистику при завершении.
+
+#include "sheet_server.h"
+
+#include <csignal>
+#include <cstdlib>
+#include <exception>
+#include <iostream>
+#include <optional>
+#include <string>
+
+#include <pthread.h>
+
+namespace {
+
+void PrintUsage() {
+    std::cerr << "Usage: sheet_server (--unix <path> | --port N)" << std::endl;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    SheetServer::Options options;
+    std::optional<int> port;
+    for(int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if(arg == "--unix" && i + 1 < argc) {
+            options.unix_path = argv[++i];
+        }
+        else if(arg == "--port" && i + 1 < argc) {
+            port = std::atoi(argv[++i]);
+        }
+        else {
+            PrintUsage();
+            return 1;
+        }
+    }
+    if(options.unix_path.empty() == !port || (port && (*port < 0 || *port > 65535))) {
+        PrintUsage();
+        return 1;
+    }
+    options.tcp_port = static_cast<uint16_t>(port.value_or(0));
+
+    // сигналы блокируются до запуска реактора, чтобы их получал только
+    // основной поток в sigwait
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    try {
+        SheetServer server(options);
+        if(options.unix_path.empty()) {
+            std::cout << "listening on 127.0.0.1:" << server.GetPort() << std::endl;
+        }
+        else {
+            std::cout << "listening on " << options.unix_path << std::endl;
+        }
+        int signal = 0;
+        sigwait(&signals, &signal);
+
+        auto stats = server.GetStats();
+        std::cout << "connections: " << stats.accepted_connections << ", frames: " << stats.frames
+                  << ", commands: " << stats.commands << ", groups: " << stats.groups
+                  << ", coalesced numbers: " << stats.coalesced_numbers
+                  << ", protocol errors: " << stats.protocol_errors << std::endl;
+    }
+    catch(const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
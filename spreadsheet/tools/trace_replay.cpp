@@ -0,0 +1,120 @@
+// Воспроизведение трассы нагрузки, записанной RecordingSheet.
+// Запуск: trace_replay <трасса> [--speed N] [--threads N]
+//   --speed N    ускорение относительно исходного темпа; 0 (по умолчанию) -
+//                без пауз, с максимальной скоростью
+//   --threads N  число потоков; каждый воспроизводит трассу на своей таблице
+// Выводит пропускную способность и процентили задержек по типам операций.
+
+#include "common.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+void PrintUsage() {
+    std::cerr << "Usage: trace_replay <trace> [--speed N] [--threads N]" << std::endl;
+}
+
+double ToMicroseconds(std::chrono::nanoseconds duration) {
+    return std::chrono::duration<double, std::micro>(duration).count();
+}
+
+std::chrono::nanoseconds Percentile(const std::vector<std::chrono::nanoseconds>& sorted, double rank) {
+    auto index = static_cast<size_t>(rank * static_cast<double>(sorted.size() - 1u) + 0.5);
+    return sorted[index];
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    if(argc < 2) {
+        PrintUsage();
+        return 1;
+    }
+    double speed = 0.0;
+    int threads = 1;
+    for(int i = 2; i < argc; ++i) {
+        std::string arg = argv[i];
+        if(arg == "--speed" && i + 1 < argc) {
+            speed = std::atof(argv[++i]);
+        }
+        else if(arg == "--threads" && i + 1 < argc) {
+            threads = std::max(1, std::atoi(argv[++i]));
+        }
+        else {
+            PrintUsage();
+            return 1;
+        }
+    }
+
+    std::vector<TraceRecord> records;
+    try {
+        std::ifstream input(argv[1], std::ios::binary);
+        if(!input) {
+            std::cerr << "Cannot open " << argv[1] << std::endl;
+            return 1;
+        }
+        records = TraceReader(input).ReadAll();
+    }
+    catch(const std::exception& e) {
+        std::cerr << argv[1] << ": " << e.what() << std::endl;
+        return 1;
+    }
+
+    std::vector<ReplayResult> results(threads);
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for(int i = 0; i < threads; ++i) {
+        workers.emplace_back([&records, &results, speed, i] {
+            auto sheet = CreateSheet();
+            results[i] = ReplayTrace(records, *sheet, speed);
+        });
+    }
+    for(auto& worker : workers) {
+        worker.join();
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+
+    size_t operations = 0;
+    size_t errors = 0;
+    std::vector<std::vector<std::chrono::nanoseconds>> latencies(static_cast<size_t>(TraceOp::PrintTexts) + 1u);
+    for(auto& result : results) {
+        operations += result.operations;
+        errors += result.errors;
+        for(size_t op = 0; op < latencies.size(); ++op) {
+            latencies[op].insert(latencies[op].end(), result.latencies[op].begin(), result.latencies[op].end());
+        }
+    }
+
+    double seconds = std::chrono::duration<double>(elapsed).count();
+    std::cout << "records: " << records.size() << ", threads: " << threads
+              << ", operations: " << operations << ", errors: " << errors << '\n'
+              << "elapsed: " << std::fixed << std::setprecision(3) << seconds << " s, throughput: "
+              << std::setprecision(0) << operations / seconds << " ops/s\n\n";
+    std::cout << std::left << std::setw(12) << "operation" << std::right << std::setw(10) << "count"
+              << std::setw(12) << "p50, us" << std::setw(12) << "p90, us" << std::setw(12) << "p99, us"
+              << std::setw(12) << "max, us" << '\n' << std::setprecision(2);
+    for(size_t op = 0; op < latencies.size(); ++op) {
+        auto& values = latencies[op];
+        if(values.empty()) {
+            continue;
+        }
+        std::sort(values.begin(), values.end());
+        std::cout << std::left << std::setw(12) << ToString(static_cast<TraceOp>(op)) << std::right
+                  << std::setw(10) << values.size()
+                  << std::setw(12) << ToMicroseconds(Percentile(values, 0.5))
+                  << std::setw(12) << ToMicroseconds(Percentile(values, 0.9))
+                  << std::setw(12) << ToMicroseconds(Percentile(values, 0.99))
+                  << std::setw(12) << ToMicroseconds(values.back()) << '\n';
+    }
+    return 0;
+}
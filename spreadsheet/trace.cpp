@@ -0,0 +1,290 @@
+#include "trace.h"
+
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+
+using namespace std::literals;
+
+namespace {
+constexpr std::string_view TRACE_MAGIC = "SPTRACE"sv;
+constexpr char TRACE_VERSION = 1;
+
+bool HasPosition(TraceOp op) {
+    return op != TraceOp::PrintValues && op != TraceOp::PrintTexts;
+}
+
+// Поток, отбрасывающий вывод таблицы при воспроизведении
+class NullBuffer : public std::streambuf {
+protected:
+    int overflow(int c) override {
+        return c;
+    }
+    std::streamsize xsputn(const char* /*s*/, std::streamsize n) override {
+        return n;
+    }
+};
+}  // namespace
+
+std::string_view ToString(TraceOp op) {
+    switch(op) {
+        case TraceOp::SetCell:
+            return "SetCell"sv;
+        case TraceOp::ClearCell:
+            return "ClearCell"sv;
+        case TraceOp::GetValue:
+            return "GetValue"sv;
+        case TraceOp::GetText:
+            return "GetText"sv;
+        case TraceOp::PrintValues:
+            return "PrintValues"sv;
+        case TraceOp::PrintTexts:
+            return "PrintTexts"sv;
+    }
+    return ""sv;
+}
+
+TraceWriter::TraceWriter(std::ostream& output)
+    : output_(output)
+    , start_(std::chrono::steady_clock::now()) {
+    output_.write(TRACE_MAGIC.data(), TRACE_MAGIC.size());
+    output_.put(TRACE_VERSION);
+}
+
+void TraceWriter::Write(TraceOp op, Position pos, std::string_view text) {
+    std::lock_guard lock(mutex_);
+    auto time = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start_);
+    // время из разных потоков может прийти не по порядку
+    if(time < last_time_) {
+        time = last_time_;
+    }
+    output_.put(static_cast<char>(op));
+    WriteVarint(static_cast<uint64_t>((time - last_time_).count()));
+    last_time_ = time;
+    if(HasPosition(op)) {
+        WriteVarint(static_cast<uint64_t>(pos.row));
+        WriteVarint(static_cast<uint64_t>(pos.col));
+    }
+    if(op == TraceOp::SetCell) {
+        WriteVarint(text.size());
+        output_.write(text.data(), text.size());
+    }
+    ++records_;
+}
+
+size_t TraceWriter::GetRecordCount() const {
+    std::lock_guard lock(mutex_);
+    return records_;
+}
+
+void TraceWriter::WriteVarint(uint64_t value) {
+    while(value >= 0x80u) {
+        output_.put(static_cast<char>((value & 0x7Fu) | 0x80u));
+        value >>= 7u;
+    }
+    output_.put(static_cast<char>(value));
+}
+
+TraceReader::TraceReader(std::istream& input)
+    : input_(input) {
+    std::string magic(TRACE_MAGIC.size(), '\0');
+    input_.read(magic.data(), magic.size());
+    if(magic != TRACE_MAGIC || input_.get() != TRACE_VERSION) {
+        throw std::runtime_error("Not a spreadsheet trace");
+    }
+}
+
+std::optional<TraceRecord> TraceReader::Next() {
+    int op = input_.get();
+    if(op == std::istream::traits_type::eof()) {
+        return std::nullopt;
+    }
+    if(op > static_cast<int>(TraceOp::PrintTexts)) {
+        throw std::runtime_error("Unknown trace operation");
+    }
+    TraceRecord res;
+    res.op = static_cast<TraceOp>(op);
+    auto delta = ReadVarint();
+    if(!delta) {
+        throw std::runtime_error("Truncated trace");
+    }
+    time_ += std::chrono::nanoseconds(*delta);
+    res.time = time_;
+    if(HasPosition(res.op)) {
+        auto row = ReadVarint();
+        auto col = ReadVarint();
+        if(!row || !col) {
+            throw std::runtime_error("Truncated trace");
+        }
+        res.pos = {static_cast<int>(*row), static_cast<int>(*col)};
+    }
+    if(res.op == TraceOp::SetCell) {
+        auto size = ReadVarint();
+        if(!size) {
+            throw std::runtime_error("Truncated trace");
+        }
+        res.text.resize(*size);
+        if(!input_.read(res.text.data(), *size)) {
+            throw std::runtime_error("Truncated trace");
+        }
+    }
+    return res;
+}
+
+std::vector<TraceRecord> TraceReader::ReadAll() {
+    std::vector<TraceRecord> res;
+    while(auto record = Next()) {
+        res.push_back(std::move(*record));
+    }
+    return res;
+}
+
+std::optional<uint64_t> TraceReader::ReadVarint() {
+    uint64_t res = 0;
+    for(unsigned shift = 0; shift < 64u; shift += 7u) {
+        int byte = input_.get();
+        if(byte == std::istream::traits_type::eof()) {
+            return std::nullopt;
+        }
+        res |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if(!(byte & 0x80)) {
+            return res;
+        }
+    }
+    throw std::runtime_error("Malformed varint in trace");
+}
+
+class RecordingSheet::RecordingCell : public CellInterface {
+public:
+    RecordingCell(RecordingSheet& owner, Position pos)
+        : owner_(owner)
+        , pos_(pos) {}
+
+    // запись в ячейку - то же, что SetCell таблицы
+    void Set(std::string text) override {
+        owner_.SetCell(pos_, std::move(text));
+    }
+
+    Value GetValue() const override {
+        owner_.writer_.Write(TraceOp::GetValue, pos_);
+        auto cell = std::as_const(owner_.inner_).GetCell(pos_);
+        return cell ? cell->GetValue() : Value{};
+    }
+
+    std::string GetText() const override {
+        owner_.writer_.Write(TraceOp::GetText, pos_);
+        auto cell = std::as_const(owner_.inner_).GetCell(pos_);
+        return cell ? cell->GetText() : std::string{};
+    }
+
+    std::vector<Position> GetReferencedCells() const override {
+        auto cell = std::as_const(owner_.inner_).GetCell(pos_);
+        return cell ? cell->GetReferencedCells() : std::vector<Position>{};
+    }
+
+private:
+    RecordingSheet& owner_;
+    Position pos_;
+};
+
+RecordingSheet::RecordingSheet(SheetInterface& inner, TraceWriter& writer)
+    : inner_(inner)
+    , writer_(writer) {}
+
+RecordingSheet::~RecordingSheet() = default;
+
+void RecordingSheet::SetCell(Position pos, std::string text) {
+    writer_.Write(TraceOp::SetCell, pos, text);
+    inner_.SetCell(pos, std::move(text));
+}
+
+const CellInterface* RecordingSheet::GetCell(Position pos) const {
+    if(!inner_.GetCell(pos)) {
+        return nullptr;
+    }
+    auto& cell = cells_[pos];
+    if(!cell) {
+        // через константный указатель Set() у посредника недоступен
+        cell = std::make_unique<RecordingCell>(const_cast<RecordingSheet&>(*this), pos);
+    }
+    return cell.get();
+}
+
+CellInterface* RecordingSheet::GetCell(Position pos) {
+    return const_cast<CellInterface*>(std::as_const(*this).GetCell(pos));
+}
+
+void RecordingSheet::ClearCell(Position pos) {
+    writer_.Write(TraceOp::ClearCell, pos);
+    inner_.ClearCell(pos);
+}
+
+Size RecordingSheet::GetPrintableSize() const {
+    return inner_.GetPrintableSize();
+}
+
+void RecordingSheet::PrintValues(std::ostream& output) const {
+    writer_.Write(TraceOp::PrintValues);
+    inner_.PrintValues(output);
+}
+
+void RecordingSheet::PrintTexts(std::ostream& output) const {
+    writer_.Write(TraceOp::PrintTexts);
+    inner_.PrintTexts(output);
+}
+
+const SheetInterface* RecordingSheet::FindSheet(std::string_view name) const {
+    return inner_.FindSheet(name);
+}
+
+ReplayResult ReplayTrace(const std::vector<TraceRecord>& records, SheetInterface& sheet, double speed) {
+    using Clock = std::chrono::steady_clock;
+    ReplayResult res;
+    res.latencies.resize(static_cast<size_t>(TraceOp::PrintTexts) + 1u);
+    NullBuffer null_buffer;
+    std::ostream null_output(&null_buffer);
+
+    auto start = Clock::now();
+    for(const auto& record : records) {
+        if(speed > 0.0) {
+            auto due = start + std::chrono::duration_cast<Clock::duration>(record.time / speed);
+            std::this_thread::sleep_until(due);
+        }
+        auto op_start = Clock::now();
+        try {
+            switch(record.op) {
+                case TraceOp::SetCell:
+                    sheet.SetCell(record.pos, record.text);
+                    break;
+                case TraceOp::ClearCell:
+                    sheet.ClearCell(record.pos);
+                    break;
+                case TraceOp::GetValue:
+                    if(auto cell = std::as_const(sheet).GetCell(record.pos)) {
+                        cell->GetValue();
+                    }
+                    break;
+                case TraceOp::GetText:
+                    if(auto cell = std::as_const(sheet).GetCell(record.pos)) {
+                        cell->GetText();
+                    }
+                    break;
+                case TraceOp::PrintValues:
+                    sheet.PrintValues(null_output);
+                    break;
+                case TraceOp::PrintTexts:
+                    sheet.PrintTexts(null_output);
+                    break;
+            }
+        }
+        catch(const std::exception&) {
+            ++res.errors;
+        }
+        res.latencies[static_cast<size_t>(record.op)].push_back(Clock::now() - op_start);
+        ++res.operations;
+    }
+    res.elapsed = Clock::now() - start;
+    return res;
+}
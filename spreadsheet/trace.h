@@ -0,0 +1,113 @@
+#pragma once
+
+#include "common.h"
+#include "position_map.h"
+
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+// Запись и воспроизведение нагрузки на таблицу.
+//
+// Формат трассы: заголовок "SPTRACE" и байт версии, затем записи подряд.
+// Запись - байт операции, время от предыдущей записи в наносекундах, для
+// операций с ячейкой - строка и столбец, для SetCell - длина текста и текст.
+// Все целые числа записываются как varint (по 7 бит в байте, младшие вперёд).
+
+enum class TraceOp : uint8_t {
+    SetCell,
+    ClearCell,
+    GetValue,
+    GetText,
+    PrintValues,
+    PrintTexts,
+};
+
+struct TraceRecord {
+    TraceOp op = TraceOp::GetValue;
+    // время от начала записи
+    std::chrono::nanoseconds time{0};
+    Position pos;
+    std::string text;
+};
+
+std::string_view ToString(TraceOp op);
+
+// Пишет трассу в поток. Время записей отсчитывается от создания объекта.
+// Может использоваться из нескольких потоков.
+class TraceWriter {
+public:
+    explicit TraceWriter(std::ostream& output);
+
+    void Write(TraceOp op, Position pos = {}, std::string_view text = {});
+    size_t GetRecordCount() const;
+
+private:
+    void WriteVarint(uint64_t value);
+
+    std::ostream& output_;
+    mutable std::mutex mutex_;
+    std::chrono::steady_clock::time_point start_;
+    std::chrono::nanoseconds last_time_{0};
+    size_t records_ = 0;
+};
+
+// Читает трассу из потока. Бросает std::runtime_error на повреждённых данных.
+class TraceReader {
+public:
+    explicit TraceReader(std::istream& input);
+
+    std::optional<TraceRecord> Next();
+    std::vector<TraceRecord> ReadAll();
+
+private:
+    std::optional<uint64_t> ReadVarint();
+
+    std::istream& input_;
+    std::chrono::nanoseconds time_{0};
+};
+
+// Таблица-обёртка, которая записывает в трассу каждое обращение к таблице
+// inner и к её ячейкам, а затем выполняет его. Вызовы, которые формулы
+// делают внутри inner, не записываются.
+class RecordingSheet : public SheetInterface {
+public:
+    RecordingSheet(SheetInterface& inner, TraceWriter& writer);
+    ~RecordingSheet();
+
+    void SetCell(Position pos, std::string text) override;
+    const CellInterface* GetCell(Position pos) const override;
+    CellInterface* GetCell(Position pos) override;
+    void ClearCell(Position pos) override;
+    Size GetPrintableSize() const override;
+    void PrintValues(std::ostream& output) const override;
+    void PrintTexts(std::ostream& output) const override;
+    const SheetInterface* FindSheet(std::string_view name) const override;
+
+private:
+    class RecordingCell;
+
+    SheetInterface& inner_;
+    TraceWriter& writer_;
+    // ячейки-посредники создаются по одной на позицию и живут вместе с обёрткой
+    mutable PositionMap<std::unique_ptr<RecordingCell>> cells_;
+};
+
+// Результат воспроизведения трассы
+struct ReplayResult {
+    // задержки операций по типам, в порядке выполнения
+    std::vector<std::vector<std::chrono::nanoseconds>> latencies;
+    std::chrono::nanoseconds elapsed{0};
+    size_t operations = 0;
+    // операции, бросившие исключение (например, запись некорректной формулы)
+    size_t errors = 0;
+};
+
+// Выполняет записи на таблице sheet. speed задаёт ускорение относительно
+// исходного темпа (2 - вдвое быстрее); 0 - без пауз, с максимальной скоростью.
+ReplayResult ReplayTrace(const std::vector<TraceRecord>& records, SheetInterface& sheet, double speed = 0.0);
@@ -0,0 +1,196 @@
+#include "value_cache.h"
+
+#include <algorithm>
+#include <cassert>
+
+void ValueCache::Page::Grow(size_t index) {
+    size_t size = values.size();
+    size_t new_first = first;
+    size_t new_end = first + size;
+    if(size == 0u) {
+        new_first = index;
+        new_end = index + 1u;
+    }
+    else if(index < first) {
+        // окно растёт вдвое, чтобы заполнение столбца снизу вверх не
+        // копировало его на каждой строке
+        new_first = std::min(index, first > size ? first - size : size_t{0});
+    }
+    else {
+        new_end = std::max(index + 1u, std::min(first + 2u * size, size_t{PAGE_ROWS}));
+    }
+    size_t new_size = new_end - new_first;
+    std::vector<double> new_values(new_size);
+    std::vector<Tag> new_tags(new_size);
+    std::vector<uint64_t> new_dirty((new_size + 63u) / 64u, ~uint64_t{0});
+    size_t shift = first - new_first;
+    for(size_t i = 0; i < size; ++i) {
+        new_values[i + shift] = values[i];
+        new_tags[i + shift] = tags[i];
+        if(!(dirty[i / 64u] >> (i % 64u) & 1u)) {
+            new_dirty[(i + shift) / 64u] &= ~(uint64_t{1} << ((i + shift) % 64u));
+        }
+    }
+    first = new_first;
+    values = std::move(new_values);
+    tags = std::move(new_tags);
+    dirty = std::move(new_dirty);
+}
+
+void ValueCache::Occupy(Position pos) {
+    auto& page = pages_[GetPageKey(pos)];
+    if(!page) {
+        page = std::make_unique<Page>();
+    }
+    size_t index = GetIndex(pos);
+    if(!page->Contains(index)) {
+        page->Grow(index);
+    }
+    ++page->occupied;
+}
+
+void ValueCache::Release(Position pos) {
+    auto iter = pages_.find(GetPageKey(pos));
+    assert(iter != pages_.end() && iter->second->occupied > 0);
+    Invalidate(pos);
+    if(--iter->second->occupied == 0) {
+        pages_.erase(iter);
+    }
+}
+
+bool ValueCache::IsDirty(Position pos) const {
+    auto page = FindPage(pos);
+    size_t index = GetIndex(pos);
+    if(!page || !page->Contains(index)) {
+        return true;
+    }
+    index -= page->first;
+    return page->dirty[index / 64u] >> (index % 64u) & 1u;
+}
+
+void ValueCache::Invalidate(Position pos) {
+    auto page = FindPage(pos);
+    size_t index = GetIndex(pos);
+    if(page && page->Contains(index)) {
+        index -= page->first;
+        page->dirty[index / 64u] |= uint64_t{1} << (index % 64u);
+    }
+}
+
+ValueCache::Tag ValueCache::GetTag(Position pos) const {
+    auto page = FindPage(pos);
+    return page->tags[GetIndex(pos) - page->first];
+}
+
+double ValueCache::GetNumber(Position pos) const {
+    auto page = FindPage(pos);
+    return page->values[GetIndex(pos) - page->first];
+}
+
+void ValueCache::SetNumber(Position pos, double value) {
+    auto [page, index] = GetSlot(pos);
+    page->values[index] = value;
+    page->tags[index] = Tag::Number;
+    page->dirty[index / 64u] &= ~(uint64_t{1} << (index % 64u));
+}
+
+void ValueCache::SetError(Position pos, FormulaError error) {
+    auto [page, index] = GetSlot(pos);
+    page->tags[index] = ToTag(error);
+    page->dirty[index / 64u] &= ~(uint64_t{1} << (index % 64u));
+}
+
+void ValueCache::SetText(Position pos) {
+    auto [page, index] = GetSlot(pos);
+    page->tags[index] = Tag::Text;
+    page->dirty[index / 64u] &= ~(uint64_t{1} << (index % 64u));
+}
+
+bool ValueCache::IsError(Tag tag) {
+    return tag >= Tag::RefError;
+}
+
+ValueCache::Tag ValueCache::ToTag(FormulaError error) {
+    switch(error.GetCategory()) {
+        case FormulaError::Category::Ref:
+            return Tag::RefError;
+        case FormulaError::Category::Value:
+            return Tag::ValueError;
+        case FormulaError::Category::Div0:
+            return Tag::Div0Error;
+        case FormulaError::Category::NA:
+            return Tag::NAError;
+    }
+    return Tag::ValueError;
+}
+
+FormulaError ValueCache::ToError(Tag tag) {
+    assert(IsError(tag));
+    switch(tag) {
+        case Tag::RefError:
+            return FormulaError::Category::Ref;
+        case Tag::Div0Error:
+            return FormulaError::Category::Div0;
+        case Tag::NAError:
+            return FormulaError::Category::NA;
+        default:
+            return FormulaError::Category::Value;
+    }
+}
+
+ValueCache::Span ValueCache::GetSpan(Position pos) const {
+    Span res;
+    auto page = FindPage(pos);
+    size_t index = GetIndex(pos);
+    if(!page || index >= page->first + page->values.size()) {
+        res.empty = PAGE_ROWS - index;
+        return res;
+    }
+    if(index < page->first) {
+        res.empty = page->first - index;
+        return res;
+    }
+    size_t offset = index - page->first;
+    res.values = page->values.data() + offset;
+    res.tags = page->tags.data() + offset;
+    res.dirty = page->dirty.data();
+    res.first_bit = offset;
+    res.count = page->values.size() - offset;
+    return res;
+}
+
+size_t ValueCache::GetAllocatedBytes() const {
+    size_t res = pages_.allocated_bytes();
+    for(const auto& [_, page] : pages_) {
+        res += sizeof(Page) + page->values.capacity() * sizeof(double)
+            + page->tags.capacity() * sizeof(Tag) + page->dirty.capacity() * sizeof(uint64_t);
+    }
+    return res;
+}
+
+size_t ValueCache::GetPageCount() const {
+    return pages_.size();
+}
+
+const ValueCache::Page* ValueCache::FindPage(Position pos) const {
+    auto iter = pages_.find(GetPageKey(pos));
+    return iter != pages_.end() ? iter->second.get() : nullptr;
+}
+
+ValueCache::Page* ValueCache::FindPage(Position pos) {
+    return const_cast<Page*>(static_cast<const ValueCache&>(*this).FindPage(pos));
+}
+
+std::pair<ValueCache::Page*, size_t> ValueCache::GetSlot(Position pos) {
+    auto page = FindPage(pos);
+    assert(page && page->Contains(GetIndex(pos)));
+    return {page, GetIndex(pos) - page->first};
+}
+
+Position ValueCache::GetPageKey(Position pos) {
+    return {pos.row / PAGE_ROWS, pos.col};
+}
+
+size_t ValueCache::GetIndex(Position pos) {
+    return static_cast<size_t>(pos.row % PAGE_ROWS);
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include "common.h"
+#include "position_map.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+// Вычисленные значения ячеек листа, разложенные по столбцам в виде
+// "структуры массивов". Столбец разбит на страницы по PAGE_ROWS строк;
+// страница хранит плотный массив чисел, массив однобайтовых тегов (число,
+// текст или категория ошибки) и битовую карту устаревших значений.
+// Текст в кэше не хранится: тег Text означает, что значение ячейки - её
+// собственный текст, который лежит в пуле строк листа.
+// Страницы ищутся по хешу, поэтому пустые столбцы и блоки строк ничего не
+// занимают. Массивы страницы покрывают не все её строки, а только окно от
+// первой до последней занятой, которое растёт вдвое при выходе за него.
+// В плотном столбце числовое значение занимает 9 байт и бит, а пакетные
+// вычисления читают числа подряд идущих строк прямо из массива, без
+// виртуальных вызовов и копирования std::variant. Одиночная ячейка в своём
+// блоке строк занимает около 150 байт: заголовок страницы с окном из одного
+// значения и её запись в хеше.
+class ValueCache {
+public:
+    enum class Tag : uint8_t {
+        Number,
+        Text,
+        RefError,
+        ValueError,
+        Div0Error,
+        NAError,
+    };
+
+    static constexpr int PAGE_ROWS = 256;
+
+    // Позиция с ячейкой. Страница существует, пока на ней есть хотя бы одна
+    // занятая позиция; значения свободных позиций всегда устаревшие.
+    void Occupy(Position pos);
+    void Release(Position pos);
+
+    bool IsDirty(Position pos) const;
+    void Invalidate(Position pos);
+
+    Tag GetTag(Position pos) const;
+    // Число; имеет смысл только для тега Number
+    double GetNumber(Position pos) const;
+
+    void SetNumber(Position pos, double value);
+    void SetError(Position pos, FormulaError error);
+    void SetText(Position pos);
+
+    static bool IsError(Tag tag);
+    static Tag ToTag(FormulaError error);
+    static FormulaError ToError(Tag tag);
+
+    // Непрерывные массивы окна страницы, в которое попадает pos, начиная с
+    // pos: count строк, не дальше строки, кратной PAGE_ROWS. Если pos не
+    // попадает в окно, count == 0, а в empty строк начиная с pos нет ни одной
+    // ячейки.
+    struct Span {
+        const double* values = nullptr;
+        const Tag* tags = nullptr;
+        const uint64_t* dirty = nullptr;  // биты с номера first_bit
+        size_t first_bit = 0;
+        size_t count = 0;
+        size_t empty = 0;
+
+        bool IsDirty(size_t i) const {
+            size_t bit = first_bit + i;
+            return dirty[bit / 64u] >> (bit % 64u) & 1u;
+        }
+    };
+    Span GetSpan(Position pos) const;
+
+    size_t GetAllocatedBytes() const;
+    size_t GetPageCount() const;
+
+private:
+    struct Page {
+        // окно - строки страницы [first, first + values.size())
+        size_t first = 0;
+        std::vector<double> values;
+        std::vector<Tag> tags;
+        // единица - значение устарело
+        std::vector<uint64_t> dirty;
+        int occupied = 0;
+
+        bool Contains(size_t index) const {
+            return first <= index && index < first + values.size();
+        }
+        // Расширяет окно до строки index, новые значения устаревшие
+        void Grow(size_t index);
+    };
+
+    const Page* FindPage(Position pos) const;
+    Page* FindPage(Position pos);
+    // Для записи значения: ячейка на позиции занята, поэтому она в окне
+    // страницы; возвращает страницу и номер значения в окне
+    std::pair<Page*, size_t> GetSlot(Position pos);
+    // Ключ страницы: номер блока строк и столбец
+    static Position GetPageKey(Position pos);
+    static size_t GetIndex(Position pos);
+
+    PositionMap<std::unique_ptr<Page>> pages_;
+};
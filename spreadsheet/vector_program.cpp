@@ -0,0 +1,324 @@
+#include "vector_program.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+namespace {
+constexpr double MAX_FINITE = std::numeric_limits<double>::max();
+
+// Порядок вычисления формулы определяет, какая ошибка будет видна: у дорожки
+// остаётся первая из них
+inline VectorProgram::ErrorCode KeepFirst(VectorProgram::ErrorCode current,
+                                          VectorProgram::ErrorCode next) {
+    return current != VectorProgram::NO_ERROR ? current : next;
+}
+
+inline bool Compare(VectorProgram::OpCode code, double lhs, double rhs) {
+    switch(code) {
+        case VectorProgram::OpCode::Equal:
+            return lhs == rhs;
+        case VectorProgram::OpCode::NotEqual:
+            return lhs != rhs;
+        case VectorProgram::OpCode::Less:
+            return lhs < rhs;
+        case VectorProgram::OpCode::LessEqual:
+            return lhs <= rhs;
+        case VectorProgram::OpCode::Greater:
+            return lhs > rhs;
+        default:
+            assert(code == VectorProgram::OpCode::GreaterEqual);
+            return lhs >= rhs;
+    }
+}
+}  // namespace
+
+VectorProgram::ErrorCode VectorProgram::ToErrorCode(FormulaError::Category category) {
+    return static_cast<ErrorCode>(static_cast<int>(category) + 1);
+}
+
+FormulaError VectorProgram::FromErrorCode(ErrorCode code) {
+    assert(code != NO_ERROR);
+    return FormulaError{static_cast<FormulaError::Category>(code - 1)};
+}
+
+void VectorProgram::PushConstant(double value) {
+    ops_.push_back({OpCode::Constant, static_cast<uint32_t>(constants_.size())});
+    constants_.push_back(value);
+    max_depth_ = std::max(max_depth_, ++depth_);
+}
+
+void VectorProgram::PushInput(Position pos) {
+    auto iter = std::find(inputs_.begin(), inputs_.end(), pos);
+    if(iter == inputs_.end()) {
+        iter = inputs_.insert(iter, pos);
+    }
+    ops_.push_back({OpCode::Input, static_cast<uint32_t>(iter - inputs_.begin())});
+    max_depth_ = std::max(max_depth_, ++depth_);
+}
+
+void VectorProgram::PushError(FormulaError error) {
+    ops_.push_back({OpCode::Error, ToErrorCode(error.GetCategory())});
+    max_depth_ = std::max(max_depth_, ++depth_);
+}
+
+void VectorProgram::PushOperation(OpCode code) {
+    assert(code != OpCode::Constant && code != OpCode::Input && code != OpCode::Error);
+    ops_.push_back({code, 0u});
+    if(code != OpCode::Negate) {
+        assert(depth_ >= 2u);
+        --depth_;
+    }
+}
+
+void VectorProgram::MarkNotBatchable() {
+    batchable_ = false;
+}
+
+bool VectorProgram::IsBatchable() const {
+    return batchable_;
+}
+
+const std::vector<Position>& VectorProgram::GetInputs() const {
+    return inputs_;
+}
+
+const std::vector<VectorProgram::Op>& VectorProgram::GetOps() const {
+    return ops_;
+}
+
+bool VectorProgram::IsShiftOf(const VectorProgram& other, int row_shift, int col_shift) const {
+    if(ops_ != other.ops_ || inputs_.size() != other.inputs_.size()
+       || constants_.size() != other.constants_.size()) {
+        return false;
+    }
+    // побитовое сравнение отличает -0 от 0
+    if(!constants_.empty()
+       && std::memcmp(constants_.data(), other.constants_.data(),
+                      constants_.size() * sizeof(double)) != 0) {
+        return false;
+    }
+    for(size_t i = 0; i < inputs_.size(); ++i) {
+        if(inputs_[i].row + row_shift != other.inputs_[i].row
+           || inputs_[i].col + col_shift != other.inputs_[i].col) {
+            return false;
+        }
+    }
+    return true;
+}
+
+VectorProgram VectorProgram::Shifted(int row_shift, int col_shift) const {
+    VectorProgram res = *this;
+    for(auto& input : res.inputs_) {
+        input = {input.row + row_shift, input.col + col_shift};
+        assert(input.IsValid());
+    }
+    return res;
+}
+
+void VectorProgram::Run(const std::vector<InputLanes>& inputs, size_t count,
+                        double* values, ErrorCode* errors) const {
+    assert(inputs.size() == inputs_.size());
+    std::vector<double> stack(std::max<size_t>(max_depth_, 1u) * BLOCK_SIZE);
+    std::fill(errors, errors + count, NO_ERROR);
+    for(size_t offset = 0; offset < count; offset += BLOCK_SIZE) {
+        size_t n = std::min(BLOCK_SIZE, count - offset);
+        RunBlock(inputs, offset, n, stack.data(), errors + offset);
+        std::copy(stack.begin(), stack.begin() + n, values + offset);
+    }
+}
+
+void VectorProgram::RunBlock(const std::vector<InputLanes>& inputs, size_t offset, size_t n,
+                             double* stack, ErrorCode* errors) const {
+    const ErrorCode div0 = ToErrorCode(FormulaError::Category::Div0);
+    size_t sp = 0;
+    for(const auto& op : ops_) {
+        switch(op.code) {
+            case OpCode::Constant: {
+                double* dst = stack + sp++ * BLOCK_SIZE;
+                std::fill(dst, dst + n, constants_[op.arg]);
+                break;
+            }
+            case OpCode::Input: {
+                double* dst = stack + sp++ * BLOCK_SIZE;
+                const auto& lanes = inputs[op.arg];
+                std::copy(lanes.values + offset, lanes.values + offset + n, dst);
+                if(lanes.errors) {
+                    const ErrorCode* src = lanes.errors + offset;
+                    for(size_t i = 0; i < n; ++i) {
+                        errors[i] = KeepFirst(errors[i], src[i]);
+                    }
+                }
+                break;
+            }
+            case OpCode::Error: {
+                double* dst = stack + sp++ * BLOCK_SIZE;
+                std::fill(dst, dst + n, 0.0);
+                for(size_t i = 0; i < n; ++i) {
+                    errors[i] = KeepFirst(errors[i], static_cast<ErrorCode>(op.arg));
+                }
+                break;
+            }
+            case OpCode::Negate: {
+                double* dst = stack + (sp - 1u) * BLOCK_SIZE;
+                for(size_t i = 0; i < n; ++i) {
+                    dst[i] = -dst[i];
+                }
+                break;
+            }
+            case OpCode::Add:
+            case OpCode::Subtract:
+            case OpCode::Multiply:
+            case OpCode::Divide: {
+                --sp;
+                double* lhs = stack + (sp - 1u) * BLOCK_SIZE;
+                const double* rhs = stack + sp * BLOCK_SIZE;
+                // бесконечный результат - #DIV/0!, как и в скалярном вычислении
+                if(op.code == OpCode::Add) {
+                    for(size_t i = 0; i < n; ++i) {
+                        double r = lhs[i] + rhs[i];
+                        errors[i] = KeepFirst(errors[i], std::fabs(r) > MAX_FINITE ? div0 : NO_ERROR);
+                        lhs[i] = r;
+                    }
+                }
+                else if(op.code == OpCode::Subtract) {
+                    for(size_t i = 0; i < n; ++i) {
+                        double r = lhs[i] - rhs[i];
+                        errors[i] = KeepFirst(errors[i], std::fabs(r) > MAX_FINITE ? div0 : NO_ERROR);
+                        lhs[i] = r;
+                    }
+                }
+                else if(op.code == OpCode::Multiply) {
+                    for(size_t i = 0; i < n; ++i) {
+                        double r = lhs[i] * rhs[i];
+                        errors[i] = KeepFirst(errors[i], std::fabs(r) > MAX_FINITE ? div0 : NO_ERROR);
+                        lhs[i] = r;
+                    }
+                }
+                else {
+                    for(size_t i = 0; i < n; ++i) {
+                        double r = lhs[i] / rhs[i];
+                        bool bad = rhs[i] == 0.0 || std::fabs(r) > MAX_FINITE;
+                        errors[i] = KeepFirst(errors[i], bad ? div0 : NO_ERROR);
+                        lhs[i] = r;
+                    }
+                }
+                break;
+            }
+            case OpCode::Equal:
+            case OpCode::NotEqual:
+            case OpCode::Less:
+            case OpCode::LessEqual:
+            case OpCode::Greater:
+            case OpCode::GreaterEqual: {
+                --sp;
+                double* lhs = stack + (sp - 1u) * BLOCK_SIZE;
+                const double* rhs = stack + sp * BLOCK_SIZE;
+                // вид сравнения выбирается один раз на блок, чтобы цикл остался простым
+                switch(op.code) {
+                    case OpCode::Equal:
+                        for(size_t i = 0; i < n; ++i) {
+                            lhs[i] = lhs[i] == rhs[i] ? 1.0 : 0.0;
+                        }
+                        break;
+                    case OpCode::NotEqual:
+                        for(size_t i = 0; i < n; ++i) {
+                            lhs[i] = lhs[i] != rhs[i] ? 1.0 : 0.0;
+                        }
+                        break;
+                    case OpCode::Less:
+                        for(size_t i = 0; i < n; ++i) {
+                            lhs[i] = lhs[i] < rhs[i] ? 1.0 : 0.0;
+                        }
+                        break;
+                    case OpCode::LessEqual:
+                        for(size_t i = 0; i < n; ++i) {
+                            lhs[i] = lhs[i] <= rhs[i] ? 1.0 : 0.0;
+                        }
+                        break;
+                    case OpCode::Greater:
+                        for(size_t i = 0; i < n; ++i) {
+                            lhs[i] = lhs[i] > rhs[i] ? 1.0 : 0.0;
+                        }
+                        break;
+                    default:
+                        for(size_t i = 0; i < n; ++i) {
+                            lhs[i] = lhs[i] >= rhs[i] ? 1.0 : 0.0;
+                        }
+                        break;
+                }
+                break;
+            }
+        }
+    }
+    assert(sp == 1u);
+}
+
+double VectorProgram::RunScalar(const double* inputs, const ErrorCode* errors,
+                                std::vector<double>& stack, ErrorCode& error) const {
+    const ErrorCode div0 = ToErrorCode(FormulaError::Category::Div0);
+    stack.resize(std::max<size_t>(max_depth_, 1u));
+    error = NO_ERROR;
+    size_t sp = 0;
+    for(const auto& op : ops_) {
+        switch(op.code) {
+            case OpCode::Constant:
+                stack[sp++] = constants_[op.arg];
+                break;
+            case OpCode::Input:
+                stack[sp++] = inputs[op.arg];
+                error = KeepFirst(error, errors[op.arg]);
+                break;
+            case OpCode::Error:
+                stack[sp++] = 0.0;
+                error = KeepFirst(error, static_cast<ErrorCode>(op.arg));
+                break;
+            case OpCode::Negate:
+                stack[sp - 1u] = -stack[sp - 1u];
+                break;
+            case OpCode::Add:
+            case OpCode::Subtract:
+            case OpCode::Multiply:
+            case OpCode::Divide: {
+                double rhs = stack[--sp];
+                double& lhs = stack[sp - 1u];
+                bool bad = false;
+                if(op.code == OpCode::Add) {
+                    lhs += rhs;
+                }
+                else if(op.code == OpCode::Subtract) {
+                    lhs -= rhs;
+                }
+                else if(op.code == OpCode::Multiply) {
+                    lhs *= rhs;
+                }
+                else {
+                    bad = rhs == 0.0;
+                    lhs /= rhs;
+                }
+                error = KeepFirst(error, bad || std::fabs(lhs) > MAX_FINITE ? div0 : NO_ERROR);
+                break;
+            }
+            case OpCode::Equal:
+            case OpCode::NotEqual:
+            case OpCode::Less:
+            case OpCode::LessEqual:
+            case OpCode::Greater:
+            case OpCode::GreaterEqual: {
+                double rhs = stack[--sp];
+                double& lhs = stack[sp - 1u];
+                lhs = Compare(op.code, lhs, rhs) ? 1.0 : 0.0;
+                break;
+            }
+        }
+    }
+    assert(sp == 1u);
+    return stack[0];
+}
+
+size_t VectorProgram::GetAllocatedBytes() const {
+    return ops_.capacity() * sizeof(Op) + constants_.capacity() * sizeof(double)
+        + inputs_.capacity() * sizeof(Position);
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Формула, скомпилированная в плоскую постфиксную программу. Одна программа
+// вычисляется сразу для многих наборов входов ("дорожек"): например, для всех
+// строк столбца, заполненного одной и той же относительной формулой. Каждая
+// операция выполняется простым циклом по блоку дорожек, который компилятор
+// разворачивает в SIMD-инструкции.
+class VectorProgram {
+public:
+    enum class OpCode : uint8_t {
+        Constant,   // arg - индекс в таблице констант
+        Input,      // arg - индекс входа
+        Error,      // arg - категория ошибки
+        Add,
+        Subtract,
+        Multiply,
+        Divide,
+        Negate,
+        // сравнения дают 1, если условие выполнено, иначе 0
+        Equal,
+        NotEqual,
+        Less,
+        LessEqual,
+        Greater,
+        GreaterEqual,
+    };
+
+    struct Op {
+        OpCode code;
+        uint32_t arg = 0;
+
+        bool operator==(const Op& rhs) const {
+            return code == rhs.code && arg == rhs.arg;
+        }
+    };
+
+    // Код ошибки дорожки: 0 - ошибки нет, иначе категория FormulaError + 1
+    using ErrorCode = uint8_t;
+    static constexpr ErrorCode NO_ERROR = 0;
+    static ErrorCode ToErrorCode(FormulaError::Category category);
+    static FormulaError FromErrorCode(ErrorCode code);
+
+    // Значения одного входа для всех дорожек. errors может быть nullptr, если
+    // ошибок во входе нет.
+    struct InputLanes {
+        const double* values = nullptr;
+        const ErrorCode* errors = nullptr;
+    };
+
+    // Количество дорожек, обрабатываемых за один проход по программе
+    static constexpr size_t BLOCK_SIZE = 256;
+
+    void PushConstant(double value);
+    void PushInput(Position pos);
+    void PushError(FormulaError error);
+    void PushOperation(OpCode code);
+    // Формула читает то, что нельзя подать на вход пакетом (например, ячейки
+    // другого листа), и вычисляется только по одной
+    void MarkNotBatchable();
+    bool IsBatchable() const;
+
+    // Различные ячейки, значения которых читает программа, в порядке первого
+    // обращения
+    const std::vector<Position>& GetInputs() const;
+    const std::vector<Op>& GetOps() const;
+
+    // Совпадает ли программа с other, если все её входы сдвинуть на
+    // (row_shift, col_shift). Так распознаются копии одной относительной формулы.
+    bool IsShiftOf(const VectorProgram& other, int row_shift, int col_shift) const;
+    // Копия программы, все входы которой сдвинуты на (row_shift, col_shift).
+    // Сдвинутые входы должны оставаться в пределах таблицы.
+    VectorProgram Shifted(int row_shift, int col_shift) const;
+
+    // Вычисляет программу для count дорожек. inputs[i] соответствует GetInputs()[i].
+    // Ошибки распространяются так же, как при обычном вычислении формулы:
+    // дорожка получает первую ошибку в порядке вычисления.
+    void Run(const std::vector<InputLanes>& inputs, size_t count,
+             double* values, ErrorCode* errors) const;
+
+    // Вычисляет программу для одного набора входов: inputs[i] и errors[i]
+    // соответствуют GetInputs()[i]. Ошибка результата записывается в error.
+    // stack - рабочий буфер, который можно переиспользовать между вызовами.
+    double RunScalar(const double* inputs, const ErrorCode* errors,
+                     std::vector<double>& stack, ErrorCode& error) const;
+
+    size_t GetAllocatedBytes() const;
+
+private:
+    void RunBlock(const std::vector<InputLanes>& inputs, size_t offset, size_t count,
+                  double* stack, ErrorCode* errors) const;
+
+    std::vector<Op> ops_;
+    std::vector<double> constants_;
+    std::vector<Position> inputs_;
+    size_t max_depth_ = 0;
+    size_t depth_ = 0;
+    bool batchable_ = true;
+};
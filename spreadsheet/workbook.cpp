@@ -0,0 +1,153 @@
+#include "workbook.h"
+
+#include "sheet.h"
+
+#include <algorithm>
+#include <cctype>
+#include <stdexcept>
+
+using namespace std::literals;
+
+namespace {
+bool IsValidSheetName(std::string_view name) {
+    if(name.empty() || std::isdigit(static_cast<unsigned char>(name.front()))) {
+        return false;
+    }
+    return std::all_of(name.begin(), name.end(), [] (char c) {
+        return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+    });
+}
+}  // namespace
+
+Workbook::Workbook() = default;
+
+Workbook::~Workbook() = default;
+
+SheetInterface& Workbook::CreateSheet(std::string name) {
+    auto& entry = AddEntry(std::move(name));
+    return *GetConcreteSheet(entry.name);
+}
+
+void Workbook::AddSheet(std::string name, SheetLoader loader) {
+    auto& entry = AddEntry(std::move(name));
+    // лист будет создан при первом обращении
+    entry.loader = std::move(loader);
+}
+
+SheetInterface* Workbook::GetSheet(std::string_view name) {
+    return GetConcreteSheet(name);
+}
+
+bool Workbook::HasSheet(std::string_view name) const {
+    return sheets_.find(name) != sheets_.end();
+}
+
+bool Workbook::IsLoaded(std::string_view name) const {
+    auto iter = sheets_.find(name);
+    return iter != sheets_.end() && iter->second.sheet;
+}
+
+size_t Workbook::GetLoadedSheetCount() const {
+    return std::count_if(sheets_.begin(), sheets_.end(), [] (const auto& item) {
+        return item.second.sheet != nullptr;
+    });
+}
+
+std::vector<std::string> Workbook::GetSheetNames() const {
+    std::vector<std::string> res;
+    res.reserve(sheets_.size());
+    for(const auto& [name, _] : sheets_) {
+        res.push_back(name);
+    }
+    return res;
+}
+
+Workbook::SheetEntry& Workbook::AddEntry(std::string name) {
+    if(!IsValidSheetName(name)) {
+        throw std::invalid_argument("Invalid sheet name: "s.append(name));
+    }
+    if(HasSheet(name)) {
+        throw std::invalid_argument("Duplicate sheet name: "s.append(name));
+    }
+    auto& entry = sheets_[name];
+    entry.name = name;
+    // формулы, ссылавшиеся на несуществующий лист, теперь видят его ячейки
+    InvalidateExternalDependents(name);
+    return entry;
+}
+
+Sheet* Workbook::GetConcreteSheet(std::string_view name) {
+    auto iter = sheets_.find(name);
+    if(iter == sheets_.end()) {
+        return nullptr;
+    }
+    auto& entry = iter->second;
+    if(!entry.sheet) {
+        entry.sheet = std::make_unique<Sheet>(*this, iter->first);
+        // лист уже считается загруженным, чтобы ссылки на него из загружаемых
+        // формул не запускали загрузку повторно
+        auto loader = std::move(entry.loader);
+        entry.loader = nullptr;
+        if(loader) {
+            loader(*entry.sheet);
+        }
+    }
+    return entry.sheet.get();
+}
+
+void Workbook::AddExternalDependency(const SheetReference& ref, Sheet* sheet, Position pos) {
+    external_dependents_[ref.sheet][ref.pos].push_back({sheet, pos});
+}
+
+void Workbook::RemoveExternalDependency(const SheetReference& ref, Sheet* sheet, Position pos) {
+    auto sheet_iter = external_dependents_.find(ref.sheet);
+    if(sheet_iter == external_dependents_.end()) {
+        return;
+    }
+    auto& cells = sheet_iter->second;
+    auto iter = cells.find(ref.pos);
+    if(iter == cells.end()) {
+        return;
+    }
+    auto& dependents = iter->second;
+    dependents.erase(std::find(dependents.begin(), dependents.end(), ExternalDependent{sheet, pos}));
+    if(dependents.empty()) {
+        cells.erase(iter);
+        if(cells.empty()) {
+            external_dependents_.erase(sheet_iter);
+        }
+    }
+}
+
+const std::vector<Workbook::ExternalDependent>& Workbook::GetExternalDependents(const std::string& sheet,
+                                                                                Position pos) const {
+    static const std::vector<ExternalDependent> empty;
+    auto sheet_iter = external_dependents_.find(sheet);
+    if(sheet_iter == external_dependents_.end()) {
+        return empty;
+    }
+    auto iter = sheet_iter->second.find(pos);
+    return iter != sheet_iter->second.end() ? iter->second : empty;
+}
+
+bool Workbook::HasExternalDependencies() const {
+    return !external_dependents_.empty();
+}
+
+void Workbook::InvalidateExternalDependents(const std::string& sheet) {
+    auto sheet_iter = external_dependents_.find(sheet);
+    if(sheet_iter == external_dependents_.end()) {
+        return;
+    }
+    std::vector<ExternalDependent> dependents;
+    for(const auto& [_, cell_dependents] : sheet_iter->second) {
+        dependents.insert(dependents.end(), cell_dependents.begin(), cell_dependents.end());
+    }
+    for(const auto& dependent : dependents) {
+        dependent.sheet->InvalidateCell(dependent.pos);
+    }
+}
+
+std::unique_ptr<Workbook> CreateWorkbook() {
+    return std::make_unique<Workbook>();
+}
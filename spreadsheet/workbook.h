@@ -0,0 +1,83 @@
+#pragma once
+
+#include "common.h"
+#include "position_map.h"
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+class Sheet;
+
+// Книга из нескольких именованных листов. Формулы могут ссылаться на ячейки
+// других листов (Sheet2!A1). Зависимости между листами образуют общий граф:
+// изменение ячейки одного листа сбрасывает кэш зависящих от неё формул на всех
+// листах, а циклические зависимости через несколько листов запрещены так же,
+// как и в пределах одного.
+// Лист, добавленный с загрузчиком, создаётся и загружается только при первом
+// обращении: из GetSheet() или при вычислении/установке формулы, которая на
+// него ссылается.
+class Workbook {
+public:
+    // Заполняет пустой лист содержимым из хранилища
+    using SheetLoader = std::function<void(SheetInterface& sheet)>;
+
+    Workbook();
+    ~Workbook();
+
+    Workbook(const Workbook&) = delete;
+    Workbook& operator=(const Workbook&) = delete;
+
+    // Имя листа должно иметь вид [A-Za-z_][A-Za-z0-9_]* и быть уникальным,
+    // иначе бросается std::invalid_argument
+    SheetInterface& CreateSheet(std::string name);
+    void AddSheet(std::string name, SheetLoader loader);
+
+    // Возвращает лист, при необходимости загружая его, или nullptr
+    SheetInterface* GetSheet(std::string_view name);
+
+    bool HasSheet(std::string_view name) const;
+    bool IsLoaded(std::string_view name) const;
+    size_t GetLoadedSheetCount() const;
+    std::vector<std::string> GetSheetNames() const;
+
+private:
+    friend class Sheet;
+
+    struct ExternalDependent {
+        Sheet* sheet;
+        Position pos;
+
+        bool operator==(const ExternalDependent& rhs) const {
+            return sheet == rhs.sheet && pos == rhs.pos;
+        }
+    };
+
+    struct SheetEntry {
+        std::string name;
+        std::unique_ptr<Sheet> sheet;
+        SheetLoader loader;
+    };
+
+    SheetEntry& AddEntry(std::string name);
+    Sheet* GetConcreteSheet(std::string_view name);
+
+    void AddExternalDependency(const SheetReference& ref, Sheet* sheet, Position pos);
+    void RemoveExternalDependency(const SheetReference& ref, Sheet* sheet, Position pos);
+    const std::vector<ExternalDependent>& GetExternalDependents(const std::string& sheet,
+                                                                Position pos) const;
+    bool HasExternalDependencies() const;
+    void InvalidateExternalDependents(const std::string& sheet);
+
+    std::map<std::string, SheetEntry, std::less<>> sheets_;
+    // Рёбра графа между листами: ячейка листа (в том числе ещё не созданного) ->
+    // формулы других листов, которые на неё ссылаются
+    std::unordered_map<std::string, PositionMap<std::vector<ExternalDependent>>> external_dependents_;
+};
+
+// Создаёт пустую книгу.
+std::unique_ptr<Workbook> CreateWorkbook();